@@ -7,6 +7,7 @@ extern "C" {
 
 #include <stddef.h>
 #include <stdint.h>
+#include "sx127x.h"
 
 /**
  * @brief Read up to 4 bytes from device via SPI
@@ -60,6 +61,19 @@ int sx127x_spi_write_register(int reg, uint8_t *data, size_t data_length, void *
  */
 int sx127x_spi_write_buffer(int reg, uint8_t *buffer, size_t buffer_length, void *spi_device);
 
+/**
+ * @brief Write segments into the register as one burst, i.e. chip select stays asserted between the segments
+ *
+ * @param reg Register
+ * @param segments Buffers to write in order
+ * @param segments_count Number of segments
+ * @param spi_device Pointer to variable to hold the device handle. Can be different on different platforms
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if parameter is invalid
+ *         - SX127X_OK                on success
+ */
+int sx127x_spi_write_segments(int reg, const sx127x_segment_t *segments, size_t segments_count, void *spi_device);
+
 #ifdef __cplusplus
 }
 #endif
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sx127x_spi.h>
 
 // registers
@@ -12,6 +13,7 @@
 #define REG_FRF_MID 0x07
 #define REG_FRF_LSB 0x08
 #define REG_PA_CONFIG 0x09
+#define REG_PA_RAMP 0x0a
 #define REG_OCP 0x0b
 #define REG_LNA 0x0c
 #define REG_FIFO_ADDR_PTR 0x0d
@@ -25,9 +27,12 @@
 #define REG_RSSI_VALUE 0x1b
 #define REG_MODEM_CONFIG_1 0x1d
 #define REG_MODEM_CONFIG_2 0x1e
+#define REG_SYMB_TIMEOUT_LSB 0x1f
 #define REG_PREAMBLE_MSB 0x20
 #define REG_PREAMBLE_LSB 0x21
 #define REG_PAYLOAD_LENGTH 0x22
+#define REG_MAX_PAYLOAD_LENGTH 0x23
+#define REG_HOP_PERIOD 0x24
 #define REG_MODEM_CONFIG_3 0x26
 #define REG_FREQ_ERROR_MSB 0x28
 #define REG_FREQ_ERROR_MID 0x29
@@ -52,6 +57,8 @@
 #define SX127x_FREQ_ERROR_FACTOR ((1 << 24) / SX127x_OSCILLATOR_FREQUENCY)
 #define SX127x_REG_MODEM_CONFIG_3_AGC_ON 0b00000100
 #define SX127x_REG_MODEM_CONFIG_3_AGC_OFF 0b00000000
+// RX single timeout in symbols, reset value
+#define SX127x_SYMB_TIMEOUT_DEFAULT 0x64
 
 #define SX127x_IRQ_FLAG_RXTIMEOUT 0b10000000
 #define SX127x_IRQ_FLAG_RXDONE 0b01000000
@@ -80,18 +87,81 @@ typedef enum {
   SX127x_HEADER_MODE_IMPLICIT = 0b00000001
 } sx127x_header_mode_t;
 
+// registers read in one burst by sx127x_reload_registers. 0x00 is FIFO and can't be part of it
+#define SHADOW_BURST_START REG_OP_MODE
+#define SHADOW_BURST_END REG_VERSION
+
 struct sx127x_t {
   void *spi_device;
   sx127x_implicit_header_t *header;
+  // header mode the running reception was started with, its frames are read with it whatever header a transmit
+  // switched to meanwhile
+  sx127x_implicit_header_t *rx_header;
   uint8_t version;
   uint64_t frequency;
   void (*rx_callback)(sx127x *);
   void (*tx_callback)(sx127x *);
   void (*cad_callback)(sx127x *, int);
-  uint8_t packet[256];
+  // FIFO is read by DMA straight into this buffer, see sx127x_read_payload
+  uint8_t packet[256] __attribute__((aligned(4)));
+  // write-through copy of the configuration registers. Indexed by register address
+  uint8_t shadow[REG_PA_DAC + 1];
 };
 
+// Configuration registers are only changed by the host, so their value can be served from the shadow.
+// Status registers, FIFO pointers and the operating mode change on their own and always go to the chip.
+static int sx127x_is_shadowed(int reg) {
+  switch (reg) {
+    case REG_FRF_MSB:
+    case REG_FRF_MID:
+    case REG_FRF_LSB:
+    case REG_PA_CONFIG:
+    case REG_PA_RAMP:
+    case REG_OCP:
+    case REG_LNA:
+    case REG_FIFO_TX_BASE_ADDR:
+    case REG_FIFO_RX_BASE_ADDR:
+    case REG_MODEM_CONFIG_1:
+    case REG_MODEM_CONFIG_2:
+    case REG_SYMB_TIMEOUT_LSB:
+    case REG_PREAMBLE_MSB:
+    case REG_PREAMBLE_LSB:
+    case REG_PAYLOAD_LENGTH:
+    case REG_MAX_PAYLOAD_LENGTH:
+    case REG_HOP_PERIOD:
+    case REG_MODEM_CONFIG_3:
+    case REG_DETECTION_OPTIMIZE:
+    case REG_INVERTIQ:
+    case REG_DETECTION_THRESHOLD:
+    case REG_SYNC_WORD:
+    case REG_INVERTIQ2:
+    case REG_DIO_MAPPING_1:
+    case REG_DIO_MAPPING_2:
+    case REG_PA_DAC:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+int sx127x_write_register(int reg, uint8_t *data, size_t data_length, sx127x *device) {
+  int code = sx127x_spi_write_register(reg, data, data_length, device->spi_device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  for (size_t i = 0; i < data_length; i++) {
+    if (sx127x_is_shadowed(reg + i)) {
+      device->shadow[reg + i] = data[i];
+    }
+  }
+  return SX127X_OK;
+}
+
 int sx127x_read_register(int reg, sx127x *device, uint8_t *result) {
+  if (sx127x_is_shadowed(reg)) {
+    *result = device->shadow[reg];
+    return SX127X_OK;
+  }
   uint32_t value;
   int code = sx127x_spi_read_registers(reg, device->spi_device, 1, &value);
   if (code != SX127X_OK) {
@@ -108,54 +178,93 @@ int sx127x_append_register(int reg, uint8_t value, uint8_t mask, sx127x *device)
     return code;
   }
   uint8_t data[] = {(previous & mask) | value};
-  return sx127x_spi_write_register(reg, data, 1, device->spi_device);
+  if (sx127x_is_shadowed(reg) && data[0] == previous) {
+    return SX127X_OK;
+  }
+  return sx127x_write_register(reg, data, 1, device);
+}
+
+int sx127x_reload_registers(sx127x *device) {
+  // 0x0d..0x3f are different registers in FSK mode and the chip comes out of reset in FSK mode.
+  // LongRangeMode can only be changed in sleep mode
+  uint32_t mode;
+  int code = sx127x_spi_read_registers(REG_OP_MODE, device->spi_device, 1, &mode);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  if ((mode & SX127x_LORA_MODE_LORA) == 0) {
+    uint8_t data[] = {SX127x_MODE_SLEEP | SX127x_LORA_MODE_FSK};
+    code = sx127x_spi_write_register(REG_OP_MODE, data, 1, device->spi_device);
+    if (code != SX127X_OK) {
+      return code;
+    }
+    data[0] = SX127x_MODE_SLEEP | SX127x_LORA_MODE_LORA;
+    code = sx127x_spi_write_register(REG_OP_MODE, data, 1, device->spi_device);
+    if (code != SX127X_OK) {
+      return code;
+    }
+  }
+  code = sx127x_spi_read_buffer(SHADOW_BURST_START, device->shadow + SHADOW_BURST_START, SHADOW_BURST_END - SHADOW_BURST_START + 1, device->spi_device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  uint32_t value;
+  code = sx127x_spi_read_registers(REG_PA_DAC, device->spi_device, 1, &value);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  device->shadow[REG_PA_DAC] = (uint8_t)value;
+  return SX127X_OK;
 }
 
 int sx127x_set_low_datarate_optimization(sx127x_low_datarate_optimization_t value, sx127x *device) {
   return sx127x_append_register(REG_MODEM_CONFIG_3, value, 0b11110111, device);
 }
 
+static uint32_t sx127x_bandwidth_to_hz(sx127x_bw_t bandwidth) {
+  static const uint32_t bandwidths[] = {7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000};
+  return bandwidths[bandwidth >> 4];
+}
+
 int sx127x_get_bandwidth(sx127x *device, uint32_t *bandwidth) {
   uint8_t config = 0;
   int code = sx127x_read_register(REG_MODEM_CONFIG_1, device, &config);
   if (code != SX127X_OK) {
     return code;
   }
-  config = (config >> 4);
-  switch (config) {
-    case 0b0000:
-      *bandwidth = 7800;
-      break;
-    case 0b0001:
-      *bandwidth = 10400;
-      break;
-    case 0b0010:
-      *bandwidth = 15600;
-      break;
-    case 0b0011:
-      *bandwidth = 20800;
-      break;
-    case 0b0100:
-      *bandwidth = 31250;
-      break;
-    case 0b0101:
-      *bandwidth = 41700;
-      break;
-    case 0b0110:
-      *bandwidth = 62500;
-      break;
-    case 0b0111:
-      *bandwidth = 125000;
-      break;
-    case 0b1000:
-      *bandwidth = 250000;
-      break;
-    case 0b1001:
-      *bandwidth = 500000;
-      break;
-    default:
-      return SX127X_ERR_INVALID_ARG;
+  if ((config >> 4) > (SX127x_BW_500000 >> 4)) {
+    return SX127X_ERR_INVALID_ARG;
+  }
+  *bandwidth = sx127x_bandwidth_to_hz(config & 0b11110000);
+  return SX127X_OK;
+}
+
+int sx127x_get_time_on_air(sx127x *device, uint8_t payload_length, uint32_t *time_on_air) {
+  // modem configuration is shadowed, no SPI access
+  uint8_t config1 = device->shadow[REG_MODEM_CONFIG_1];
+  uint8_t config2 = device->shadow[REG_MODEM_CONFIG_2];
+  uint8_t config3 = device->shadow[REG_MODEM_CONFIG_3];
+  if ((config1 >> 4) > (SX127x_BW_500000 >> 4)) {
+    return SX127X_ERR_INVALID_ARG;
   }
+  int64_t bandwidth = sx127x_bandwidth_to_hz(config1 & 0b11110000);
+  int64_t spreading_factor = config2 >> 4;
+  int64_t coding_rate = (config1 >> 1) & 0b111;
+  int64_t implicit_header = config1 & 0b1;
+  int64_t crc = (config2 >> 2) & 0b1;
+  int64_t low_datarate_optimization = (config3 >> 3) & 0b1;
+  int64_t preamble_length = ((uint16_t)device->shadow[REG_PREAMBLE_MSB] << 8) | device->shadow[REG_PREAMBLE_LSB];
+
+  // Section 4.1.1.7
+  int64_t payload_bits = 8 * (int64_t)payload_length - 4 * spreading_factor + 28 + 16 * crc - 20 * implicit_header;
+  int64_t bits_per_block = 4 * (spreading_factor - 2 * low_datarate_optimization);
+  int64_t payload_symbols = 8;
+  if (payload_bits > 0) {
+    payload_symbols += ((payload_bits + bits_per_block - 1) / bits_per_block) * (coding_rate + 4);
+  }
+  // preamble is n + 4.25 symbols, count in quarter symbols to stay in integers
+  int64_t quarter_symbols = 4 * (preamble_length + payload_symbols) + 17;
+  *time_on_air = (uint32_t)((quarter_symbols * (1LL << spreading_factor) * 1000000) / (4 * bandwidth));
   return SX127X_OK;
 }
 
@@ -189,7 +298,7 @@ void sx127x_handle_interrupt(sx127x *device) {
   }
   // clear the irq
   uint8_t data[] = {value};
-  code = sx127x_spi_write_register(REG_IRQ_FLAGS, data, 1, device->spi_device);
+  code = sx127x_write_register(REG_IRQ_FLAGS, data, 1, device);
   if (code != SX127X_OK) {
     return;
   }
@@ -233,6 +342,11 @@ int sx127x_create(void *spi_device, sx127x **result) {
     sx127x_destroy(device);
     return SX127X_ERR_INVALID_VERSION;
   }
+  code = sx127x_reload_registers(device);
+  if (code != SX127X_OK) {
+    sx127x_destroy(device);
+    return code;
+  }
   *result = device;
   return SX127X_OK;
 }
@@ -257,13 +371,17 @@ int sx127x_set_opmod(sx127x_mode_t opmod, sx127x *device) {
     }
   }
   data[0] = (opmod | SX127x_LORA_MODE_LORA);
-  return sx127x_spi_write_register(REG_OP_MODE, data, 1, device->spi_device);
+  int code = sx127x_write_register(REG_OP_MODE, data, 1, device);
+  if (code == SX127X_OK && (opmod == SX127x_MODE_RX_CONT || opmod == SX127x_MODE_RX_SINGLE)) {
+    device->rx_header = device->header;
+  }
+  return code;
 }
 
 int sx127x_set_frequency(uint64_t frequency, sx127x *device) {
   uint64_t adjusted = (frequency << 19) / SX127x_OSCILLATOR_FREQUENCY;
   uint8_t data[] = {(uint8_t)(adjusted >> 16), (uint8_t)(adjusted >> 8), (uint8_t)(adjusted >> 0)};
-  int result = sx127x_spi_write_register(REG_FRF_MSB, data, 3, device->spi_device);
+  int result = sx127x_write_register(REG_FRF_MSB, data, 3, device);
   if (result != SX127X_OK) {
     return result;
   }
@@ -274,7 +392,7 @@ int sx127x_set_frequency(uint64_t frequency, sx127x *device) {
 int sx127x_reset_fifo(sx127x *device) {
   // reset both RX and TX
   uint8_t data[] = {FIFO_TX_BASE_ADDR, FIFO_RX_BASE_ADDR};
-  return sx127x_spi_write_register(REG_FIFO_TX_BASE_ADDR, data, 2, device->spi_device);
+  return sx127x_write_register(REG_FIFO_TX_BASE_ADDR, data, 2, device);
 }
 
 int sx127x_set_lna_gain(sx127x_gain_t gain, sx127x *device) {
@@ -315,12 +433,12 @@ int sx127x_set_modem_config_2(sx127x_sf_t spreading_factor, sx127x *device) {
     detection_threshold = 0x0a;
   }
   uint8_t data[] = {detection_optimize};
-  int code = sx127x_spi_write_register(REG_DETECTION_OPTIMIZE, data, 1, device->spi_device);
+  int code = sx127x_write_register(REG_DETECTION_OPTIMIZE, data, 1, device);
   if (code != SX127X_OK) {
     return code;
   }
   data[0] = detection_threshold;
-  code = sx127x_spi_write_register(REG_DETECTION_THRESHOLD, data, 1, device->spi_device);
+  code = sx127x_write_register(REG_DETECTION_THRESHOLD, data, 1, device);
   if (code != SX127X_OK) {
     return code;
   }
@@ -337,12 +455,12 @@ void sx127x_set_rx_callback(void (*rx_callback)(sx127x *), sx127x *device) {
 
 int sx127x_set_syncword(uint8_t value, sx127x *device) {
   uint8_t data[] = {value};
-  return sx127x_spi_write_register(REG_SYNC_WORD, data, 1, device->spi_device);
+  return sx127x_write_register(REG_SYNC_WORD, data, 1, device);
 }
 
 int sx127x_set_preamble_length(uint16_t value, sx127x *device) {
   uint8_t data[] = {(uint8_t)(value >> 8), (uint8_t)(value >> 0)};
-  return sx127x_spi_write_register(REG_PREAMBLE_MSB, data, 2, device->spi_device);
+  return sx127x_write_register(REG_PREAMBLE_MSB, data, 2, device);
 }
 
 int sx127x_set_implicit_header(sx127x_implicit_header_t *header, sx127x *device) {
@@ -354,10 +472,13 @@ int sx127x_set_implicit_header(sx127x_implicit_header_t *header, sx127x *device)
     if (code != SX127X_OK) {
       return code;
     }
-    uint8_t reg_data[] = {header->length};
-    code = sx127x_spi_write_register(REG_PAYLOAD_LENGTH, reg_data, 1, device->spi_device);
-    if (code != SX127X_OK) {
-      return code;
+    // header mode is switched per frame, only changed registers are written
+    if (device->shadow[REG_PAYLOAD_LENGTH] != header->length) {
+      uint8_t reg_data[] = {header->length};
+      code = sx127x_write_register(REG_PAYLOAD_LENGTH, reg_data, 1, device);
+      if (code != SX127X_OK) {
+        return code;
+      }
     }
     return sx127x_append_register(REG_MODEM_CONFIG_2, header->crc, 0b11111011, device);
   }
@@ -365,7 +486,7 @@ int sx127x_set_implicit_header(sx127x_implicit_header_t *header, sx127x *device)
 
 int sx127x_read_payload(sx127x *device, uint8_t **packet, uint8_t *packet_length) {
   uint8_t length;
-  if (device->header == NULL) {
+  if (device->rx_header == NULL) {
     int code = sx127x_read_register(REG_RX_NB_BYTES, device, &length);
     if (code != SX127X_OK) {
       *packet_length = 0;
@@ -373,7 +494,7 @@ int sx127x_read_payload(sx127x *device, uint8_t **packet, uint8_t *packet_length
       return code;
     }
   } else {
-    length = device->header->length;
+    length = device->rx_header->length;
   }
 
   uint8_t current;
@@ -384,14 +505,20 @@ int sx127x_read_payload(sx127x *device, uint8_t **packet, uint8_t *packet_length
     return code;
   }
   uint8_t data[] = {current};
-  code = sx127x_spi_write_register(REG_FIFO_ADDR_PTR, data, 1, device->spi_device);
+  code = sx127x_write_register(REG_FIFO_ADDR_PTR, data, 1, device);
   if (code != SX127X_OK) {
     *packet_length = 0;
     *packet = NULL;
     return code;
   }
 
-  code = sx127x_spi_read_buffer(REG_FIFO, device->packet, length, device->spi_device);
+  // read whole words, so the DMA can write into device->packet directly without a bounce buffer.
+  // Bytes past the payload are ignored, FIFO_ADDR_PTR is set before every read
+  size_t read_length = ((size_t)length + 3) & ~(size_t)3;
+  if (read_length > sizeof(device->packet)) {
+    read_length = sizeof(device->packet);
+  }
+  code = sx127x_spi_read_buffer(REG_FIFO, device->packet, read_length, device->spi_device);
   if (code != SX127X_OK) {
     *packet_length = 0;
     *packet = NULL;
@@ -459,63 +586,53 @@ int sx127x_get_frequency_error(sx127x *device, int32_t *result) {
 int sx127x_dump_registers(sx127x *device) {
   uint8_t length = 0x7F;
   for (int i = 0; i < length; i++) {
-    uint8_t value;
-    sx127x_read_register(i, device, &value);
-    printf("0x%2x: 0x%2x\n", i, value);
+    uint32_t value;
+    sx127x_spi_read_registers(i, device->spi_device, 1, &value);
+    printf("0x%2x: 0x%2x\n", i, (uint8_t)value);
   }
   return SX127X_OK;
 }
 
 int sx127x_set_dio_mapping1(sx127x_dio_mapping1_t value, sx127x *device) {
   uint8_t data[] = {value};
-  return sx127x_spi_write_register(REG_DIO_MAPPING_1, data, 1, device->spi_device);
+  return sx127x_write_register(REG_DIO_MAPPING_1, data, 1, device);
 }
 
 int sx127x_set_dio_mapping2(sx127x_dio_mapping2_t value, sx127x *device) {
   uint8_t data[] = {value};
-  return sx127x_spi_write_register(REG_DIO_MAPPING_2, data, 1, device->spi_device);
+  return sx127x_write_register(REG_DIO_MAPPING_2, data, 1, device);
 }
 
 void sx127x_set_tx_callback(void (*tx_callback)(sx127x *), sx127x *device) {
   device->tx_callback = tx_callback;
 }
 
-int sx127x_set_pa_config(sx127x_pa_pin_t pin, int power, sx127x *device) {
+static int sx127x_calculate_pa_config(sx127x_pa_pin_t pin, int power, uint8_t *pa_dac, uint8_t *pa_config, uint8_t *max_current) {
   if (pin == SX127x_PA_PIN_RFO && (power < -4 || power > 15)) {
     return SX127X_ERR_INVALID_ARG;
   }
   if (pin == SX127x_PA_PIN_BOOST && (power < 2 || power > 20)) {
     return SX127X_ERR_INVALID_ARG;
   }
-  uint8_t data[] = {0};
   if (pin == SX127x_PA_PIN_BOOST && power == 20) {
-    data[0] = SX127x_HIGH_POWER_ON;
+    *pa_dac = SX127x_HIGH_POWER_ON;
   } else {
-    data[0] = SX127x_HIGH_POWER_OFF;
-  }
-  int code = sx127x_spi_write_register(REG_PA_DAC, data, 1, device->spi_device);
-  if (code != SX127X_OK) {
-    return code;
+    *pa_dac = SX127x_HIGH_POWER_OFF;
   }
-  uint8_t max_current;
   // according to 2.5.1. Power Consumption
   if (pin == SX127x_PA_PIN_BOOST) {
     if (power == 20) {
-      max_current = 120;
+      *max_current = 120;
     } else {
-      max_current = 87;
+      *max_current = 87;
     }
   } else {
     if (power > 7) {
-      max_current = 29;
+      *max_current = 29;
     } else {
-      max_current = 20;
+      *max_current = 20;
     }
   }
-  code = sx127x_set_ocp(SX127x_OCP_ON, max_current, device);
-  if (code != SX127X_OK) {
-    return code;
-  }
   uint8_t value;
   if (pin == SX127x_PA_PIN_RFO) {
     if (power < 0) {
@@ -531,26 +648,50 @@ int sx127x_set_pa_config(sx127x_pa_pin_t pin, int power, sx127x *device) {
       value = SX127x_PA_PIN_BOOST | (power - 2);
     }
   }
-  data[0] = value;
-  return sx127x_spi_write_register(REG_PA_CONFIG, data, 1, device->spi_device);
+  *pa_config = value;
+  return SX127X_OK;
 }
 
-int sx127x_set_ocp(sx127x_ocp_t onoff, uint8_t max_current, sx127x *device) {
-  uint8_t data[1];
+static uint8_t sx127x_calculate_ocp(sx127x_ocp_t onoff, uint8_t max_current) {
   if (onoff == SX127x_OCP_OFF) {
-    data[0] = SX127x_OCP_OFF;
-    return sx127x_spi_write_register(REG_OCP, data, 1, device->spi_device);
+    return SX127x_OCP_OFF;
   }
+  uint8_t result;
   // 5.4.4. Over Current Protection
   if (max_current <= 120) {
-    data[0] = (max_current - 45) / 5;
+    result = (max_current - 45) / 5;
   } else if (max_current <= 240) {
-    data[0] = (max_current + 30) / 10;
+    result = (max_current + 30) / 10;
   } else {
-    data[0] = 27;
+    result = 27;
+  }
+  return (result | onoff);
+}
+
+int sx127x_set_pa_config(sx127x_pa_pin_t pin, int power, sx127x *device) {
+  uint8_t pa_dac;
+  uint8_t pa_config;
+  uint8_t max_current;
+  int code = sx127x_calculate_pa_config(pin, power, &pa_dac, &pa_config, &max_current);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  uint8_t data[] = {pa_dac};
+  code = sx127x_write_register(REG_PA_DAC, data, 1, device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  code = sx127x_set_ocp(SX127x_OCP_ON, max_current, device);
+  if (code != SX127X_OK) {
+    return code;
   }
-  data[0] = (data[0] | onoff);
-  return sx127x_spi_write_register(REG_OCP, data, 1, device->spi_device);
+  data[0] = pa_config;
+  return sx127x_write_register(REG_PA_CONFIG, data, 1, device);
+}
+
+int sx127x_set_ocp(sx127x_ocp_t onoff, uint8_t max_current, sx127x *device) {
+  uint8_t data[] = {sx127x_calculate_ocp(onoff, max_current)};
+  return sx127x_write_register(REG_OCP, data, 1, device);
 }
 
 int sx127x_set_tx_explicit_header(sx127x_tx_header_t *header, sx127x *device) {
@@ -570,12 +711,12 @@ int sx127x_set_for_transmission(uint8_t *data, uint8_t data_length, sx127x *devi
     return SX127X_ERR_INVALID_ARG;
   }
   uint8_t fifo_addr[] = {FIFO_TX_BASE_ADDR};
-  int code = sx127x_spi_write_register(REG_FIFO_ADDR_PTR, fifo_addr, 1, device->spi_device);
+  int code = sx127x_write_register(REG_FIFO_ADDR_PTR, fifo_addr, 1, device);
   if (code != SX127X_OK) {
     return code;
   }
   uint8_t reg_data[] = {data_length};
-  code = sx127x_spi_write_register(REG_PAYLOAD_LENGTH, reg_data, 1, device->spi_device);
+  code = sx127x_write_register(REG_PAYLOAD_LENGTH, reg_data, 1, device);
   if (code != SX127X_OK) {
     return code;
   }
@@ -583,10 +724,125 @@ int sx127x_set_for_transmission(uint8_t *data, uint8_t data_length, sx127x *devi
   return sx127x_spi_write_buffer(REG_FIFO, data, data_length, device->spi_device);
 }
 
+int sx127x_set_for_transmission_segments(const sx127x_segment_t *segments, size_t segments_count, sx127x *device) {
+  size_t data_length = 0;
+  for (size_t i = 0; i < segments_count; i++) {
+    data_length += segments[i].buffer_length;
+  }
+  // same limit as sx127x_set_for_transmission, PAYLOAD_LENGTH is 8 bit
+  if (data_length == 0 || data_length > UINT8_MAX) {
+    return SX127X_ERR_INVALID_ARG;
+  }
+  uint8_t fifo_addr[] = {FIFO_TX_BASE_ADDR};
+  int code = sx127x_write_register(REG_FIFO_ADDR_PTR, fifo_addr, 1, device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  uint8_t reg_data[] = {(uint8_t)data_length};
+  code = sx127x_write_register(REG_PAYLOAD_LENGTH, reg_data, 1, device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  return sx127x_spi_write_segments(REG_FIFO, segments, segments_count, device->spi_device);
+}
+
 void sx127x_set_cad_callback(void (*cad_callback)(sx127x *, int), sx127x *device) {
   device->cad_callback = cad_callback;
 }
 
+// Write a range of shadowed registers in one burst. Skipped entirely if the chip already has these values
+static int sx127x_write_burst(int reg, uint8_t *data, size_t data_length, sx127x *device) {
+  if (memcmp(device->shadow + reg, data, data_length) == 0) {
+    return SX127X_OK;
+  }
+  int code;
+  if (data_length <= 4) {
+    code = sx127x_spi_write_register(reg, data, data_length, device->spi_device);
+  } else {
+    code = sx127x_spi_write_buffer(reg, data, data_length, device->spi_device);
+  }
+  if (code != SX127X_OK) {
+    return code;
+  }
+  memcpy(device->shadow + reg, data, data_length);
+  return SX127X_OK;
+}
+
+int sx127x_apply_profile(const sx127x_modem_profile_t *profile, sx127x *device) {
+  if (profile == NULL || (profile->bandwidth >> 4) > (SX127x_BW_500000 >> 4)) {
+    return SX127X_ERR_INVALID_ARG;
+  }
+  sx127x_implicit_header_t *header = profile->implicit_header;
+  if (profile->spreading_factor == SX127x_SF_6 && header == NULL) {
+    return SX127X_ERR_INVALID_ARG;
+  }
+  uint8_t pa_dac;
+  uint8_t pa_config;
+  uint8_t max_current;
+  int code = sx127x_calculate_pa_config(profile->pa_pin, profile->power, &pa_dac, &pa_config, &max_current);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  sx127x_cr_t coding_rate = (header == NULL) ? profile->coding_rate : header->coding_rate;
+  sx127x_crc_payload_t crc = (header == NULL) ? profile->crc : header->crc;
+
+  // RegFrfMsb .. RegLna
+  uint64_t frf = (profile->frequency << 19) / SX127x_OSCILLATOR_FREQUENCY;
+  uint8_t rf[] = {(uint8_t)(frf >> 16), (uint8_t)(frf >> 8), (uint8_t)(frf >> 0), pa_config, device->shadow[REG_PA_RAMP], sx127x_calculate_ocp(SX127x_OCP_ON, max_current), device->shadow[REG_LNA]};
+  code = sx127x_write_burst(REG_FRF_MSB, rf, sizeof(rf), device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  device->frequency = profile->frequency;
+
+  // RegModemConfig1 .. RegPayloadLength. TxContinuousMode off and the reset value of SymbTimeout, the driver sets
+  // neither. PayloadLength is rewritten for every frame in explicit header mode
+  uint8_t modem[] = {
+      profile->bandwidth | coding_rate | (header == NULL ? SX127x_HEADER_MODE_EXPLICIT : SX127x_HEADER_MODE_IMPLICIT),
+      profile->spreading_factor | crc | (uint8_t)(SX127x_SYMB_TIMEOUT_DEFAULT >> 8),
+      (uint8_t)(SX127x_SYMB_TIMEOUT_DEFAULT >> 0),
+      (uint8_t)(profile->preamble_length >> 8),
+      (uint8_t)(profile->preamble_length >> 0),
+      (header == NULL ? device->shadow[REG_PAYLOAD_LENGTH] : header->length)};
+  code = sx127x_write_burst(REG_MODEM_CONFIG_1, modem, sizeof(modem), device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  device->header = header;
+
+  // Section 4.1.1.5
+  long symbol_duration = 1000 / (sx127x_bandwidth_to_hz(profile->bandwidth) / (1L << (profile->spreading_factor >> 4)));
+  uint8_t config3[] = {SX127x_REG_MODEM_CONFIG_3_AGC_ON | (symbol_duration > 16 ? SX127x_LOW_DATARATE_OPTIMIZATION_ON : SX127x_LOW_DATARATE_OPTIMIZATION_OFF)};
+  code = sx127x_write_burst(REG_MODEM_CONFIG_3, config3, 1, device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+
+  uint8_t detection_optimize[] = {profile->spreading_factor == SX127x_SF_6 ? 0xc5 : 0xc3};
+  code = sx127x_write_burst(REG_DETECTION_OPTIMIZE, detection_optimize, 1, device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  uint8_t detection_threshold[] = {profile->spreading_factor == SX127x_SF_6 ? 0x0c : 0x0a};
+  code = sx127x_write_burst(REG_DETECTION_THRESHOLD, detection_threshold, 1, device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  uint8_t syncword[] = {profile->syncword};
+  code = sx127x_write_burst(REG_SYNC_WORD, syncword, 1, device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+
+  uint8_t dio_mapping[] = {profile->dio_mapping1, profile->dio_mapping2};
+  code = sx127x_write_burst(REG_DIO_MAPPING_1, dio_mapping, sizeof(dio_mapping), device);
+  if (code != SX127X_OK) {
+    return code;
+  }
+  uint8_t pa_dac_data[] = {pa_dac};
+  return sx127x_write_burst(REG_PA_DAC, pa_dac_data, 1, device);
+}
+
 void sx127x_destroy(sx127x *device) {
   if (device == NULL) {
     return;
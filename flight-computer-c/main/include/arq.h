@@ -0,0 +1,60 @@
+#ifndef ARQ_H
+#define ARQ_H
+
+#include <stdint.h>
+
+// Selective-repeat sender of one fragmented message. Fragments are sent in rounds, the last fragment of a round polls
+// the receiver, which answers with a NACK bitmap of the fragments it is still missing. Only those are sent again.
+// A round covers the unconfirmed fragments within ARQ_WINDOW of the lowest unconfirmed one, so the window slides as
+// soon as its first fragment is confirmed. Portable C, time is passed in by the caller
+#define ARQ_MAX_FRAGMENTS 64
+#define ARQ_WINDOW 8
+// wait for the report on top of the airtime of the round
+#define ARQ_REPORT_TIMEOUT_MS 300
+// rounds in a row without progress before the message is given up
+#define ARQ_MAX_RETRIES 5
+
+typedef enum {
+    ARQ_IDLE = 0, // no message
+    ARQ_WAITING, // round sent, waiting for the report
+    ARQ_SEND, // next round is due, get it with arq_next_round
+    ARQ_DONE, // receiver has every fragment
+    ARQ_FAILED, // ARQ_MAX_RETRIES rounds without progress
+} Arq_Status;
+
+typedef struct {
+    Arq_Status status;
+    uint8_t message_id;
+    uint8_t num_of_packets;
+    uint64_t acked; // bit n is set once the receiver confirmed fragment n
+    uint64_t sent; // bit n is set once fragment n was sent, later rounds resend it
+    uint8_t retries;
+    int64_t deadline; // us, end of the report wait
+} Arq_Sender;
+
+/// Starts sending a message, the first round is due right away.
+/// \param arq Sender state.
+/// \param message_id Message id of the fragments.
+/// \param num_of_packets Number of fragments, at most ARQ_MAX_FRAGMENTS.
+void arq_start(Arq_Sender* arq, uint8_t message_id, uint8_t num_of_packets);
+
+/// Selects the fragments of the next round and starts waiting for its report.
+/// \param arq Sender state, status must be ARQ_SEND.
+/// \param deadline Time in us when the round is considered lost, should cover its airtime.
+/// \return Bitmap of the fragments to send, the highest one should poll the receiver. 0 if nothing is due.
+uint64_t arq_next_round(Arq_Sender* arq, int64_t deadline);
+
+/// Applies a NACK of the receiver. Reports of other messages, or received while no round is pending, are ignored.
+/// \param arq Sender state.
+/// \param message_id Message id of the report.
+/// \param missing Fragments the receiver is missing, 0 acknowledges the whole message.
+/// \return New status, ARQ_SEND when another round is due.
+Arq_Status arq_report(Arq_Sender* arq, uint8_t message_id, uint64_t missing);
+
+/// Schedules the round again when its report did not arrive in time.
+/// \param arq Sender state.
+/// \param now Current time in us.
+/// \return New status, ARQ_SEND when the round is due again.
+Arq_Status arq_check_timeout(Arq_Sender* arq, int64_t now);
+
+#endif //ARQ_H
@@ -0,0 +1,168 @@
+#ifndef LORA_CODEC_H
+#define LORA_CODEC_H
+
+#include <sx127x.h>
+#include "network.h"
+#include "tdma.h"
+
+// On-air header, version 2:
+//   byte 0: version (bits 7-6) | single fragment flag (bit 5) | poll flag (bit 4) | message type (bits 3-0)
+//   src, dest
+//   sequence number (big endian), counts the frames the source sent to the destination
+//   num_of_packets, packet_num, message_id, only if the single fragment flag is not set
+//   last_payload_size, parity frames only
+//   CRC16 over the header bytes above and the payload (big endian)
+// The payload follows the header, its length is implied by the RX byte count. The CRC is sent before the
+// payload so the frame can be gathered from two buffers. Data frames always carry the full header, the receiver
+// needs the message id to tell a retransmitted message from a new one. Parity frames carry the size of the last
+// data fragment, which can't be rebuilt without it. The sequence number is set by the sender task for every frame
+// that goes on air, resends included, the receiver rejects duplicated and replayed frames with it
+#define LORA_WIRE_VERSION 2
+#define LORA_WIRE_VERSION_SHIFT 6
+#define LORA_WIRE_FLAG_SINGLE 0x20
+#define LORA_WIRE_FLAG_POLL 0x10
+#define LORA_WIRE_TYPE_MASK 0x0F
+#define LORA_WIRE_MESSAGE_TYPE(first_byte) ((first_byte) & LORA_WIRE_TYPE_MASK)
+
+#define LORA_PACKET_WIRE_HEADER_SIZE 10
+#define LORA_PACKET_WIRE_SINGLE_HEADER_SIZE 7
+#define LORA_PACKET_WIRE_PARITY_HEADER_SIZE 11
+#define LORA_PACKET_WIRE_MAX_HEADER_SIZE LORA_PACKET_WIRE_PARITY_HEADER_SIZE
+// 255, the longest LoRa payload
+#define LORA_PACKET_WIRE_MAX_SIZE (LORA_PACKET_WIRE_MAX_HEADER_SIZE + LORA_PAYLOAD_MAX_SIZE)
+// Control, header mode and beacon frames have this fixed length, they are sent with implicit LoRa header
+#define LORA_CONTROL_WIRE_SIZE (LORA_PACKET_WIRE_SINGLE_HEADER_SIZE + LORA_CONTROL_FRAME_SIZE)
+// Header and payload
+#define LORA_PACKET_WIRE_SEGMENTS 2
+// Beacon payload: control slots (bits 3-0) | downlink slots (bits 7-4), the modem profile from the end of the
+// superframe on, then the owner of every reply slot. Fills a control frame payload
+#define LORA_BEACON_FRAME_SIZE (2 + TDMA_MAX_REPLY_SLOTS)
+#define LORA_BEACON_SLOTS_MASK 0x0F
+#define LORA_BEACON_DOWNLINK_SHIFT 4
+
+// Batch frames carry several small packets for the same destination as records:
+//   record length, the length of the rest of the record
+//   byte 0 and, unless single, num_of_packets, packet_num and message_id of the packet's own header
+//   payload
+// Addresses and the sequence number come from the batch frame and its CRC covers every record. NACKs and single fragment messages are
+// batched, a record may take at most half of a frame
+#define LORA_BATCH_MAX_RECORD_SIZE (LORA_PAYLOAD_MAX_SIZE / 2)
+
+/// On-air length of the packet.
+/// \param packet Packet to send.
+/// \return Header and payload length in bytes.
+uint8_t lora_codec_frame_length(const LoRa_Packet* packet);
+
+/// Serializes the on-air header of the packet, the frame CRC is calculated here.
+/// \param packet Packet to serialize.
+/// \param wire_header Output, up to LORA_PACKET_WIRE_MAX_HEADER_SIZE bytes.
+/// \return Header length in bytes.
+uint8_t lora_codec_encode_header(const LoRa_Packet* packet, uint8_t* wire_header);
+
+/// Prepares the packet for a single FIFO burst without copying the payload.
+/// \param packet Packet to send. The payload segment points into it, so it must stay valid until the frame is loaded.
+/// \param wire_header Buffer for the serialized header, LORA_PACKET_WIRE_MAX_HEADER_SIZE bytes. Should be word aligned for DMA.
+/// \param segments Output, LORA_PACKET_WIRE_SEGMENTS segments.
+/// \return Frame length in bytes.
+uint8_t lora_codec_encode_segments(LoRa_Packet* packet, uint8_t* wire_header, sx127x_segment_t* segments);
+
+/// Serializes the packet into one contiguous frame.
+/// \param packet Packet to serialize.
+/// \param frame Output, up to LORA_PACKET_WIRE_MAX_SIZE bytes.
+/// \return Frame length in bytes.
+uint8_t lora_codec_encode(const LoRa_Packet* packet, uint8_t* frame);
+
+/// Deserializes a received frame into the packet. The in-memory header and payload CRCs are
+/// recalculated once the frame CRC is verified.
+/// \param packet Output.
+/// \param frame Received frame, e.g. the FIFO buffer returned by sx127x_read_payload.
+/// \param frame_length Length of the frame.
+/// \return 0 if successful, 1 if the frame is too short, has an unknown version or its CRC doesn't match.
+uint8_t lora_codec_decode(LoRa_Packet* packet, const uint8_t* frame, uint8_t frame_length);
+
+/// Builds a complete single frame control packet, CRCs included. No buffer is allocated.
+/// \param control Setpoint to send.
+/// \param src_addr Source network address.
+/// \param dest_addr Destination network address.
+/// \param packet Output, e.g. a pool buffer.
+void lora_codec_encode_control(const LoRa_Control_Frame* control, uint8_t src_addr, uint8_t dest_addr, LoRa_Packet* packet);
+
+/// Builds the frame announcing that explicit header frames follow. It has the length of a control frame.
+/// \param src_addr Source network address.
+/// \param dest_addr Destination network address.
+/// \param packet Output, e.g. a pool buffer.
+void lora_codec_encode_header_mode(uint8_t src_addr, uint8_t dest_addr, LoRa_Packet* packet);
+
+/// Builds the broadcast beacon that starts a superframe. It has the length of a control frame.
+/// \param superframe Layout of the superframe.
+/// \param profile Modem profile of the link once the superframe ended, index into adr_profiles.
+/// \param src_addr Source network address.
+/// \param packet Output, e.g. a pool buffer.
+void lora_codec_encode_beacon(const Tdma_Superframe* superframe, uint8_t profile, uint8_t src_addr, LoRa_Packet* packet);
+
+/// Extracts the superframe layout from a beacon packet. CRCs are not checked here.
+/// \param packet Received packet.
+/// \param superframe Output.
+/// \param profile Output, modem profile of the link once the superframe ended.
+/// \return 0 if successful, 1 if the packet is not a beacon or the layout exceeds the slot limits.
+uint8_t lora_codec_decode_beacon(const LoRa_Packet* packet, Tdma_Superframe* superframe, uint8_t* profile);
+
+/// Builds a single frame link management packet, CRCs included.
+/// \param link Report, switch or acknowledgement to send.
+/// \param src_addr Source network address.
+/// \param dest_addr Destination network address.
+/// \param packet Output, e.g. a pool buffer.
+void lora_codec_encode_link(const LoRa_Link_Frame* link, uint8_t src_addr, uint8_t dest_addr, LoRa_Packet* packet);
+
+/// Extracts the link management frame from a packet. CRCs are not checked here.
+/// \param packet Received packet.
+/// \param link Output.
+/// \return 0 if successful, 1 if the packet is not a link management frame.
+uint8_t lora_codec_decode_link(const LoRa_Packet* packet, LoRa_Link_Frame* link);
+
+/// Builds a single frame selective repeat report, CRCs included.
+/// \param src_addr Source network address.
+/// \param dest_addr Destination network address, sender of the message.
+/// \param message_id Message id of the reported message.
+/// \param missing Bit n is set if fragment n is missing.
+/// \param packet Output, e.g. a pool buffer.
+void lora_codec_encode_nack(uint8_t src_addr, uint8_t dest_addr, uint8_t message_id, uint64_t missing, LoRa_Packet* packet);
+
+/// Extracts the report from a NACK packet. CRCs are not checked here.
+/// \param packet Received packet.
+/// \param message_id Output, message id of the reported message.
+/// \param missing Output, bit n is set if fragment n is missing.
+/// \return 0 if successful, 1 if the packet is not a NACK.
+uint8_t lora_codec_decode_nack(const LoRa_Packet* packet, uint8_t* message_id, uint64_t* missing);
+
+/// Starts an empty batch frame.
+/// \param src_addr Source network address.
+/// \param dest_addr Destination network address, shared by every record.
+/// \param batch Output, e.g. a pool buffer.
+void lora_codec_batch_init(uint8_t src_addr, uint8_t dest_addr, LoRa_Packet* batch);
+
+/// Tells whether the packet may share a batch frame.
+/// \param packet Packet to send.
+/// \return 1 for a NACK or a single fragment message of at most LORA_BATCH_MAX_RECORD_SIZE record bytes.
+uint8_t lora_codec_can_batch(const LoRa_Packet* packet);
+
+/// Appends the packet to the batch frame as one record, CRCs included.
+/// \param batch Batch frame from lora_codec_batch_init.
+/// \param packet Packet accepted by lora_codec_can_batch, copied.
+/// \return 0 if successful, 1 if the frame has no room for it.
+uint8_t lora_codec_batch_append(LoRa_Packet* batch, const LoRa_Packet* packet);
+
+/// Extracts the next record of a received batch frame as a packet of its own, CRCs included.
+/// \param batch Received batch frame.
+/// \param offset Start of the record, 0 for the first one. Advanced to the next record.
+/// \param packet Output.
+/// \return 0 if successful, 1 if there are no more records or the record is malformed.
+uint8_t lora_codec_batch_next(const LoRa_Packet* batch, uint8_t* offset, LoRa_Packet* packet);
+
+/// Extracts the setpoint from a control packet. CRCs are not checked here.
+/// \param packet Received packet.
+/// \param control Output.
+/// \return 0 if successful, 1 if the packet is not a control frame.
+uint8_t lora_codec_decode_control(const LoRa_Packet* packet, LoRa_Control_Frame* control);
+
+#endif //LORA_CODEC_H
@@ -13,16 +13,25 @@
 #include "security.h"
 #include "math.h"
 #include <sx127x.h>
+#include <sx127x_async.h>
 #include <stdlib.h>
 #include <driver/spi_common.h>
 #include <driver/spi_master.h>
 #include <driver/gpio.h>
 #include <esp_log.h>
 #include "esp_crc.h"
-#include <rom/crc.h>
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "crc16.h"
 #include "memory.h"
 #include "servo.h"
 #include "motor.h"
+#include "reassembly.h"
+#include "arq.h"
+#include "fec.h"
+#include "replay.h"
+#include "tdma.h"
+#include "adr.h"
 
 #define LORA_SPI_HOST VSPI_HOST
 
@@ -33,33 +42,124 @@
 #define LORA_RST_PIN 0
 #define LORA_DIO0_PIN 4
 
-#define LORA_PAYLOAD_MAX_SIZE 246
+// sx127x SPI interface is rated up to 10 MHz (SCK period min 100 ns)
+#define LORA_SPI_CLOCK_SPEED_HZ 10000000
+
+// FIFO loads, mode changes and payload reads are executed by the sx127x async worker
+#define LORA_ASYNC_QUEUE_LENGTH 16
+#define LORA_ASYNC_TASK_PRIORITY 20
+// A return to rx the full request queue refused is submitted again this much later, the worker drains the queue
+// meanwhile
+#define LORA_ASYNC_RETRY_MS 1
+// Next frame is encoded while the previous one is loaded into the FIFO
+#define LORA_TX_FRAME_BUFFERS 2
+// Slack on top of the calculated time on air before a missing TX_DONE is reported
+#define LORA_TX_DONE_MARGIN_MS 20
+// The ground station grants every aircraft a reply slot at least every this many superframes, its
+// NETWORK_REPLY_EVERY. Bounds the report timeout of a selective repeat round until the real interval is measured
+#define LORA_REPLY_EVERY 16
+// Adaptive data rate, see adr.h. The ground station decides the profile of the link, the aircraft reports the
+// window of the frames it received at most this often, each report in a reply slot
+#define LORA_LINK_REPORT_MS 1000
+// The link counts as lost after this long plus two of the longest superframes without a frame from the ground
+// station. The aircraft then tries the profile it acknowledged last, then the others in turn, each one as long
+#define LORA_LINK_LOST_MS 1000
+// Listen before talk: this many CADs run before every frame, each one listens for about one symbol. A busy channel
+// defers the frame by a random backoff. TDMA keeps the nodes of this network apart, the CAD finds other ground
+// stations and their aircraft on the channel. 0 sends without listening
+#define LORA_LBT_CAD_SYMBOLS 0
+// Backoff after a busy CAD, a random number of units from 1 to 2^n, n counts the busy CADs of the frame up to
+// LORA_LBT_BACKOFF_MAX_EXP
+#define LORA_LBT_BACKOFF_UNIT_US 1000
+#define LORA_LBT_BACKOFF_MAX_EXP 6
+// A control setpoint still queued this long after it was made is dropped instead of taking airtime, the aircraft
+// drops one it could not apply within this long of its arrival. The two ends don't share a clock
+#define LORA_CONTROL_EXPIRY_MS 100
+
+#define LORA_PAYLOAD_MAX_SIZE 244
 
 #define LORA_BASE_STATION_ADDR 0x00
 #define LORA_SELF_ADDRESS 0x01
 #define LORA_NETWORK_BROADCAST_ADDR 0xFF
 
 
+typedef enum {
+    LORA_MESSAGE_DATA = 0x00, // fragmented network message
+    LORA_MESSAGE_CONTROL = 0x01, // single frame LoRa_Control_Frame, bypasses message reassembly
+    LORA_MESSAGE_HEADER_MODE = 0x02, // announces explicit header frames, sent like a control frame
+    LORA_MESSAGE_NACK = 0x03, // selective repeat report, fragments of a message the receiver is missing
+    LORA_MESSAGE_PARITY = 0x04, // erasure code fragment, sent after the data fragments of a message
+    LORA_MESSAGE_BATCH = 0x05, // several small packets for one destination in one frame, see lora_codec.h
+    LORA_MESSAGE_BEACON = 0x06, // broadcast superframe layout of the ground station, sent like a control frame
+    LORA_MESSAGE_LINK = 0x07, // link management, adaptive data rate reports and modem profile switches
+} LoRa_Message_Type;
+
 typedef struct {
+    uint8_t message_type;
     uint8_t src_device_addr;
     uint8_t dest_device_addr;
+    uint16_t sequence; // frame counter of the source towards the destination, set by the sender task
     uint8_t num_of_packets;
-    uint8_t packet_num;
+    uint8_t packet_num; // index of the parity fragment for LORA_MESSAGE_PARITY
+    uint8_t message_id; // fragments of one message share it, 0 for single frame control messages
+    uint8_t poll; // last fragment of a selective repeat round, the receiver answers with a NACK
+    uint8_t last_payload_size; // parity fragments only, payload size of the last data fragment
     uint8_t payload_size;
     uint16_t header_crc;
 } LoRa_Packet_Header;
 
 typedef struct {
-    uint8_t payload[LORA_PAYLOAD_MAX_SIZE]; // Lora packet at 128 coding rate is 256 bytes - 7 bytes of header - 2 bytes crc
+    // word aligned for DMA, 255 byte LoRa frame minus the longest header
+    WORD_ALIGNED_ATTR uint8_t payload[LORA_PAYLOAD_MAX_SIZE];
     uint16_t payload_crc;
 } LoRa_Packet_Payload;
 
 typedef struct  {
     LoRa_Packet_Header header;
     LoRa_Packet_Payload payload;
-
+    int64_t expires_at; // esp_timer time in us, the sender drops the frame unsent after it. 0 never, not on air
 } LoRa_Packet;
 
+// Control setpoint sent every control period, fits a single packet. On air the landing gear
+// shares the throttle byte
+#define LORA_CONTROL_FRAME_SIZE 4
+#define LORA_CONTROL_LANDING_GEAR_BIT 0x80
+
+// NACK payload: message id, then the 64 bit bitmap of missing fragments, big endian. An empty bitmap
+// acknowledges the whole message
+#define LORA_NACK_FRAME_SIZE 9
+
+// Link management payload: op, profile, then the average SNR in quarter dB normalized to 500 kHz, the received and
+// the lost frames of the reported window, big endian. Switches and acknowledgements leave the window zeroed
+#define LORA_LINK_FRAME_SIZE 8
+
+typedef enum {
+    LORA_LINK_REPORT = 0x00, // aircraft to ground station, window of the frames it received, see adr.h
+    LORA_LINK_SWITCH = 0x01, // ground station to aircraft, the profile it offers to switch to
+    LORA_LINK_ACK = 0x02, // aircraft to ground station, ready to switch to the offered profile
+} LoRa_Link_Op;
+
+typedef struct {
+    uint8_t op; // LoRa_Link_Op
+    uint8_t profile; // index into adr_profiles
+    int16_t snr_qdb;
+    uint16_t received;
+    uint16_t lost;
+} LoRa_Link_Frame;
+
+typedef struct {
+    int8_t aileron; // joystick x, percentage
+    int8_t elevator; // joystick y, percentage
+    int8_t rudder; // joystick rudder, percentage
+    uint8_t throttle; // percentage, 0-100
+    uint8_t landing_gear; // RTLG_Status
+} LoRa_Control_Frame;
+
+// Parity fragments appended to the multi-fragment messages of a new device, at most FEC_MAX_PARITY. Off by default,
+// parity costs airtime on a clean link and only wins goodput at around 10% frame loss, but it saves the resend
+// round of most messages on a lossy one
+#define NETWORK_FEC_PARITY 0
+
 typedef enum {
     NETWORK_OK = 0x00,
     NETWORK_ERR = 0x01,
@@ -116,15 +216,24 @@ typedef struct {
     uint8_t* rx_message;
     uint16_t rx_message_size;
     LoRa_Packet* packet_tx_buff; // assembled packets to be sent to device
-    LoRa_Packet* packet_rx_buff; // stores last received packets from device
+    uint8_t tx_message_id; // message id of the next message sent to the device
+    Arq_Sender arq; // selective repeat state of the message in packet_tx_buff
+    uint8_t tx_parity; // parity fragments appended to multi-fragment messages, 0 disables the erasure code
+    uint8_t packet_tx_num_of_parity; // parity fragments after the data fragments in packet_tx_buff
     uint8_t received_packets; // for security measurements when requesting resend of corrupted packets
-    uint8_t* packet_num_of_faulty_packets; // for packet correction
+    uint8_t* packet_num_of_faulty_packets; // fragments resent in the current round, ARQ_WINDOW entries
     uint8_t num_of_faulty_packets;
 } Network_Device_Context;
 
+// One slot for every 1 byte address
+#define NETWORK_DEVICE_TABLE_SIZE 256
+
+// Devices indexed by address. A context is allocated once when the device is added and never moves, so a pointer
+// taken from the table stays valid while other devices join
 typedef struct {
-    Network_Device_Context* device_contexts;
-    uint8_t num_of_devices;
+    Network_Device_Context* device_contexts[NETWORK_DEVICE_TABLE_SIZE]; // NULL if the address is not registered
+    uint32_t occupied[NETWORK_DEVICE_TABLE_SIZE / 32]; // bit n % 32 of word n / 32 is set if address n is registered
+    uint16_t num_of_devices;
 } Network_Device_Container;
 
 
@@ -140,10 +249,117 @@ void init_lora(spi_device_handle_t* spi_device, sx127x* lora_dev);
 
 void handle_interrupt_task(void *arg);
 void tx_callback(sx127x *device);
+void cad_callback(sx127x *device, int detected);
 void rx_callback(sx127x *device);
+void rx_payload_callback(sx127x *device, int code, uint8_t *data, uint8_t data_length, void *arg);
+void lora_tx_loaded_callback(sx127x *device, int code, void *arg);
+void lora_async_callback(sx127x *device, int code, void *arg);
 
 void lora_packet_sender_task(void* pvParameters);
 uint8_t lora_send_packet(sx127x *lora_device, LoRa_Packet* packet);
+/// Sends the packet with the given LoRa header mode and waits for TX_DONE.
+/// \param packet Pool buffer, owned by the tx path from here.
+/// \param header Implicit header, NULL for explicit header.
+void lora_transmit_and_wait(sx127x* lora_dev, LoRa_Packet* packet, sx127x_implicit_header_t* header);
+/// Header mode the receiver currently listens with.
+/// \return Control frame implicit header, NULL while bulk frames are expected.
+sx127x_implicit_header_t* lora_listen_header();
+/// Switches the receiver to lora_listen_header, skipped while the sender owns the radio. Retried by
+/// lora_relisten_timer while the async request queue is full.
+void lora_relisten();
+void lora_relisten_timer_expired(void* arg);
+/// Listens with explicit header until the end of the current superframe, or for one downlink slot if its beacon
+/// was missed.
+void lora_extend_explicit_window();
+void lora_explicit_window_expired(void* arg);
+/// Takes the superframe layout from a received beacon and wakes the sender if it grants this device a reply slot.
+/// Only the rx path may call it.
+/// \param beacon Decoded beacon frame.
+void lora_receive_beacon(const LoRa_Packet* beacon);
+void lora_slot_timer_expired(void* arg);
+void lora_profile_applied(sx127x *device, int code, void *arg);
+/// Applies the profile in lora_link_next, at the end of the superframe whose beacon announced it or once the link is
+/// lost. Runs on the esp_timer task.
+void lora_switch_timer_expired(void* arg);
+void lora_link_lost(void* arg);
+// Traffic classes of the transmit path. Setpoints have control slots of their own, link management is served before
+// bulk traffic. NACKs come once per selective repeat round and can't starve it
+typedef enum {
+    LORA_CLASS_CONTROL = 0, // setpoints, sent in the control slots of the superframe
+    LORA_CLASS_LINK, // NACKs, header mode and link management frames
+    LORA_CLASS_BULK, // message fragments and single frame messages
+    LORA_CLASS_COUNT,
+} LoRa_Traffic_Class;
+
+typedef struct {
+    uint32_t sent; // frames taken by the sender
+    int64_t wait_total_us; // time from enqueue until the sender took the frame
+    int64_t wait_max_us;
+    uint32_t expired; // frames dropped unsent, they expired in the queue
+    uint32_t rx_expired; // received frames dropped before use, only setpoints expire
+    uint32_t overflow; // frames lost to a full class queue
+    uint32_t rx_overflow; // received frames lost to a full packet_rx_queue
+    uint32_t rx_rejected; // received frames dropped as duplicates, replays or out of order setpoints
+    uint32_t busy; // backoffs after a busy CAD
+    uint32_t busy_skipped; // no clear channel within the reply slot, the frame is requeued
+} LoRa_Class_Stats;
+
+// Link state of one peer, the table is indexed by the 1 byte address
+typedef struct {
+    uint16_t tx_sequence; // sequence number of the next frame sent to the peer, sender task only
+    Replay_Window rx_window; // frames received from the peer, rx path only
+} LoRa_Peer;
+
+// What a full queue does with a frame, no producer waits for room
+typedef enum {
+    LORA_OVERFLOW_REJECT = 0, // the frame is not queued, the caller keeps it
+    LORA_OVERFLOW_DROP_NEWEST, // the frame is released
+    LORA_OVERFLOW_DROP_OLDEST, // the frame at the front of the queue is released to make room
+} LoRa_Overflow_Policy;
+
+/// Traffic class of a frame, decided by its message type.
+LoRa_Traffic_Class lora_traffic_class(const LoRa_Packet* packet);
+/// Runs a received frame addressed to this device through the replay window of its source. Only the rx path
+/// may call it.
+/// \param packet Decoded frame.
+/// \param in_order 1 for frames that carry the latest state, like setpoints, which are useless once a newer
+/// frame arrived.
+/// \return 1 if the frame should be processed, 0 if it is a duplicate, a replay or out of order.
+uint8_t lora_accept_sequence(const LoRa_Packet* packet, uint8_t in_order);
+/// Hands a frame to the link or bulk queue of the sender without blocking. Setpoints don't come through here, the
+/// superframe planner hands them to the sender for the control slots.
+/// \param packet Pool buffer, owned by the tx path unless it is rejected.
+/// \param policy What to do when the class queue is full.
+/// \return 0 if the packet was queued, 1 if it was dropped or rejected. The caller owns a rejected packet.
+uint8_t lora_tx_enqueue(LoRa_Packet* packet, LoRa_Overflow_Policy policy);
+/// Hands a received frame to the rx handler without blocking.
+/// \param packet Pool buffer, owned by the rx path unless it is rejected.
+/// \param policy What to do when packet_rx_queue is full.
+/// \return 0 if the packet was queued, 1 if it was dropped or rejected. The caller owns a rejected packet.
+uint8_t lora_rx_enqueue(LoRa_Packet* packet, LoRa_Overflow_Policy policy);
+/// Takes the next frame to send, link management first, then bulk traffic.
+/// Expired frames are released on the way.
+/// \return Frame, NULL if nothing is queued.
+LoRa_Packet* lora_tx_dequeue();
+/// \return 1 if any class has a frame queued.
+uint8_t lora_tx_pending();
+/// Upper bound of the time until the given number of queued frames is on air, one frame goes per reply slot.
+/// For the report timeout of a selective repeat round.
+/// \param frames Frames queued.
+/// \return Time in us, from the measured interval of the reply slots of this device.
+uint32_t lora_tx_time_us(uint8_t frames);
+/// Copies the queue wait and drop statistics since boot, to check control latency under load.
+/// \param stats Output, LORA_CLASS_COUNT entries indexed by LoRa_Traffic_Class.
+void lora_get_class_stats(LoRa_Class_Stats* stats);
+/// Packs the small frames queued behind the packet in its class for the same destination into one batch frame.
+/// Only frames already queued are batched, frames wait for their slot in the queue and a wait here would eat into
+/// the guard time of the slot. Only the sender task may call it.
+/// \param packet Frame from lora_tx_dequeue, owned by the tx path.
+/// \return Batch frame, or the packet itself if nothing could be batched with it.
+LoRa_Packet* lora_coalesce(LoRa_Packet* packet);
+/// Queues every record of a received batch frame to packet_rx_queue, as if each one arrived in its own frame.
+/// \param batch Pool buffer, released here.
+void lora_demux_batch(LoRa_Packet* batch);
 
 
 /// Returned when message is fragmented and sent
@@ -170,20 +386,55 @@ uint8_t lora_calc_packet_num_for_message_size(uint16_t message_size);
 uint8_t lora_fragment_message(uint8_t* message, uint16_t message_size);
 
 
+/// Single consumer of packet_rx_queue, reassembles the fragments of every device. Unfinished messages are dropped
+/// after REASSEMBLY_TIMEOUT_MS.
 void network_packet_processor_task(void* pvParameters);
+/// Moves a complete message into the device rx buffer, rx_secret_message if the device is ONLINE, rx_message
+/// otherwise, then notifies the device processor.
+/// \param device_ctx Source device.
+/// \param message Complete message from reassembly_add.
+void network_deliver_message(Network_Device_Context* device_ctx, Reassembly_Message* message);
 void network_device_processor_task(void* pvParameters);
-void network_packet_rx_handler_task(void* pvParameters);
+/// Validates a received control frame and hands the setpoint to the control task, the newest one wins.
+/// Called from the rx path, the frame is not copied into a pool buffer.
+/// \param frame Received frame.
+/// \param frame_length Length of the frame.
+void network_receive_control_frame(const uint8_t* frame, uint8_t frame_length);
+/// Applies the setpoints to the servos and the motor. Cuts the motor and extracts the landing gear
+/// when no setpoint arrives in time.
+void network_control_task(void* pvParameters);
+/// Parses an on-air frame, see lora_codec.h for the format.
+/// \return 0 if successful, 1 if the frame is malformed or corrupted.
 uint8_t network_parse_byte_array_into_packet(LoRa_Packet* packet, uint8_t* byte_arr, uint16_t arr_size);
-void network_parse_packet_into_byte_array(LoRa_Packet* packet, uint8_t* byte_arr);
+/// Serializes the packet into an on-air frame, byte_arr must hold LORA_PACKET_WIRE_MAX_SIZE bytes.
+/// \return Frame length in bytes.
+uint8_t network_parse_packet_into_byte_array(LoRa_Packet* packet, uint8_t* byte_arr);
 void network_init(Network_Device_Container* device_cont);
+/// Registers a device.
+/// \return NETWORK_OK, also if it was registered already, NETWORK_OUT_OF_MEMORY if its context can't be allocated.
 network_operation_t network_add_device(Network_Device_Container* device_cont, uint8_t dev_addr);
+/// Iterates the registered devices in address order:
+/// for (uint16_t addr = network_next_device(cont, 0); addr < NETWORK_DEVICE_TABLE_SIZE; addr = network_next_device(cont, addr + 1))
+/// \param from First address to look at.
+/// \return Lowest registered address from from on, NETWORK_DEVICE_TABLE_SIZE if there is none.
+uint16_t network_next_device(const Network_Device_Container* device_cont, uint16_t from);
 uint8_t check_packet_crc(LoRa_Packet* packet);
-uint8_t construct_message_from_packets(Network_Device_Context* device_ctx);
 uint8_t deconstruct_message_into_packets(Network_Device_Context *device_ctx);
 void network_generate_security_credentials_for_device(Network_Device_Context* device_ctx);
 void network_encrypt_device_message(Network_Device_Context* device_ctx);
 network_operation_t network_decrypt_device_message(Network_Device_Context* device_ctx);
-void set_packets_for_tx(Network_Device_Context* device_ctx, QueueHandle_t* lora_queue);
+/// Sends the message in packet_tx_buff with selective repeat. Only the first round is queued here, the following
+/// ones are queued by the packet processor when the NACK of the device arrives or its report times out.
+/// Never waits for room in the tx queue, fragments that don't fit are left to the following rounds.
+/// packet_tx_buff must not be rebuilt until connection_status returns to CONNECTION_ESTABLISHED.
+/// \param device_ctx Destination device.
+void set_packets_for_tx(Network_Device_Context* device_ctx);
+/// Applies a NACK of the device to the message being sent to it, the missing fragments are queued again.
+/// \param device_ctx Source of the NACK.
+/// \param packet Received NACK.
+void network_receive_nack(Network_Device_Context* device_ctx, LoRa_Packet* packet);
+/// Queues the round again for every device whose NACK did not arrive in time.
+void network_check_arq_timeouts(Network_Device_Container* dev_ctnr);
 /// Extracts auth tag from rx_secret_message, put the tag into rx_auth_tag
 /// \param device_ctx
 void network_get_auth_tag_from_secret_message(Network_Device_Context* device_ctx);
@@ -198,7 +449,6 @@ void network_free_device_tx_secret_message(Network_Device_Context* device_ctx);
 void network_free_device_rx_secret_message(Network_Device_Context* device_ctx);
 void network_free_device_tx_message(Network_Device_Context* device_ctx);
 void network_free_device_rx_message(Network_Device_Context* device_ctx);
-void network_free_device_network_rx_buff(Network_Device_Context* device_ctx);
 void network_free_device_network_tx_buff(Network_Device_Context* device_ctx);
 
 
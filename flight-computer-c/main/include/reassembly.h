@@ -0,0 +1,104 @@
+#ifndef REASSEMBLY_H
+#define REASSEMBLY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "fec.h"
+
+// Rebuilds fragmented messages, keyed by source address and message id. Each message tracks its fragments in a
+// bitmap, so duplicates are rejected with one bit test and completion is a single compare against the full mask.
+// Parity fragments of the erasure code are kept aside and rebuild the missing data fragments once enough arrived.
+// Portable C, time is passed in by the caller
+#define REASSEMBLY_SLOTS 4
+#define REASSEMBLY_MAX_FRAGMENTS 64
+// a message is dropped when none of its fragments arrived for this long
+#define REASSEMBLY_TIMEOUT_MS 2000
+
+typedef enum {
+    REASSEMBLY_STORED = 0, // fragment stored, message is not complete yet
+    REASSEMBLY_COMPLETE, // last missing fragment stored or rebuilt, take the message with reassembly_take
+    REASSEMBLY_DUPLICATE, // fragment was already received, nothing changed
+    REASSEMBLY_INVALID, // fragment doesn't fit the message, e.g. index out of range or short middle fragment
+    REASSEMBLY_NO_SLOT, // every slot holds an unfinished message
+    REASSEMBLY_OUT_OF_MEMORY,
+} Reassembly_Status;
+
+typedef struct {
+    uint8_t in_use;
+    uint8_t taken; // message was delivered, the slot only rejects late duplicates until the deadline
+    uint8_t src_device_addr;
+    uint8_t message_id;
+    uint8_t num_of_packets;
+    uint64_t received; // bit n is set once fragment n is stored
+    uint8_t parity_received; // bit n is set once parity fragment n is stored
+    uint16_t message_size; // known once the last fragment or a parity fragment arrived
+    int64_t deadline; // us, refreshed by every fragment of the message, duplicates included
+    uint8_t* data; // fragment n is stored at n * fragment_size
+    uint8_t* parity; // FEC_MAX_PARITY fragments, allocated by the first parity fragment
+} Reassembly_Message;
+
+typedef struct {
+    uint8_t fragment_size; // payload size of every fragment but the last
+    Reassembly_Message slots[REASSEMBLY_SLOTS];
+} Reassembly_Context;
+
+/// Empties every slot.
+/// \param ctx Context to initialize.
+/// \param fragment_size Payload size of the full fragments, LORA_PAYLOAD_MAX_SIZE.
+void reassembly_init(Reassembly_Context* ctx, uint8_t fragment_size);
+
+/// Stores a fragment. Timed out messages are dropped first.
+/// \param ctx Reassembly context.
+/// \param src_device_addr Source of the fragment.
+/// \param message_id Message id of the fragment.
+/// \param num_of_packets Number of fragments of the message.
+/// \param packet_num Index of the fragment.
+/// \param payload Fragment payload, copied.
+/// \param payload_size Fragment payload size.
+/// \param now Current time in us.
+/// \param message Output, slot of the message the fragment belongs to. Set for REASSEMBLY_STORED, REASSEMBLY_COMPLETE and REASSEMBLY_DUPLICATE.
+/// \return Result of the operation.
+Reassembly_Status reassembly_add(Reassembly_Context* ctx, uint8_t src_device_addr, uint8_t message_id,
+                                 uint8_t num_of_packets, uint8_t packet_num,
+                                 const uint8_t* payload, uint8_t payload_size,
+                                 int64_t now, Reassembly_Message** message);
+
+/// Stores a parity fragment, and rebuilds the missing data fragments when enough fragments arrived.
+/// \param ctx Reassembly context.
+/// \param src_device_addr Source of the fragment.
+/// \param message_id Message id of the fragment.
+/// \param num_of_packets Number of data fragments of the message.
+/// \param parity_index Index of the parity fragment.
+/// \param last_payload_size Payload size of the last data fragment.
+/// \param payload Parity, fragment_size bytes, copied.
+/// \param payload_size Fragment payload size.
+/// \param now Current time in us.
+/// \param message Output, slot of the message the fragment belongs to. Set for REASSEMBLY_STORED, REASSEMBLY_COMPLETE and REASSEMBLY_DUPLICATE.
+/// \return Result of the operation.
+Reassembly_Status reassembly_add_parity(Reassembly_Context* ctx, uint8_t src_device_addr, uint8_t message_id,
+                                        uint8_t num_of_packets, uint8_t parity_index, uint8_t last_payload_size,
+                                        const uint8_t* payload, uint8_t payload_size,
+                                        int64_t now, Reassembly_Message** message);
+
+/// Takes the buffer of a complete message. The slot keeps rejecting duplicates of the message until it
+/// times out or is reclaimed for a new message.
+/// \param message Complete message.
+/// \param message_size Output, message size in bytes.
+/// \return Message buffer, owned by the caller who must free() it.
+uint8_t* reassembly_take(Reassembly_Message* message, uint16_t* message_size);
+
+/// Fragments of the message that did not arrive yet, the NACK bitmap of selective repeat.
+/// \param message Message from reassembly_add.
+/// \return Bit n is set if data fragment n is missing, 0 once the message is complete.
+uint64_t reassembly_missing(const Reassembly_Message* message);
+
+/// Drops the message and frees its slot.
+void reassembly_release(Reassembly_Message* message);
+
+/// Drops every message whose deadline passed, delivered ones included.
+/// \param ctx Reassembly context.
+/// \param now Current time in us.
+/// \return Number of dropped messages.
+uint8_t reassembly_expire(Reassembly_Context* ctx, int64_t now);
+
+#endif //REASSEMBLY_H
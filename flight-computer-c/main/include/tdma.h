@@ -0,0 +1,65 @@
+#ifndef TDMA_H
+#define TDMA_H
+
+#include <stdint.h>
+
+// Superframe of the half-duplex link, owned by the ground station. A broadcast beacon carrying the layout starts
+// the superframe, the slots follow back to back:
+//   control slots, ground station to aircraft setpoints
+//   reply slots, only the aircraft the beacon granted the slot to may send, one frame each
+//   downlink slots, ground station link management and bulk frames, each one with its header mode announce
+// Nobody sends outside its own slots, so frames can't collide. Slot lengths are derived from the airtime of the
+// modem profile both ends share, offsets are counted from the end of the beacon, which is the TX_DONE of the ground
+// station and the RX_DONE of the aircraft. The guard covers the interrupt and FIFO load latency of either end.
+// A superframe of setpoints only needs no sync, the ground station may leave out its beacon.
+// Portable C, time is passed in by the caller
+#define TDMA_MAX_CONTROL_SLOTS 8
+#define TDMA_MAX_REPLY_SLOTS 2
+#define TDMA_MAX_DOWNLINK_SLOTS 2
+#define TDMA_GUARD_US 2000
+// reply_owner entry of an unused reply slot, the ground station address is never granted one
+#define TDMA_NO_OWNER 0x00
+// tdma_reply_slot result if the device has no reply slot
+#define TDMA_NO_SLOT 0xFF
+
+typedef struct {
+    uint32_t beacon_slot_us; // beacon airtime, the beacon has the length of a control frame
+    uint32_t control_slot_us; // control frame airtime and guard
+    uint32_t reply_slot_us; // airtime of the longest frame and guard
+    uint32_t downlink_slot_us; // header mode announce, the longest frame and guard
+} Tdma_Timing;
+
+typedef struct {
+    uint8_t control_slots;
+    uint8_t downlink_slots;
+    uint8_t reply_owner[TDMA_MAX_REPLY_SLOTS]; // address granted reply slot n, TDMA_NO_OWNER if unused
+} Tdma_Superframe;
+
+/// Derives the slot lengths from the airtime of the modem profile.
+/// \param control_airtime_us Airtime of a control frame, implicit header.
+/// \param max_frame_airtime_us Airtime of the longest frame, explicit header.
+void tdma_timing_init(Tdma_Timing* timing, uint32_t control_airtime_us, uint32_t max_frame_airtime_us);
+
+/// \return Number of reply slots in the superframe, unused ones are not on air.
+uint8_t tdma_reply_slots(const Tdma_Superframe* superframe);
+
+/// \return Reply slot granted to the device, TDMA_NO_SLOT if there is none.
+uint8_t tdma_reply_slot(const Tdma_Superframe* superframe, uint8_t dev_addr);
+
+/// \return Start of control slot n, us after the end of the beacon.
+uint32_t tdma_control_slot_start_us(const Tdma_Timing* timing, uint8_t slot);
+
+/// \return Planned start of control slot n, us after the start of a superframe with beacon. A setpoint sampled
+/// right before the beacon is this old when its slot comes up.
+uint32_t tdma_control_slot_due_us(const Tdma_Timing* timing, uint8_t slot);
+
+/// \return Start of reply slot n, us after the end of the beacon.
+uint32_t tdma_reply_slot_start_us(const Tdma_Timing* timing, const Tdma_Superframe* superframe, uint8_t slot);
+
+/// \return Start of downlink slot n, us after the end of the beacon.
+uint32_t tdma_downlink_slot_start_us(const Tdma_Timing* timing, const Tdma_Superframe* superframe, uint8_t slot);
+
+/// \return End of the last slot, us after the end of the beacon. The next beacon may start from here.
+uint32_t tdma_superframe_end_us(const Tdma_Timing* timing, const Tdma_Superframe* superframe);
+
+#endif //TDMA_H
@@ -0,0 +1,63 @@
+#include "arq.h"
+
+static uint64_t arq_complete_mask(uint8_t num_of_packets) {
+    return num_of_packets == ARQ_MAX_FRAGMENTS ? UINT64_MAX : (((uint64_t) 1 << num_of_packets) - 1);
+}
+
+static Arq_Status arq_no_progress(Arq_Sender* arq) {
+    arq->retries++;
+    arq->status = arq->retries >= ARQ_MAX_RETRIES ? ARQ_FAILED : ARQ_SEND;
+    return arq->status;
+}
+
+void arq_start(Arq_Sender* arq, uint8_t message_id, uint8_t num_of_packets) {
+    arq->status = num_of_packets == 0 || num_of_packets > ARQ_MAX_FRAGMENTS ? ARQ_FAILED : ARQ_SEND;
+    arq->message_id = message_id;
+    arq->num_of_packets = num_of_packets;
+    arq->acked = 0;
+    arq->sent = 0;
+    arq->retries = 0;
+    arq->deadline = 0;
+}
+
+uint64_t arq_next_round(Arq_Sender* arq, int64_t deadline) {
+    if (arq->status != ARQ_SEND) {
+        return 0;
+    }
+    uint64_t pending = arq_complete_mask(arq->num_of_packets) & ~arq->acked;
+    // window starts at the lowest unconfirmed fragment
+    uint8_t base = (uint8_t) __builtin_ctzll(pending);
+    uint64_t window = ARQ_WINDOW >= ARQ_MAX_FRAGMENTS ? UINT64_MAX : (((uint64_t) 1 << ARQ_WINDOW) - 1);
+    uint64_t round = pending & (window << base);
+    arq->sent |= round;
+    arq->status = ARQ_WAITING;
+    arq->deadline = deadline;
+    return round;
+}
+
+Arq_Status arq_report(Arq_Sender* arq, uint8_t message_id, uint64_t missing) {
+    if (arq->status != ARQ_WAITING || message_id != arq->message_id) {
+        return arq->status;
+    }
+    uint64_t complete = arq_complete_mask(arq->num_of_packets);
+    uint64_t acked = arq->acked | (complete & ~missing);
+    if (acked == complete) {
+        arq->acked = acked;
+        arq->status = ARQ_DONE;
+        return arq->status;
+    }
+    if (acked == arq->acked) {
+        return arq_no_progress(arq);
+    }
+    arq->acked = acked;
+    arq->retries = 0;
+    arq->status = ARQ_SEND;
+    return arq->status;
+}
+
+Arq_Status arq_check_timeout(Arq_Sender* arq, int64_t now) {
+    if (arq->status != ARQ_WAITING || now < arq->deadline) {
+        return arq->status;
+    }
+    return arq_no_progress(arq);
+}
@@ -0,0 +1,269 @@
+#include "fec.h"
+#include <stdlib.h>
+#include <string.h>
+
+// GF(256) with the polynomial 0x11D. fec_gf_exp is doubled so a product needs no modulo
+static const uint8_t fec_gf_exp[512] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1D, 0x3A, 0x74, 0xE8, 0xCD, 0x87, 0x13, 0x26,
+    0x4C, 0x98, 0x2D, 0x5A, 0xB4, 0x75, 0xEA, 0xC9, 0x8F, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xC0,
+    0x9D, 0x27, 0x4E, 0x9C, 0x25, 0x4A, 0x94, 0x35, 0x6A, 0xD4, 0xB5, 0x77, 0xEE, 0xC1, 0x9F, 0x23,
+    0x46, 0x8C, 0x05, 0x0A, 0x14, 0x28, 0x50, 0xA0, 0x5D, 0xBA, 0x69, 0xD2, 0xB9, 0x6F, 0xDE, 0xA1,
+    0x5F, 0xBE, 0x61, 0xC2, 0x99, 0x2F, 0x5E, 0xBC, 0x65, 0xCA, 0x89, 0x0F, 0x1E, 0x3C, 0x78, 0xF0,
+    0xFD, 0xE7, 0xD3, 0xBB, 0x6B, 0xD6, 0xB1, 0x7F, 0xFE, 0xE1, 0xDF, 0xA3, 0x5B, 0xB6, 0x71, 0xE2,
+    0xD9, 0xAF, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0D, 0x1A, 0x34, 0x68, 0xD0, 0xBD, 0x67, 0xCE,
+    0x81, 0x1F, 0x3E, 0x7C, 0xF8, 0xED, 0xC7, 0x93, 0x3B, 0x76, 0xEC, 0xC5, 0x97, 0x33, 0x66, 0xCC,
+    0x85, 0x17, 0x2E, 0x5C, 0xB8, 0x6D, 0xDA, 0xA9, 0x4F, 0x9E, 0x21, 0x42, 0x84, 0x15, 0x2A, 0x54,
+    0xA8, 0x4D, 0x9A, 0x29, 0x52, 0xA4, 0x55, 0xAA, 0x49, 0x92, 0x39, 0x72, 0xE4, 0xD5, 0xB7, 0x73,
+    0xE6, 0xD1, 0xBF, 0x63, 0xC6, 0x91, 0x3F, 0x7E, 0xFC, 0xE5, 0xD7, 0xB3, 0x7B, 0xF6, 0xF1, 0xFF,
+    0xE3, 0xDB, 0xAB, 0x4B, 0x96, 0x31, 0x62, 0xC4, 0x95, 0x37, 0x6E, 0xDC, 0xA5, 0x57, 0xAE, 0x41,
+    0x82, 0x19, 0x32, 0x64, 0xC8, 0x8D, 0x07, 0x0E, 0x1C, 0x38, 0x70, 0xE0, 0xDD, 0xA7, 0x53, 0xA6,
+    0x51, 0xA2, 0x59, 0xB2, 0x79, 0xF2, 0xF9, 0xEF, 0xC3, 0x9B, 0x2B, 0x56, 0xAC, 0x45, 0x8A, 0x09,
+    0x12, 0x24, 0x48, 0x90, 0x3D, 0x7A, 0xF4, 0xF5, 0xF7, 0xF3, 0xFB, 0xEB, 0xCB, 0x8B, 0x0B, 0x16,
+    0x2C, 0x58, 0xB0, 0x7D, 0xFA, 0xE9, 0xCF, 0x83, 0x1B, 0x36, 0x6C, 0xD8, 0xAD, 0x47, 0x8E, 0x01,
+    0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1D, 0x3A, 0x74, 0xE8, 0xCD, 0x87, 0x13, 0x26, 0x4C,
+    0x98, 0x2D, 0x5A, 0xB4, 0x75, 0xEA, 0xC9, 0x8F, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xC0, 0x9D,
+    0x27, 0x4E, 0x9C, 0x25, 0x4A, 0x94, 0x35, 0x6A, 0xD4, 0xB5, 0x77, 0xEE, 0xC1, 0x9F, 0x23, 0x46,
+    0x8C, 0x05, 0x0A, 0x14, 0x28, 0x50, 0xA0, 0x5D, 0xBA, 0x69, 0xD2, 0xB9, 0x6F, 0xDE, 0xA1, 0x5F,
+    0xBE, 0x61, 0xC2, 0x99, 0x2F, 0x5E, 0xBC, 0x65, 0xCA, 0x89, 0x0F, 0x1E, 0x3C, 0x78, 0xF0, 0xFD,
+    0xE7, 0xD3, 0xBB, 0x6B, 0xD6, 0xB1, 0x7F, 0xFE, 0xE1, 0xDF, 0xA3, 0x5B, 0xB6, 0x71, 0xE2, 0xD9,
+    0xAF, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0D, 0x1A, 0x34, 0x68, 0xD0, 0xBD, 0x67, 0xCE, 0x81,
+    0x1F, 0x3E, 0x7C, 0xF8, 0xED, 0xC7, 0x93, 0x3B, 0x76, 0xEC, 0xC5, 0x97, 0x33, 0x66, 0xCC, 0x85,
+    0x17, 0x2E, 0x5C, 0xB8, 0x6D, 0xDA, 0xA9, 0x4F, 0x9E, 0x21, 0x42, 0x84, 0x15, 0x2A, 0x54, 0xA8,
+    0x4D, 0x9A, 0x29, 0x52, 0xA4, 0x55, 0xAA, 0x49, 0x92, 0x39, 0x72, 0xE4, 0xD5, 0xB7, 0x73, 0xE6,
+    0xD1, 0xBF, 0x63, 0xC6, 0x91, 0x3F, 0x7E, 0xFC, 0xE5, 0xD7, 0xB3, 0x7B, 0xF6, 0xF1, 0xFF, 0xE3,
+    0xDB, 0xAB, 0x4B, 0x96, 0x31, 0x62, 0xC4, 0x95, 0x37, 0x6E, 0xDC, 0xA5, 0x57, 0xAE, 0x41, 0x82,
+    0x19, 0x32, 0x64, 0xC8, 0x8D, 0x07, 0x0E, 0x1C, 0x38, 0x70, 0xE0, 0xDD, 0xA7, 0x53, 0xA6, 0x51,
+    0xA2, 0x59, 0xB2, 0x79, 0xF2, 0xF9, 0xEF, 0xC3, 0x9B, 0x2B, 0x56, 0xAC, 0x45, 0x8A, 0x09, 0x12,
+    0x24, 0x48, 0x90, 0x3D, 0x7A, 0xF4, 0xF5, 0xF7, 0xF3, 0xFB, 0xEB, 0xCB, 0x8B, 0x0B, 0x16, 0x2C,
+    0x58, 0xB0, 0x7D, 0xFA, 0xE9, 0xCF, 0x83, 0x1B, 0x36, 0x6C, 0xD8, 0xAD, 0x47, 0x8E, 0x01, 0x02,
+};
+
+static const uint8_t fec_gf_log[256] = {
+    0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1A, 0xC6, 0x03, 0xDF, 0x33, 0xEE, 0x1B, 0x68, 0xC7, 0x4B,
+    0x04, 0x64, 0xE0, 0x0E, 0x34, 0x8D, 0xEF, 0x81, 0x1C, 0xC1, 0x69, 0xF8, 0xC8, 0x08, 0x4C, 0x71,
+    0x05, 0x8A, 0x65, 0x2F, 0xE1, 0x24, 0x0F, 0x21, 0x35, 0x93, 0x8E, 0xDA, 0xF0, 0x12, 0x82, 0x45,
+    0x1D, 0xB5, 0xC2, 0x7D, 0x6A, 0x27, 0xF9, 0xB9, 0xC9, 0x9A, 0x09, 0x78, 0x4D, 0xE4, 0x72, 0xA6,
+    0x06, 0xBF, 0x8B, 0x62, 0x66, 0xDD, 0x30, 0xFD, 0xE2, 0x98, 0x25, 0xB3, 0x10, 0x91, 0x22, 0x88,
+    0x36, 0xD0, 0x94, 0xCE, 0x8F, 0x96, 0xDB, 0xBD, 0xF1, 0xD2, 0x13, 0x5C, 0x83, 0x38, 0x46, 0x40,
+    0x1E, 0x42, 0xB6, 0xA3, 0xC3, 0x48, 0x7E, 0x6E, 0x6B, 0x3A, 0x28, 0x54, 0xFA, 0x85, 0xBA, 0x3D,
+    0xCA, 0x5E, 0x9B, 0x9F, 0x0A, 0x15, 0x79, 0x2B, 0x4E, 0xD4, 0xE5, 0xAC, 0x73, 0xF3, 0xA7, 0x57,
+    0x07, 0x70, 0xC0, 0xF7, 0x8C, 0x80, 0x63, 0x0D, 0x67, 0x4A, 0xDE, 0xED, 0x31, 0xC5, 0xFE, 0x18,
+    0xE3, 0xA5, 0x99, 0x77, 0x26, 0xB8, 0xB4, 0x7C, 0x11, 0x44, 0x92, 0xD9, 0x23, 0x20, 0x89, 0x2E,
+    0x37, 0x3F, 0xD1, 0x5B, 0x95, 0xBC, 0xCF, 0xCD, 0x90, 0x87, 0x97, 0xB2, 0xDC, 0xFC, 0xBE, 0x61,
+    0xF2, 0x56, 0xD3, 0xAB, 0x14, 0x2A, 0x5D, 0x9E, 0x84, 0x3C, 0x39, 0x53, 0x47, 0x6D, 0x41, 0xA2,
+    0x1F, 0x2D, 0x43, 0xD8, 0xB7, 0x7B, 0xA4, 0x76, 0xC4, 0x17, 0x49, 0xEC, 0x7F, 0x0C, 0x6F, 0xF6,
+    0x6C, 0xA1, 0x3B, 0x52, 0x29, 0x9D, 0x55, 0xAA, 0xFB, 0x60, 0x86, 0xB1, 0xBB, 0xCC, 0x3E, 0x5A,
+    0xCB, 0x59, 0x5F, 0xB0, 0x9C, 0xA9, 0xA0, 0x51, 0x0B, 0xF5, 0x16, 0xEB, 0x7A, 0x75, 0x2C, 0xD7,
+    0x4F, 0xAE, 0xD5, 0xE9, 0xE6, 0xE7, 0xAD, 0xE8, 0x74, 0xD6, 0xF4, 0xEA, 0xA8, 0x50, 0x58, 0xAF,
+};
+
+// Cauchy matrix 1 / (x_j + y_i) with x_j = j and y_i = FEC_MAX_PARITY + i, every square submatrix is invertible.
+// Columns are scaled so parity 0 is all ones, rows so data fragment 0 is all ones, which keeps the property
+static const uint8_t fec_coefficients[FEC_MAX_PARITY][FEC_MAX_DATA_FRAGMENTS] = {
+    {
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+        0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    },
+    {
+        0x01, 0x37, 0x27, 0x49, 0x54, 0xB5, 0xE1, 0xD9, 0x97, 0x6F, 0xFF, 0x74, 0x5C, 0x50, 0x0F, 0x67,
+        0xA0, 0x2E, 0x3C, 0xD0, 0xD5, 0x18, 0xC4, 0x04, 0x7F, 0x43, 0x5A, 0x3F, 0x39, 0xC0, 0x70, 0x0B,
+        0x66, 0xD2, 0xA8, 0xD4, 0xDC, 0x47, 0x06, 0x73, 0x99, 0xED, 0x4E, 0xAA, 0x9D, 0x92, 0x30, 0xE4,
+        0xCD, 0xF6, 0xBD, 0x1E, 0x2F, 0xF8, 0xFC, 0x98, 0x9C, 0x55, 0x40, 0x4B, 0x22, 0x6B, 0x26, 0xD7,
+    },
+    {
+        0x01, 0x27, 0xD9, 0xA1, 0x5C, 0x3C, 0xAC, 0x5A, 0xBB, 0xDA, 0x87, 0x9B, 0xF8, 0xB9, 0xEB, 0x25,
+        0x48, 0x1B, 0x33, 0x88, 0x7B, 0x07, 0x4B, 0x92, 0xA6, 0x42, 0xA8, 0x79, 0x08, 0x0A, 0xB6, 0xC1,
+        0xF9, 0xF7, 0x9E, 0x93, 0xB7, 0xAD, 0x19, 0x86, 0x21, 0x0D, 0xF2, 0x83, 0xE6, 0xD5, 0x41, 0x32,
+        0x2C, 0xD3, 0xCE, 0x13, 0xE8, 0x67, 0xD6, 0x58, 0xD7, 0x15, 0x31, 0x59, 0x44, 0x4C, 0x36, 0xFD,
+    },
+    {
+        0x01, 0x49, 0xA1, 0xEF, 0xDC, 0x84, 0x0F, 0x18, 0x24, 0xCE, 0x0D, 0xE9, 0xB7, 0x9E, 0x78, 0xBA,
+        0x26, 0x99, 0x29, 0x1C, 0xC2, 0x7E, 0x46, 0x52, 0x19, 0x98, 0x07, 0xEA, 0x7B, 0x02, 0xF9, 0x77,
+        0x5E, 0x2C, 0xF4, 0x4D, 0xAA, 0xC5, 0x5B, 0x5F, 0x42, 0x8A, 0x1B, 0x1E, 0xE4, 0x03, 0xAE, 0xD2,
+        0x6F, 0x33, 0xDF, 0x39, 0x9A, 0x71, 0x76, 0x2F, 0x54, 0x9D, 0xC4, 0x65, 0x6B, 0x92, 0xDE, 0x5C,
+    },
+    {
+        0x01, 0x54, 0x5C, 0xDC, 0x46, 0xE6, 0x7B, 0xF8, 0xF5, 0x0B, 0x3A, 0xC6, 0x65, 0xBE, 0x35, 0x42,
+        0x68, 0xA2, 0x28, 0x73, 0xC8, 0x71, 0x6C, 0xA8, 0xD2, 0x66, 0x67, 0x94, 0xFA, 0xDB, 0x19, 0x74,
+        0x5B, 0x92, 0x25, 0xF6, 0xB2, 0x55, 0xCD, 0x2E, 0x70, 0x3F, 0x12, 0x56, 0x22, 0x9E, 0xF0, 0x6B,
+        0x52, 0xA7, 0xF1, 0xF3, 0x72, 0x43, 0x17, 0x5E, 0xC4, 0x36, 0x7C, 0x97, 0x3B, 0x50, 0xA5, 0x4B,
+    },
+    {
+        0x01, 0xB5, 0x3C, 0x84, 0xE6, 0x70, 0xDE, 0x33, 0x56, 0xA4, 0xC8, 0x5C, 0x28, 0x0B, 0xBC, 0x40,
+        0x76, 0x71, 0xB6, 0x2D, 0xD0, 0xE7, 0x95, 0xBD, 0x5E, 0x13, 0xE5, 0x6D, 0xA5, 0xB8, 0x2F, 0x27,
+        0x4F, 0x1D, 0xF1, 0x57, 0x32, 0x61, 0x87, 0x18, 0xA3, 0xE3, 0x67, 0xF7, 0x06, 0xCE, 0x24, 0x5B,
+        0x89, 0xAB, 0x0E, 0x68, 0x8F, 0x85, 0xE2, 0x08, 0x15, 0xAE, 0xB0, 0xAA, 0xCD, 0x6F, 0x0A, 0xEF,
+    },
+    {
+        0x01, 0xE1, 0xAC, 0x0F, 0x7B, 0xDE, 0x9E, 0x46, 0xC3, 0x7E, 0x1F, 0x2F, 0x8F, 0x99, 0xE3, 0x24,
+        0x52, 0x75, 0x22, 0x31, 0x25, 0xB2, 0xFA, 0xF8, 0x6E, 0x9F, 0x65, 0xA6, 0xBE, 0x37, 0x53, 0xA3,
+        0x93, 0x5A, 0x43, 0x15, 0x35, 0xD8, 0x2D, 0xC7, 0xF5, 0x82, 0x30, 0x0C, 0xD0, 0x67, 0xD1, 0x1C,
+        0x18, 0x95, 0x85, 0xFE, 0x3A, 0x8C, 0xBD, 0x51, 0x39, 0xDA, 0xF3, 0xCA, 0x73, 0x5F, 0x0B, 0x08,
+    },
+    {
+        0x01, 0xD9, 0x5A, 0x18, 0xF8, 0x33, 0x46, 0xA8, 0x70, 0xA5, 0x72, 0x4E, 0x67, 0xFA, 0xB2, 0x8D,
+        0xB0, 0x57, 0xE5, 0x3B, 0x8F, 0xF4, 0x59, 0xD5, 0xEE, 0x64, 0x9E, 0xA4, 0x6C, 0x80, 0xDD, 0x11,
+        0x5D, 0xE1, 0xC8, 0x05, 0x71, 0xE0, 0xA0, 0xFE, 0xB3, 0x10, 0x90, 0xA3, 0x28, 0x7B, 0x84, 0x3D,
+        0x68, 0x81, 0xD0, 0x7C, 0x30, 0x25, 0x9D, 0x4A, 0xFD, 0xEF, 0xE9, 0x99, 0x1E, 0x39, 0x95, 0x5F,
+    },
+};
+
+static uint8_t fec_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return fec_gf_exp[fec_gf_log[a] + fec_gf_log[b]];
+}
+
+static uint8_t fec_inverse(uint8_t a) {
+    return fec_gf_exp[255 - fec_gf_log[a]];
+}
+
+// dst ^= coefficient * src, four bytes per step. Fragments are not word aligned inside LoRa_Packet, memcpy
+// compiles to the fastest access the target allows
+static void fec_mul_add(uint8_t* dst, const uint8_t* src, uint8_t coefficient, uint8_t length) {
+    uint8_t i = 0;
+    uint32_t s, d;
+    if (coefficient == 0) {
+        return;
+    }
+    if (coefficient == 1) {
+        for (; i + 4 <= length; i += 4) {
+            memcpy(&s, &src[i], 4);
+            memcpy(&d, &dst[i], 4);
+            d ^= s;
+            memcpy(&dst[i], &d, 4);
+        }
+        for (; i < length; i++) {
+            dst[i] ^= src[i];
+        }
+        return;
+    }
+    // multiplication is linear, the product of a byte is the XOR of the products of its two nibbles
+    uint8_t low[16], high[16];
+    for (uint8_t n = 0; n < 16; n++) {
+        low[n] = fec_mul(coefficient, n);
+        high[n] = fec_mul(coefficient, n << 4);
+    }
+    for (; i + 4 <= length; i += 4) {
+        memcpy(&s, &src[i], 4);
+        memcpy(&d, &dst[i], 4);
+        d ^= (uint32_t) (low[s & 0x0F] ^ high[(s >> 4) & 0x0F]) |
+             (uint32_t) (low[(s >> 8) & 0x0F] ^ high[(s >> 12) & 0x0F]) << 8 |
+             (uint32_t) (low[(s >> 16) & 0x0F] ^ high[(s >> 20) & 0x0F]) << 16 |
+             (uint32_t) (low[(s >> 24) & 0x0F] ^ high[s >> 28]) << 24;
+        memcpy(&dst[i], &d, 4);
+    }
+    for (; i < length; i++) {
+        dst[i] ^= low[src[i] & 0x0F] ^ high[src[i] >> 4];
+    }
+}
+
+// Gauss-Jordan elimination, matrix is destroyed
+static uint8_t fec_invert(uint8_t matrix[FEC_MAX_PARITY][FEC_MAX_PARITY], uint8_t inverse[FEC_MAX_PARITY][FEC_MAX_PARITY], uint8_t size) {
+    for (uint8_t r = 0; r < size; r++) {
+        for (uint8_t c = 0; c < size; c++) {
+            inverse[r][c] = r == c;
+        }
+    }
+    for (uint8_t c = 0; c < size; c++) {
+        uint8_t pivot = c;
+        while (pivot < size && matrix[pivot][c] == 0) {
+            pivot++;
+        }
+        if (pivot == size) {
+            return 1;
+        }
+        for (uint8_t k = 0; k < size; k++) {
+            uint8_t t = matrix[c][k]; matrix[c][k] = matrix[pivot][k]; matrix[pivot][k] = t;
+            t = inverse[c][k]; inverse[c][k] = inverse[pivot][k]; inverse[pivot][k] = t;
+        }
+        uint8_t scale = fec_inverse(matrix[c][c]);
+        for (uint8_t k = 0; k < size; k++) {
+            matrix[c][k] = fec_mul(matrix[c][k], scale);
+            inverse[c][k] = fec_mul(inverse[c][k], scale);
+        }
+        for (uint8_t r = 0; r < size; r++) {
+            uint8_t factor = matrix[r][c];
+            if (r == c || factor == 0) {
+                continue;
+            }
+            for (uint8_t k = 0; k < size; k++) {
+                matrix[r][k] ^= fec_mul(factor, matrix[c][k]);
+                inverse[r][k] ^= fec_mul(factor, inverse[c][k]);
+            }
+        }
+    }
+    return 0;
+}
+
+void fec_encode(const uint8_t* data, size_t stride, uint8_t num_of_data, uint8_t fragment_size,
+                uint8_t parity_index, uint8_t* parity) {
+    memset(parity, 0, fragment_size);
+    for (uint8_t i = 0; i < num_of_data; i++) {
+        fec_mul_add(parity, &data[i * stride], fec_coefficients[parity_index][i], fragment_size);
+    }
+}
+
+uint8_t fec_decode(uint8_t* data, size_t stride, uint8_t num_of_data, uint64_t received,
+                   const uint8_t* parity, uint8_t parity_received, uint8_t fragment_size) {
+    uint8_t lost[FEC_MAX_PARITY];
+    uint8_t rows[FEC_MAX_PARITY];
+    uint8_t num_of_lost = 0;
+    uint8_t num_of_rows = 0;
+    for (uint8_t i = 0; i < num_of_data; i++) {
+        if (!(received & ((uint64_t) 1 << i))) {
+            if (num_of_lost == FEC_MAX_PARITY) {
+                return 1;
+            }
+            lost[num_of_lost++] = i;
+        }
+    }
+    if (num_of_lost == 0) {
+        return 0;
+    }
+    for (uint8_t j = 0; j < FEC_MAX_PARITY && num_of_rows < num_of_lost; j++) {
+        if (parity_received & (1 << j)) {
+            rows[num_of_rows++] = j;
+        }
+    }
+    if (num_of_rows < num_of_lost) {
+        return 1;
+    }
+
+    // parity j minus the received fragments leaves the lost ones: syndrome_r = sum_c C[rows[r]][lost[c]] * data_c
+    uint8_t matrix[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    uint8_t inverse[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    for (uint8_t r = 0; r < num_of_lost; r++) {
+        for (uint8_t c = 0; c < num_of_lost; c++) {
+            matrix[r][c] = fec_coefficients[rows[r]][lost[c]];
+        }
+    }
+    if (fec_invert(matrix, inverse, num_of_lost)) {
+        return 1;
+    }
+    uint8_t* syndromes = (uint8_t*) malloc((size_t) num_of_lost * fragment_size);
+    if (syndromes == NULL) {
+        return 2;
+    }
+    for (uint8_t r = 0; r < num_of_lost; r++) {
+        uint8_t* syndrome = &syndromes[r * fragment_size];
+        memcpy(syndrome, &parity[rows[r] * fragment_size], fragment_size);
+        for (uint8_t i = 0; i < num_of_data; i++) {
+            if (received & ((uint64_t) 1 << i)) {
+                fec_mul_add(syndrome, &data[i * stride], fec_coefficients[rows[r]][i], fragment_size);
+            }
+        }
+    }
+    for (uint8_t c = 0; c < num_of_lost; c++) {
+        uint8_t* fragment = &data[lost[c] * stride];
+        memset(fragment, 0, fragment_size);
+        for (uint8_t r = 0; r < num_of_lost; r++) {
+            fec_mul_add(fragment, &syndromes[r * fragment_size], inverse[c][r], fragment_size);
+        }
+    }
+    free(syndromes);
+    return 0;
+}
@@ -0,0 +1,319 @@
+#include "lora_codec.h"
+
+static uint8_t lora_codec_is_single(const LoRa_Packet* packet) {
+    return packet->header.message_type != LORA_MESSAGE_DATA && packet->header.message_type != LORA_MESSAGE_PARITY &&
+           packet->header.num_of_packets == 1 && packet->header.packet_num == 0;
+}
+
+static uint8_t lora_codec_header_length(uint8_t message_type, uint8_t single) {
+    if (single) {
+        return LORA_PACKET_WIRE_SINGLE_HEADER_SIZE;
+    }
+    return message_type == LORA_MESSAGE_PARITY ? LORA_PACKET_WIRE_PARITY_HEADER_SIZE : LORA_PACKET_WIRE_HEADER_SIZE;
+}
+
+static uint8_t lora_codec_first_byte(const LoRa_Packet* packet, uint8_t single) {
+    return (LORA_WIRE_VERSION << LORA_WIRE_VERSION_SHIFT) |
+           (single ? LORA_WIRE_FLAG_SINGLE : 0) |
+           (packet->header.poll ? LORA_WIRE_FLAG_POLL : 0) |
+           (packet->header.message_type & LORA_WIRE_TYPE_MASK);
+}
+
+// record length byte excluded
+static uint8_t lora_codec_record_length(const LoRa_Packet* packet) {
+    return (lora_codec_is_single(packet) ? 1 : 4) + packet->header.payload_size;
+}
+
+uint8_t lora_codec_frame_length(const LoRa_Packet* packet) {
+    return lora_codec_header_length(packet->header.message_type, lora_codec_is_single(packet)) + packet->header.payload_size;
+}
+
+uint8_t lora_codec_encode_header(const LoRa_Packet* packet, uint8_t* wire_header) {
+    uint8_t length = 0;
+    uint8_t single = lora_codec_is_single(packet);
+    wire_header[length++] = lora_codec_first_byte(packet, single);
+    wire_header[length++] = packet->header.src_device_addr;
+    wire_header[length++] = packet->header.dest_device_addr;
+    wire_header[length++] = packet->header.sequence >> 8;
+    wire_header[length++] = packet->header.sequence & 0xFF;
+    if (!single) {
+        wire_header[length++] = packet->header.num_of_packets;
+        wire_header[length++] = packet->header.packet_num;
+        wire_header[length++] = packet->header.message_id;
+    }
+    if (packet->header.message_type == LORA_MESSAGE_PARITY) {
+        wire_header[length++] = packet->header.last_payload_size;
+    }
+    // one CRC covers the header and the payload
+    uint16_t crc = crc16(0, wire_header, length);
+    crc = crc16(crc, packet->payload.payload, packet->header.payload_size);
+    wire_header[length++] = crc >> 8;
+    wire_header[length++] = crc & 0xFF;
+    return length;
+}
+
+uint8_t lora_codec_encode_segments(LoRa_Packet* packet, uint8_t* wire_header, sx127x_segment_t* segments) {
+    uint8_t header_length = lora_codec_encode_header(packet, wire_header);
+    segments[0].buffer = wire_header;
+    segments[0].buffer_length = header_length;
+    segments[1].buffer = packet->payload.payload;
+    segments[1].buffer_length = packet->header.payload_size;
+    return header_length + packet->header.payload_size;
+}
+
+uint8_t lora_codec_encode(const LoRa_Packet* packet, uint8_t* frame) {
+    uint8_t header_length = lora_codec_encode_header(packet, frame);
+    memcpy(&frame[header_length], packet->payload.payload, packet->header.payload_size);
+    return header_length + packet->header.payload_size;
+}
+
+uint8_t lora_codec_decode(LoRa_Packet* packet, const uint8_t* frame, uint8_t frame_length) {
+    // packet cannot be empty, or have missing header parameters
+    if (frame_length <= LORA_PACKET_WIRE_SINGLE_HEADER_SIZE ||
+        (frame[0] >> LORA_WIRE_VERSION_SHIFT) != LORA_WIRE_VERSION) {
+        return 1;
+    }
+    uint8_t single = (frame[0] & LORA_WIRE_FLAG_SINGLE) != 0;
+    uint8_t header_length = lora_codec_header_length(LORA_WIRE_MESSAGE_TYPE(frame[0]), single);
+    if (frame_length <= header_length || frame_length - header_length > LORA_PAYLOAD_MAX_SIZE) {
+        return 1;
+    }
+    uint16_t crc = crc16(0, frame, header_length - 2);
+    crc = crc16(crc, &frame[header_length], frame_length - header_length);
+    if (crc != (((uint16_t)frame[header_length - 2] << 8) | frame[header_length - 1])) {
+        return 1;
+    }
+
+    packet->header.message_type = LORA_WIRE_MESSAGE_TYPE(frame[0]);
+    packet->header.src_device_addr = frame[1];
+    packet->header.dest_device_addr = frame[2];
+    packet->header.sequence = ((uint16_t) frame[3] << 8) | frame[4];
+    packet->header.num_of_packets = single ? 1 : frame[5];
+    packet->header.packet_num = single ? 0 : frame[6];
+    packet->header.message_id = single ? 0 : frame[7];
+    packet->header.poll = (frame[0] & LORA_WIRE_FLAG_POLL) != 0;
+    packet->header.last_payload_size = header_length == LORA_PACKET_WIRE_PARITY_HEADER_SIZE ? frame[8] : 0;
+    packet->header.payload_size = frame_length - header_length;
+    memcpy(packet->payload.payload, &frame[header_length], packet->header.payload_size);
+    // the frame is verified, the in-memory CRCs keep check_packet_crc meaningful further down the pipeline
+    packet->header.header_crc = lora_calc_header_crc(&packet->header);
+    packet->payload.payload_crc = lora_calc_packet_crc(&packet->payload, packet->header.payload_size);
+
+    return 0;
+}
+
+void lora_codec_encode_control(const LoRa_Control_Frame* control, uint8_t src_addr, uint8_t dest_addr, LoRa_Packet* packet) {
+    packet->header.message_type = LORA_MESSAGE_CONTROL;
+    packet->header.src_device_addr = src_addr;
+    packet->header.dest_device_addr = dest_addr;
+    packet->header.num_of_packets = 1;
+    packet->header.packet_num = 0;
+    packet->header.message_id = 0;
+    packet->header.poll = 0;
+    packet->header.payload_size = LORA_CONTROL_FRAME_SIZE;
+    packet->payload.payload[0] = (uint8_t) control->aileron;
+    packet->payload.payload[1] = (uint8_t) control->elevator;
+    packet->payload.payload[2] = (uint8_t) control->rudder;
+    packet->payload.payload[3] = (control->throttle & ~LORA_CONTROL_LANDING_GEAR_BIT) |
+                                  (control->landing_gear ? LORA_CONTROL_LANDING_GEAR_BIT : 0);
+    packet->header.header_crc = lora_calc_header_crc(&packet->header);
+    packet->payload.payload_crc = lora_calc_packet_crc(&packet->payload, LORA_CONTROL_FRAME_SIZE);
+}
+
+void lora_codec_encode_header_mode(uint8_t src_addr, uint8_t dest_addr, LoRa_Packet* packet) {
+    packet->header.message_type = LORA_MESSAGE_HEADER_MODE;
+    packet->header.src_device_addr = src_addr;
+    packet->header.dest_device_addr = dest_addr;
+    packet->header.num_of_packets = 1;
+    packet->header.packet_num = 0;
+    packet->header.message_id = 0;
+    packet->header.poll = 0;
+    // padded to the implicit header length
+    packet->header.payload_size = LORA_CONTROL_FRAME_SIZE;
+    memset(packet->payload.payload, 0, LORA_CONTROL_FRAME_SIZE);
+    packet->header.header_crc = lora_calc_header_crc(&packet->header);
+    packet->payload.payload_crc = lora_calc_packet_crc(&packet->payload, LORA_CONTROL_FRAME_SIZE);
+}
+
+void lora_codec_encode_beacon(const Tdma_Superframe* superframe, uint8_t profile, uint8_t src_addr, LoRa_Packet* packet) {
+    packet->header.message_type = LORA_MESSAGE_BEACON;
+    packet->header.src_device_addr = src_addr;
+    packet->header.dest_device_addr = LORA_NETWORK_BROADCAST_ADDR;
+    packet->header.num_of_packets = 1;
+    packet->header.packet_num = 0;
+    packet->header.message_id = 0;
+    packet->header.poll = 0;
+    packet->header.payload_size = LORA_CONTROL_FRAME_SIZE;
+    memset(packet->payload.payload, 0, LORA_CONTROL_FRAME_SIZE);
+    packet->payload.payload[0] = superframe->control_slots | superframe->downlink_slots << LORA_BEACON_DOWNLINK_SHIFT;
+    packet->payload.payload[1] = profile;
+    memcpy(&packet->payload.payload[2], superframe->reply_owner, TDMA_MAX_REPLY_SLOTS);
+    packet->header.header_crc = lora_calc_header_crc(&packet->header);
+    packet->payload.payload_crc = lora_calc_packet_crc(&packet->payload, LORA_CONTROL_FRAME_SIZE);
+}
+
+void lora_codec_batch_init(uint8_t src_addr, uint8_t dest_addr, LoRa_Packet* batch) {
+    batch->header.message_type = LORA_MESSAGE_BATCH;
+    batch->header.src_device_addr = src_addr;
+    batch->header.dest_device_addr = dest_addr;
+    batch->header.num_of_packets = 1;
+    batch->header.packet_num = 0;
+    batch->header.message_id = 0;
+    batch->header.poll = 0;
+    batch->header.payload_size = 0;
+}
+
+uint8_t lora_codec_can_batch(const LoRa_Packet* packet) {
+    uint8_t type = packet->header.message_type;
+    return (type == LORA_MESSAGE_NACK || (type == LORA_MESSAGE_DATA && packet->header.num_of_packets == 1)) &&
+           1 + lora_codec_record_length(packet) <= LORA_BATCH_MAX_RECORD_SIZE;
+}
+
+uint8_t lora_codec_batch_append(LoRa_Packet* batch, const LoRa_Packet* packet) {
+    uint8_t single = lora_codec_is_single(packet);
+    uint8_t record_length = lora_codec_record_length(packet);
+    if (batch->header.payload_size + 1 + record_length > LORA_PAYLOAD_MAX_SIZE) {
+        return 1;
+    }
+    uint8_t* record = &batch->payload.payload[batch->header.payload_size];
+    record[0] = record_length;
+    record[1] = lora_codec_first_byte(packet, single);
+    if (!single) {
+        record[2] = packet->header.num_of_packets;
+        record[3] = packet->header.packet_num;
+        record[4] = packet->header.message_id;
+    }
+    memcpy(&record[1 + record_length - packet->header.payload_size], packet->payload.payload, packet->header.payload_size);
+    batch->header.payload_size += 1 + record_length;
+    batch->header.header_crc = lora_calc_header_crc(&batch->header);
+    batch->payload.payload_crc = lora_calc_packet_crc(&batch->payload, batch->header.payload_size);
+    return 0;
+}
+
+uint8_t lora_codec_batch_next(const LoRa_Packet* batch, uint8_t* offset, LoRa_Packet* packet) {
+    if (*offset >= batch->header.payload_size) {
+        return 1;
+    }
+    const uint8_t* record = &batch->payload.payload[*offset];
+    uint8_t record_length = record[0];
+    if (record_length == 0 || *offset + 1 + record_length > batch->header.payload_size) {
+        return 1;
+    }
+    uint8_t single = (record[1] & LORA_WIRE_FLAG_SINGLE) != 0;
+    uint8_t header_length = single ? 1 : 4;
+    uint8_t type = LORA_WIRE_MESSAGE_TYPE(record[1]);
+    // records never nest, and only packets without extra header bytes are batched
+    if (record_length < header_length || type == LORA_MESSAGE_BATCH || type == LORA_MESSAGE_PARITY) {
+        return 1;
+    }
+    packet->header.message_type = type;
+    packet->header.src_device_addr = batch->header.src_device_addr;
+    packet->header.dest_device_addr = batch->header.dest_device_addr;
+    packet->header.sequence = batch->header.sequence;
+    packet->header.num_of_packets = single ? 1 : record[2];
+    packet->header.packet_num = single ? 0 : record[3];
+    packet->header.message_id = single ? 0 : record[4];
+    packet->header.poll = (record[1] & LORA_WIRE_FLAG_POLL) != 0;
+    packet->header.last_payload_size = 0;
+    packet->header.payload_size = record_length - header_length;
+    memcpy(packet->payload.payload, &record[1 + header_length], packet->header.payload_size);
+    packet->header.header_crc = lora_calc_header_crc(&packet->header);
+    packet->payload.payload_crc = lora_calc_packet_crc(&packet->payload, packet->header.payload_size);
+    *offset += 1 + record_length;
+    return 0;
+}
+
+uint8_t lora_codec_decode_control(const LoRa_Packet* packet, LoRa_Control_Frame* control) {
+    if (packet->header.message_type != LORA_MESSAGE_CONTROL ||
+        packet->header.payload_size != LORA_CONTROL_FRAME_SIZE) {
+        return 1;
+    }
+    control->aileron = (int8_t) packet->payload.payload[0];
+    control->elevator = (int8_t) packet->payload.payload[1];
+    control->rudder = (int8_t) packet->payload.payload[2];
+    control->throttle = packet->payload.payload[3] & ~LORA_CONTROL_LANDING_GEAR_BIT;
+    control->landing_gear = (packet->payload.payload[3] & LORA_CONTROL_LANDING_GEAR_BIT) != 0;
+    return 0;
+}
+
+uint8_t lora_codec_decode_beacon(const LoRa_Packet* packet, Tdma_Superframe* superframe, uint8_t* profile) {
+    if (packet->header.message_type != LORA_MESSAGE_BEACON ||
+        packet->header.payload_size != LORA_CONTROL_FRAME_SIZE) {
+        return 1;
+    }
+    uint8_t control_slots = packet->payload.payload[0] & LORA_BEACON_SLOTS_MASK;
+    uint8_t downlink_slots = packet->payload.payload[0] >> LORA_BEACON_DOWNLINK_SHIFT;
+    if (control_slots > TDMA_MAX_CONTROL_SLOTS || downlink_slots > TDMA_MAX_DOWNLINK_SLOTS) {
+        return 1;
+    }
+    superframe->control_slots = control_slots;
+    superframe->downlink_slots = downlink_slots;
+    *profile = packet->payload.payload[1];
+    memcpy(superframe->reply_owner, &packet->payload.payload[2], TDMA_MAX_REPLY_SLOTS);
+    return 0;
+}
+
+void lora_codec_encode_link(const LoRa_Link_Frame* link, uint8_t src_addr, uint8_t dest_addr, LoRa_Packet* packet) {
+    packet->header.message_type = LORA_MESSAGE_LINK;
+    packet->header.src_device_addr = src_addr;
+    packet->header.dest_device_addr = dest_addr;
+    packet->header.num_of_packets = 1;
+    packet->header.packet_num = 0;
+    packet->header.message_id = 0;
+    packet->header.poll = 0;
+    packet->header.payload_size = LORA_LINK_FRAME_SIZE;
+    packet->payload.payload[0] = link->op;
+    packet->payload.payload[1] = link->profile;
+    packet->payload.payload[2] = (uint8_t) ((uint16_t) link->snr_qdb >> 8);
+    packet->payload.payload[3] = (uint8_t) link->snr_qdb;
+    packet->payload.payload[4] = link->received >> 8;
+    packet->payload.payload[5] = (uint8_t) link->received;
+    packet->payload.payload[6] = link->lost >> 8;
+    packet->payload.payload[7] = (uint8_t) link->lost;
+    packet->header.header_crc = lora_calc_header_crc(&packet->header);
+    packet->payload.payload_crc = lora_calc_packet_crc(&packet->payload, LORA_LINK_FRAME_SIZE);
+}
+
+uint8_t lora_codec_decode_link(const LoRa_Packet* packet, LoRa_Link_Frame* link) {
+    if (packet->header.message_type != LORA_MESSAGE_LINK ||
+        packet->header.payload_size != LORA_LINK_FRAME_SIZE) {
+        return 1;
+    }
+    const uint8_t* payload = packet->payload.payload;
+    link->op = payload[0];
+    link->profile = payload[1];
+    link->snr_qdb = (int16_t) (payload[2] << 8 | payload[3]);
+    link->received = payload[4] << 8 | payload[5];
+    link->lost = payload[6] << 8 | payload[7];
+    return 0;
+}
+
+void lora_codec_encode_nack(uint8_t src_addr, uint8_t dest_addr, uint8_t message_id, uint64_t missing, LoRa_Packet* packet) {
+    packet->header.message_type = LORA_MESSAGE_NACK;
+    packet->header.src_device_addr = src_addr;
+    packet->header.dest_device_addr = dest_addr;
+    packet->header.num_of_packets = 1;
+    packet->header.packet_num = 0;
+    packet->header.message_id = 0;
+    packet->header.poll = 0;
+    packet->header.payload_size = LORA_NACK_FRAME_SIZE;
+    packet->payload.payload[0] = message_id;
+    for (uint8_t i = 0; i < 8; i++) {
+        packet->payload.payload[1 + i] = (uint8_t) (missing >> (56 - 8 * i));
+    }
+    packet->header.header_crc = lora_calc_header_crc(&packet->header);
+    packet->payload.payload_crc = lora_calc_packet_crc(&packet->payload, LORA_NACK_FRAME_SIZE);
+}
+
+uint8_t lora_codec_decode_nack(const LoRa_Packet* packet, uint8_t* message_id, uint64_t* missing) {
+    if (packet->header.message_type != LORA_MESSAGE_NACK ||
+        packet->header.payload_size != LORA_NACK_FRAME_SIZE) {
+        return 1;
+    }
+    *message_id = packet->payload.payload[0];
+    *missing = 0;
+    for (uint8_t i = 0; i < 8; i++) {
+        *missing = (*missing << 8) | packet->payload.payload[1 + i];
+    }
+    return 0;
+}
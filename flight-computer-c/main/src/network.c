@@ -2,6 +2,8 @@
 // Created by molnar on 2023.02.14..
 //
 #include "network.h"
+#include "packet_pool.h"
+#include "lora_codec.h"
 
 static const char TAG[] = "LoRa";
 
@@ -11,7 +13,10 @@ sx127x *lora_device;
 SemaphoreHandle_t xLoraMutex;
 // Rx buff mutex is not needed because the rx_callback dispatches the tasks
 // TX buffer is not needed because the task will send data when it receives a packet from queue
+// Bulk traffic: message fragments and single frame messages
 QueueHandle_t lora_tx_queue;
+// Link management: NACKs, served before bulk traffic
+QueueHandle_t lora_tx_link_queue;
 SemaphoreHandle_t xLoraTXQueueMutex;
 
 spi_device_handle_t lora_spi_device;
@@ -19,16 +24,127 @@ TaskHandle_t lora_interrupt_handler;
 // When a packet needs to be sent, only put in the rx buffer
 // The sender task sends the packets
 TaskHandle_t lora_packet_sender_handler;
-LoRa_Packet lora_rx_buff[20];
+// FIFO transfers run on the async worker, so neither the interrupt task nor the sender waits for the SPI bus
+sx127x_async *lora_async;
+// Frames handed to the async worker. A slot is reused only after its FIFO load completed
+typedef struct {
+    WORD_ALIGNED_ATTR uint8_t header[LORA_PACKET_WIRE_MAX_HEADER_SIZE];
+    sx127x_segment_t segments[LORA_PACKET_WIRE_SEGMENTS];
+    LoRa_Packet* packet; // payload is sent from the pool buffer, released once loaded
+    int64_t load_start;
+} LoRa_TX_Frame;
+
+// Entry of the class queues
+typedef struct {
+    LoRa_Packet* packet;
+    int64_t queued_at; // us
+} LoRa_TX_Entry;
+
+// Entry of control_frame_queue
+typedef struct {
+    LoRa_Control_Frame control;
+    int64_t expires_at; // us, LORA_CONTROL_EXPIRY_MS after the frame arrived
+} Network_Control_Entry;
+
+LoRa_TX_Frame lora_tx_frames[LORA_TX_FRAME_BUFFERS];
+SemaphoreHandle_t lora_tx_frame_semaphore;
+// given by tx_callback, the sender loads the next frame only after the previous one left the radio
+SemaphoreHandle_t lora_tx_done_semaphore;
+uint8_t lora_tx_frame_index = 0;
+// queue wait of the frames taken by the sender, stale and overflow drops, per traffic class
+LoRa_Class_Stats lora_class_stats[LORA_CLASS_COUNT];
+portMUX_TYPE lora_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+// sequence numbers and replay windows of every address, zeroed windows accept the first frame
+LoRa_Peer lora_peers[256];
+
+// Fixed length header of control frames, coding rate and CRC match lora_modem_profile
+sx127x_implicit_header_t lora_control_header = {
+        .length = LORA_CONTROL_WIRE_SIZE,
+        .crc = SX127x_RX_PAYLOAD_CRC_OFF,
+        .coding_rate = SX127x_CR_4_5,
+};
+// airtime of a LORA_PACKET_WIRE_MAX_SIZE frame with explicit header, bounds the airtime of a selective repeat round
+uint32_t lora_max_frame_airtime_us;
+// Control frames arrive with implicit header. A header mode frame or a bulk frame switches the receiver to explicit
+// header until the end of the superframe, the next beacon comes with implicit header again
+volatile uint8_t lora_listen_explicit = 0;
+esp_timer_handle_t lora_explicit_window_timer;
+// retries a return to rx the full async request queue refused
+esp_timer_handle_t lora_relisten_timer;
+// Slot lengths of the superframe, see tdma.h. Both ends derive them from the same modem profile
+Tdma_Timing lora_tdma_timing;
+// longest superframe the slot limits allow, beacon included
+uint32_t lora_superframe_max_us;
+// beacons are broadcast, their sequence numbers don't follow the unicast frames of the ground station
+Replay_Window lora_beacon_window;
+// RX_DONE of the last frame, taken by the interrupt task before the FIFO is read. The end of a beacon
+int64_t lora_rx_done_at;
+// Timing of the last beacon, written by the rx path under lora_superframe_lock. The sender sends only in the
+// reply slot a beacon granted, lora_reply_semaphore is given for every one of them
+int64_t lora_superframe_end = 0;
+int64_t lora_reply_slot_start = 0;
+// measured interval of the reply slots of this device, 0 until two of them were granted
+int64_t lora_reply_interval_us = 0;
+portMUX_TYPE lora_superframe_lock = portMUX_INITIALIZER_UNLOCKED;
+SemaphoreHandle_t lora_reply_semaphore;
+// the sender sleeps on it until the start of its slot
+esp_timer_handle_t lora_slot_timer;
+SemaphoreHandle_t lora_slot_semaphore;
+// time the listen before talk CADs take, the sender starts them this early, 0 if LORA_LBT_CAD_SYMBOLS is 0
+uint32_t lora_lbt_us;
+// given by cad_callback with the result in lora_cad_detected
+SemaphoreHandle_t lora_cad_semaphore;
+volatile uint8_t lora_cad_detected;
+// RSSI and SNR of the frame on the rx path, read before it is decoded
+int16_t lora_rx_rssi;
+int16_t lora_rx_snr_qdb;
+// Adaptive data rate, see adr.h. Window of the frames of the ground station, reported to it. Rx path only
+Adr_Link lora_downlink;
+int64_t lora_link_reported_at = 0;
+// profile the link runs, written by lora_profile_applied on the async worker
+volatile uint8_t lora_link_profile = 0;
+// profile acknowledged last, tried first once the link is lost. ADR_UNKNOWN if none is pending
+volatile uint8_t lora_link_acked = ADR_UNKNOWN;
+// profile lora_switch_timer applies
+volatile uint8_t lora_link_next = 0;
+esp_timer_handle_t lora_switch_timer;
+// restarted by every frame of the ground station, see LORA_LINK_LOST_MS
+esp_timer_handle_t lora_link_timer;
+
+// Modem configuration of the link, the ground station and the aircraft must use the same values
+sx127x_modem_profile_t lora_modem_profile = {
+        .frequency = 437200012,
+        .bandwidth = SX127x_BW_500000,
+        .spreading_factor = SX127x_SF_7,
+        .coding_rate = SX127x_CR_4_5,
+        .crc = SX127x_RX_PAYLOAD_CRC_OFF,
+        .implicit_header = NULL,
+        .syncword = 18,
+        .preamble_length = 8,
+        .pa_pin = SX127x_PA_PIN_BOOST,
+        .power = 4,
+        .dio_mapping1 = SX127x_DIO0_RX_DONE,
+        .dio_mapping2 = SX127x_DIO4_CAD_DETECTED,
+};
 
 Network_Device_Container device_container;
 
 TaskHandle_t network_rx_packet_handler;
 QueueHandle_t packet_rx_queue;
+// fragments of every device, only touched by network_packet_processor_task
+Reassembly_Context network_reassembly;
+// selective repeat state is updated by the packet processor and by set_packets_for_tx
+portMUX_TYPE network_arq_lock = portMUX_INITIALIZER_UNLOCKED;
+// taken while a device is published to the table, lookups read the slots without it
+portMUX_TYPE network_device_lock = portMUX_INITIALIZER_UNLOCKED;
 TaskHandle_t network_device_processor_handler;
 QueueHandle_t network_device_processor_queue;
 
 QueueHandle_t device_queue;
+// latest received setpoint, the control task applies it to the servos and the motor
+QueueHandle_t control_frame_queue;
+// control frames are decoded here on the async worker, they never take a pool buffer
+LoRa_Packet control_rx_packet;
 
 extern SemaphoreHandle_t joystick_semaphore_handle;
 
@@ -37,78 +153,156 @@ extern SemaphoreHandle_t lcd_mutex;
 extern RTLG_Status RTLG_status;
 extern SemaphoreHandle_t RTLG_status_mutex;
 
-static bool network_is_device_in_arp(Network_Device_Container* dev_container, uint8_t dev_addr) {
-    for (uint8_t i = 0; i < dev_container->num_of_devices; i++) {
-        if (dev_container->device_contexts[i].address == dev_addr) {
-            return true;
-        }
-    }
-
-
-    return false;
+static Network_Device_Context* get_device_from_arp(Network_Device_Container* dev_container, uint8_t dev_addr) {
+    return dev_container->device_contexts[dev_addr];
 }
 
-static Network_Device_Context* get_device_from_arp(Network_Device_Container* dev_container, uint8_t dev_addr) {
-    for (uint8_t i = 0; i < dev_container->num_of_devices; i++) {
-        if (dev_container->device_contexts[i].address == dev_addr) {
-            return &dev_container->device_contexts[i];
-        }
+// Queues the fragments of the next selective repeat round, the last one polls the device for a NACK.
+// A fragment that can't be queued is left out, the missing report or the next NACK brings it back
+static void network_send_round(Network_Device_Context* device_ctx) {
+    // the report is due once the whole window is on air
+    int64_t report_due = esp_timer_get_time() + lora_tx_time_us(ARQ_WINDOW + device_ctx->packet_tx_num_of_parity) +
+                         ARQ_REPORT_TIMEOUT_MS * 1000;
+    taskENTER_CRITICAL(&network_arq_lock);
+    uint64_t previously_sent = device_ctx->arq.sent;
+    uint64_t round = arq_next_round(&device_ctx->arq, report_due);
+    uint8_t num_of_packets = device_ctx->arq.num_of_packets;
+    taskEXIT_CRITICAL(&network_arq_lock);
+    if (round == 0) {
+        return;
+    }
+    // parity follows the first transmission of the last data fragment, resends are plain data fragments
+    uint64_t last_fragment = (uint64_t) 1 << (num_of_packets - 1);
+    uint8_t num_of_parity = (round & last_fragment) && !(previously_sent & last_fragment) ?
+                            device_ctx->packet_tx_num_of_parity : 0;
+
+    uint64_t resent = round & previously_sent;
+    device_ctx->num_of_faulty_packets = 0;
+    if (resent != 0 && device_ctx->packet_num_of_faulty_packets == NULL) {
+        device_ctx->packet_num_of_faulty_packets = (uint8_t*) malloc(ARQ_WINDOW);
     }
+    device_ctx->connection_status = resent != 0 ? WAITING_FOR_PACKET_CORRECTION : MESSAGE_SENT;
 
-    return NULL;
+    uint8_t last = 63 - __builtin_clzll(round);
+    for (uint8_t i = 0; i <= last; i++) {
+        if (!((round >> i) & 1)) {
+            continue;
+        }
+        if (((resent >> i) & 1) && device_ctx->packet_num_of_faulty_packets != NULL) {
+            device_ctx->packet_num_of_faulty_packets[device_ctx->num_of_faulty_packets++] = i;
+        }
+        LoRa_Packet* packet = packet_pool_alloc(0);
+        if (packet == NULL) {
+            ESP_LOGW(TAG, "No free packet buffer, round cut short");
+            return;
+        }
+        packet_pool_copy(packet, &device_ctx->packet_tx_buff[i]);
+        packet->header.poll = i == last && num_of_parity == 0;
+        if (lora_tx_enqueue(packet, LORA_OVERFLOW_REJECT) != 0) {
+            ESP_LOGW(TAG, "TX queue full, round cut short");
+            packet_pool_free(packet);
+            return;
+        }
+    }
+    for (uint8_t i = 0; i < num_of_parity; i++) {
+        LoRa_Packet* packet = packet_pool_alloc(0);
+        if (packet == NULL) {
+            ESP_LOGW(TAG, "No free packet buffer, parity cut short");
+            return;
+        }
+        packet_pool_copy(packet, &device_ctx->packet_tx_buff[num_of_packets + i]);
+        packet->header.poll = i == num_of_parity - 1;
+        if (lora_tx_enqueue(packet, LORA_OVERFLOW_REJECT) != 0) {
+            ESP_LOGW(TAG, "TX queue full, parity cut short");
+            packet_pool_free(packet);
+            return;
+        }
+    }
 }
 
-static uint8_t build_packet_from_bytes(LoRa_Packet* packet, uint8_t* raw_data, uint8_t raw_data_size){
-    if (raw_data_size <= 9 ) {
-        return 1; // Error, packet cannot be empty, or have missing header parameters
+static void network_handle_arq_status(Network_Device_Context* device_ctx, Arq_Status status) {
+    switch (status) {
+        case ARQ_SEND:
+            network_send_round(device_ctx);
+            break;
+        case ARQ_DONE:
+            ESP_LOGD(TAG, "Message %d delivered to %#X", device_ctx->arq.message_id, device_ctx->address);
+            device_ctx->connection_status = CONNECTION_ESTABLISHED;
+            break;
+        case ARQ_FAILED:
+            ESP_LOGE(TAG, "Message %d to %#X given up after %d rounds without progress", device_ctx->arq.message_id,
+                     device_ctx->address, ARQ_MAX_RETRIES);
+            device_ctx->connection_status = CONNECTION_ESTABLISHED;
+            break;
+        default:
+            break;
     }
-
-    packet->header.src_device_addr = raw_data[0];
-    packet->header.dest_device_addr = raw_data[1];
-    packet->header.num_of_packets = raw_data[2];
-    packet->header.packet_num = raw_data[3];
-    packet->header.payload_size = raw_data[4];
-    packet->header.header_crc = ((uint16_t)raw_data[5] << 8) | raw_data[6];
-    packet->payload.payload_crc = ((uint16_t)raw_data[7] << 8) | raw_data[8];
-    memcpy(packet->payload.payload, &raw_data[9], raw_data_size - 9);
-
-    return 0;
 }
 
-static void display_packet(LoRa_Packet* packet_to_display){
-    printf("Printing packet...\n");
-    printf("\tHeader:\n");
-    printf("\t\tSource device address: %d\n", packet_to_display->header.src_device_addr);
-    printf("\t\tDestination device address: %d\n", packet_to_display->header.dest_device_addr);
-    printf("\t\tNumber of packets: %d\n", packet_to_display->header.num_of_packets);
-    printf("\t\tPacket number: %d\n", packet_to_display->header.packet_num);
-    printf("\t\tPayload size: %d\n", packet_to_display->header.payload_size);
-    printf("\t\tHeader CRC: %d\n", packet_to_display->header.payload_size);
-    printf("\tPayload:\n");
-    printf("\t\t");
-    for (uint8_t i = 0; i < packet_to_display->header.payload_size; i++) {
-        printf("%#X ", packet_to_display->payload.payload[i]);
+// Answers a polling fragment with the fragments still missing from its message
+static void network_send_nack(uint8_t dest_addr, uint8_t message_id, uint64_t missing) {
+    LoRa_Packet* packet = packet_pool_alloc(0);
+    if (packet == NULL) {
+        ESP_LOGW(TAG, "No free packet buffer, NACK dropped");
+        return;
     }
+    lora_codec_encode_nack(LORA_SELF_ADDRESS, dest_addr, message_id, missing, packet);
+    // the ARQ timeout of the sender covers a lost NACK
+    lora_tx_enqueue(packet, LORA_OVERFLOW_DROP_NEWEST);
+}
 
-    printf("\tPayload CRC:\n");
-    printf("\t\t%d\n", packet_to_display->payload.payload_crc);
+// Appends device_ctx->tx_parity erasure code fragments to the data fragments in packet_tx_buff. Without memory
+// the message goes out unprotected, selective repeat still delivers it
+static void network_append_parity(Network_Device_Context* device_ctx) {
+    uint8_t num_of_packets = device_ctx->packet_tx_buff[0].header.num_of_packets;
+    uint8_t num_of_parity = device_ctx->tx_parity > FEC_MAX_PARITY ? FEC_MAX_PARITY : device_ctx->tx_parity;
+    device_ctx->packet_tx_num_of_parity = 0;
+    // a single fragment is cheaper to resend than to protect
+    if (num_of_parity == 0 || num_of_packets < 2) {
+        return;
+    }
+    LoRa_Packet* packets = (LoRa_Packet*) realloc(device_ctx->packet_tx_buff,
+                                                  (num_of_packets + num_of_parity) * sizeof(LoRa_Packet));
+    if (packets == NULL) {
+        ESP_LOGW(TAG, "No memory for parity fragments, message sent without");
+        return;
+    }
+    device_ctx->packet_tx_buff = packets;
+
+    LoRa_Packet* last = &packets[num_of_packets - 1];
+    // the code covers the zero padded last fragment
+    memset(&last->payload.payload[last->header.payload_size], 0, LORA_PAYLOAD_MAX_SIZE - last->header.payload_size);
+    for (uint8_t i = 0; i < num_of_parity; i++) {
+        LoRa_Packet* parity = &packets[num_of_packets + i];
+        parity->header = packets[0].header;
+        parity->header.message_type = LORA_MESSAGE_PARITY;
+        parity->header.packet_num = i;
+        parity->header.last_payload_size = last->header.payload_size;
+        parity->header.payload_size = LORA_PAYLOAD_MAX_SIZE;
+        fec_encode(packets[0].payload.payload, sizeof(LoRa_Packet), num_of_packets, LORA_PAYLOAD_MAX_SIZE, i,
+                   parity->payload.payload);
+        parity->header.header_crc = lora_calc_header_crc(&parity->header);
+        parity->payload.payload_crc = lora_calc_packet_crc(&parity->payload, LORA_PAYLOAD_MAX_SIZE);
+    }
+    device_ctx->packet_tx_num_of_parity = num_of_parity;
 }
 
 uint16_t lora_calc_header_crc(LoRa_Packet_Header* header){
-    uint8_t header_arr[5] = {header->src_device_addr, header->dest_device_addr,
-                             header->num_of_packets, header->packet_num,
+    uint8_t header_arr[7] = {header->message_type, header->src_device_addr, header->dest_device_addr,
+                             header->num_of_packets, header->packet_num, header->message_id,
                              header->payload_size};
 
-    return crc16_be(0, header_arr, 5);
+    return crc16(0, header_arr, 7);
 }
 
 uint16_t lora_calc_packet_crc(LoRa_Packet_Payload* payload, uint8_t payload_length){
-    return crc16_be(0, payload->payload, payload_length);
+    return crc16(0, payload->payload, payload_length);
 }
 
 void lora_display_packet(LoRa_Packet* packet_to_display){
     printf("Printing packet...\n");
     printf("\tHeader:\n");
+    printf("\t\tMessage type: %d\n", packet_to_display->header.message_type);
     printf("\t\tSource device address: %d\n", packet_to_display->header.src_device_addr);
     printf("\t\tDestination device address: %d\n", packet_to_display->header.dest_device_addr);
     printf("\t\tPacket number: %d\n", packet_to_display->header.packet_num);
@@ -129,9 +323,53 @@ void IRAM_ATTR lora_handle_interrupt_fromisr(void *arg)
     xTaskResumeFromISR(lora_interrupt_handler);
 }
 
+// Sets the modem profile and the control frame header to a profile of the adaptive data rate ladder
+static void lora_load_profile(uint8_t profile) {
+    const Adr_Profile* adr = &adr_profiles[profile];
+    lora_modem_profile.spreading_factor = (sx127x_sf_t) (adr->spreading_factor << 4);
+    lora_modem_profile.coding_rate = (sx127x_cr_t) ((adr->coding_rate - 4) << 1);
+    switch (adr->bandwidth_hz) {
+        case 125000:
+            lora_modem_profile.bandwidth = SX127x_BW_125000;
+            break;
+        case 250000:
+            lora_modem_profile.bandwidth = SX127x_BW_250000;
+            break;
+        default:
+            lora_modem_profile.bandwidth = SX127x_BW_500000;
+            break;
+    }
+    lora_control_header.coding_rate = lora_modem_profile.coding_rate;
+}
+
+// Derives the airtimes, the slot lengths and the CAD time from the modem profile the radio runs. Configures the radio
+// synchronously, so only init_lora and the async worker may call it. The radio is left with explicit header
+static void lora_load_timing(sx127x* lora_dev) {
+    // airtime of a control frame with both header modes, calculated from the shadowed configuration
+    uint32_t control_explicit_us;
+    uint32_t control_implicit_us;
+    ESP_ERROR_CHECK(sx127x_get_time_on_air(lora_dev, LORA_PACKET_WIRE_MAX_SIZE, &lora_max_frame_airtime_us));
+    ESP_ERROR_CHECK(sx127x_get_time_on_air(lora_dev, LORA_CONTROL_WIRE_SIZE, &control_explicit_us));
+    ESP_ERROR_CHECK(sx127x_set_implicit_header(&lora_control_header, lora_dev));
+    ESP_ERROR_CHECK(sx127x_get_time_on_air(lora_dev, LORA_CONTROL_WIRE_SIZE, &control_implicit_us));
+    ESP_LOGI(TAG, "Control frame airtime: %lu us with explicit, %lu us with implicit header", control_explicit_us, control_implicit_us);
+    ESP_ERROR_CHECK(sx127x_set_implicit_header(NULL, lora_dev));
+    tdma_timing_init(&lora_tdma_timing, control_implicit_us, lora_max_frame_airtime_us);
+    Tdma_Superframe longest = {
+            .control_slots = TDMA_MAX_CONTROL_SLOTS,
+            .downlink_slots = TDMA_MAX_DOWNLINK_SLOTS,
+            .reply_owner = {[0 ... TDMA_MAX_REPLY_SLOTS - 1] = LORA_NETWORK_BROADCAST_ADDR},
+    };
+    lora_superframe_max_us = lora_tdma_timing.beacon_slot_us + tdma_superframe_end_us(&lora_tdma_timing, &longest);
+    uint32_t bandwidth;
+    ESP_ERROR_CHECK(sx127x_get_bandwidth(lora_dev, &bandwidth));
+    // a CAD listens for one symbol and takes about as long again to evaluate it
+    lora_lbt_us = LORA_LBT_CAD_SYMBOLS * 2 * (uint32_t) ((1000000ULL << (lora_modem_profile.spreading_factor >> 4)) / bandwidth);
+}
+
 void init_lora(spi_device_handle_t* spi_device, sx127x* lora_dev) {
     spi_device_interface_config_t dev_cfg = {
-            .clock_speed_hz = 100000,
+            .clock_speed_hz = LORA_SPI_CLOCK_SPEED_HZ,
             .spics_io_num = LORA_SS_PIN,
             .queue_size = 16,
             .command_bits = 0,
@@ -140,24 +378,57 @@ void init_lora(spi_device_handle_t* spi_device, sx127x* lora_dev) {
             .mode = 0
     };
 
+    packet_pool_init();
     ESP_ERROR_CHECK(spi_bus_add_device(LORA_SPI_HOST, &dev_cfg, spi_device));
     //spi_device_acquire_bus(lora_spi_device, portMAX_DELAY);
     ESP_ERROR_CHECK(sx127x_create(*spi_device, &lora_dev));
     ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_SLEEP, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_frequency(437200012, lora_dev));
     ESP_ERROR_CHECK(sx127x_reset_fifo(lora_dev));
     ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_STANDBY, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_bandwidth(SX127x_BW_500000, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_implicit_header(NULL, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_modem_config_2(SX127x_SF_7, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_syncword(18, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_preamble_length(8, lora_dev));
+    lora_load_profile(lora_link_profile);
+    ESP_ERROR_CHECK(sx127x_apply_profile(&lora_modem_profile, lora_dev));
+    lora_load_timing(lora_dev);
+    // control frames and beacons come with implicit header
+    ESP_ERROR_CHECK(sx127x_set_implicit_header(&lora_control_header, lora_dev));
+    const esp_timer_create_args_t switch_timer_args = {
+            .callback = lora_switch_timer_expired,
+            .name = "lora switch",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&switch_timer_args, &lora_switch_timer));
+    const esp_timer_create_args_t link_timer_args = {
+            .callback = lora_link_lost,
+            .name = "lora link",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&link_timer_args, &lora_link_timer));
     sx127x_set_tx_callback(tx_callback, lora_dev);
     sx127x_set_rx_callback(rx_callback, lora_dev);
+    sx127x_set_cad_callback(cad_callback, lora_dev);
 
     ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_RX_CONT, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_pa_config(SX127x_PA_PIN_BOOST, 4, lora_dev));
     //spi_device_release_bus(lora_spi_device);
+    lora_tx_frame_semaphore = xSemaphoreCreateCounting(LORA_TX_FRAME_BUFFERS, LORA_TX_FRAME_BUFFERS);
+    lora_tx_done_semaphore = xSemaphoreCreateBinary();
+    ESP_ERROR_CHECK(sx127x_async_create(lora_dev, LORA_ASYNC_QUEUE_LENGTH, LORA_ASYNC_TASK_PRIORITY, &lora_async));
+    // a ground station running another profile is searched for from here
+    ESP_ERROR_CHECK(esp_timer_start_once(lora_link_timer, LORA_LINK_LOST_MS * 1000 + 2 * (uint64_t) lora_superframe_max_us));
+    const esp_timer_create_args_t explicit_window_timer_args = {
+            .callback = lora_explicit_window_expired,
+            .name = "lora explicit window",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&explicit_window_timer_args, &lora_explicit_window_timer));
+    const esp_timer_create_args_t relisten_timer_args = {
+            .callback = lora_relisten_timer_expired,
+            .name = "lora relisten",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&relisten_timer_args, &lora_relisten_timer));
+    lora_reply_semaphore = xSemaphoreCreateBinary();
+    lora_slot_semaphore = xSemaphoreCreateBinary();
+    lora_cad_semaphore = xSemaphoreCreateBinary();
+    const esp_timer_create_args_t slot_timer_args = {
+            .callback = lora_slot_timer_expired,
+            .name = "lora slot",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&slot_timer_args, &lora_slot_timer));
     BaseType_t task_code = xTaskCreatePinnedToCore(handle_interrupt_task, "handle interrupt", 8196, lora_dev, 100, &lora_interrupt_handler, xPortGetCoreID());
     if (task_code != pdPASS)
     {
@@ -176,7 +447,9 @@ void init_lora(spi_device_handle_t* spi_device, sx127x* lora_dev) {
 
     xLoraMutex = xSemaphoreCreateMutex();
     xLoraTXQueueMutex = xSemaphoreCreateMutex();
-    lora_tx_queue = xQueueCreate(50, sizeof(LoRa_Packet));
+    // every entry holds a pool buffer, neither queue can overflow
+    lora_tx_queue = xQueueCreate(PACKET_POOL_SIZE, sizeof(LoRa_TX_Entry));
+    lora_tx_link_queue = xQueueCreate(PACKET_POOL_SIZE, sizeof(LoRa_TX_Entry));
     BaseType_t sender_task_code = xTaskCreatePinnedToCore(lora_packet_sender_task, "PacketSenderTask", 5120, lora_dev, 2, &lora_packet_sender_handler, 1);
     if (sender_task_code != pdPASS)
     {
@@ -189,21 +462,23 @@ void init_lora(spi_device_handle_t* spi_device, sx127x* lora_dev) {
 
 void network_init(Network_Device_Container* device_cont)
 {
-    device_cont->device_contexts = NULL;
-    device_cont->num_of_devices = 0;
+    memset(device_cont, 0, sizeof(Network_Device_Container));
     network_add_device(device_cont, 0x00);
 
     Network_Device_Context* device_ctx = get_device_from_arp(device_cont, 0x00);
     device_ctx->status = ONLINE;
-    packet_rx_queue = xQueueCreate(50, sizeof(LoRa_Packet));
-    device_queue = xQueueCreate(15, sizeof(uint8_t));
+    packet_rx_queue = xQueueCreate(PACKET_POOL_SIZE, sizeof(LoRa_Packet*));
+    reassembly_init(&network_reassembly, LORA_PAYLOAD_MAX_SIZE);
+    // latest complete message wins, the servos never replay a backlog of old setpoints
+    device_queue = xQueueCreate(1, sizeof(uint8_t));
+    control_frame_queue = xQueueCreate(1, sizeof(Network_Control_Entry));
 
     // TODO: Check tasks for safety purposes and create task handles for them
-    xTaskCreate(network_packet_rx_handler_task, "PacketReceiveTask", 4096, &device_container, 1, &network_rx_packet_handler);
     network_device_processor_queue = xQueueCreate(20, sizeof(uint8_t));
-    xTaskCreate(network_packet_rx_handler_task, "DeviceProcessorTask", 4096, &device_container, 1, &network_device_processor_handler);
-    xTaskCreate(network_packet_processor_task, "PacketProcessorTask", 5120, &device_container, 1, NULL);
-    xTaskCreate(network_device_processor_task, "PacketProcessorTask", 5120, &device_container, 1, NULL);
+    // packet_rx_queue has a single consumer, fragments of a message must not be split between tasks
+    xTaskCreate(network_packet_processor_task, "PacketProcessorTask", 5120, &device_container, 1, &network_rx_packet_handler);
+    xTaskCreate(network_device_processor_task, "DeviceProcessorTask", 5120, &device_container, 1, &network_device_processor_handler);
+    xTaskCreate(network_control_task, "ControlTask", 4096, NULL, 2, NULL);
     ESP_LOGI("Network", "Network init finished.");
 
 }
@@ -219,14 +494,128 @@ void handle_interrupt_task(void *arg)
 
 void tx_callback(sx127x *device)
 {
-    ESP_LOGI(TAG, "Transmitted");
+    ESP_LOGD(TAG, "Transmitted");
+    xSemaphoreGive(lora_tx_done_semaphore);
+}
+
+void cad_callback(sx127x *device, int detected) {
+    lora_cad_detected = detected != 0;
+    xSemaphoreGive(lora_cad_semaphore);
+}
+
+// Restarts the lost link timeout, see LORA_LINK_LOST_MS
+static void lora_link_heard() {
+    esp_timer_stop(lora_link_timer);
+    esp_timer_start_once(lora_link_timer, LORA_LINK_LOST_MS * 1000 + 2 * (uint64_t) lora_superframe_max_us);
+}
+
+// Queues a link management frame to the ground station, it goes in the next reply slot.
+// \return 0 if it was queued
+static uint8_t lora_link_send(const LoRa_Link_Frame* link, int64_t expires_at) {
+    LoRa_Packet* packet = packet_pool_alloc(0);
+    if (packet == NULL) {
+        ESP_LOGW(TAG, "No free packet buffer, link frame dropped");
+        return 1;
+    }
+    lora_codec_encode_link(link, LORA_SELF_ADDRESS, LORA_BASE_STATION_ADDR, packet);
+    packet->expires_at = expires_at;
+    return lora_tx_enqueue(packet, LORA_OVERFLOW_DROP_NEWEST);
+}
+
+// Adds a frame of the ground station to the downlink window and reports the window once it is full, at most every
+// LORA_LINK_REPORT_MS. Only the rx path may call it
+static void lora_link_record(const LoRa_Packet* packet) {
+    lora_link_heard();
+    adr_record(&lora_downlink, packet->header.sequence, lora_rx_rssi, lora_rx_snr_qdb, lora_link_profile);
+    int64_t now = esp_timer_get_time();
+    if (lora_downlink.received + lora_downlink.lost < ADR_MIN_FRAMES || now - lora_link_reported_at < LORA_LINK_REPORT_MS * 1000) {
+        return;
+    }
+    LoRa_Link_Frame report = {
+            .op = LORA_LINK_REPORT,
+            .profile = lora_link_profile,
+            .snr_qdb = adr_snr_qdb(&lora_downlink),
+            .received = lora_downlink.received,
+            .lost = lora_downlink.lost,
+    };
+    // the next report supersedes one still waiting for a reply slot
+    if (lora_link_send(&report, now + LORA_LINK_REPORT_MS * 1000) == 0) {
+        adr_restart_window(&lora_downlink);
+        lora_link_reported_at = now;
+    }
+}
+
+static void lora_receive_link(const LoRa_Packet* packet) {
+    LoRa_Link_Frame link;
+    if (lora_codec_decode_link(packet, &link) != 0 || link.op != LORA_LINK_SWITCH || link.profile >= ADR_PROFILE_COUNT) {
+        ESP_LOGD(TAG, "Invalid link frame dropped");
+        return;
+    }
+    // the beacon that announces the switch may be missed, the lost link falls back to the profile
+    lora_link_acked = link.profile;
+    LoRa_Link_Frame ack = {.op = LORA_LINK_ACK, .profile = link.profile};
+    lora_link_send(&ack, esp_timer_get_time() + LORA_LINK_LOST_MS * 1000);
+}
+
+void lora_profile_applied(sx127x *device, int code, void *arg) {
+    uint8_t profile = (uint8_t) (uintptr_t) arg;
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't apply modem profile %d", code);
+        lora_load_profile(lora_link_profile);
+    } else {
+        lora_load_timing(device);
+        lora_link_profile = profile;
+        lora_link_acked = ADR_UNKNOWN;
+        adr_restart_window(&lora_downlink);
+        ESP_LOGI(TAG, "Modem profile %u: SF%u, %lu Hz, CR 4/%u", profile, adr_profiles[profile].spreading_factor,
+                 adr_profiles[profile].bandwidth_hz, adr_profiles[profile].coding_rate);
+    }
+    // back to listening on the worker, requests queued behind the switch follow
+    ESP_ERROR_CHECK(sx127x_set_implicit_header(lora_listen_header(), device));
+    ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_RX_CONT, device));
+    lora_link_heard();
+}
+
+void lora_switch_timer_expired(void* arg) {
+    // the sender still owns the radio, its reply slot ends within the guard time
+    if (xSemaphoreTake(xLoraMutex, 0) != pdTRUE) {
+        esp_timer_stop(lora_switch_timer);
+        ESP_ERROR_CHECK(esp_timer_start_once(lora_switch_timer, TDMA_GUARD_US / 2));
+        return;
+    }
+    uint8_t profile = lora_link_next;
+    lora_load_profile(profile);
+    int code = sx127x_async_set_opmod(SX127x_MODE_STANDBY, lora_async, NULL, NULL);
+    if (code == SX127X_OK) {
+        code = sx127x_async_apply_profile(&lora_modem_profile, lora_async, lora_profile_applied, (void*) (uintptr_t) profile);
+    }
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't queue modem profile %d", code);
+        lora_load_profile(lora_link_profile);
+    }
+    xSemaphoreGive(xLoraMutex);
 }
 
+void lora_link_lost(void* arg) {
+    uint8_t acked = lora_link_acked;
+    lora_link_next = acked != ADR_UNKNOWN && acked != lora_link_profile ? acked : (lora_link_profile + 1) % ADR_PROFILE_COUNT;
+    ESP_LOGW(TAG, "No frame from the ground station, trying modem profile %u", lora_link_next);
+    esp_timer_stop(lora_switch_timer);
+    lora_switch_timer_expired(NULL);
+    // tried again if the switch could not be queued
+    lora_link_heard();
+}
 
 void rx_callback(sx127x *device) {
-    uint8_t *data = NULL;
-    uint8_t data_length = 0;
-    esp_err_t code = sx127x_read_payload(device, &data, &data_length);
+    lora_rx_done_at = esp_timer_get_time();
+    // FIFO is read by the async worker, the interrupt task is free for the next irq
+    int code = sx127x_async_read_payload(lora_async, rx_payload_callback, NULL);
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't queue payload read %d", code);
+    }
+}
+
+void rx_payload_callback(sx127x *device, int code, uint8_t *data, uint8_t data_length, void *arg) {
     if (code != ESP_OK) {
         ESP_LOGE(TAG, "can't read %d", code);
         return;
@@ -235,166 +624,709 @@ void rx_callback(sx127x *device) {
         // no message received
         return;
     }
-    uint8_t payload[514];
+    // the next frame overwrites them
+    float snr;
+    ESP_ERROR_CHECK(sx127x_get_packet_snr(device, &snr));
+    ESP_ERROR_CHECK(sx127x_get_packet_rssi(device, &lora_rx_rssi));
+    lora_rx_snr_qdb = (int16_t) (snr * 4);
+    if (LORA_WIRE_MESSAGE_TYPE(data[0]) == LORA_MESSAGE_CONTROL) {
+        network_receive_control_frame(data, data_length);
+        return;
+    }
+    if (LORA_WIRE_MESSAGE_TYPE(data[0]) == LORA_MESSAGE_BEACON) {
+        // a replayed beacon would move the reply slot
+        if (lora_codec_decode(&control_rx_packet, data, data_length) == 0 &&
+            control_rx_packet.header.src_device_addr == LORA_BASE_STATION_ADDR &&
+            control_rx_packet.header.dest_device_addr == LORA_NETWORK_BROADCAST_ADDR &&
+            replay_check(&lora_beacon_window, control_rx_packet.header.sequence) == REPLAY_FRESH) {
+            lora_receive_beacon(&control_rx_packet);
+        }
+        return;
+    }
+    if (LORA_WIRE_MESSAGE_TYPE(data[0]) == LORA_MESSAGE_HEADER_MODE) {
+        if (lora_codec_decode(&control_rx_packet, data, data_length) == 0 &&
+            control_rx_packet.header.dest_device_addr == LORA_SELF_ADDRESS &&
+            lora_accept_sequence(&control_rx_packet, 1)) {
+            lora_link_record(&control_rx_packet);
+            lora_extend_explicit_window();
+        }
+        return;
+    }
+    // decoded from the FIFO DMA buffer straight into the pool buffer, the queue only carries the pointer
+    LoRa_Packet* packet_received = packet_pool_alloc(0);
+    if (packet_received == NULL) {
+        ESP_LOGE(TAG, "No free packet buffer, frame dropped");
+        return;
+    }
+    // the replay window only follows frames addressed to this device
+    if (lora_codec_decode(packet_received, data, data_length) != 0 ||
+        packet_received->header.dest_device_addr != LORA_SELF_ADDRESS ||
+        !lora_accept_sequence(packet_received, 0)) {
+        packet_pool_free(packet_received);
+        return;
+    }
+    // more bulk frames may follow, keep listening with explicit header
+    lora_extend_explicit_window();
+    lora_link_record(packet_received);
+    if (packet_received->header.message_type == LORA_MESSAGE_LINK) {
+        lora_receive_link(packet_received);
+        packet_pool_free(packet_received);
+        return;
+    }
+    if (packet_received->header.message_type == LORA_MESSAGE_BATCH) {
+        lora_demux_batch(packet_received);
+        return;
+    }
+    // the freshest frames matter most to the reassembly and the selective repeat state
+    lora_rx_enqueue(packet_received, LORA_OVERFLOW_DROP_OLDEST);
+}
+
+static void lora_record_overflow(LoRa_Traffic_Class traffic_class, uint8_t received) {
+    taskENTER_CRITICAL(&lora_stats_lock);
+    if (received) {
+        lora_class_stats[traffic_class].rx_overflow++;
+    } else {
+        lora_class_stats[traffic_class].overflow++;
+    }
+    taskEXIT_CRITICAL(&lora_stats_lock);
+}
+
+// Puts a frame the sender took back to the front of its queue. A producer may have filled the slot meanwhile,
+// then the frame is lost like the oldest frame of a full queue
+static void lora_tx_requeue(QueueHandle_t queue, LoRa_Traffic_Class traffic_class, LoRa_TX_Entry* entry) {
+    if (xQueueSendToFront(queue, entry, 0) != pdPASS) {
+        lora_record_overflow(traffic_class, 0);
+        packet_pool_free(entry->packet);
+    }
+}
 
-    LoRa_Packet packet_received;
-    build_packet_from_bytes(&packet_received, data, data_length);
-    xQueueSend(packet_rx_queue, &packet_received, portMAX_DELAY);
+static void lora_wait_until(int64_t time) {
+    int64_t wait = time - esp_timer_get_time();
+    if (wait <= 0) {
+        return;
+    }
+    ESP_ERROR_CHECK(esp_timer_start_once(lora_slot_timer, wait));
+    xSemaphoreTake(lora_slot_semaphore, portMAX_DELAY);
+}
 
+void lora_slot_timer_expired(void* arg) {
+    xSemaphoreGive(lora_slot_semaphore);
+}
+
+// Runs one CAD, the radio is in standby afterwards. A CAD that can't be started or never completes counts as clear
+static uint8_t lora_cad() {
+    xSemaphoreTake(lora_cad_semaphore, 0);
+    int code = sx127x_async_set_opmod(SX127x_MODE_STANDBY, lora_async, NULL, NULL);
+    if (code == SX127X_OK) {
+        code = sx127x_async_set_opmod(SX127x_MODE_CAD, lora_async, lora_async_callback, NULL);
+    }
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't queue CAD %d", code);
+        return 0;
+    }
+    if (xSemaphoreTake(lora_cad_semaphore, pdMS_TO_TICKS(LORA_TX_DONE_MARGIN_MS)) != pdTRUE) {
+        ESP_LOGW(TAG, "No CAD_DONE");
+        return 0;
+    }
+    return lora_cad_detected;
+}
+
+// Listen before talk, see LORA_LBT_CAD_SYMBOLS. Every busy CAD doubles the range of the random backoff, the sender
+// holds the radio meanwhile. The caller owns xLoraMutex.
+// \return 1 if the channel was clear by latest_start, 0 if it stayed busy
+static uint8_t lora_channel_clear(LoRa_Traffic_Class traffic_class, int64_t latest_start) {
+    for (uint8_t attempt = 1; ; attempt++) {
+        uint8_t busy = 0;
+        for (int i = 0; i < LORA_LBT_CAD_SYMBOLS && !busy; i++) {
+            busy = lora_cad();
+        }
+        if (!busy) {
+            return 1;
+        }
+        uint8_t exponent = attempt < LORA_LBT_BACKOFF_MAX_EXP ? attempt : LORA_LBT_BACKOFF_MAX_EXP;
+        int64_t resume = esp_timer_get_time() + (1 + esp_random() % (1u << exponent)) * LORA_LBT_BACKOFF_UNIT_US;
+        taskENTER_CRITICAL(&lora_stats_lock);
+        lora_class_stats[traffic_class].busy++;
+        if (resume > latest_start) {
+            lora_class_stats[traffic_class].busy_skipped++;
+        }
+        taskEXIT_CRITICAL(&lora_stats_lock);
+        if (resume > latest_start) {
+            return 0;
+        }
+        lora_wait_until(resume);
+    }
 }
 
 void lora_packet_sender_task(void* pvParameters) {
     sx127x* lora_dev = (sx127x*) pvParameters;
-    LoRa_Packet packet_to_send;
-    // Optimization: if there are messages which has packet left to send
-    // the program does not set the LoRa mode back to receiving until every message has been sent
-    // which is indicated by the 0 value
-    uint8_t messages_unfinished = 0;
-    uint8_t mode = SX127x_MODE_RX_CONT;
-    uint8_t lora_mutex_is_held_by_task = 0;
+    LoRa_Packet* packet_to_send;
+    int64_t slot_start;
+    // The ground station owns the superframe, see tdma.h. The aircraft sends one frame in every reply slot a beacon
+    // granted it and listens the rest of the time. Frames wait in their class queues meanwhile, the next frame
+    // is still picked by class. Half of the guard time covers the RX_DONE latency of the beacon, a slot the sender
+    // reaches later than the other half is left unused. With listen before talk the CADs run in the guard time
+    // before the slot, a frame that finds no clear channel while it would still end in the slot goes back to its queue
     while (1) {
-        if( xQueueReceive(lora_tx_queue, &packet_to_send, 1000) == pdPASS )
-        {
-            if ( lora_mutex_is_held_by_task || xSemaphoreTake(xLoraMutex, portMAX_DELAY) == pdTRUE) {
-                lora_mutex_is_held_by_task = 1;
-                if (mode != SX127x_MODE_TX) {
-                    //spi_device_polling_end(lora_spi_device, portMAX_DELAY);
-                    ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_TX, lora_dev));
-                    vTaskDelay(50 / portTICK_PERIOD_MS);
-                    ESP_LOGI("LoRa", "Device set to tx...");
-                    mode = SX127x_MODE_TX;
-                }
+        xSemaphoreTake(lora_reply_semaphore, portMAX_DELAY);
+        taskENTER_CRITICAL(&lora_superframe_lock);
+        slot_start = lora_reply_slot_start;
+        taskEXIT_CRITICAL(&lora_superframe_lock);
+        lora_wait_until(slot_start - lora_lbt_us);
+        if (esp_timer_get_time() > slot_start + TDMA_GUARD_US / 2) {
+            ESP_LOGW(TAG, "Reply slot missed by %lld us", esp_timer_get_time() - slot_start);
+            continue;
+        }
+        packet_to_send = lora_tx_dequeue();
+        if (packet_to_send == NULL) {
+            continue;
+        }
+        packet_to_send = lora_coalesce(packet_to_send);
+        LoRa_Traffic_Class traffic_class = lora_traffic_class(packet_to_send);
+        uint32_t time_on_air;
+        ESP_ERROR_CHECK(sx127x_get_time_on_air(lora_dev, lora_codec_frame_length(packet_to_send), &time_on_air));
+        xSemaphoreTake(xLoraMutex, portMAX_DELAY);
+        if (lora_channel_clear(traffic_class, slot_start + lora_tdma_timing.reply_slot_us - TDMA_GUARD_US / 2 - time_on_air)) {
+            lora_wait_until(slot_start);
+            // the ground station always listens with explicit header
+            lora_transmit_and_wait(lora_dev, packet_to_send, NULL);
+        } else {
+            LoRa_TX_Entry entry = {.packet = packet_to_send, .queued_at = esp_timer_get_time()};
+            lora_tx_requeue(traffic_class == LORA_CLASS_LINK ? lora_tx_link_queue : lora_tx_queue, traffic_class, &entry);
+        }
+        int code = sx127x_async_set_implicit_header(lora_listen_header(), lora_async, NULL, NULL);
+        if (code == SX127X_OK) {
+            code = sx127x_async_set_opmod(SX127x_MODE_RX_CONT, lora_async, lora_async_callback, NULL);
+        }
+        xSemaphoreGive(xLoraMutex);
+        if (code != SX127X_OK) {
+            ESP_LOGE(TAG, "can't queue return to rx %d", code);
+            lora_relisten();
+        }
+    }
+}
 
-                //lora_display_packet(&packet_to_send);
 
-                // TODO: Put a while (spi_device_is_polling_transaction(spi)) here to
-                // check when the spi bs is available
-                // otherwise the lora_send_packet will throw spi error
-                //lora_display_packet(&packet_to_send);
+void lora_transmit_and_wait(sx127x* lora_dev, LoRa_Packet* packet, sx127x_implicit_header_t* header) {
+    uint32_t time_on_air;
+    // calculated with the header mode of the previous frame, an explicit header costs at most 5 more symbols
+    // which the margin covers
+    ESP_ERROR_CHECK(sx127x_get_time_on_air(lora_dev, lora_codec_frame_length(packet), &time_on_air));
 
-                ESP_ERROR_CHECK(lora_send_packet(lora_dev, &packet_to_send));
-                // Indicating the last packet of the message
-                if (packet_to_send.header.packet_num == packet_to_send.header.num_of_packets - 1 &&
-                    packet_to_send.header.num_of_packets != 1) {
-                    messages_unfinished--;
-                }
+    // drop a TX_DONE that arrived after its wait timed out
+    xSemaphoreTake(lora_tx_done_semaphore, 0);
+    // chained with the FIFO load, a failed switch is reported by lora_tx_loaded_callback. A frame received before
+    // the switch is still read with the header mode of its reception
+    int code = sx127x_async_set_implicit_header(header, lora_async, NULL, NULL);
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't queue header mode %d", code);
+    }
+    // the buffer belongs to the tx path from here
+    if (lora_send_packet(lora_dev, packet) == 0 &&
+        xSemaphoreTake(lora_tx_done_semaphore, pdMS_TO_TICKS(time_on_air / 1000 + LORA_TX_DONE_MARGIN_MS)) != pdTRUE) {
+        ESP_LOGW(TAG, "No TX_DONE within %lu us", time_on_air);
+    }
+}
 
-                // Indicating start of the message
-                if (packet_to_send.header.packet_num == 0 && packet_to_send.header.num_of_packets != 1) {
-                    messages_unfinished++;
-                }
+sx127x_implicit_header_t* lora_listen_header() {
+    return lora_listen_explicit ? NULL : &lora_control_header;
+}
 
-//                // Indicating all messages has been sent
-//                if (messages_unfinished == 0) {
-//                    ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_RX_CONT, lora_dev));
-//                    mode = SX127x_MODE_RX_CONT;
-//                    xSemaphoreGive(xLoraMutex);
-//                    lora_mutex_is_held_by_task = 0;
-//                }
-            }
-        } else { // if packet are not received for a long period of time, reset state
-            if (mode != SX127x_MODE_RX_CONT) {
-                ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_RX_CONT, lora_dev));
-                ESP_LOGI("LoRa", "LoRa set back to rx");
-                mode = SX127x_MODE_RX_CONT;
-            }
+void lora_relisten() {
+    // while the sender owns the radio it restores the listening header mode itself when it returns to rx
+    if (xSemaphoreTake(xLoraMutex, 0) != pdTRUE) {
+        return;
+    }
+    int code = sx127x_async_set_opmod(SX127x_MODE_STANDBY, lora_async, NULL, NULL);
+    if (code == SX127X_OK) {
+        code = sx127x_async_set_implicit_header(lora_listen_header(), lora_async, NULL, NULL);
+    }
+    if (code == SX127X_OK) {
+        code = sx127x_async_set_opmod(SX127x_MODE_RX_CONT, lora_async, lora_async_callback, NULL);
+    }
+    xSemaphoreGive(xLoraMutex);
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't queue header mode switch %d", code);
+        // still running if an earlier retry is pending, that one covers this switch as well
+        esp_timer_start_once(lora_relisten_timer, LORA_ASYNC_RETRY_MS * 1000);
+    }
+}
+
+void lora_relisten_timer_expired(void* arg) {
+    lora_relisten();
+}
+
+void lora_extend_explicit_window() {
+    int64_t now = esp_timer_get_time();
+    taskENTER_CRITICAL(&lora_superframe_lock);
+    int64_t window_end = lora_superframe_end;
+    taskEXIT_CRITICAL(&lora_superframe_lock);
+    // the beacon of this superframe was missed, the next downlink frame may follow one slot later
+    if (window_end <= now) {
+        window_end = now + lora_tdma_timing.downlink_slot_us;
+    }
+    esp_timer_stop(lora_explicit_window_timer);
+    ESP_ERROR_CHECK(esp_timer_start_once(lora_explicit_window_timer, window_end - now));
+    if (!lora_listen_explicit) {
+        lora_listen_explicit = 1;
+        lora_relisten();
+    }
+}
 
-            if (lora_mutex_is_held_by_task == 1) {
-                xSemaphoreGive(xLoraMutex);
-                lora_mutex_is_held_by_task = 0;
+void lora_explicit_window_expired(void* arg) {
+    lora_listen_explicit = 0;
+    lora_relisten();
+}
+
+void lora_receive_beacon(const LoRa_Packet* beacon) {
+    Tdma_Superframe superframe;
+    uint8_t profile;
+    if (lora_codec_decode_beacon(beacon, &superframe, &profile) != 0 || profile >= ADR_PROFILE_COUNT) {
+        ESP_LOGD(TAG, "Invalid beacon dropped");
+        return;
+    }
+    lora_link_heard();
+    int64_t beacon_end = lora_rx_done_at;
+    uint8_t slot = tdma_reply_slot(&superframe, LORA_SELF_ADDRESS);
+    taskENTER_CRITICAL(&lora_superframe_lock);
+    lora_superframe_end = beacon_end + tdma_superframe_end_us(&lora_tdma_timing, &superframe);
+    if (slot != TDMA_NO_SLOT) {
+        int64_t slot_start = beacon_end + tdma_reply_slot_start_us(&lora_tdma_timing, &superframe, slot);
+        // the longest recent interval, it decays by an eighth with every shorter one
+        int64_t interval = lora_reply_slot_start != 0 ? slot_start - lora_reply_slot_start : 0;
+        if (interval > lora_reply_interval_us) {
+            lora_reply_interval_us = interval;
+        } else {
+            lora_reply_interval_us -= (lora_reply_interval_us - interval) / 8;
+        }
+        lora_reply_slot_start = slot_start;
+    }
+    int64_t superframe_end = lora_superframe_end;
+    taskEXIT_CRITICAL(&lora_superframe_lock);
+    if (slot != TDMA_NO_SLOT) {
+        xSemaphoreGive(lora_reply_semaphore);
+    }
+    // both ends switch once the superframe ended
+    if (profile != lora_link_profile) {
+        int64_t now = esp_timer_get_time();
+        lora_link_next = profile;
+        esp_timer_stop(lora_switch_timer);
+        ESP_ERROR_CHECK(esp_timer_start_once(lora_switch_timer, superframe_end > now ? superframe_end - now : 1));
+    }
+}
+
+static void lora_record_wait(LoRa_Traffic_Class traffic_class, int64_t queued_at) {
+    int64_t wait = esp_timer_get_time() - queued_at;
+    taskENTER_CRITICAL(&lora_stats_lock);
+    lora_class_stats[traffic_class].sent++;
+    lora_class_stats[traffic_class].wait_total_us += wait;
+    if (wait > lora_class_stats[traffic_class].wait_max_us) {
+        lora_class_stats[traffic_class].wait_max_us = wait;
+    }
+    taskEXIT_CRITICAL(&lora_stats_lock);
+}
+
+static uint8_t lora_frame_expired(const LoRa_Packet* packet) {
+    return packet->expires_at != 0 && esp_timer_get_time() >= packet->expires_at;
+}
+
+// Releases a frame that expired before the sender got to it
+static void lora_drop_expired(LoRa_Traffic_Class traffic_class, LoRa_Packet* packet) {
+    taskENTER_CRITICAL(&lora_stats_lock);
+    lora_class_stats[traffic_class].expired++;
+    taskEXIT_CRITICAL(&lora_stats_lock);
+    ESP_LOGD(TAG, "Expired frame of type %d to %#X dropped", packet->header.message_type,
+             packet->header.dest_device_addr);
+    packet_pool_free(packet);
+}
+
+uint8_t lora_accept_sequence(const LoRa_Packet* packet, uint8_t in_order) {
+    Replay_Status status = replay_check(&lora_peers[packet->header.src_device_addr].rx_window,
+                                        packet->header.sequence);
+    if (status == REPLAY_FRESH || (status == REPLAY_REORDERED && !in_order)) {
+        return 1;
+    }
+    taskENTER_CRITICAL(&lora_stats_lock);
+    lora_class_stats[lora_traffic_class(packet)].rx_rejected++;
+    taskEXIT_CRITICAL(&lora_stats_lock);
+    ESP_LOGD(TAG, "Frame %u from %#X rejected (%d)", packet->header.sequence, packet->header.src_device_addr, status);
+    return 0;
+}
+
+LoRa_Traffic_Class lora_traffic_class(const LoRa_Packet* packet) {
+    switch (packet->header.message_type) {
+        case LORA_MESSAGE_CONTROL:
+            return LORA_CLASS_CONTROL;
+        case LORA_MESSAGE_NACK:
+        case LORA_MESSAGE_HEADER_MODE:
+        case LORA_MESSAGE_LINK:
+            return LORA_CLASS_LINK;
+        default:
+            return LORA_CLASS_BULK;
+    }
+}
+
+uint8_t lora_tx_enqueue(LoRa_Packet* packet, LoRa_Overflow_Policy policy) {
+    LoRa_Traffic_Class traffic_class = lora_traffic_class(packet);
+    LoRa_TX_Entry entry = {
+            .packet = packet,
+            .queued_at = esp_timer_get_time(),
+    };
+    LoRa_TX_Entry oldest;
+    QueueHandle_t queue = traffic_class == LORA_CLASS_LINK ? lora_tx_link_queue : lora_tx_queue;
+    if (xQueueSend(queue, &entry, 0) != pdPASS) {
+        lora_record_overflow(traffic_class, 0);
+        if (policy == LORA_OVERFLOW_REJECT) {
+            return 1;
+        }
+        if (policy == LORA_OVERFLOW_DROP_OLDEST && xQueueReceive(queue, &oldest, 0) == pdPASS) {
+            packet_pool_free(oldest.packet);
+        }
+        // another producer may take the freed slot first
+        if (policy == LORA_OVERFLOW_DROP_NEWEST || xQueueSend(queue, &entry, 0) != pdPASS) {
+            packet_pool_free(packet);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint8_t lora_rx_enqueue(LoRa_Packet* packet, LoRa_Overflow_Policy policy) {
+    LoRa_Packet* oldest;
+    if (xQueueSend(packet_rx_queue, &packet, 0) == pdPASS) {
+        return 0;
+    }
+    lora_record_overflow(lora_traffic_class(packet), 1);
+    if (policy == LORA_OVERFLOW_REJECT) {
+        return 1;
+    }
+    if (policy == LORA_OVERFLOW_DROP_OLDEST && xQueueReceive(packet_rx_queue, &oldest, 0) == pdPASS) {
+        packet_pool_free(oldest);
+    }
+    if (policy == LORA_OVERFLOW_DROP_NEWEST || xQueueSend(packet_rx_queue, &packet, 0) != pdPASS) {
+        packet_pool_free(packet);
+        return 1;
+    }
+    return 0;
+}
+
+LoRa_Packet* lora_tx_dequeue() {
+    LoRa_TX_Entry entry;
+    while (xQueueReceive(lora_tx_link_queue, &entry, 0) == pdPASS) {
+        if (!lora_frame_expired(entry.packet)) {
+            lora_record_wait(LORA_CLASS_LINK, entry.queued_at);
+            return entry.packet;
+        }
+        lora_drop_expired(LORA_CLASS_LINK, entry.packet);
+    }
+    while (xQueueReceive(lora_tx_queue, &entry, 0) == pdPASS) {
+        if (!lora_frame_expired(entry.packet)) {
+            lora_record_wait(LORA_CLASS_BULK, entry.queued_at);
+            return entry.packet;
+        }
+        lora_drop_expired(LORA_CLASS_BULK, entry.packet);
+    }
+    return NULL;
+}
+
+uint8_t lora_tx_pending() {
+    return uxQueueMessagesWaiting(lora_tx_link_queue) != 0 || uxQueueMessagesWaiting(lora_tx_queue) != 0;
+}
+
+uint32_t lora_tx_time_us(uint8_t frames) {
+    taskENTER_CRITICAL(&lora_superframe_lock);
+    int64_t interval = lora_reply_interval_us;
+    taskEXIT_CRITICAL(&lora_superframe_lock);
+    if (interval == 0) {
+        interval = (int64_t) LORA_REPLY_EVERY * lora_superframe_max_us;
+    }
+    // one interval more for the slot of the report
+    int64_t time = (frames + 1) * interval;
+    return time < UINT32_MAX ? (uint32_t) time : UINT32_MAX;
+}
+
+void lora_get_class_stats(LoRa_Class_Stats* stats) {
+    taskENTER_CRITICAL(&lora_stats_lock);
+    memcpy(stats, lora_class_stats, sizeof(lora_class_stats));
+    taskEXIT_CRITICAL(&lora_stats_lock);
+}
+
+LoRa_Packet* lora_coalesce(LoRa_Packet* packet) {
+    if (!lora_codec_can_batch(packet)) {
+        return packet;
+    }
+    LoRa_Traffic_Class traffic_class = lora_traffic_class(packet);
+    QueueHandle_t queue = traffic_class == LORA_CLASS_LINK ? lora_tx_link_queue : lora_tx_queue;
+    LoRa_Packet* batch = NULL;
+    LoRa_TX_Entry next;
+    while (1) {
+        // a higher class is never held back by a longer frame
+        if (traffic_class == LORA_CLASS_BULK && uxQueueMessagesWaiting(lora_tx_link_queue) != 0) {
+            break;
+        }
+        // taken rather than peeked, a producer dropping the oldest frame may consume the queue too
+        if (xQueueReceive(queue, &next, 0) != pdPASS) {
+            break;
+        }
+        if (lora_frame_expired(next.packet)) {
+            lora_drop_expired(traffic_class, next.packet);
+            continue;
+        }
+        if (next.packet->header.dest_device_addr != packet->header.dest_device_addr ||
+            !lora_codec_can_batch(next.packet)) {
+            lora_tx_requeue(queue, traffic_class, &next);
+            break;
+        }
+        if (batch == NULL) {
+            batch = packet_pool_alloc(0);
+            if (batch == NULL) {
+                lora_tx_requeue(queue, traffic_class, &next);
+                break;
             }
+            lora_codec_batch_init(packet->header.src_device_addr, packet->header.dest_device_addr, batch);
+            lora_codec_batch_append(batch, packet);
+        }
+        if (lora_codec_batch_append(batch, next.packet) != 0) {
+            lora_tx_requeue(queue, traffic_class, &next);
+            break;
+        }
+        lora_record_wait(traffic_class, next.queued_at);
+        packet_pool_free(next.packet);
+    }
+    if (batch == NULL) {
+        return packet;
+    }
+    packet_pool_free(packet);
+    return batch;
+}
+
+void lora_demux_batch(LoRa_Packet* batch) {
+    uint8_t offset = 0;
+    LoRa_Packet* packet = packet_pool_alloc(0);
+    while (packet != NULL && lora_codec_batch_next(batch, &offset, packet) == 0) {
+        if (lora_rx_enqueue(packet, LORA_OVERFLOW_REJECT) != 0) {
+            break;
         }
+        packet = packet_pool_alloc(0);
     }
+    if (offset < batch->header.payload_size) {
+        ESP_LOGW(TAG, "Batch frame cut short at %d of %d bytes", offset, batch->header.payload_size);
+    }
+    // spare buffer, or the record that didn't fit the queue
+    packet_pool_free(packet);
+    packet_pool_free(batch);
 }
 
+void lora_async_callback(sx127x *device, int code, void *arg) {
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "async request failed %d", code);
+    }
+}
 
-// Sends packet
+void lora_tx_loaded_callback(sx127x *device, int code, void *arg) {
+    LoRa_TX_Frame* frame = (LoRa_TX_Frame*) arg;
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't load frame %d", code);
+    } else {
+        ESP_LOGD(TAG, "Frame loaded in %lld us", esp_timer_get_time() - frame->load_start);
+    }
+    packet_pool_free(frame->packet);
+    frame->packet = NULL;
+    xSemaphoreGive(lora_tx_frame_semaphore);
+}
+
+// Sends packet. Takes ownership of the pool buffer, it is released once the frame is in the FIFO
+// Returns 0 if the frame was queued for transmission, 1 if it was dropped
+// The frame is encoded while the previous one is still being loaded, the FIFO load and the switch to tx are
+// queued on the async worker as one request
 uint8_t lora_send_packet(sx127x *lora_dev, LoRa_Packet* packet){
-    uint8_t data[255];
-    memset(&data[0], packet->header.src_device_addr, sizeof(uint8_t));
-    memset(&data[1], packet->header.dest_device_addr, sizeof(uint8_t));
-    memset(&data[2], packet->header.num_of_packets, sizeof(uint8_t));
-    memset(&data[3], packet->header.packet_num, sizeof(uint8_t));
-    memset(&data[4], packet->header.payload_size, sizeof(uint8_t));
-    memset(&data[5], packet->header.header_crc >> 8, sizeof(uint8_t));
-    memset(&data[6], packet->header.header_crc & 0xFF, sizeof(uint8_t));
-    memset(&data[7], packet->payload.payload_crc >> 8, sizeof(uint8_t));
-    memset(&data[8], packet->payload.payload_crc & 0xFF, sizeof(uint8_t));
-    memcpy(&data[9], packet->payload.payload, packet->header.payload_size);
-    spi_device_acquire_bus(lora_spi_device, portMAX_DELAY);
-    ESP_ERROR_CHECK(sx127x_set_for_transmission(data, packet->header.payload_size + sizeof(LoRa_Packet_Header) - 1 + sizeof(uint16_t), lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_TX, lora_dev));
-    spi_device_release_bus(lora_spi_device);
+    xSemaphoreTake(lora_tx_frame_semaphore, portMAX_DELAY);
+    LoRa_TX_Frame* frame = &lora_tx_frames[lora_tx_frame_index];
+    lora_tx_frame_index = (lora_tx_frame_index + 1) % LORA_TX_FRAME_BUFFERS;
+    // every frame on air gets the next number, a resent fragment is a new frame
+    packet->header.sequence = lora_peers[packet->header.dest_device_addr].tx_sequence++;
+    // only the header is serialized, header and payload go out in the same FIFO burst
+    lora_codec_encode_segments(packet, frame->header, frame->segments);
+    frame->packet = packet;
+    frame->load_start = esp_timer_get_time();
+    int code = sx127x_async_transmit_segments(frame->segments, LORA_PACKET_WIRE_SEGMENTS, lora_async, lora_tx_loaded_callback, frame);
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't queue frame %d, dropped", code);
+        packet_pool_free(packet);
+        frame->packet = NULL;
+        xSemaphoreGive(lora_tx_frame_semaphore);
+        return 1;
+    }
     ESP_LOGI(TAG, "Sent packet...");
     return 0;
 }
 
 void network_packet_processor_task(void* pvParameters){
     Network_Device_Container* dev_ctnr = (Network_Device_Container*) pvParameters;
-    LoRa_Packet packet;
+    LoRa_Packet* packet;
     Network_Device_Context* device_ctx;
+    Reassembly_Message* message;
     // TODO: implement required security features later...
     while (1) {
-        if( xQueueReceive(packet_rx_queue, &packet, portMAX_DELAY) == pdPASS ) {
-            device_ctx = get_device_from_arp(dev_ctnr, packet.header.src_device_addr);
-            if (device_ctx == NULL) {
-                continue;
+        // woken at least every ARQ_REPORT_TIMEOUT_MS, lost reports and unfinished messages time out without traffic
+        if( xQueueReceive(packet_rx_queue, &packet, pdMS_TO_TICKS(ARQ_REPORT_TIMEOUT_MS)) != pdPASS ) {
+            if (reassembly_expire(&network_reassembly, esp_timer_get_time()) > 0) {
+                ESP_LOGW(TAG, "Incomplete message dropped");
             }
+            network_check_arq_timeouts(dev_ctnr);
+            continue;
+        }
+        device_ctx = get_device_from_arp(dev_ctnr, packet->header.src_device_addr);
+        if (device_ctx == NULL || packet->header.dest_device_addr != LORA_SELF_ADDRESS) {
+            packet_pool_free(packet);
+            continue;
+        }
+        if (packet->header.message_type == LORA_MESSAGE_NACK) {
+            network_receive_nack(device_ctx, packet);
+            packet_pool_free(packet);
+            continue;
+        }
 
+        Reassembly_Status status;
+        if (packet->header.message_type == LORA_MESSAGE_PARITY) {
+            status = reassembly_add_parity(&network_reassembly, packet->header.src_device_addr,
+                                           packet->header.message_id, packet->header.num_of_packets,
+                                           packet->header.packet_num, packet->header.last_payload_size,
+                                           packet->payload.payload, packet->header.payload_size,
+                                           esp_timer_get_time(), &message);
+        } else {
+            status = reassembly_add(&network_reassembly, packet->header.src_device_addr,
+                                    packet->header.message_id, packet->header.num_of_packets,
+                                    packet->header.packet_num, packet->payload.payload,
+                                    packet->header.payload_size, esp_timer_get_time(), &message);
+        }
+        switch (status) {
+            case REASSEMBLY_COMPLETE:
+                network_deliver_message(device_ctx, message);
+                break;
+            case REASSEMBLY_STORED:
+            case REASSEMBLY_DUPLICATE:
+                break;
+            default:
+                ESP_LOGW(TAG, "Fragment %d/%d of message %d from %#X dropped (%d)", packet->header.packet_num,
+                         packet->header.num_of_packets, packet->header.message_id, packet->header.src_device_addr, status);
+                break;
+        }
+        if (packet->header.poll && (status == REASSEMBLY_COMPLETE || status == REASSEMBLY_STORED ||
+                                    status == REASSEMBLY_DUPLICATE)) {
+            // an empty bitmap acknowledges a delivered message, late polls included
+            network_send_nack(packet->header.src_device_addr, packet->header.message_id, reassembly_missing(message));
+        }
+        packet_pool_free(packet);
+        network_check_arq_timeouts(dev_ctnr);
+    }
+}
 
-            // not safe yet!
-            if (packet.header.packet_num == 0) {
-                if (device_ctx->packet_rx_buff != NULL) {
-                    free(device_ctx->packet_rx_buff);
-                }
-
-                device_ctx->packet_rx_buff = (LoRa_Packet*) malloc(packet.header.num_of_packets * sizeof(LoRa_Packet));
-                device_ctx->packet_rx_buff[0] = packet;
-            } else {
-                device_ctx->packet_rx_buff[packet.header.packet_num] = packet;
-            }
+void network_receive_nack(Network_Device_Context* device_ctx, LoRa_Packet* packet) {
+    uint8_t message_id;
+    uint64_t missing;
+    if (lora_codec_decode_nack(packet, &message_id, &missing) != 0) {
+        return;
+    }
+    taskENTER_CRITICAL(&network_arq_lock);
+    Arq_Status status = arq_report(&device_ctx->arq, message_id, missing);
+    taskEXIT_CRITICAL(&network_arq_lock);
+    network_handle_arq_status(device_ctx, status);
+}
 
-            if (packet.header.packet_num == packet.header.num_of_packets - 1) {
-                xQueueSend(device_queue, &packet.header.src_device_addr, portMAX_DELAY);
-            }
+void network_check_arq_timeouts(Network_Device_Container* dev_ctnr) {
+    int64_t now = esp_timer_get_time();
+    for (uint16_t addr = network_next_device(dev_ctnr, 0); addr < NETWORK_DEVICE_TABLE_SIZE;
+         addr = network_next_device(dev_ctnr, addr + 1)) {
+        Network_Device_Context* device_ctx = dev_ctnr->device_contexts[addr];
+        taskENTER_CRITICAL(&network_arq_lock);
+        uint8_t waiting = device_ctx->arq.status == ARQ_WAITING;
+        Arq_Status status = arq_check_timeout(&device_ctx->arq, now);
+        taskEXIT_CRITICAL(&network_arq_lock);
+        if (waiting && status != ARQ_WAITING) {
+            network_handle_arq_status(device_ctx, status);
         }
     }
 }
 
+void network_deliver_message(Network_Device_Context* device_ctx, Reassembly_Message* message) {
+    // if device is online decryption is needed so message goes into the rx_secret_message buffer
+    if (device_ctx->status == ONLINE) {
+        network_free_device_rx_secret_message(device_ctx);
+        device_ctx->rx_secret_message = reassembly_take(message, &device_ctx->rx_secret_message_size);
+    } else {
+        network_free_device_rx_message(device_ctx);
+        device_ctx->rx_message = reassembly_take(message, &device_ctx->rx_message_size);
+    }
+    xQueueOverwrite(device_queue, &device_ctx->address);
+}
+
 
 void network_device_processor_task(void* pvParameters){
     Network_Device_Container* dev_ctnr = (Network_Device_Container*) pvParameters;
     uint8_t dev_addr;
     Network_Device_Context* device_ctx;
-    RTLG_Status prev_state_of_RTLG_status = EXTRACTED;
 
     while (1) {
-        if( xQueueReceive(device_queue, &dev_addr, 200) == pdPASS ) {
+        if( xQueueReceive(device_queue, &dev_addr, portMAX_DELAY) == pdPASS ) {
             device_ctx = get_device_from_arp(dev_ctnr, dev_addr);
             if (device_ctx == NULL) {
                 ESP_LOGE(TAG, "device with address %#X does not exist in ARP.", dev_addr);
                 continue;
             }
 
-            construct_message_from_packets(device_ctx);
+            // setpoints arrive as control frames, this path only handles network messages
+            ESP_LOGD(TAG, "Message of %d bytes received from %#X", device_ctx->status == ONLINE ?
+                     device_ctx->rx_secret_message_size : device_ctx->rx_message_size, dev_addr);
+        }
+    }
+}
 
-//            printf("\n\nalerion percentage: %d\nelevator percentage: %d\nrudder percentage: %d\nmotor percentage: %d\nRTLG staus: %d\n\n",
-//                   (int8_t)device_ctx->rx_secret_message[0],
-//                   (int8_t)device_ctx->rx_secret_message[1],
-//                   (int8_t)device_ctx->rx_secret_message[2],
-//                   device_ctx->rx_secret_message[3],
-//                   device_ctx->rx_secret_message[4]
-//                   );
+void network_receive_control_frame(const uint8_t* frame, uint8_t frame_length) {
+    Network_Control_Entry entry;
+    if (control_frame_queue == NULL) {
+        // network is not initialized yet
+        return;
+    }
+    if (lora_codec_decode(&control_rx_packet, frame, frame_length) != 0 ||
+        control_rx_packet.header.dest_device_addr != LORA_SELF_ADDRESS ||
+        lora_codec_decode_control(&control_rx_packet, &entry.control) != 0) {
+        ESP_LOGD(TAG, "Invalid control frame dropped");
+        return;
+    }
+    // a setpoint older than the last one would move the servos back
+    if (!lora_accept_sequence(&control_rx_packet, 1)) {
+        return;
+    }
+    lora_link_record(&control_rx_packet);
+    entry.expires_at = esp_timer_get_time() + LORA_CONTROL_EXPIRY_MS * 1000;
+    xQueueOverwrite(control_frame_queue, &entry);
+}
+
+void network_control_task(void* pvParameters){
+    Network_Control_Entry entry;
+    LoRa_Control_Frame control;
+    RTLG_Status prev_state_of_RTLG_status = EXTRACTED;
 
-            servo_set_ailerons_servo_by_joystick_percentage((int8_t) device_ctx->rx_secret_message[0]);
-            servo_set_elevator_servo_by_joystick_percentage((int8_t) device_ctx->rx_secret_message[1]);
-            servo_set_rudder_servo_by_joystick_percentage((int8_t) device_ctx->rx_secret_message[2]);
-            motor_set_motor_speed(motor_get_duty_value_from_percentage(device_ctx->rx_secret_message[3]));
+    while (1) {
+        if( xQueueReceive(control_frame_queue, &entry, 200) == pdPASS ) {
+            if (esp_timer_get_time() >= entry.expires_at) {
+                // the servos keep the previous setpoint, a newer one is on its way
+                taskENTER_CRITICAL(&lora_stats_lock);
+                lora_class_stats[LORA_CLASS_CONTROL].rx_expired++;
+                taskEXIT_CRITICAL(&lora_stats_lock);
+                continue;
+            }
+            control = entry.control;
+            servo_set_ailerons_servo_by_joystick_percentage(control.aileron);
+            servo_set_elevator_servo_by_joystick_percentage(control.elevator);
+            servo_set_rudder_servo_by_joystick_percentage(control.rudder);
+            motor_set_motor_speed(motor_get_duty_value_from_percentage(control.throttle));
             if (xSemaphoreTake(RTLG_status_mutex, portMAX_DELAY) == pdPASS) {
-                if (device_ctx->rx_secret_message[4] != prev_state_of_RTLG_status) {
-                    prev_state_of_RTLG_status = device_ctx->rx_secret_message[4];
-                    RTLG_status = device_ctx->rx_secret_message[4];
-                    servo_set_RTLG_status(device_ctx->rx_secret_message[4]);
+                if (control.landing_gear != prev_state_of_RTLG_status) {
+                    prev_state_of_RTLG_status = control.landing_gear;
+                    RTLG_status = control.landing_gear;
+                    servo_set_RTLG_status(control.landing_gear);
                 }
                 xSemaphoreGive(RTLG_status_mutex);
             }
@@ -407,68 +1339,6 @@ void network_device_processor_task(void* pvParameters){
     }
 }
 
-void network_packet_rx_handler_task(void* pvParameters){
-    Network_Device_Container* dev_cntr = (Network_Device_Container*) pvParameters;
-    LoRa_Packet received_packet;
-    Network_Device_Context* packet_device_ctx;
-
-    while (1) {
-        if( xQueueReceive(packet_rx_queue, &received_packet, portMAX_DELAY) == pdPASS ) {
-            // check if the packet was addressed to this device
-            if (received_packet.header.dest_device_addr != LORA_BASE_STATION_ADDR) {
-                continue;
-            }
-
-            display_packet(&received_packet);
-
-            // check if device is in ARP, if not add a new device with status OFFLINE, start copy packet to its rx buff
-            // only if this is the first packet of the device, else throw out packet
-            if (!network_is_device_in_arp(dev_cntr, received_packet.header.src_device_addr) &&
-                received_packet.header.packet_num == 0)
-            {
-                network_add_device(dev_cntr, received_packet.header.src_device_addr);
-            } else if (!network_is_device_in_arp(dev_cntr, received_packet.header.src_device_addr) &&
-                       received_packet.header.packet_num != 0)
-            {
-                continue;
-                // TODO: send back some type of error message
-            }
-
-            packet_device_ctx = get_device_from_arp(dev_cntr, received_packet.header.src_device_addr);
-
-            // checking the packet indexing
-            if (received_packet.header.packet_num > received_packet.header.num_of_packets - 1) {
-                continue;
-                // TODO: send back error
-            }
-
-            // the procedure is different when the station is waiting for corrected devices
-            if (packet_device_ctx->connection_status == WAITING_FOR_PACKET_CORRECTION) {
-                packet_device_ctx->packet_rx_buff[received_packet.header.packet_num] = received_packet;
-
-                // last corrected packet
-                if (received_packet.header.packet_num == packet_device_ctx->packet_num_of_faulty_packets[packet_device_ctx->num_of_faulty_packets - 1]) {
-                    // TODO: pass device to the device processor
-                }
-            } else {
-                if (received_packet.header.packet_num == 0) {
-                    network_free_device_network_rx_buff(packet_device_ctx);
-                    packet_device_ctx->packet_rx_buff = (LoRa_Packet*) malloc(received_packet.header.num_of_packets * sizeof(LoRa_Packet));
-                }
-
-                packet_device_ctx->packet_rx_buff[received_packet.header.packet_num] = received_packet;
-
-                if (received_packet.header.packet_num == received_packet.header.num_of_packets - 1){
-                    // TODO: pass device to device processor
-                }
-            }
-        }
-    }
-}
-
-
-
-
 network_operation_t network_add_device(Network_Device_Container* device_cont, uint8_t dev_addr)
 {
     Network_Device_Context new_device;
@@ -484,29 +1354,45 @@ network_operation_t network_add_device(Network_Device_Container* device_cont, ui
     new_device.tx_message_size = 0;
     new_device.rx_message = NULL;
     new_device.rx_message_size = 0;
-    new_device.packet_rx_buff = NULL;
     new_device.packet_tx_buff = NULL;
+    new_device.tx_message_id = 0;
+    new_device.arq.status = ARQ_IDLE;
+    new_device.tx_parity = NETWORK_FEC_PARITY;
+    new_device.packet_tx_num_of_parity = 0;
     new_device.packet_num_of_faulty_packets = NULL;
     new_device.num_of_faulty_packets = 0;
 
-    if (device_cont->num_of_devices == 0) {
-        device_cont->num_of_devices++;
-        device_cont->device_contexts = (Network_Device_Context*) malloc(sizeof(Network_Device_Context));
-
-    } else {
-        device_cont->num_of_devices++;
-        device_cont->device_contexts = (Network_Device_Context*) realloc(device_cont->device_contexts, device_cont->num_of_devices * sizeof(Network_Device_Context));
+    if (device_cont->device_contexts[dev_addr] != NULL) {
+        return NETWORK_OK;
     }
-
-    if (device_cont->device_contexts == NULL) {
+    Network_Device_Context* device_ctx = (Network_Device_Context*) malloc(sizeof(Network_Device_Context));
+    if (device_ctx == NULL) {
         return NETWORK_OUT_OF_MEMORY;
     }
+    *device_ctx = new_device;
 
-    device_cont->device_contexts[device_cont->num_of_devices - 1] = new_device;
+    // the context is complete before its slot is visible
+    taskENTER_CRITICAL(&network_device_lock);
+    device_cont->device_contexts[dev_addr] = device_ctx;
+    device_cont->occupied[dev_addr / 32] |= (uint32_t) 1 << (dev_addr % 32);
+    device_cont->num_of_devices++;
+    taskEXIT_CRITICAL(&network_device_lock);
 
     return NETWORK_OK;
 }
 
+uint16_t network_next_device(const Network_Device_Container* device_cont, uint16_t from) {
+    while (from < NETWORK_DEVICE_TABLE_SIZE) {
+        // registered addresses from from on in its word
+        uint32_t word = device_cont->occupied[from / 32] & (UINT32_MAX << (from % 32));
+        if (word != 0) {
+            return (from & ~31) + __builtin_ctz(word);
+        }
+        from = (from & ~31) + 32;
+    }
+    return NETWORK_DEVICE_TABLE_SIZE;
+}
+
 uint8_t check_packet_crc(LoRa_Packet* packet){
     uint16_t header_crc;
     uint16_t payload_crc;
@@ -522,80 +1408,6 @@ uint8_t check_packet_crc(LoRa_Packet* packet){
 }
 
 
-uint8_t construct_message_from_packets(Network_Device_Context* device_ctx){
-    // TODO: construct package only into rx_message, same when deconstructing
-    if (device_ctx->packet_rx_buff == NULL) {
-        ESP_LOGE(TAG, "Network rx buffer empty");
-        return NETWORK_BUFFER_EMPTY_ERROR;
-    }
-
-    // free both message rx buffers
-    if (device_ctx->rx_secret_message != NULL) {
-        free(device_ctx->rx_secret_message);
-        device_ctx->rx_secret_message = NULL; // for safety
-        device_ctx->rx_secret_message_size = 0;
-    }
-
-    if (device_ctx->rx_message != NULL) {
-        free(device_ctx->rx_message);
-        device_ctx->rx_message = NULL; // for safety
-        device_ctx->rx_message_size = 0;
-    }
-
-    // if device is online decryption is needed so message gets copied into
-    // the rx_secret_message buffer
-    if (device_ctx->status == ONLINE){
-        // calculate message length
-        for (uint8_t i = 0; i < device_ctx->packet_rx_buff[0].header.num_of_packets; i++) {
-            device_ctx->rx_secret_message_size += device_ctx->packet_rx_buff->header.payload_size;
-        }
-
-
-
-        device_ctx->rx_secret_message = (uint8_t*) malloc(device_ctx->rx_secret_message_size * sizeof(uint8_t));
-
-        // test it thoroughly!
-        uint8_t rx_secret_message_buff_index = 0;
-        for (uint8_t i = 0; i < device_ctx->packet_rx_buff[0].header.num_of_packets; i++) {
-            memcpy(&device_ctx->rx_secret_message[rx_secret_message_buff_index],
-                   device_ctx->packet_rx_buff[i].payload.payload,
-                   device_ctx->packet_rx_buff[i].header.payload_size);
-
-            rx_secret_message_buff_index += (LORA_PAYLOAD_MAX_SIZE + 1);
-        }
-
-
-
-    } else { // message gets copied into rx_message buffer
-        for (uint8_t i = 0; i < device_ctx->packet_rx_buff[0].header.num_of_packets; i++) {
-            device_ctx->rx_message_size += device_ctx->packet_rx_buff->header.payload_size;
-        }
-
-        device_ctx->rx_message = (uint8_t*) malloc(device_ctx->rx_message_size * sizeof(uint8_t));
-
-        // test it thoroughly!
-        uint8_t rx_secret_message_buff_index = 0;
-        for (uint8_t i = 0; i < device_ctx->packet_rx_buff[0].header.num_of_packets; i++) {
-            memcpy(&device_ctx->rx_message[rx_secret_message_buff_index],
-                   device_ctx->packet_rx_buff[i].payload.payload,
-                   device_ctx->packet_rx_buff[i].header.payload_size);
-
-            rx_secret_message_buff_index += (LORA_PAYLOAD_MAX_SIZE);
-        }
-    }
-
-
-    if (device_ctx->packet_rx_buff != NULL) {
-        free(device_ctx->packet_rx_buff);
-        device_ctx->packet_rx_buff = NULL;
-    }
-
-    ESP_LOGI(TAG, "Secret message size: %d", device_ctx->rx_secret_message_size);
-
-    return NETWORK_OK;
-}
-
-
 uint8_t deconstruct_message_into_packets(Network_Device_Context *device_ctx) {
     if (device_ctx->packet_tx_buff != NULL) {
         free(device_ctx->packet_tx_buff);
@@ -615,11 +1427,14 @@ uint8_t deconstruct_message_into_packets(Network_Device_Context *device_ctx) {
 
         // test thoroughly!!
         for (uint8_t i = 0; i < num_of_packets; i++) {
+            device_ctx->packet_tx_buff[i].header.message_type = LORA_MESSAGE_DATA;
             device_ctx->packet_tx_buff[i].header.num_of_packets = num_of_packets;
             device_ctx->packet_tx_buff[i].header.payload_size = (i == (num_of_packets - 1)) ? last_packet_payload_size : LORA_PAYLOAD_MAX_SIZE;
             device_ctx->packet_tx_buff[i].header.dest_device_addr = device_ctx->address;
-            device_ctx->packet_tx_buff[i].header.src_device_addr = LORA_BASE_STATION_ADDR;
+            device_ctx->packet_tx_buff[i].header.src_device_addr = LORA_SELF_ADDRESS;
             device_ctx->packet_tx_buff[i].header.packet_num = i;
+            device_ctx->packet_tx_buff[i].header.message_id = device_ctx->tx_message_id;
+            device_ctx->packet_tx_buff[i].header.poll = 0;
             if (i == num_of_packets - 1) { // last packet
                 memcpy(device_ctx->packet_tx_buff[i].payload.payload, &device_ctx->tx_secret_message[i * LORA_PAYLOAD_MAX_SIZE], last_packet_payload_size);
             } else {
@@ -641,11 +1456,14 @@ uint8_t deconstruct_message_into_packets(Network_Device_Context *device_ctx) {
         }
 
         for (uint8_t i = 0; i < num_of_packets; i++) {
+            device_ctx->packet_tx_buff[i].header.message_type = LORA_MESSAGE_DATA;
             device_ctx->packet_tx_buff[i].header.num_of_packets = num_of_packets;
             device_ctx->packet_tx_buff[i].header.payload_size = i == num_of_packets - 1 ? last_packet_payload_size : LORA_PAYLOAD_MAX_SIZE;
             device_ctx->packet_tx_buff[i].header.dest_device_addr = device_ctx->address;
-            device_ctx->packet_tx_buff[i].header.src_device_addr = LORA_BASE_STATION_ADDR;
+            device_ctx->packet_tx_buff[i].header.src_device_addr = LORA_SELF_ADDRESS;
             device_ctx->packet_tx_buff[i].header.packet_num = i;
+            device_ctx->packet_tx_buff[i].header.message_id = device_ctx->tx_message_id;
+            device_ctx->packet_tx_buff[i].header.poll = 0;
             if (i == num_of_packets - 1) {
                 memcpy(device_ctx->packet_tx_buff[i].payload.payload, &device_ctx->tx_message[i * LORA_PAYLOAD_MAX_SIZE], last_packet_payload_size);
             } else {
@@ -656,20 +1474,22 @@ uint8_t deconstruct_message_into_packets(Network_Device_Context *device_ctx) {
             device_ctx->packet_tx_buff[i].payload.payload_crc = lora_calc_packet_crc(&device_ctx->packet_tx_buff[i].payload, device_ctx->packet_tx_buff[i].header.payload_size);
         }
     }
+    network_append_parity(device_ctx);
+    // packets resent from packet_tx_buff keep this id, the receiver only stores the fragments it is missing
+    device_ctx->tx_message_id++;
     return NETWORK_OK;
 }
 
-void set_packets_for_tx(Network_Device_Context* device_ctx, QueueHandle_t* lora_tx_queue_ptr) {
+void set_packets_for_tx(Network_Device_Context* device_ctx) {
     if (device_ctx->packet_tx_buff == NULL) {
         return;
     }
 
-    for (uint8_t i = 0; i < device_ctx->packet_tx_buff->header.num_of_packets; i++) {
-        //display_packet(&device_ctx->packet_tx_buff[i]);
-        if (xQueueSend(*lora_tx_queue_ptr, &device_ctx->packet_tx_buff[i], portMAX_DELAY) != pdPASS) {
-            ESP_LOGE("packet setup", "Could not send packet to queue");
-        }
-    }
+    // rounds are copied out of packet_tx_buff into pool buffers, it stays cached for the resends
+    taskENTER_CRITICAL(&network_arq_lock);
+    arq_start(&device_ctx->arq, device_ctx->packet_tx_buff->header.message_id, device_ctx->packet_tx_buff->header.num_of_packets);
+    taskEXIT_CRITICAL(&network_arq_lock);
+    network_send_round(device_ctx);
 }
 
 void network_encrypt_device_message(Network_Device_Context* device_ctx){
@@ -726,29 +1546,15 @@ network_operation_t network_decrypt_device_message(Network_Device_Context* devic
 
 
 uint8_t network_parse_byte_array_into_packet(LoRa_Packet* packet, uint8_t* byte_arr, uint16_t arr_size){
-    // size needs to be at least 9 bytes (header + payload crc)
-    if (arr_size < sizeof(LoRa_Packet_Header) + 2) {
+    // a LoRa frame is at most 255 bytes, anything longer is not a frame
+    if (arr_size > UINT8_MAX) {
         return 1;
     }
-
-    // copy header
-    memcpy(&packet->header, byte_arr, sizeof(LoRa_Packet_Header));
-
-    //copy payload
-    memcpy(&packet->payload.payload, &byte_arr[sizeof(LoRa_Packet_Header)], packet->header.payload_size);
-    // copy payload crc
-    memcpy(&packet->payload.payload_crc, &byte_arr[arr_size - 2], sizeof(uint16_t));
-
-    return 0;
+    return lora_codec_decode(packet, byte_arr, arr_size);
 }
 
-void network_parse_packet_into_byte_array(LoRa_Packet* packet, uint8_t* byte_arr){
-    // copy header
-    memcpy(byte_arr, &packet->header, sizeof(LoRa_Packet_Header));
-    // copy payload
-    memcpy(&byte_arr[sizeof(LoRa_Packet_Header)], &packet->payload.payload, packet->header.payload_size);
-    // copy payload crc
-    memcpy(&byte_arr[sizeof(LoRa_Packet_Header) + packet->header.payload_size], &packet->payload.payload_crc, sizeof(uint16_t));
+uint8_t network_parse_packet_into_byte_array(LoRa_Packet* packet, uint8_t* byte_arr){
+    return lora_codec_encode(packet, byte_arr);
 }
 
 
@@ -787,9 +1593,10 @@ void network_free_device_ctx(Network_Device_Context* device_ctx) {
         device_ctx->packet_tx_buff = NULL;
     }
 
-    if (device_ctx->packet_rx_buff != NULL) {
-        free(device_ctx->packet_rx_buff);
-        device_ctx->packet_rx_buff = NULL;
+    if (device_ctx->packet_num_of_faulty_packets != NULL) {
+        free(device_ctx->packet_num_of_faulty_packets);
+        device_ctx->packet_num_of_faulty_packets = NULL;
+        device_ctx->num_of_faulty_packets = 0;
     }
 }
 
@@ -839,13 +1646,6 @@ void network_free_device_rx_message(Network_Device_Context* device_ctx) {
 }
 
 
-void network_free_device_network_rx_buff(Network_Device_Context* device_ctx) {
-    if (device_ctx->packet_rx_buff != NULL) {
-        free(device_ctx->packet_rx_buff);
-        device_ctx->packet_rx_buff = NULL;
-    }
-}
-
 void network_free_device_network_tx_buff(Network_Device_Context* device_ctx) {
     if (device_ctx->packet_tx_buff != NULL) {
         free(device_ctx->packet_tx_buff);
@@ -0,0 +1,49 @@
+#include "packet_pool.h"
+#include <esp_attr.h>
+
+static const char TAG[] = "PacketPool";
+
+// word aligned like the payload inside each packet, so it can be sent by DMA without a bounce buffer
+static WORD_ALIGNED_ATTR LoRa_Packet packet_pool_slab[PACKET_POOL_SIZE];
+// free list, holds pointers into the slab
+static QueueHandle_t packet_pool_free_list;
+
+void packet_pool_init() {
+    packet_pool_free_list = xQueueCreate(PACKET_POOL_SIZE, sizeof(LoRa_Packet*));
+    for (uint8_t i = 0; i < PACKET_POOL_SIZE; i++) {
+        LoRa_Packet* packet = &packet_pool_slab[i];
+        xQueueSend(packet_pool_free_list, &packet, 0);
+    }
+}
+
+LoRa_Packet* packet_pool_alloc(TickType_t ticks_to_wait) {
+    LoRa_Packet* packet;
+    if (xQueueReceive(packet_pool_free_list, &packet, ticks_to_wait) != pdPASS) {
+        ESP_LOGW(TAG, "Packet pool exhausted");
+        return NULL;
+    }
+    packet->expires_at = 0;
+    return packet;
+}
+
+void packet_pool_free(LoRa_Packet* packet) {
+    if (packet == NULL) {
+        return;
+    }
+    if (packet < &packet_pool_slab[0] || packet >= &packet_pool_slab[PACKET_POOL_SIZE]) {
+        ESP_LOGE(TAG, "Packet does not belong to the pool");
+        return;
+    }
+    // can't fail, the free list has room for every buffer of the slab
+    xQueueSend(packet_pool_free_list, &packet, 0);
+}
+
+void packet_pool_copy(LoRa_Packet* dst, const LoRa_Packet* src) {
+    dst->header = src->header;
+    memcpy(dst->payload.payload, src->payload.payload, src->header.payload_size);
+    dst->payload.payload_crc = src->payload.payload_crc;
+}
+
+uint8_t packet_pool_available() {
+    return uxQueueMessagesWaiting(packet_pool_free_list);
+}
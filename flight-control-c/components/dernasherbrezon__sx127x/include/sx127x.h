@@ -5,6 +5,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define MAX_PACKET_SIZE 256
@@ -158,15 +159,44 @@ typedef enum {
   SX127x_PA_PIN_BOOST = 0b10000000  // PA_BOOST pin. Output power is limited to +20 dBm
 } sx127x_pa_pin_t;
 
+/**
+ * @brief Complete modem configuration. Applied with sx127x_apply_profile.
+ *
+ */
+typedef struct {
+  uint64_t frequency;                         // Frequency in hz
+  sx127x_bw_t bandwidth;                      // Signal bandwidth
+  sx127x_sf_t spreading_factor;               // SF rate. SF6 requires implicit header
+  sx127x_cr_t coding_rate;                    // Coding rate in explicit header mode
+  sx127x_crc_payload_t crc;                   // Payload CRC in explicit header mode
+  sx127x_implicit_header_t *implicit_header;  // If NULL, then explicit header. Otherwise length, crc and coding rate are taken from here. Must stay valid while the profile is active.
+  uint8_t syncword;                           // Syncword. 0x34 is reserved for LoRaWAN networks.
+  uint16_t preamble_length;                   // Preamble length
+  sx127x_pa_pin_t pa_pin;                     // TX pin. RFO or PA_BOOST.
+  int power;                                  // Output power in dbm. See sx127x_set_pa_config for valid ranges.
+  sx127x_dio_mapping1_t dio_mapping1;         // Mapping of DIO0-DIO3
+  sx127x_dio_mapping2_t dio_mapping2;         // Mapping of DIO4-DIO5
+} sx127x_modem_profile_t;
+
 /**
  * @brief Device handle
  *
  */
 typedef struct sx127x_t sx127x;
 
+/**
+ * @brief Part of a FIFO burst. Segments are transferred back to back within a single burst, so header and payload can stay in separate buffers.
+ */
+typedef struct {
+  uint8_t *buffer;
+  size_t buffer_length;
+} sx127x_segment_t;
+
 /**
  * @brief Create device handle and attach to SPI bus.
  *
+ * Chip is left in LoRa sleep mode.
+ *
  * @param spi_device spi device
  * @param result Pointer to variable to hold the device handle
  * @return
@@ -178,6 +208,19 @@ typedef struct sx127x_t sx127x;
  */
 int sx127x_create(void *spi_device, sx127x **result);
 
+/**
+ * @brief Read configuration registers from the chip into the device handle.
+ *
+ * Configuration registers are cached in the handle and every write goes through that cache. Read-modify-write of a register field costs a single write and no write is sent if the field is unchanged. Cache is loaded in sx127x_create. Call this function after the chip was reset or its registers were changed bypassing this driver.
+ * A chip in FSK mode is put into LoRa sleep mode first, FSK mode has different registers at the same addresses.
+ *
+ * @param device Pointer to variable to hold the device handle
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if parameter is invalid
+ *         - SX127X_OK                on success
+ */
+int sx127x_reload_registers(sx127x *device);
+
 /**
  * @brief Set operating mode.
  *
@@ -290,6 +333,8 @@ int sx127x_set_preamble_length(uint16_t value, sx127x *device);
  * sx127x can send packets for explicit header or without it (implicit). In implicit mode receiver should be configured with pre-defined values using this function.
  * In explicit mode, all information is sent in the header. Thus no configuration needed.
  *
+ * Registers are shadowed, so switching between implicit and explicit header is cheap: only the registers that change are written.
+ *
  * @param header Pre-defined packet information. If NULL, then assume explicit header in RX mode. For TX explicit mode please use sx127x_set_tx_explcit_header function.
  * @param device Pointer to variable to hold the device handle
  * @return
@@ -324,6 +369,22 @@ int sx127x_set_dio_mapping1(sx127x_dio_mapping1_t value, sx127x *device);
  */
 int sx127x_set_dio_mapping2(sx127x_dio_mapping2_t value, sx127x *device);
 
+/**
+ * @brief Apply complete modem configuration.
+ *
+ * Registers are written in contiguous bursts: RegFrfMsb..RegLna, RegModemConfig1..RegPayloadLength and RegDioMapping1..RegDioMapping2, plus single writes for RegModemConfig3, detection optimize/threshold, syncword and RegPaDac. Bursts that wouldn't change the chip are skipped, so switching between profiles costs at most 8 SPI transactions.
+ * Low datarate optimization is enabled when the symbol length exceeds 16ms and disabled otherwise. Overload current protection is set the same way as in sx127x_set_pa_config.
+ * LNA gain is set to automatic (AGC), TxContinuousMode is switched off and SymbTimeout gets its reset value. Call sx127x_set_lna_gain afterwards for a fixed gain.
+ *
+ * @note Device should be in sleep or standby mode.
+ * @param profile Modem configuration
+ * @param device Pointer to variable to hold the device handle
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if parameter is invalid
+ *         - SX127X_OK                on success
+ */
+int sx127x_apply_profile(const sx127x_modem_profile_t *profile, sx127x *device);
+
 int sx127x_dump_registers(sx127x *device);
 
 /**
@@ -369,6 +430,9 @@ void sx127x_set_rx_callback(void (*rx_callback)(sx127x *), sx127x *device);
 /**
  * @brief Read payload from sx127x's internal FIFO.
  *
+ * The frame is read with the header mode that was set when rx mode was entered, so a header switch for a transmit
+ * queued in the meantime doesn't change the length of a frame that was already received.
+ *
  * @param device Pointer to variable to hold the device handle
  * @param packet Output buffer
  * @param packet_length Output buffer length
@@ -411,6 +475,18 @@ int sx127x_get_packet_snr(sx127x *device, float *snr);
  */
 int sx127x_get_frequency_error(sx127x *device, int32_t *frequency_error);
 
+/**
+ * @brief Calculate time on air of a packet with the current modem configuration. Doesn't access the chip.
+ *
+ * @param device Pointer to variable to hold the device handle
+ * @param payload_length Payload length in bytes
+ * @param time_on_air Time on air in microseconds
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if bandwidth is invalid
+ *         - SX127X_OK                on success
+ */
+int sx127x_get_time_on_air(sx127x *device, uint8_t payload_length, uint32_t *time_on_air);
+
 // TX-related functions
 /**
  * @brief Set output power for transmittion.
@@ -473,6 +549,18 @@ void sx127x_set_tx_callback(void (*tx_callback)(sx127x *), sx127x *device);
  */
 int sx127x_set_for_transmission(uint8_t *data, uint8_t data_length, sx127x *device);
 
+/**
+ * @brief Write packet made of several segments into sx127x's FIFO in a single burst. Once packet is written, set opmod to TX.
+ *
+ * @param segments Segments of the packet in order. Empty segments are skipped.
+ * @param segments_count Number of segments
+ * @param device Pointer to variable to hold the device handle
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if total length is 0 or more than 255 bytes
+ *         - SX127X_OK                on success
+ */
+int sx127x_set_for_transmission_segments(const sx127x_segment_t *segments, size_t segments_count, sx127x *device);
+
 /**
  * @brief Set callback function for caddone interrupt. int argument is 0 when no CAD detected.
  *
@@ -0,0 +1,182 @@
+#ifndef sx127x_async_h
+#define sx127x_async_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "sx127x.h"
+
+/**
+ * @brief Asynchronous device handle.
+ *
+ * Requests are queued and executed in order by a dedicated worker task, so the caller never waits for the SPI bus.
+ * Completion callbacks run in the context of the worker task, not in ISR.
+ *
+ * Requests form chains: a request without callback is followed by the next request and its result is reported to the first callback in the chain.
+ * If one request of the chain fails, the rest of the chain is skipped and the callback receives the error code.
+ * For example sx127x_async_set_opmod(SX127x_MODE_STANDBY) without callback, then sx127x_async_set_for_transmission with callback reports both with a single notification.
+ *
+ * Chains are not atomic. Requests of other tasks may be executed between two requests of a chain, and the queue may refuse
+ * the rest of a chain that was half queued. Only one task at a time may submit chains, the caller serializes them.
+ * Payload reads are never part of a chain: they can be queued at any time, are neither skipped nor report the error of a chain,
+ * and read the frame with the header mode its reception was started with.
+ *
+ */
+typedef struct sx127x_async_t sx127x_async;
+
+/**
+ * @brief Called when request or chain of requests completed.
+ *
+ * @param device Pointer to variable to hold the device handle
+ * @param code SX127X_OK on success or error code of the first failed request in the chain
+ * @param arg User argument passed with the request
+ */
+typedef void (*sx127x_async_callback_t)(sx127x *device, int code, void *arg);
+
+/**
+ * @brief Called when payload was read from FIFO.
+ *
+ * @param device Pointer to variable to hold the device handle
+ * @param code SX127X_OK on success or error code
+ * @param packet Payload. Valid only until the next payload is read.
+ * @param packet_length Payload length
+ * @param arg User argument passed with the request
+ */
+typedef void (*sx127x_async_rx_callback_t)(sx127x *device, int code, uint8_t *packet, uint8_t packet_length, void *arg);
+
+/**
+ * @brief Create asynchronous handle and its worker task.
+ *
+ * @param device Pointer to variable to hold the device handle
+ * @param queue_length Maximum number of pending requests
+ * @param priority Priority of the worker task
+ * @param result Pointer to variable to hold the asynchronous handle
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if parameter is invalid
+ *         - SX127X_ERR_NO_MEM        if not enough memory
+ *         - SX127X_OK                on success
+ */
+int sx127x_async_create(sx127x *device, uint32_t queue_length, int priority, sx127x_async **result);
+
+/**
+ * @brief Queue operating mode change. See sx127x_set_opmod.
+ *
+ * @param mode Sleep, standby, rx or tx. See @ref sx127x_mode_t for details.
+ * @param async Pointer to variable to hold the asynchronous handle
+ * @param callback Called once mode was changed. Can be NULL to continue the chain.
+ * @param arg Passed to the callback
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if parameter is invalid
+ *         - SX127X_ERR_NO_MEM        if request queue is full
+ *         - SX127X_OK                on success
+ */
+int sx127x_async_set_opmod(sx127x_mode_t mode, sx127x_async *async, sx127x_async_callback_t callback, void *arg);
+
+/**
+ * @brief Queue header mode change. See sx127x_set_implicit_header.
+ *
+ * Typically chained before a transmit or rx request, so each frame can use its own header mode. A payload read queued
+ * after the switch still uses the header mode of the running reception, the switch applies to the next one.
+ *
+ * @param header Implicit header. NULL for explicit header. Not copied, must stay valid until the chain completes.
+ * @param async Pointer to variable to hold the asynchronous handle
+ * @param callback Called once header mode was changed. Can be NULL to continue the chain.
+ * @param arg Passed to the callback
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if parameter is invalid
+ *         - SX127X_ERR_NO_MEM        if request queue is full
+ *         - SX127X_OK                on success
+ */
+int sx127x_async_set_implicit_header(sx127x_implicit_header_t *header, sx127x_async *async, sx127x_async_callback_t callback, void *arg);
+
+/**
+ * @brief Queue complete modem configuration. See sx127x_apply_profile.
+ *
+ * Lets a link switch its modem configuration at runtime without racing the frames already queued. Chain it after sx127x_async_set_opmod(SX127x_MODE_STANDBY).
+ *
+ * @param profile Modem configuration. Not copied, must stay valid until the chain completes.
+ * @param async Pointer to variable to hold the asynchronous handle
+ * @param callback Called once the configuration was applied. Can be NULL to continue the chain.
+ * @param arg Passed to the callback
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if parameter is invalid
+ *         - SX127X_ERR_NO_MEM        if request queue is full
+ *         - SX127X_OK                on success
+ */
+int sx127x_async_apply_profile(const sx127x_modem_profile_t *profile, sx127x_async *async, sx127x_async_callback_t callback, void *arg);
+
+/**
+ * @brief Queue writing packet into FIFO. See sx127x_set_for_transmission.
+ *
+ * @param data Packet. Not copied, must stay valid until the chain completes.
+ * @param data_length Packet length. Cannot be more than 256 bytes or 0.
+ * @param async Pointer to variable to hold the asynchronous handle
+ * @param callback Called once packet is in FIFO. Can be NULL to continue the chain.
+ * @param arg Passed to the callback
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if parameter is invalid
+ *         - SX127X_ERR_NO_MEM        if request queue is full
+ *         - SX127X_OK                on success
+ */
+int sx127x_async_set_for_transmission(uint8_t *data, uint8_t data_length, sx127x_async *async, sx127x_async_callback_t callback, void *arg);
+
+/**
+ * @brief Queue writing packet into FIFO and switching to SX127x_MODE_TX as a single request.
+ *
+ * Unlike a chain of two requests, it can't be half queued when the request queue is full.
+ *
+ * @param data Packet. Not copied, must stay valid until the callback.
+ * @param data_length Packet length. Cannot be more than 256 bytes or 0.
+ * @param async Pointer to variable to hold the asynchronous handle
+ * @param callback Called once transmission started. Can be NULL to continue the chain.
+ * @param arg Passed to the callback
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if parameter is invalid
+ *         - SX127X_ERR_NO_MEM        if request queue is full
+ *         - SX127X_OK                on success
+ */
+int sx127x_async_transmit(uint8_t *data, uint8_t data_length, sx127x_async *async, sx127x_async_callback_t callback, void *arg);
+
+/**
+ * @brief Same as sx127x_async_transmit, but the packet is gathered from segments in a single FIFO burst. See sx127x_set_for_transmission_segments.
+ *
+ * @param segments Segments of the packet. Neither the array nor the buffers are copied, must stay valid until the callback.
+ * @param segments_count Number of segments
+ * @param async Pointer to variable to hold the asynchronous handle
+ * @param callback Called once transmission started. Can be NULL to continue the chain.
+ * @param arg Passed to the callback
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if parameter is invalid
+ *         - SX127X_ERR_NO_MEM        if request queue is full
+ *         - SX127X_OK                on success
+ */
+int sx127x_async_transmit_segments(const sx127x_segment_t *segments, size_t segments_count, sx127x_async *async, sx127x_async_callback_t callback, void *arg);
+
+/**
+ * @brief Queue reading payload from FIFO. See sx127x_read_payload.
+ *
+ * Not part of a chain, see @ref sx127x_async.
+ *
+ * @param async Pointer to variable to hold the asynchronous handle
+ * @param callback Called with the payload. Cannot be NULL.
+ * @param arg Passed to the callback
+ * @return
+ *         - SX127X_ERR_INVALID_ARG   if parameter is invalid
+ *         - SX127X_ERR_NO_MEM        if request queue is full
+ *         - SX127X_OK                on success
+ */
+int sx127x_async_read_payload(sx127x_async *async, sx127x_async_rx_callback_t callback, void *arg);
+
+/**
+ * @brief Stop worker task and release resources. Pending requests are dropped without calling their callbacks.
+ *
+ * @param async Pointer to variable to hold the asynchronous handle
+ */
+void sx127x_async_destroy(sx127x_async *async);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
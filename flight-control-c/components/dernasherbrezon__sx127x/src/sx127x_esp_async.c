@@ -0,0 +1,223 @@
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <stdlib.h>
+#include <sx127x_async.h>
+
+#define SX127X_ASYNC_STACK_SIZE 4096
+
+typedef enum {
+  SX127X_ASYNC_OPMOD = 0,
+  SX127X_ASYNC_TRANSMISSION = 1,
+  SX127X_ASYNC_READ_PAYLOAD = 2,
+  SX127X_ASYNC_TRANSMIT = 3,
+  SX127X_ASYNC_TRANSMIT_SEGMENTS = 4,
+  SX127X_ASYNC_IMPLICIT_HEADER = 5,
+  SX127X_ASYNC_PROFILE = 6
+} sx127x_async_op_t;
+
+typedef struct {
+  sx127x_async_op_t op;
+  sx127x_mode_t mode;
+  sx127x_implicit_header_t *header;
+  const sx127x_modem_profile_t *profile;
+  uint8_t *data;
+  uint8_t data_length;
+  const sx127x_segment_t *segments;
+  size_t segments_count;
+  sx127x_async_callback_t callback;
+  sx127x_async_rx_callback_t rx_callback;
+  void *arg;
+} sx127x_async_request_t;
+
+struct sx127x_async_t {
+  sx127x *device;
+  QueueHandle_t requests;
+  TaskHandle_t worker;
+};
+
+static void sx127x_async_task(void *arg) {
+  sx127x_async *async = (sx127x_async *)arg;
+  sx127x_async_request_t request;
+  // error of the current chain. Requests are skipped until the chain's callback reports it. Payload reads are never
+  // part of a chain, they can be queued from the interrupt task between any two requests of another task
+  int chain_code = SX127X_OK;
+  while (1) {
+    if (xQueueReceive(async->requests, &request, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    if (request.op == SX127X_ASYNC_READ_PAYLOAD) {
+      uint8_t *packet = NULL;
+      uint8_t packet_length = 0;
+      int code = sx127x_read_payload(async->device, &packet, &packet_length);
+      request.rx_callback(async->device, code, packet, packet_length, request.arg);
+      continue;
+    }
+    int code = chain_code;
+    if (code == SX127X_OK) {
+      switch (request.op) {
+        case SX127X_ASYNC_OPMOD:
+          code = sx127x_set_opmod(request.mode, async->device);
+          break;
+        case SX127X_ASYNC_TRANSMISSION:
+          code = sx127x_set_for_transmission(request.data, request.data_length, async->device);
+          break;
+        case SX127X_ASYNC_TRANSMIT:
+          code = sx127x_set_for_transmission(request.data, request.data_length, async->device);
+          if (code == SX127X_OK) {
+            code = sx127x_set_opmod(SX127x_MODE_TX, async->device);
+          }
+          break;
+        case SX127X_ASYNC_TRANSMIT_SEGMENTS:
+          code = sx127x_set_for_transmission_segments(request.segments, request.segments_count, async->device);
+          if (code == SX127X_OK) {
+            code = sx127x_set_opmod(SX127x_MODE_TX, async->device);
+          }
+          break;
+        case SX127X_ASYNC_READ_PAYLOAD:
+          // executed above, outside the chain
+          break;
+        case SX127X_ASYNC_IMPLICIT_HEADER:
+          code = sx127x_set_implicit_header(request.header, async->device);
+          break;
+        case SX127X_ASYNC_PROFILE:
+          code = sx127x_apply_profile(request.profile, async->device);
+          break;
+      }
+    }
+    if (request.callback != NULL) {
+      request.callback(async->device, code, request.arg);
+    } else {
+      chain_code = code;
+      continue;
+    }
+    chain_code = SX127X_OK;
+  }
+}
+
+static int sx127x_async_submit(sx127x_async_request_t *request, sx127x_async *async) {
+  if (async == NULL) {
+    return SX127X_ERR_INVALID_ARG;
+  }
+  // never block the caller. Full queue means the worker can't keep up with the caller
+  if (xQueueSend(async->requests, request, 0) != pdTRUE) {
+    return SX127X_ERR_NO_MEM;
+  }
+  return SX127X_OK;
+}
+
+int sx127x_async_create(sx127x *device, uint32_t queue_length, int priority, sx127x_async **result) {
+  if (device == NULL || queue_length == 0) {
+    return SX127X_ERR_INVALID_ARG;
+  }
+  struct sx127x_async_t *async = malloc(sizeof(struct sx127x_async_t));
+  if (async == NULL) {
+    return SX127X_ERR_NO_MEM;
+  }
+  *async = (struct sx127x_async_t){0};
+  async->device = device;
+  async->requests = xQueueCreate(queue_length, sizeof(sx127x_async_request_t));
+  if (async->requests == NULL) {
+    sx127x_async_destroy(async);
+    return SX127X_ERR_NO_MEM;
+  }
+  if (xTaskCreate(sx127x_async_task, "sx127x async", SX127X_ASYNC_STACK_SIZE, async, priority, &async->worker) != pdPASS) {
+    sx127x_async_destroy(async);
+    return SX127X_ERR_NO_MEM;
+  }
+  *result = async;
+  return SX127X_OK;
+}
+
+int sx127x_async_set_opmod(sx127x_mode_t mode, sx127x_async *async, sx127x_async_callback_t callback, void *arg) {
+  sx127x_async_request_t request = {
+      .op = SX127X_ASYNC_OPMOD,
+      .mode = mode,
+      .callback = callback,
+      .arg = arg};
+  return sx127x_async_submit(&request, async);
+}
+
+int sx127x_async_set_implicit_header(sx127x_implicit_header_t *header, sx127x_async *async, sx127x_async_callback_t callback, void *arg) {
+  sx127x_async_request_t request = {
+      .op = SX127X_ASYNC_IMPLICIT_HEADER,
+      .header = header,
+      .callback = callback,
+      .arg = arg};
+  return sx127x_async_submit(&request, async);
+}
+
+int sx127x_async_apply_profile(const sx127x_modem_profile_t *profile, sx127x_async *async, sx127x_async_callback_t callback, void *arg) {
+  if (profile == NULL) {
+    return SX127X_ERR_INVALID_ARG;
+  }
+  sx127x_async_request_t request = {
+      .op = SX127X_ASYNC_PROFILE,
+      .profile = profile,
+      .callback = callback,
+      .arg = arg};
+  return sx127x_async_submit(&request, async);
+}
+
+int sx127x_async_set_for_transmission(uint8_t *data, uint8_t data_length, sx127x_async *async, sx127x_async_callback_t callback, void *arg) {
+  if (data == NULL || data_length == 0) {
+    return SX127X_ERR_INVALID_ARG;
+  }
+  sx127x_async_request_t request = {
+      .op = SX127X_ASYNC_TRANSMISSION,
+      .data = data,
+      .data_length = data_length,
+      .callback = callback,
+      .arg = arg};
+  return sx127x_async_submit(&request, async);
+}
+
+int sx127x_async_transmit(uint8_t *data, uint8_t data_length, sx127x_async *async, sx127x_async_callback_t callback, void *arg) {
+  if (data == NULL || data_length == 0) {
+    return SX127X_ERR_INVALID_ARG;
+  }
+  sx127x_async_request_t request = {
+      .op = SX127X_ASYNC_TRANSMIT,
+      .data = data,
+      .data_length = data_length,
+      .callback = callback,
+      .arg = arg};
+  return sx127x_async_submit(&request, async);
+}
+
+int sx127x_async_transmit_segments(const sx127x_segment_t *segments, size_t segments_count, sx127x_async *async, sx127x_async_callback_t callback, void *arg) {
+  if (segments == NULL || segments_count == 0) {
+    return SX127X_ERR_INVALID_ARG;
+  }
+  sx127x_async_request_t request = {
+      .op = SX127X_ASYNC_TRANSMIT_SEGMENTS,
+      .segments = segments,
+      .segments_count = segments_count,
+      .callback = callback,
+      .arg = arg};
+  return sx127x_async_submit(&request, async);
+}
+
+int sx127x_async_read_payload(sx127x_async *async, sx127x_async_rx_callback_t callback, void *arg) {
+  if (callback == NULL) {
+    return SX127X_ERR_INVALID_ARG;
+  }
+  sx127x_async_request_t request = {
+      .op = SX127X_ASYNC_READ_PAYLOAD,
+      .rx_callback = callback,
+      .arg = arg};
+  return sx127x_async_submit(&request, async);
+}
+
+void sx127x_async_destroy(sx127x_async *async) {
+  if (async == NULL) {
+    return;
+  }
+  if (async->worker != NULL) {
+    vTaskDelete(async->worker);
+  }
+  if (async->requests != NULL) {
+    vQueueDelete(async->requests);
+  }
+  free(async);
+}
@@ -0,0 +1,206 @@
+#include <driver/spi_master.h>
+#include <esp_err.h>
+#include <esp_memory_utils.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <string.h>
+#include <sx127x_spi.h>
+
+// sx127x FIFO is 256 bytes, nothing longer can be transferred in one burst
+#define SX127X_SPI_MAX_BURST 256
+
+// The spi driver rejects a transaction on a device while another task's polling transaction on the same
+// device is in flight. The async worker and the application tasks share the device, so serialize here.
+// The mutex is created by the first access, which is sx127x_create before any other task can use the device.
+static StaticSemaphore_t sx127x_spi_mutex_buffer;
+static SemaphoreHandle_t sx127x_spi_mutex = NULL;
+
+static void sx127x_spi_lock() {
+  if (sx127x_spi_mutex == NULL) {
+    sx127x_spi_mutex = xSemaphoreCreateMutexStatic(&sx127x_spi_mutex_buffer);
+  }
+  xSemaphoreTake(sx127x_spi_mutex, portMAX_DELAY);
+}
+
+static void sx127x_spi_unlock() {
+  xSemaphoreGive(sx127x_spi_mutex);
+}
+
+static int sx127x_spi_transmit_polling(spi_transaction_t *t, void *spi_device) {
+  sx127x_spi_lock();
+  esp_err_t code = spi_device_polling_transmit(spi_device, t);
+  sx127x_spi_unlock();
+  return code;
+}
+
+// FIFO bursts go through the DMA as queued transactions, so the calling task sleeps while the bus is busy.
+// Register accesses are 1-4 bytes: polling is faster for those than an interrupt round trip.
+static int sx127x_spi_queue_and_wait(spi_transaction_t *t, void *spi_device) {
+  esp_err_t code = spi_device_queue_trans(spi_device, t, portMAX_DELAY);
+  if (code != ESP_OK) {
+    return code;
+  }
+  spi_transaction_t *result;
+  return spi_device_get_trans_result(spi_device, &result, portMAX_DELAY);
+}
+
+static int sx127x_spi_transmit_dma(spi_transaction_t *t, void *spi_device) {
+  sx127x_spi_lock();
+  esp_err_t code = sx127x_spi_queue_and_wait(t, spi_device);
+  sx127x_spi_unlock();
+  return code;
+}
+
+// DMA can only access internal RAM and on ESP32 it needs word aligned buffers. Otherwise the spi driver
+// allocates a temporary buffer for every transaction, so bounce through the stack instead.
+static int sx127x_spi_is_dma_ready(const uint8_t *buffer, size_t buffer_length) {
+  return esp_ptr_dma_capable(buffer) && ((uintptr_t)buffer % 4) == 0 && (buffer_length % 4) == 0;
+}
+
+int sx127x_spi_read_registers(int reg, void *spi_device, size_t data_length, uint32_t *result) {
+  if (data_length == 0 || data_length > 4) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  *result = 0;
+  spi_transaction_t t = {
+      .addr = reg & 0x7F,
+      .rx_buffer = NULL,
+      .tx_buffer = NULL,
+      .rxlength = data_length * 8,
+      .length = data_length * 8,
+      .flags = SPI_TRANS_USE_RXDATA};
+  esp_err_t code = sx127x_spi_transmit_polling(&t, spi_device);
+  if (code != ESP_OK) {
+    return code;
+  }
+  for (int i = 0; i < data_length; i++) {
+    *result = ((*result) << 8);
+    *result = (*result) + t.rx_data[i];
+  }
+  return ESP_OK;
+}
+
+int sx127x_spi_read_buffer(int reg, uint8_t *buffer, size_t buffer_length, void *spi_device) {
+  if (buffer_length == 0) {
+    return ESP_OK;
+  }
+  if (buffer_length > SX127X_SPI_MAX_BURST) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  WORD_ALIGNED_ATTR uint8_t bounce[SX127X_SPI_MAX_BURST];
+  uint8_t *rx_buffer = sx127x_spi_is_dma_ready(buffer, buffer_length) ? buffer : bounce;
+  spi_transaction_t t = {
+      .addr = reg & 0x7F,
+      .rx_buffer = rx_buffer,
+      .tx_buffer = NULL,
+      .rxlength = buffer_length * 8,
+      .length = buffer_length * 8};
+  esp_err_t code = sx127x_spi_transmit_dma(&t, spi_device);
+  if (code != ESP_OK) {
+    return code;
+  }
+  if (rx_buffer != buffer) {
+    memcpy(buffer, rx_buffer, buffer_length);
+  }
+  return ESP_OK;
+}
+
+int sx127x_spi_write_register(int reg, uint8_t *data, size_t data_length, void *spi_device) {
+  if (data_length == 0 || data_length > 4) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  spi_transaction_t t = {
+      .addr = reg | 0x80,
+      .rx_buffer = NULL,
+      .tx_buffer = NULL,
+      .rxlength = data_length * 8,
+      .length = data_length * 8,
+      .flags = SPI_TRANS_USE_RXDATA | SPI_TRANS_USE_TXDATA};
+  for (int i = 0; i < data_length; i++) {
+    t.tx_data[i] = data[i];
+  }
+  return sx127x_spi_transmit_polling(&t, spi_device);
+}
+
+int sx127x_spi_write_buffer(int reg, uint8_t *buffer, size_t buffer_length, void *spi_device) {
+  if (buffer_length == 0) {
+    return ESP_OK;
+  }
+  if (buffer_length > SX127X_SPI_MAX_BURST) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  WORD_ALIGNED_ATTR uint8_t bounce[SX127X_SPI_MAX_BURST];
+  uint8_t *tx_buffer = buffer;
+  // tx length doesn't have to be a multiple of 4
+  if (!esp_ptr_dma_capable(buffer) || ((uintptr_t)buffer % 4) != 0) {
+    memcpy(bounce, buffer, buffer_length);
+    tx_buffer = bounce;
+  }
+  spi_transaction_t t = {
+      .addr = reg | 0x80,
+      .rx_buffer = NULL,
+      .tx_buffer = tx_buffer,
+      .length = buffer_length * 8};
+  return sx127x_spi_transmit_dma(&t, spi_device);
+}
+
+int sx127x_spi_write_segments(int reg, const sx127x_segment_t *segments, size_t segments_count, void *spi_device) {
+  size_t total_length = 0;
+  int dma_ready = 1;
+  for (size_t i = 0; i < segments_count; i++) {
+    total_length += segments[i].buffer_length;
+    if (segments[i].buffer_length > 0 && (!esp_ptr_dma_capable(segments[i].buffer) || ((uintptr_t)segments[i].buffer % 4) != 0)) {
+      dma_ready = 0;
+    }
+  }
+  if (total_length == 0) {
+    return ESP_OK;
+  }
+  if (total_length > SX127X_SPI_MAX_BURST) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  // gathering into the bounce buffer is still a single burst, only the copy is extra
+  if (!dma_ready) {
+    WORD_ALIGNED_ATTR uint8_t bounce[SX127X_SPI_MAX_BURST];
+    size_t offset = 0;
+    for (size_t i = 0; i < segments_count; i++) {
+      memcpy(bounce + offset, segments[i].buffer, segments[i].buffer_length);
+      offset += segments[i].buffer_length;
+    }
+    return sx127x_spi_write_buffer(reg, bounce, total_length, spi_device);
+  }
+
+  // one transaction per segment with chip select held low in between. sx127x sees a single burst.
+  // Only the first transaction sends the register address. Keeping CS active requires the bus to be acquired
+  sx127x_spi_lock();
+  esp_err_t code = spi_device_acquire_bus(spi_device, portMAX_DELAY);
+  if (code != ESP_OK) {
+    sx127x_spi_unlock();
+    return code;
+  }
+  size_t remaining = total_length;
+  int first = 1;
+  for (size_t i = 0; i < segments_count && code == ESP_OK; i++) {
+    if (segments[i].buffer_length == 0) {
+      continue;
+    }
+    remaining -= segments[i].buffer_length;
+    spi_transaction_ext_t t = {
+        .base = {
+            .addr = reg | 0x80,
+            .tx_buffer = segments[i].buffer,
+            .length = segments[i].buffer_length * 8}};
+    if (!first) {
+      t.base.flags |= SPI_TRANS_VARIABLE_ADDR;
+      t.address_bits = 0;
+    }
+    if (remaining > 0) {
+      t.base.flags |= SPI_TRANS_CS_KEEP_ACTIVE;
+    }
+    code = sx127x_spi_queue_and_wait(&t.base, spi_device);
+    first = 0;
+  }
+  spi_device_release_bus(spi_device);
+  sx127x_spi_unlock();
+  return code;
+}
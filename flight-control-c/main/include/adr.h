@@ -0,0 +1,78 @@
+#ifndef ADR_H
+#define ADR_H
+
+#include <stdint.h>
+
+// Adaptive data rate. The link runs one modem profile of a ladder that goes from the fastest to the most robust.
+// Every received frame adds its SNR and its sequence number to the window of its link, gaps in the sequence numbers
+// count as lost frames. Once a window holds ADR_MIN_FRAMES frames it decides:
+//   more robust, if the PER is above ADR_PER_TARGET_PERMILLE or the margin to the demodulation floor is negative
+//   faster, if the PER is on target and the next faster profile still leaves ADR_MARGIN_QDB of margin
+// SNR is kept as if measured in 500 kHz, so windows measured with different profiles compare. The SNR the modem
+// reports saturates on strong signals, the RSSI above the noise floor stands in for it then, whichever is lower counts.
+// Portable C, the caller owns the locking
+#define ADR_PROFILE_COUNT 5
+// frames a window needs before it decides, fewer make the PER too noisy to hold the target
+#define ADR_MIN_FRAMES 64
+#define ADR_PER_TARGET_PERMILLE 10
+// hysteresis of stepping faster, quarter dB. 6 dB covers the fading the window average hides
+#define ADR_MARGIN_QDB 24
+// thermal noise in 500 kHz with a 6 dB noise figure
+#define ADR_NOISE_FLOOR_DBM (-111)
+// a longer sequence gap is taken as a restart of the peer, not as lost frames
+#define ADR_MAX_GAP 256
+// adr_decide result if the window has too few frames
+#define ADR_UNKNOWN 0xFF
+
+typedef struct {
+    uint8_t spreading_factor; // 7 to 12
+    uint32_t bandwidth_hz;
+    uint8_t coding_rate; // 4/n, n from 5 to 8
+    int8_t required_snr_qdb; // demodulation floor in the profile's own bandwidth, quarter dB
+    int8_t bandwidth_gain_qdb; // noise below that in 500 kHz, quarter dB
+} Adr_Profile;
+
+// Index 0 is the fastest profile, every next one trades airtime for sensitivity
+extern const Adr_Profile adr_profiles[ADR_PROFILE_COUNT];
+
+typedef struct {
+    int32_t snr_sum_qdb; // SNR of the received frames, normalized to 500 kHz
+    uint16_t received;
+    uint16_t lost;
+    uint16_t next_sequence; // sequence number the next frame should have
+    uint8_t synced; // next_sequence is known
+} Adr_Link;
+
+/// Starts a link without history. The first frame only syncs the sequence number.
+void adr_link_init(Adr_Link* link);
+
+/// Adds a received frame to the window.
+/// \param sequence Sequence number of the frame, counted by its source.
+/// \param rssi_dbm Packet RSSI.
+/// \param snr_qdb Packet SNR, quarter dB.
+/// \param profile Profile the frame was received with.
+void adr_record(Adr_Link* link, uint16_t sequence, int16_t rssi_dbm, int16_t snr_qdb, uint8_t profile);
+
+/// Adds a window the other end measured, e.g. from a link report.
+/// \param snr_qdb Average SNR of the window, normalized to 500 kHz.
+void adr_merge(Adr_Link* link, int16_t snr_qdb, uint16_t received, uint16_t lost);
+
+/// Empties the window, the sequence number stays in sync.
+void adr_restart_window(Adr_Link* link);
+
+/// \return Average SNR of the window normalized to 500 kHz in quarter dB, INT16_MIN if it is empty.
+int16_t adr_snr_qdb(const Adr_Link* link);
+
+/// \return Lost frames per thousand frames of the window.
+uint16_t adr_per_permille(const Adr_Link* link);
+
+/// Margin of the window to the demodulation floor of a profile.
+/// \return Quarter dB, INT16_MIN if the window is empty.
+int16_t adr_margin_qdb(const Adr_Link* link, uint8_t profile);
+
+/// Picks the profile the link should run, one step at a time.
+/// \param profile Current profile.
+/// \return Profile index, ADR_UNKNOWN if the window has fewer than ADR_MIN_FRAMES frames.
+uint8_t adr_decide(const Adr_Link* link, uint8_t profile);
+
+#endif //ADR_H
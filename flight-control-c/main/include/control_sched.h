@@ -0,0 +1,38 @@
+#ifndef CONTROL_SCHED_H
+#define CONTROL_SCHED_H
+
+#include <stdint.h>
+
+// Smooth weighted round robin over the devices that receive control setpoints. Every tick one device gets the next
+// setpoint, a device of weight w gets exactly w of every total_weight ticks and its setpoints are spread evenly over
+// them, so its update period is tick * total_weight / w whatever the other devices do. With equal weights it is plain
+// round robin in address order. Each pick is O(devices). Portable C, the caller owns the clock
+#define CONTROL_SCHED_TABLE_SIZE 256
+// control_sched_next result when no device is scheduled
+#define CONTROL_SCHED_NONE CONTROL_SCHED_TABLE_SIZE
+
+typedef struct {
+    uint8_t weight[CONTROL_SCHED_TABLE_SIZE]; // setpoints per cycle, 0 if the address is not scheduled
+    int32_t credit[CONTROL_SCHED_TABLE_SIZE]; // grows by weight every tick, the device with the most is picked
+    uint32_t members[CONTROL_SCHED_TABLE_SIZE / 32]; // bit n % 32 of word n / 32 is set if address n is scheduled
+    uint16_t total_weight; // ticks in a cycle
+    uint16_t num_of_devices;
+} Control_Sched;
+
+/// Empties the schedule.
+void control_sched_init(Control_Sched* sched);
+
+/// Adds, reweights or removes a device. Credits start over, so the next cycle is spread evenly again.
+/// \param dev_addr Device address.
+/// \param weight Setpoints of the device per cycle, 0 removes it.
+void control_sched_set_weight(Control_Sched* sched, uint8_t dev_addr, uint8_t weight);
+
+/// Picks the device of the next tick.
+/// \return Device address, CONTROL_SCHED_NONE if no device is scheduled.
+uint16_t control_sched_next(Control_Sched* sched);
+
+/// Update period of a device at the given tick.
+/// \return Period in us, 0 if the device is not scheduled.
+uint32_t control_sched_device_period_us(const Control_Sched* sched, uint8_t dev_addr, uint32_t tick_us);
+
+#endif //CONTROL_SCHED_H
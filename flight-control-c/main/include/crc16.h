@@ -0,0 +1,19 @@
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-16 with polynomial 0x1021, MSB first. Portable C, so the same code runs on the ESP32 and on the host.
+// crc16(0, data, length) gives the same value as the ESP ROM crc16_be(0, data, length)
+
+/// Calculates or continues a CRC16.
+/// Calls can be chained to checksum a frame stored in several buffers in one pass:
+/// crc16(crc16(0, header, header_length), payload, payload_length) == crc16(0, frame, header_length + payload_length)
+/// \param crc 0 to start, or the result of the previous call.
+/// \param data Next part of the data.
+/// \param length Length of the data.
+/// \return CRC of all the data so far.
+uint16_t crc16(uint16_t crc, const uint8_t* data, size_t length);
+
+#endif //CRC16_H
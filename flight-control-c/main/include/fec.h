@@ -0,0 +1,38 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Erasure code across the fragments of one message: K parity fragments are sent after the N data fragments and any
+// N of the N + K fragments rebuild the message, so up to K lost fragments cost no retransmission round.
+// Systematic Reed-Solomon over GF(256) with a Cauchy generator matrix, normalized so parity 0 is the plain XOR of
+// the data fragments. Every fragment is fragment_size long, a short last data fragment is zero padded.
+// Portable C, so the same code runs on the ESP32 and on the host
+#define FEC_MAX_DATA_FRAGMENTS 64
+#define FEC_MAX_PARITY 8
+
+/// Calculates one parity fragment.
+/// \param data First data fragment, fragment n starts at data + n * stride. A short last fragment must be zero padded to fragment_size.
+/// \param stride Distance of the data fragments in bytes, at least fragment_size.
+/// \param num_of_data Number of data fragments, at most FEC_MAX_DATA_FRAGMENTS.
+/// \param fragment_size Length of the fragments.
+/// \param parity_index Index of the parity fragment, less than FEC_MAX_PARITY.
+/// \param parity Output, fragment_size bytes.
+void fec_encode(const uint8_t* data, size_t stride, uint8_t num_of_data, uint8_t fragment_size,
+                uint8_t parity_index, uint8_t* parity);
+
+/// Rebuilds the missing data fragments in place.
+/// \param data First data fragment, fragment n starts at data + n * stride. Received fragments must be zero padded
+/// to fragment_size, missing ones are overwritten.
+/// \param stride Distance of the data fragments in bytes, at least fragment_size.
+/// \param num_of_data Number of data fragments, at most FEC_MAX_DATA_FRAGMENTS.
+/// \param received Bit n is set if data fragment n is present.
+/// \param parity Parity fragments, parity n starts at parity + n * fragment_size.
+/// \param parity_received Bit n is set if parity fragment n is present.
+/// \param fragment_size Length of the fragments.
+/// \return 0 if successful, 1 if fewer than num_of_data fragments arrived, 2 if out of memory.
+uint8_t fec_decode(uint8_t* data, size_t stride, uint8_t num_of_data, uint64_t received,
+                   const uint8_t* parity, uint8_t parity_received, uint8_t fragment_size);
+
+#endif //FEC_H
@@ -5,14 +5,21 @@
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include <sx127x.h>
+#include <sx127x_async.h>
 #include <stdlib.h>
 #include <driver/spi_common.h>
 #include <driver/spi_master.h>
 #include <driver/gpio.h>
 #include <esp_log.h>
 #include "esp_crc.h"
-#include <rom/crc.h>
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_random.h"
+#include "crc16.h"
 #include "memory.h"
+#include "replay.h"
+#include "tdma.h"
+#include "adr.h"
 
 #define LORA_SPI_HOST VSPI_HOST
 
@@ -23,7 +30,43 @@
 #define LORA_RST_PIN 0
 #define LORA_DIO0_PIN 4
 
-#define LORA_PAYLOAD_MAX_SIZE 246
+// sx127x SPI interface is rated up to 10 MHz (SCK period min 100 ns)
+#define LORA_SPI_CLOCK_SPEED_HZ 10000000
+
+// FIFO loads, mode changes and payload reads are executed by the sx127x async worker
+#define LORA_ASYNC_QUEUE_LENGTH 16
+#define LORA_ASYNC_TASK_PRIORITY 20
+// A return to rx the full request queue refused is submitted again this much later, the worker drains the queue
+// meanwhile. After LORA_ASYNC_RETRIES attempts the sender moves on, the next one comes with the next superframe
+#define LORA_ASYNC_RETRY_MS 1
+#define LORA_ASYNC_RETRIES 3
+// Next frame is encoded while the previous one is loaded into the FIFO
+#define LORA_TX_FRAME_BUFFERS 2
+// Slack on top of the calculated time on air before a missing TX_DONE is reported
+#define LORA_TX_DONE_MARGIN_MS 20
+// Shortest superframe, from beacon to beacon. A single aircraft gets a setpoint this often
+#define LORA_SUPERFRAME_MIN_MS 20
+// Adaptive data rate, see adr.h. Every aircraft heard from within LORA_LINK_ACTIVE_MS has a say in the profile of
+// the link, a switch goes ahead once all of them acknowledged it. One not acknowledged within
+// LORA_LINK_SWITCH_TIMEOUT_MS is given up, the next report offers it again
+#define LORA_LINK_ACTIVE_MS 3000
+#define LORA_LINK_SWITCH_TIMEOUT_MS 2000
+// Listen before talk: this many CADs run before every frame, each one listens for about one symbol. A busy channel
+// defers the frame by a random backoff. TDMA keeps the nodes of this network apart, the CAD finds other ground
+// stations and their aircraft on the channel. 0 sends without listening
+#define LORA_LBT_CAD_SYMBOLS 0
+// Backoff after a busy CAD, a random number of units from 1 to 2^n, n counts the busy CADs of the frame up to
+// LORA_LBT_BACKOFF_MAX_EXP
+#define LORA_LBT_BACKOFF_UNIT_US 1000
+#define LORA_LBT_BACKOFF_MAX_EXP 6
+// A control setpoint still queued this long after its slot was due is dropped instead of taking airtime, the aircraft
+// drops one it could not apply within this long of its arrival. The two ends don't share a clock
+#define LORA_CONTROL_EXPIRY_MS 100
+// Frames queued in the link and bulk classes from which lora_tx_congested asks producers to back off,
+// half of the packet pool
+#define LORA_TX_HIGH_WATER 16
+
+#define LORA_PAYLOAD_MAX_SIZE 244
 
 #define LORA_BASE_STATION_ADDR 0x00
 #define LORA_NETWORK_BROADCAST_ADDR 0xFF
@@ -33,26 +76,79 @@
 #define BASE_STATION_ADDR 0X00 // TODO later: DHCP server impl
 #define BROADCAST_ADDR 0XFF
 
+typedef enum {
+    LORA_MESSAGE_DATA = 0x00, // fragmented network message
+    LORA_MESSAGE_CONTROL = 0x01, // single frame LoRa_Control_Frame, bypasses message reassembly
+    LORA_MESSAGE_HEADER_MODE = 0x02, // announces explicit header frames, sent like a control frame
+    LORA_MESSAGE_NACK = 0x03, // selective repeat report, fragments of a message the receiver is missing
+    LORA_MESSAGE_PARITY = 0x04, // erasure code fragment, sent after the data fragments of a message
+    LORA_MESSAGE_BATCH = 0x05, // several small packets for one destination in one frame, see lora_codec.h
+    LORA_MESSAGE_BEACON = 0x06, // broadcast superframe layout of the ground station, sent like a control frame
+    LORA_MESSAGE_LINK = 0x07, // link management, adaptive data rate reports and modem profile switches
+} LoRa_Message_Type;
+
 typedef struct {
+    uint8_t message_type;
     uint8_t src_device_addr;
     uint8_t dest_device_addr;
+    uint16_t sequence; // frame counter of the source towards the destination, set by the sender task
     uint8_t num_of_packets;
-    uint8_t packet_num;
+    uint8_t packet_num; // index of the parity fragment for LORA_MESSAGE_PARITY
+    uint8_t message_id; // fragments of one message share it, 0 for single frame control messages
+    uint8_t poll; // last fragment of a selective repeat round, the receiver answers with a NACK
+    uint8_t last_payload_size; // parity fragments only, payload size of the last data fragment
     uint8_t payload_size;
     uint16_t header_crc;
 } LoRa_Packet_Header;
 
 typedef struct {
-    uint8_t payload[LORA_PAYLOAD_MAX_SIZE]; // Lora packet at 128 coding rate is 256 bytes - 7 bytes of header - 2 bytes crc
+    // word aligned for DMA, 255 byte LoRa frame minus the longest header
+    WORD_ALIGNED_ATTR uint8_t payload[LORA_PAYLOAD_MAX_SIZE];
     uint16_t payload_crc;
 } LoRa_Packet_Payload;
 
 typedef struct  {
     LoRa_Packet_Header header;
     LoRa_Packet_Payload payload;
-
+    int64_t expires_at; // esp_timer time in us, the sender drops the frame unsent after it. 0 never, not on air
+    int64_t sampled_at; // esp_timer time in us the setpoint of a control frame was sampled at, set by the planner
 } LoRa_Packet;
 
+// Control setpoint sent every control period, fits a single packet. On air the landing gear
+// shares the throttle byte
+#define LORA_CONTROL_FRAME_SIZE 4
+#define LORA_CONTROL_LANDING_GEAR_BIT 0x80
+
+// NACK payload: message id, then the 64 bit bitmap of missing fragments, big endian. An empty bitmap
+// acknowledges the whole message
+#define LORA_NACK_FRAME_SIZE 9
+
+// Link management payload: op, profile, then the average SNR in quarter dB normalized to 500 kHz, the received and
+// the lost frames of the reported window, big endian. Switches and acknowledgements leave the window zeroed
+#define LORA_LINK_FRAME_SIZE 8
+
+typedef enum {
+    LORA_LINK_REPORT = 0x00, // aircraft to ground station, window of the frames it received, see adr.h
+    LORA_LINK_SWITCH = 0x01, // ground station to aircraft, the profile it offers to switch to
+    LORA_LINK_ACK = 0x02, // aircraft to ground station, ready to switch to the offered profile
+} LoRa_Link_Op;
+
+typedef struct {
+    uint8_t op; // LoRa_Link_Op
+    uint8_t profile; // index into adr_profiles
+    int16_t snr_qdb;
+    uint16_t received;
+    uint16_t lost;
+} LoRa_Link_Frame;
+
+typedef struct {
+    int8_t aileron; // joystick x, percentage
+    int8_t elevator; // joystick y, percentage
+    int8_t rudder; // joystick rudder, percentage
+    uint8_t throttle; // percentage, 0-100
+    uint8_t landing_gear; // RTLG_Status
+} LoRa_Control_Frame;
+
 uint16_t lora_calc_header_crc(LoRa_Packet_Header* header);
 uint16_t lora_calc_packet_crc(LoRa_Packet_Payload* payload, uint8_t payload_length);
 
@@ -65,16 +161,138 @@ void init_lora(spi_device_handle_t* spi_device, sx127x* lora_dev);
 
 void handle_interrupt_task(void *arg);
 void tx_callback(sx127x *device);
+void cad_callback(sx127x *device, int detected);
 void rx_callback(sx127x *device);
+void rx_payload_callback(sx127x *device, int code, uint8_t *data, uint8_t data_length, void *arg);
+void lora_tx_loaded_callback(sx127x *device, int code, void *arg);
+void lora_async_callback(sx127x *device, int code, void *arg);
+void lora_slot_timer_expired(void* arg);
+void lora_profile_applied(sx127x *device, int code, void *arg);
 
 void lora_packet_sender_task(void* pvParameters);
 uint8_t lora_send_packet(sx127x *lora_device, LoRa_Packet* packet);
+/// Sends the packet with the given LoRa header mode and waits for TX_DONE.
+/// \param packet Pool buffer, owned by the tx path from here.
+/// \param header Implicit header, NULL for explicit header.
+void lora_transmit_and_wait(sx127x* lora_dev, LoRa_Packet* packet, sx127x_implicit_header_t* header);
+/// Tells the aircraft to listen with explicit header for the following bulk frames.
+void lora_announce_explicit_header(sx127x* lora_dev, uint8_t dest_addr);
+// Traffic classes of the transmit path. Setpoints have control slots of their own, link management is served before
+// bulk traffic. NACKs come once per selective repeat round and can't starve it
+typedef enum {
+    LORA_CLASS_CONTROL = 0, // setpoints, sent in the control slots of the superframe
+    LORA_CLASS_LINK, // NACKs, header mode and link management frames
+    LORA_CLASS_BULK, // message fragments and single frame messages
+    LORA_CLASS_COUNT,
+} LoRa_Traffic_Class;
+
+typedef struct {
+    uint32_t sent; // frames taken by the sender
+    int64_t wait_total_us; // time from enqueue until the sender took the frame, for setpoints from sampling to sending
+    int64_t wait_max_us;
+    uint32_t expired; // frames dropped unsent, they expired in the queue
+    uint32_t rx_expired; // received frames dropped before use, only setpoints expire
+    uint32_t overflow; // frames lost to a full class queue
+    uint32_t rx_overflow; // received frames lost to a full packet_rx_queue
+    uint32_t rx_rejected; // received frames dropped as duplicates, replays or out of order setpoints
+    uint32_t busy; // backoffs after a busy CAD
+    uint32_t busy_skipped; // no clear channel in time, setpoints are dropped, beacons sent anyway, the rest requeued
+} LoRa_Class_Stats;
+
+// Link state of one peer, the table is indexed by the 1 byte address
+typedef struct {
+    uint16_t tx_sequence; // sequence number of the next frame sent to the peer, sender task only
+    Replay_Window rx_window; // frames received from the peer, rx path only
+    // Control, header mode and beacon frames are sent with implicit LoRa header, everything else with explicit
+    // header. The aircraft listens with explicit header from a header mode frame until the end of the superframe,
+    // this mirrors its window. Sender task only
+    int64_t explicit_until;
+    // Adaptive data rate, rx path only. Windows of the frames received from the peer and of the frames it reported
+    // receiving, each with the profile it asked for last, ADR_UNKNOWN until it filled
+    Adr_Link uplink;
+    Adr_Link downlink;
+    uint8_t uplink_want;
+    uint8_t downlink_want;
+    int64_t heard_at; // last frame from the peer, 0 if none arrived
+    uint8_t switch_unacked; // the peer was offered lora_link_target and did not acknowledge it yet
+} LoRa_Peer;
+
+/// Fills the next superframe, called by the sender task right before the beacon.
+/// \param superframe Output, layout sent in the beacon. Comes zeroed, with downlink_slots set to the frames queued
+/// in the link and bulk classes, at most TDMA_MAX_DOWNLINK_SLOTS.
+/// \param control Output, setpoint of every control slot, NULL leaves the slot empty. Pool buffers, owned by the
+/// tx path from here. Each one expires LORA_CONTROL_EXPIRY_MS after tdma_control_slot_due_us of its slot, counted
+/// from sampled_at. The queue wait of the control class is counted from sampled_at as well.
+typedef void (*LoRa_Superframe_Planner)(Tdma_Superframe* superframe, LoRa_Packet* control[TDMA_MAX_CONTROL_SLOTS]);
+
+// What a full queue does with a frame, no producer waits for room
+typedef enum {
+    LORA_OVERFLOW_REJECT = 0, // the frame is not queued, the caller keeps it
+    LORA_OVERFLOW_DROP_NEWEST, // the frame is released
+    LORA_OVERFLOW_DROP_OLDEST, // the frame at the front of the queue is released to make room
+} LoRa_Overflow_Policy;
+
+/// Traffic class of a frame, decided by its message type.
+LoRa_Traffic_Class lora_traffic_class(const LoRa_Packet* packet);
+/// Runs a received frame addressed to this device through the replay window of its source. Only the rx path
+/// may call it.
+/// \param packet Decoded frame.
+/// \param in_order 1 for frames that carry the latest state, like setpoints, which are useless once a newer
+/// frame arrived.
+/// \return 1 if the frame should be processed, 0 if it is a duplicate, a replay or out of order.
+uint8_t lora_accept_sequence(const LoRa_Packet* packet, uint8_t in_order);
+/// Hands a frame to the link or bulk queue of the sender without blocking. Setpoints don't come through here, the
+/// superframe planner hands them to the sender for the control slots.
+/// \param packet Pool buffer, owned by the tx path unless it is rejected.
+/// \param policy What to do when the class queue is full.
+/// \return 0 if the packet was queued, 1 if it was dropped or rejected. The caller owns a rejected packet.
+uint8_t lora_tx_enqueue(LoRa_Packet* packet, LoRa_Overflow_Policy policy);
+/// Hands a received frame to the rx handler without blocking.
+/// \param packet Pool buffer, owned by the rx path unless it is rejected.
+/// \param policy What to do when packet_rx_queue is full.
+/// \return 0 if the packet was queued, 1 if it was dropped or rejected. The caller owns a rejected packet.
+uint8_t lora_rx_enqueue(LoRa_Packet* packet, LoRa_Overflow_Policy policy);
+/// Congestion signal for periodic producers, they should send less often while it is set.
+/// \return 1 if the class queues hold LORA_TX_HIGH_WATER frames.
+uint8_t lora_tx_congested();
+/// Takes the next frame to send, link management first, then bulk traffic.
+/// Expired frames are released on the way.
+/// \return Frame, NULL if nothing is queued.
+LoRa_Packet* lora_tx_dequeue();
+/// \return 1 if any class has a frame queued.
+uint8_t lora_tx_pending();
+/// \return Frames queued in the link and bulk classes.
+uint8_t lora_tx_backlog();
+/// Tells whether the peer owes the acknowledgement of a modem profile switch, the planner grants it a reply slot.
+/// \param dev_addr Peer address.
+/// \return 1 if the switch waits for the peer.
+uint8_t lora_link_reply_due(uint8_t dev_addr);
+/// Sets the planner of every following superframe. Until then the superframes only carry downlink frames.
+void lora_set_superframe_planner(LoRa_Superframe_Planner planner);
+/// Bound on the time from queueing frames of the longest length until the reply slot after the last one,
+/// for the report timeout of a selective repeat round.
+/// \param frames Frames queued.
+/// \return Time in us, every superframe taken as the longest possible one.
+uint32_t lora_tx_time_us(uint8_t frames);
+/// Copies the queue wait and drop statistics since boot, to check control latency under load.
+/// \param stats Output, LORA_CLASS_COUNT entries indexed by LoRa_Traffic_Class.
+void lora_get_class_stats(LoRa_Class_Stats* stats);
+/// Packs the small frames queued behind the packet in its class for the same destination into one batch frame.
+/// Only frames already queued are batched, frames wait for their slot in the queue and a wait here would eat into
+/// the guard time of the slot. Only the sender task may call it.
+/// \param packet Frame from lora_tx_dequeue, owned by the tx path.
+/// \return Batch frame, or the packet itself if nothing could be batched with it.
+LoRa_Packet* lora_coalesce(LoRa_Packet* packet);
+/// Queues every record of a received batch frame to packet_rx_queue, as if each one arrived in its own frame.
+/// \param batch Pool buffer, released here.
+void lora_demux_batch(LoRa_Packet* batch);
 
 
 /// Returned when message is fragmented and sent
 typedef enum {
     MESSAGE_OK = 0x00,
-    MESSAGE_NOT_ENOUGH_MEMORY = 0x02
+    MESSAGE_NOT_ENOUGH_MEMORY = 0x02,
+    MESSAGE_QUEUE_FULL = 0x03, // the tx queue had no room for every fragment, the message is incomplete
 } Message_Process_Status;
 
 ///Fragments message into packages, inits packages, calculate 16 bit CRC, then sends it to the
@@ -18,6 +18,26 @@
 #include "joystick.h"
 #include "lcd.h"
 #include "landing_gear.h"
+#include "reassembly.h"
+#include "arq.h"
+#include "fec.h"
+#include "control_sched.h"
+
+// Parity fragments appended to the multi-fragment messages of a new device, at most FEC_MAX_PARITY. Off by default,
+// parity costs airtime on a clean link and only wins goodput at around 10% frame loss, but it saves the resend
+// round of most messages on a lossy one
+#define NETWORK_FEC_PARITY 0
+// Scheduler weight of a new device
+#define NETWORK_CONTROL_DEFAULT_WEIGHT 1
+// While lora_tx_congested is set the setpoints go out in every n-th superframe only, n doubles with every congested
+// superframe and shrinks back one step at a time. Superframes without setpoints are shorter, so the downlink slots
+// drain the backlog sooner. A device of weight 1 still gets a setpoint every NETWORK_CONTROL_PERIOD_MAX_MS, unless
+// the fleet alone needs longer. The max stays well below the time the aircraft waits for a setpoint before it cuts
+// the motor
+#define NETWORK_CONTROL_PERIOD_MAX_MS 160
+// Every this many superframes a reply slot goes to the next device in turn even if it owes no report, so the
+// aircraft can start messages of their own. An unused reply slot costs the airtime of the longest frame
+#define NETWORK_REPLY_EVERY 16
 
 typedef enum {
     NETWORK_OK = 0x00,
@@ -75,30 +95,74 @@ typedef struct {
     uint8_t* rx_message;
     uint16_t rx_message_size;
     LoRa_Packet* packet_tx_buff; // assembled packets to be sent to device
-    LoRa_Packet* packet_rx_buff; // stores last received packets from device
+    uint8_t tx_message_id; // message id of the next message sent to the device
+    Arq_Sender arq; // selective repeat state of the message in packet_tx_buff
+    uint8_t tx_parity; // parity fragments appended to multi-fragment messages, 0 disables the erasure code
+    uint8_t packet_tx_num_of_parity; // parity fragments after the data fragments in packet_tx_buff
     uint8_t received_packets; // for security measurements when requesting resend of corrupted packets
-    uint8_t* packet_num_of_faulty_packets; // for packet correction
+    uint8_t* packet_num_of_faulty_packets; // fragments resent in the current round, ARQ_WINDOW entries
     uint8_t num_of_faulty_packets;
+    uint8_t control_weight; // control slots per scheduler cycle while the device is ONLINE, 0 sends it no setpoints
+    uint32_t reply_superframe; // network_superframe_count when the last frame of the device arrived, 0 if none did
 } Network_Device_Context;
 
+// One slot for every 1 byte address
+#define NETWORK_DEVICE_TABLE_SIZE 256
+
+// Devices indexed by address. A context is allocated once when the device is added and never moves, so a pointer
+// taken from the table stays valid while other devices join
 typedef struct {
-    Network_Device_Context* device_contexts;
-    uint8_t num_of_devices;
+    Network_Device_Context* device_contexts[NETWORK_DEVICE_TABLE_SIZE]; // NULL if the address is not registered
+    uint32_t occupied[NETWORK_DEVICE_TABLE_SIZE / 32]; // bit n % 32 of word n / 32 is set if address n is registered
+    uint16_t num_of_devices;
 } Network_Device_Container;
 
+/// Superframe planner of the sender task. The control scheduler picks an ONLINE device for every control slot, there
+/// are as many of them as the total weight, at most TDMA_MAX_CONTROL_SLOTS. Devices that join or leave are picked up
+/// by the next superframe and the setpoint period of each one is logged. Fewer superframes carry setpoints while the
+/// transmit queues are congested, see NETWORK_CONTROL_PERIOD_MAX_MS. See LoRa_Superframe_Planner.
+void network_plan_superframe(Tdma_Superframe* superframe, LoRa_Packet* control[TDMA_MAX_CONTROL_SLOTS]);
 void network_device_processor_task(void* pvParameters);
+/// Single consumer of packet_rx_queue, reassembles the fragments of every device. Unfinished messages are dropped
+/// after REASSEMBLY_TIMEOUT_MS.
 void network_packet_rx_handler_task(void* pvParameters);
+/// Moves a complete message into the device rx buffer, rx_secret_message if the device is ONLINE, rx_message
+/// otherwise, then notifies the device processor.
+/// \param device_ctx Source device.
+/// \param message Complete message from reassembly_add.
+void network_deliver_message(Network_Device_Context* device_ctx, Reassembly_Message* message);
+/// Parses an on-air frame, see lora_codec.h for the format.
+/// \return 0 if successful, 1 if the frame is malformed or corrupted.
 uint8_t network_parse_byte_array_into_packet(LoRa_Packet* packet, uint8_t* byte_arr, uint16_t arr_size);
-void network_parse_packet_into_byte_array(LoRa_Packet* packet, uint8_t* byte_arr);
+/// Serializes the packet into an on-air frame, byte_arr must hold LORA_PACKET_WIRE_MAX_SIZE bytes.
+/// \return Frame length in bytes.
+uint8_t network_parse_packet_into_byte_array(LoRa_Packet* packet, uint8_t* byte_arr);
 void network_init(Network_Device_Container* device_cont);
+/// Registers a device.
+/// \return NETWORK_OK, also if it was registered already, NETWORK_OUT_OF_MEMORY if its context can't be allocated.
 network_operation_t network_add_device(Network_Device_Container* device_cont, uint8_t dev_addr);
+/// Iterates the registered devices in address order:
+/// for (uint16_t addr = network_next_device(cont, 0); addr < NETWORK_DEVICE_TABLE_SIZE; addr = network_next_device(cont, addr + 1))
+/// \param from First address to look at.
+/// \return Lowest registered address from from on, NETWORK_DEVICE_TABLE_SIZE if there is none.
+uint16_t network_next_device(const Network_Device_Container* device_cont, uint16_t from);
 uint8_t check_packet_crc(LoRa_Packet* packet);
-uint8_t construct_message_from_packets(Network_Device_Context* device_ctx);
 uint8_t deconstruct_message_into_packets(Network_Device_Context *device_ctx);
 void network_generate_security_credentials_for_device(Network_Device_Context* device_ctx);
 void network_encrypt_device_message(Network_Device_Context* device_ctx);
 network_operation_t network_decrypt_device_message(Network_Device_Context* device_ctx);
-void set_packets_for_tx(Network_Device_Context* device_ctx, QueueHandle_t* lora_queue);
+/// Sends the message in packet_tx_buff with selective repeat. Only the first round is queued here, the following
+/// ones are queued by the rx handler when the NACK of the device arrives or its report times out.
+/// Never waits for room in the tx queue, fragments that don't fit are left to the following rounds.
+/// packet_tx_buff must not be rebuilt until connection_status returns to CONNECTION_ESTABLISHED.
+/// \param device_ctx Destination device.
+void set_packets_for_tx(Network_Device_Context* device_ctx);
+/// Applies a NACK of the device to the message being sent to it, the missing fragments are queued again.
+/// \param device_ctx Source of the NACK.
+/// \param packet Received NACK.
+void network_receive_nack(Network_Device_Context* device_ctx, LoRa_Packet* packet);
+/// Queues the round again for every device whose NACK did not arrive in time.
+void network_check_arq_timeouts(Network_Device_Container* dev_ctnr);
 /// Extracts auth tag from rx_secret_message, put the tag into rx_auth_tag
 /// \param device_ctx
 void network_get_auth_tag_from_secret_message(Network_Device_Context* device_ctx);
@@ -113,7 +177,6 @@ void network_free_device_tx_secret_message(Network_Device_Context* device_ctx);
 void network_free_device_rx_secret_message(Network_Device_Context* device_ctx);
 void network_free_device_tx_message(Network_Device_Context* device_ctx);
 void network_free_device_rx_message(Network_Device_Context* device_ctx);
-void network_free_device_network_rx_buff(Network_Device_Context* device_ctx);
 void network_free_device_network_tx_buff(Network_Device_Context* device_ctx);
 
 
@@ -0,0 +1,33 @@
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "lora.h"
+
+// Every LoRa_Packet in flight between the radio and the network tasks lives in this pool.
+// Queues carry pointers into it, so a frame is written once and never copied by the queues.
+#define PACKET_POOL_SIZE 32
+
+/// Fills the free list. Must be called before any other packet_pool function.
+void packet_pool_init();
+
+/// Takes a buffer from the pool. The content is not cleared, only the expiry is reset.
+/// \param ticks_to_wait How long to wait for a buffer to be released when the pool is empty.
+/// \return Pointer to the buffer or NULL if the pool stayed empty.
+LoRa_Packet* packet_pool_alloc(TickType_t ticks_to_wait);
+
+/// Gives the buffer back to the pool. The caller can't touch it afterwards.
+/// \param packet Buffer returned by packet_pool_alloc. NULL is ignored.
+void packet_pool_free(LoRa_Packet* packet);
+
+/// Copies only the used part of the packet: header, payload_size bytes of payload and the payload CRC.
+/// The expiry of dst is kept.
+/// \param dst Destination packet.
+/// \param src Source packet.
+void packet_pool_copy(LoRa_Packet* dst, const LoRa_Packet* src);
+
+/// \return Number of buffers currently available.
+uint8_t packet_pool_available();
+
+#endif //PACKET_POOL_H
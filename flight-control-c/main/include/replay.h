@@ -0,0 +1,37 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+
+// Duplicate and replay filter over the 16 bit frame sequence numbers of one source. The window keeps the highest
+// sequence number seen and a bitmap of the REPLAY_WINDOW numbers up to it, every check is O(1). Numbers compare
+// with serial number arithmetic, so the counter may wrap. A source that restarted its counter falls behind the
+// window, it is followed again after REPLAY_RESYNC_AFTER frames in a row were too old. Portable C
+#define REPLAY_WINDOW 64
+#define REPLAY_RESYNC_AFTER 8
+
+typedef enum {
+    REPLAY_FRESH = 0, // newer than every frame so far
+    REPLAY_REORDERED, // not seen yet, but older than the newest frame
+    REPLAY_DUPLICATE, // seen before
+    REPLAY_TOO_OLD, // behind the window, can't be told from a replay
+} Replay_Status;
+
+typedef struct {
+    uint64_t seen; // bit n is set if highest - n was received
+    uint16_t highest;
+    uint8_t started; // 0 until the first frame
+    uint8_t too_old_run; // frames in a row behind the window
+} Replay_Window;
+
+/// Forgets every frame, the next one is fresh.
+/// \param window Window of one source.
+void replay_init(Replay_Window* window);
+
+/// Checks the sequence number of a received frame and marks it seen.
+/// \param window Window of the frame's source.
+/// \param sequence Sequence number of the frame.
+/// \return REPLAY_FRESH or REPLAY_REORDERED if the frame was not seen before.
+Replay_Status replay_check(Replay_Window* window, uint16_t sequence);
+
+#endif //REPLAY_H
@@ -0,0 +1,81 @@
+#include "adr.h"
+#include <string.h>
+
+// Demodulation floors of the SX127x datasheet, CR 4/8 gains about 1.5 dB over 4/5
+const Adr_Profile adr_profiles[ADR_PROFILE_COUNT] = {
+        {.spreading_factor = 7, .bandwidth_hz = 500000, .coding_rate = 5, .required_snr_qdb = -30, .bandwidth_gain_qdb = 0},
+        {.spreading_factor = 8, .bandwidth_hz = 500000, .coding_rate = 5, .required_snr_qdb = -40, .bandwidth_gain_qdb = 0},
+        {.spreading_factor = 9, .bandwidth_hz = 500000, .coding_rate = 5, .required_snr_qdb = -50, .bandwidth_gain_qdb = 0},
+        {.spreading_factor = 10, .bandwidth_hz = 500000, .coding_rate = 5, .required_snr_qdb = -60, .bandwidth_gain_qdb = 0},
+        {.spreading_factor = 10, .bandwidth_hz = 250000, .coding_rate = 8, .required_snr_qdb = -66, .bandwidth_gain_qdb = 12},
+};
+
+void adr_link_init(Adr_Link* link) {
+    memset(link, 0, sizeof(Adr_Link));
+}
+
+void adr_record(Adr_Link* link, uint16_t sequence, int16_t rssi_dbm, int16_t snr_qdb, uint8_t profile) {
+    int16_t gap = (int16_t) (sequence - link->next_sequence);
+    if (!link->synced || gap >= ADR_MAX_GAP || gap < -ADR_MAX_GAP) {
+        link->synced = 1;
+        link->next_sequence = sequence + 1;
+    } else if (gap >= 0) {
+        link->lost += gap;
+        link->next_sequence = sequence + 1;
+    } else if (link->lost != 0) {
+        // a reordered frame, it was counted lost
+        link->lost--;
+    }
+    int32_t snr = snr_qdb - adr_profiles[profile].bandwidth_gain_qdb;
+    int32_t rssi_snr = 4 * (rssi_dbm - ADR_NOISE_FLOOR_DBM);
+    link->snr_sum_qdb += snr < rssi_snr ? snr : rssi_snr;
+    link->received++;
+}
+
+void adr_merge(Adr_Link* link, int16_t snr_qdb, uint16_t received, uint16_t lost) {
+    link->snr_sum_qdb += (int32_t) snr_qdb * received;
+    link->received += received;
+    link->lost += lost;
+}
+
+void adr_restart_window(Adr_Link* link) {
+    link->snr_sum_qdb = 0;
+    link->received = 0;
+    link->lost = 0;
+}
+
+int16_t adr_snr_qdb(const Adr_Link* link) {
+    if (link->received == 0) {
+        return INT16_MIN;
+    }
+    return (int16_t) (link->snr_sum_qdb / link->received);
+}
+
+uint16_t adr_per_permille(const Adr_Link* link) {
+    uint32_t frames = (uint32_t) link->received + link->lost;
+    if (frames == 0) {
+        return 0;
+    }
+    return (uint16_t) ((uint32_t) link->lost * 1000 / frames);
+}
+
+int16_t adr_margin_qdb(const Adr_Link* link, uint8_t profile) {
+    if (link->received == 0) {
+        return INT16_MIN;
+    }
+    return adr_snr_qdb(link) + adr_profiles[profile].bandwidth_gain_qdb - adr_profiles[profile].required_snr_qdb;
+}
+
+uint8_t adr_decide(const Adr_Link* link, uint8_t profile) {
+    if ((uint32_t) link->received + link->lost < ADR_MIN_FRAMES) {
+        return ADR_UNKNOWN;
+    }
+    // a window of lost frames only is as bad as it gets
+    if (adr_per_permille(link) > ADR_PER_TARGET_PERMILLE || adr_margin_qdb(link, profile) < 0) {
+        return profile + 1 < ADR_PROFILE_COUNT ? profile + 1 : profile;
+    }
+    if (profile > 0 && adr_margin_qdb(link, profile - 1) >= ADR_MARGIN_QDB) {
+        return profile - 1;
+    }
+    return profile;
+}
@@ -0,0 +1,47 @@
+#include "control_sched.h"
+#include <string.h>
+
+void control_sched_init(Control_Sched* sched) {
+    memset(sched, 0, sizeof(Control_Sched));
+}
+
+void control_sched_set_weight(Control_Sched* sched, uint8_t dev_addr, uint8_t weight) {
+    uint32_t bit = (uint32_t) 1 << (dev_addr % 32);
+    sched->total_weight = sched->total_weight - sched->weight[dev_addr] + weight;
+    if (weight == 0 && sched->weight[dev_addr] != 0) {
+        sched->members[dev_addr / 32] &= ~bit;
+        sched->num_of_devices--;
+    } else if (weight != 0 && sched->weight[dev_addr] == 0) {
+        sched->members[dev_addr / 32] |= bit;
+        sched->num_of_devices++;
+    }
+    sched->weight[dev_addr] = weight;
+    memset(sched->credit, 0, sizeof(sched->credit));
+}
+
+uint16_t control_sched_next(Control_Sched* sched) {
+    uint16_t picked = CONTROL_SCHED_NONE;
+    int32_t best = INT32_MIN;
+    for (uint16_t w = 0; w < CONTROL_SCHED_TABLE_SIZE / 32; w++) {
+        for (uint32_t word = sched->members[w]; word != 0; word &= word - 1) {
+            uint16_t addr = w * 32 + __builtin_ctz(word);
+            sched->credit[addr] += sched->weight[addr];
+            // ties go to the lower address
+            if (sched->credit[addr] > best) {
+                best = sched->credit[addr];
+                picked = addr;
+            }
+        }
+    }
+    if (picked != CONTROL_SCHED_NONE) {
+        sched->credit[picked] -= sched->total_weight;
+    }
+    return picked;
+}
+
+uint32_t control_sched_device_period_us(const Control_Sched* sched, uint8_t dev_addr, uint32_t tick_us) {
+    if (sched->weight[dev_addr] == 0) {
+        return 0;
+    }
+    return (uint32_t) ((uint64_t) tick_us * sched->total_weight / sched->weight[dev_addr]);
+}
@@ -1,5 +1,7 @@
 
 #include "lora.h"
+#include "packet_pool.h"
+#include "lora_codec.h"
 
 static const char TAG[] = "LoRa";
 
@@ -7,7 +9,10 @@ static const char TAG[] = "LoRa";
 SemaphoreHandle_t xLoraMutex;
 // Rx buff mutex is not needed because the rx_callback dispatches the tasks
 // TX buffer is not needed because the task will send data when it receives a packet from queue
+// Bulk traffic: message fragments and single frame messages
 QueueHandle_t lora_tx_queue;
+// Link management: NACKs, served before bulk traffic
+QueueHandle_t lora_tx_link_queue;
 SemaphoreHandle_t xLoraTXQueueMutex;
 struct sx127x_t *lora_device;
 spi_device_handle_t lora_spi_device;
@@ -15,23 +20,106 @@ TaskHandle_t lora_interrupt_handler;
 // When a packet needs to be sent, only put in the rx buffer
 // The sender task sends the packets
 TaskHandle_t lora_packet_sender_handler;
+// FIFO transfers run on the async worker, so neither the interrupt task nor the sender waits for the SPI bus
+sx127x_async *lora_async;
+// Frames handed to the async worker. A slot is reused only after its FIFO load completed
+typedef struct {
+    WORD_ALIGNED_ATTR uint8_t header[LORA_PACKET_WIRE_MAX_HEADER_SIZE];
+    sx127x_segment_t segments[LORA_PACKET_WIRE_SEGMENTS];
+    LoRa_Packet* packet; // payload is sent from the pool buffer, released once loaded
+    int64_t load_start;
+} LoRa_TX_Frame;
+
+// Entry of the class queues
+typedef struct {
+    LoRa_Packet* packet;
+    int64_t queued_at; // us
+} LoRa_TX_Entry;
+
+LoRa_TX_Frame lora_tx_frames[LORA_TX_FRAME_BUFFERS];
+SemaphoreHandle_t lora_tx_frame_semaphore;
+// given by tx_callback, the sender loads the next frame only after the previous one left the radio
+SemaphoreHandle_t lora_tx_done_semaphore;
+uint8_t lora_tx_frame_index = 0;
+// queue wait of the frames taken by the sender, stale and overflow drops, per traffic class
+LoRa_Class_Stats lora_class_stats[LORA_CLASS_COUNT];
+portMUX_TYPE lora_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+// sequence numbers and replay windows of every address, zeroed windows accept the first frame
+LoRa_Peer lora_peers[256];
+
+// Fixed length header of control frames, coding rate and CRC match lora_modem_profile
+sx127x_implicit_header_t lora_control_header = {
+        .length = LORA_CONTROL_WIRE_SIZE,
+        .crc = SX127x_RX_PAYLOAD_CRC_OFF,
+        .coding_rate = SX127x_CR_4_5,
+};
+// airtime of a LORA_PACKET_WIRE_MAX_SIZE frame with explicit header, sets the length of the reply and downlink slots
+uint32_t lora_max_frame_airtime_us;
+// airtime of a control frame with implicit header, sets the length of the beacon and the control slots
+uint32_t lora_control_airtime_us;
+// slot lengths of the superframe, derived from the airtimes above
+Tdma_Timing lora_tdma_timing;
+// longest superframe the slot limits allow, beacon included
+uint32_t lora_superframe_max_us;
+LoRa_Superframe_Planner lora_superframe_planner = NULL;
+// the sender waits for the start of its next slot on it
+esp_timer_handle_t lora_slot_timer;
+SemaphoreHandle_t lora_slot_semaphore;
+// time the listen before talk CADs take, the sender starts them this early, 0 if LORA_LBT_CAD_SYMBOLS is 0
+uint32_t lora_lbt_us;
+// given by cad_callback with the result in lora_cad_detected
+SemaphoreHandle_t lora_cad_semaphore;
+volatile uint8_t lora_cad_detected;
+// Adaptive data rate, see adr.h. The profile the link runs and the one offered to the aircraft, equal while no switch
+// is negotiated. Both are only changed on the rx path, lora_profile_applied runs there too
+uint8_t lora_link_profile = 0;
+uint8_t lora_link_target = 0;
+int64_t lora_link_offered_at;
+uint8_t lora_link_unacked = 0;
+// profile every aircraft acknowledged, the next beacon announces it and the sender applies it at the end of that
+// superframe. ADR_UNKNOWN while none is
+volatile uint8_t lora_link_switch = ADR_UNKNOWN;
+// given by lora_profile_applied once the worker configured the radio and derived the new timing, with its result
+SemaphoreHandle_t lora_profile_semaphore;
+volatile int lora_profile_result;
+// message id of the next lora_send_message call
+uint8_t lora_tx_message_id = 0;
+// fragments are reassembled by network_packet_rx_handler_task
+extern QueueHandle_t packet_rx_queue;
+
+// Modem configuration of the link, the ground station and the aircraft must use the same values
+sx127x_modem_profile_t lora_modem_profile = {
+        .frequency = 437200012,
+        .bandwidth = SX127x_BW_500000,
+        .spreading_factor = SX127x_SF_7,
+        .coding_rate = SX127x_CR_4_5,
+        .crc = SX127x_RX_PAYLOAD_CRC_OFF,
+        .implicit_header = NULL,
+        .syncword = 18,
+        .preamble_length = 8,
+        .pa_pin = SX127x_PA_PIN_BOOST,
+        .power = 4,
+        .dio_mapping1 = SX127x_DIO0_RX_DONE,
+        .dio_mapping2 = SX127x_DIO4_CAD_DETECTED,
+};
 
 
 uint16_t lora_calc_header_crc(LoRa_Packet_Header* header){
-    uint8_t header_arr[5] = {header->src_device_addr, header->dest_device_addr,
-                             header->num_of_packets, header->packet_num,
+    uint8_t header_arr[7] = {header->message_type, header->src_device_addr, header->dest_device_addr,
+                             header->num_of_packets, header->packet_num, header->message_id,
                              header->payload_size};
 
-    return crc16_be(0, header_arr, 5);
+    return crc16(0, header_arr, 7);
 }
 
 uint16_t lora_calc_packet_crc(LoRa_Packet_Payload* payload, uint8_t payload_length){
-    return crc16_be(0, payload->payload, payload_length);
+    return crc16(0, payload->payload, payload_length);
 }
 
 void lora_display_packet(LoRa_Packet* packet_to_display){
     printf("Printing packet...\n");
     printf("\tHeader:\n");
+    printf("\t\tMessage type: %d\n", packet_to_display->header.message_type);
     printf("\t\tSource device address: %d\n", packet_to_display->header.src_device_addr);
     printf("\t\tDestination device address: %d\n", packet_to_display->header.dest_device_addr);
     printf("\t\tNumber of Packets: %d\n", packet_to_display->header.num_of_packets);
@@ -53,9 +141,55 @@ void IRAM_ATTR lora_handle_interrupt_fromisr(void *arg)
     xTaskResumeFromISR(lora_interrupt_handler);
 }
 
+// Sets the modem profile and the control frame header to a profile of the adaptive data rate ladder
+static void lora_load_profile(uint8_t profile) {
+    const Adr_Profile* adr = &adr_profiles[profile];
+    lora_modem_profile.spreading_factor = (sx127x_sf_t) (adr->spreading_factor << 4);
+    lora_modem_profile.coding_rate = (sx127x_cr_t) ((adr->coding_rate - 4) << 1);
+    switch (adr->bandwidth_hz) {
+        case 125000:
+            lora_modem_profile.bandwidth = SX127x_BW_125000;
+            break;
+        case 250000:
+            lora_modem_profile.bandwidth = SX127x_BW_250000;
+            break;
+        default:
+            lora_modem_profile.bandwidth = SX127x_BW_500000;
+            break;
+    }
+    lora_control_header.coding_rate = lora_modem_profile.coding_rate;
+}
+
+// Derives the airtimes, the slot lengths and the CAD time from the modem profile the radio runs. Configures the radio
+// synchronously, so only init_lora and the async worker may call it. The radio is left with explicit header
+static void lora_load_timing(sx127x* lora_dev) {
+    // airtime of a control frame with both header modes, calculated from the shadowed configuration
+    uint32_t control_explicit_us;
+    ESP_ERROR_CHECK(sx127x_get_time_on_air(lora_dev, LORA_PACKET_WIRE_MAX_SIZE, &lora_max_frame_airtime_us));
+    ESP_ERROR_CHECK(sx127x_get_time_on_air(lora_dev, LORA_CONTROL_WIRE_SIZE, &control_explicit_us));
+    ESP_ERROR_CHECK(sx127x_set_implicit_header(&lora_control_header, lora_dev));
+    ESP_ERROR_CHECK(sx127x_get_time_on_air(lora_dev, LORA_CONTROL_WIRE_SIZE, &lora_control_airtime_us));
+    ESP_LOGI(TAG, "Control frame airtime: %lu us with explicit, %lu us with implicit header", control_explicit_us, lora_control_airtime_us);
+    ESP_ERROR_CHECK(sx127x_set_implicit_header(NULL, lora_dev));
+    tdma_timing_init(&lora_tdma_timing, lora_control_airtime_us, lora_max_frame_airtime_us);
+    Tdma_Superframe longest = {
+            .control_slots = TDMA_MAX_CONTROL_SLOTS,
+            .downlink_slots = TDMA_MAX_DOWNLINK_SLOTS,
+            .reply_owner = {[0 ... TDMA_MAX_REPLY_SLOTS - 1] = LORA_NETWORK_BROADCAST_ADDR},
+    };
+    lora_superframe_max_us = lora_tdma_timing.beacon_slot_us + tdma_superframe_end_us(&lora_tdma_timing, &longest);
+    ESP_LOGI(TAG, "Slots: control %lu us, reply %lu us, downlink %lu us, superframe at most %lu us",
+             lora_tdma_timing.control_slot_us, lora_tdma_timing.reply_slot_us, lora_tdma_timing.downlink_slot_us,
+             lora_superframe_max_us);
+    uint32_t bandwidth;
+    ESP_ERROR_CHECK(sx127x_get_bandwidth(lora_dev, &bandwidth));
+    // a CAD listens for one symbol and takes about as long again to evaluate it
+    lora_lbt_us = LORA_LBT_CAD_SYMBOLS * 2 * (uint32_t) ((1000000ULL << (lora_modem_profile.spreading_factor >> 4)) / bandwidth);
+}
+
 void init_lora(spi_device_handle_t* spi_device, sx127x* lora_dev) {
     spi_device_interface_config_t dev_cfg = {
-            .clock_speed_hz = 100000,
+            .clock_speed_hz = LORA_SPI_CLOCK_SPEED_HZ,
             .spics_io_num = LORA_SS_PIN,
             .queue_size = 16,
             .command_bits = 0,
@@ -64,24 +198,37 @@ void init_lora(spi_device_handle_t* spi_device, sx127x* lora_dev) {
             .mode = 0
     };
 
+    packet_pool_init();
     ESP_ERROR_CHECK(spi_bus_add_device(LORA_SPI_HOST, &dev_cfg, spi_device));
     //spi_device_acquire_bus(lora_spi_device, portMAX_DELAY);
     ESP_ERROR_CHECK(sx127x_create(*spi_device, &lora_dev));
     ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_SLEEP, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_frequency(437200012, lora_dev));
     ESP_ERROR_CHECK(sx127x_reset_fifo(lora_dev));
     ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_STANDBY, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_bandwidth(SX127x_BW_500000, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_implicit_header(NULL, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_modem_config_2(SX127x_SF_7, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_syncword(18, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_preamble_length(8, lora_dev));
+    lora_load_profile(lora_link_profile);
+    ESP_ERROR_CHECK(sx127x_apply_profile(&lora_modem_profile, lora_dev));
+    lora_load_timing(lora_dev);
     sx127x_set_tx_callback(tx_callback, lora_dev);
     sx127x_set_rx_callback(rx_callback, lora_dev);
+    sx127x_set_cad_callback(cad_callback, lora_dev);
 
     ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_RX_CONT, lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_pa_config(SX127x_PA_PIN_BOOST, 4, lora_dev));
     //spi_device_release_bus(lora_spi_device);
+    lora_tx_frame_semaphore = xSemaphoreCreateCounting(LORA_TX_FRAME_BUFFERS, LORA_TX_FRAME_BUFFERS);
+    lora_tx_done_semaphore = xSemaphoreCreateBinary();
+    lora_slot_semaphore = xSemaphoreCreateBinary();
+    lora_cad_semaphore = xSemaphoreCreateBinary();
+    lora_profile_semaphore = xSemaphoreCreateBinary();
+    for (uint16_t addr = 0; addr < 256; addr++) {
+        lora_peers[addr].uplink_want = ADR_UNKNOWN;
+        lora_peers[addr].downlink_want = ADR_UNKNOWN;
+    }
+    const esp_timer_create_args_t slot_timer_args = {
+            .callback = lora_slot_timer_expired,
+            .name = "lora slot",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&slot_timer_args, &lora_slot_timer));
+    ESP_ERROR_CHECK(sx127x_async_create(lora_dev, LORA_ASYNC_QUEUE_LENGTH, LORA_ASYNC_TASK_PRIORITY, &lora_async));
     BaseType_t task_code = xTaskCreatePinnedToCore(handle_interrupt_task, "handle interrupt", 8196, lora_dev, 100, &lora_interrupt_handler, xPortGetCoreID());
     if (task_code != pdPASS)
     {
@@ -99,7 +246,9 @@ void init_lora(spi_device_handle_t* spi_device, sx127x* lora_dev) {
 
     xLoraMutex = xSemaphoreCreateMutex();
     xLoraTXQueueMutex = xSemaphoreCreateMutex();
-    lora_tx_queue = xQueueCreate(50, sizeof(LoRa_Packet));
+    // every entry holds a pool buffer, neither queue can overflow
+    lora_tx_queue = xQueueCreate(PACKET_POOL_SIZE, sizeof(LoRa_TX_Entry));
+    lora_tx_link_queue = xQueueCreate(PACKET_POOL_SIZE, sizeof(LoRa_TX_Entry));
     BaseType_t sender_task_code = xTaskCreatePinnedToCore(lora_packet_sender_task, "PacketSenderTask", 5120, lora_dev, 2, &lora_packet_sender_handler, 1);
     if (sender_task_code != pdPASS)
     {
@@ -121,13 +270,168 @@ void handle_interrupt_task(void *arg)
 void tx_callback(sx127x *device)
 {
     //ESP_LOGI(TAG, "transmitted");
+    xSemaphoreGive(lora_tx_done_semaphore);
+}
+
+void cad_callback(sx127x *device, int detected) {
+    lora_cad_detected = detected != 0;
+    xSemaphoreGive(lora_cad_semaphore);
 }
 
+// Queues a link management frame to the aircraft.
+// \return 0 if it was queued
+static uint8_t lora_link_send(const LoRa_Link_Frame* link, uint8_t dest_addr, int64_t expires_at) {
+    LoRa_Packet* packet = packet_pool_alloc(0);
+    if (packet == NULL) {
+        ESP_LOGW(TAG, "No free packet buffer, link frame dropped");
+        return 1;
+    }
+    lora_codec_encode_link(link, LORA_BASE_STATION_ADDR, dest_addr, packet);
+    packet->expires_at = expires_at;
+    return lora_tx_enqueue(packet, LORA_OVERFLOW_DROP_NEWEST);
+}
+
+// Offers a profile to every active aircraft, the switch waits for all of them to acknowledge it
+static void lora_link_offer(uint8_t profile, int64_t now) {
+    LoRa_Link_Frame offer = {.op = LORA_LINK_SWITCH, .profile = profile};
+    lora_link_target = profile;
+    lora_link_offered_at = now;
+    lora_link_unacked = 0;
+    for (uint16_t addr = 0; addr < 256; addr++) {
+        LoRa_Peer* peer = &lora_peers[addr];
+        if (peer->heard_at == 0 || now - peer->heard_at > LORA_LINK_ACTIVE_MS * 1000) {
+            continue;
+        }
+        // a lost offer is covered by the timeout, the next report offers the profile again
+        lora_link_send(&offer, addr, now + LORA_LINK_SWITCH_TIMEOUT_MS * 1000);
+        peer->switch_unacked = 1;
+        lora_link_unacked++;
+    }
+    ESP_LOGI(TAG, "Profile %u offered to %u aircraft", profile, lora_link_unacked);
+}
+
+// Picks the profile the active aircraft need. Any of them asking for a more robust profile gets it, a faster one is
+// only offered once every one of them has a full window asking for it. Only the rx path may call it
+static void lora_link_evaluate() {
+    int64_t now = esp_timer_get_time();
+    if (lora_link_target != lora_link_profile) {
+        if (lora_link_switch == ADR_UNKNOWN && now - lora_link_offered_at > LORA_LINK_SWITCH_TIMEOUT_MS * 1000) {
+            ESP_LOGW(TAG, "Profile %u not acknowledged by %u aircraft, given up", lora_link_target, lora_link_unacked);
+            for (uint16_t addr = 0; addr < 256; addr++) {
+                lora_peers[addr].switch_unacked = 0;
+            }
+            lora_link_target = lora_link_profile;
+        }
+        return;
+    }
+    uint8_t wanted = 0;
+    uint8_t undecided = 0;
+    uint8_t active = 0;
+    for (uint16_t addr = 0; addr < 256; addr++) {
+        LoRa_Peer* peer = &lora_peers[addr];
+        if (peer->heard_at == 0 || now - peer->heard_at > LORA_LINK_ACTIVE_MS * 1000) {
+            continue;
+        }
+        active++;
+        // a full window asks once, the next one starts empty
+        uint8_t want = adr_decide(&peer->uplink, lora_link_profile);
+        if (want != ADR_UNKNOWN) {
+            peer->uplink_want = want;
+            adr_restart_window(&peer->uplink);
+        }
+        want = adr_decide(&peer->downlink, lora_link_profile);
+        if (want != ADR_UNKNOWN) {
+            peer->downlink_want = want;
+            adr_restart_window(&peer->downlink);
+        }
+        if (peer->uplink_want == ADR_UNKNOWN && peer->downlink_want == ADR_UNKNOWN) {
+            undecided = 1;
+            continue;
+        }
+        want = peer->uplink_want == ADR_UNKNOWN ? peer->downlink_want :
+               peer->downlink_want == ADR_UNKNOWN ? peer->uplink_want :
+               peer->uplink_want > peer->downlink_want ? peer->uplink_want : peer->downlink_want;
+        wanted = want > wanted ? want : wanted;
+    }
+    if (active != 0 && (wanted > lora_link_profile || (wanted < lora_link_profile && !undecided))) {
+        lora_link_offer(wanted, now);
+    }
+}
+
+// Adds a frame received from a peer to its uplink window
+static void lora_link_record(const LoRa_Packet* packet, int16_t rssi, float snr) {
+    LoRa_Peer* peer = &lora_peers[packet->header.src_device_addr];
+    adr_record(&peer->uplink, packet->header.sequence, rssi, (int16_t) (snr * 4), lora_link_profile);
+    peer->heard_at = esp_timer_get_time();
+}
+
+static void lora_receive_link(const LoRa_Packet* packet) {
+    LoRa_Link_Frame link;
+    LoRa_Peer* peer = &lora_peers[packet->header.src_device_addr];
+    if (lora_codec_decode_link(packet, &link) != 0) {
+        ESP_LOGD(TAG, "Invalid link frame dropped");
+        return;
+    }
+    switch (link.op) {
+        case LORA_LINK_REPORT:
+            // a window measured with another profile says nothing about this one
+            if (link.profile == lora_link_profile) {
+                adr_merge(&peer->downlink, link.snr_qdb, link.received, link.lost);
+            }
+            lora_link_evaluate();
+            break;
+        case LORA_LINK_ACK:
+            if (link.profile != lora_link_target || !peer->switch_unacked) {
+                break;
+            }
+            peer->switch_unacked = 0;
+            if (--lora_link_unacked == 0) {
+                lora_link_switch = lora_link_target;
+            }
+            break;
+        default:
+            ESP_LOGD(TAG, "Unknown link op %d from %#X", link.op, packet->header.src_device_addr);
+            break;
+    }
+}
+
+uint8_t lora_link_reply_due(uint8_t dev_addr) {
+    return lora_peers[dev_addr].switch_unacked;
+}
+
+void lora_profile_applied(sx127x *device, int code, void *arg) {
+    lora_profile_result = code;
+    if (code != SX127X_OK) {
+        // the link keeps its profile and timing, lora_switch_profile puts the radio back on it
+        ESP_LOGE(TAG, "can't apply modem profile %d", code);
+        xSemaphoreGive(lora_profile_semaphore);
+        return;
+    }
+    lora_load_timing(device);
+    // on the rx path like the rest of the adaptive data rate state. Every window starts over with the new profile
+    lora_link_profile = lora_link_target;
+    lora_link_switch = ADR_UNKNOWN;
+    for (uint16_t addr = 0; addr < 256; addr++) {
+        adr_restart_window(&lora_peers[addr].uplink);
+        adr_restart_window(&lora_peers[addr].downlink);
+        lora_peers[addr].uplink_want = ADR_UNKNOWN;
+        lora_peers[addr].downlink_want = ADR_UNKNOWN;
+    }
+    ESP_LOGI(TAG, "Modem profile %u: SF%u, %lu Hz, CR 4/%u", lora_link_profile,
+             adr_profiles[lora_link_profile].spreading_factor, adr_profiles[lora_link_profile].bandwidth_hz,
+             adr_profiles[lora_link_profile].coding_rate);
+    xSemaphoreGive(lora_profile_semaphore);
+}
 
 void rx_callback(sx127x *device) {
-    uint8_t *data = NULL;
-    uint8_t data_length = 0;
-    esp_err_t code = sx127x_read_payload(device, &data, &data_length);
+    // FIFO is read by the async worker, the interrupt task is free for the next irq
+    int code = sx127x_async_read_payload(lora_async, rx_payload_callback, NULL);
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't queue payload read %d", code);
+    }
+}
+
+void rx_payload_callback(sx127x *device, int code, uint8_t *data, uint8_t data_length, void *arg) {
     if (code != ESP_OK) {
         ESP_LOGE(TAG, "can't read %d", code);
         return;
@@ -136,109 +440,574 @@ void rx_callback(sx127x *device) {
         // no message received
         return;
     }
-    uint8_t payload[514];
-    const char SYMBOLS[] = "0123456789ABCDEF";
-    for (size_t i = 0; i < data_length; i++) {
-        uint8_t cur = data[i];
-        payload[2 * i] = SYMBOLS[cur >> 4];
-        payload[2 * i + 1] = SYMBOLS[cur & 0x0F];
-    }
-    payload[data_length * 2] = '\0';
-
     int16_t rssi;
     ESP_ERROR_CHECK(sx127x_get_packet_rssi(device, &rssi));
     float snr;
     ESP_ERROR_CHECK(sx127x_get_packet_snr(device, &snr));
-    int32_t frequency_error;
-    ESP_ERROR_CHECK(sx127x_get_frequency_error(device, &frequency_error));
+    // runs on the async worker for every frame, TX, RX and profile requests queue up behind it
+    ESP_LOGD(TAG, "received: %d bytes type %d rssi: %d snr: %d qdB", data_length, LORA_WIRE_MESSAGE_TYPE(data[0]), rssi,
+             (int) (snr * 4));
+
+    // control, header mode and beacon frames only go to the aircraft
+    if (packet_rx_queue == NULL || LORA_WIRE_MESSAGE_TYPE(data[0]) == LORA_MESSAGE_CONTROL ||
+        LORA_WIRE_MESSAGE_TYPE(data[0]) == LORA_MESSAGE_HEADER_MODE ||
+        LORA_WIRE_MESSAGE_TYPE(data[0]) == LORA_MESSAGE_BEACON) {
+        return;
+    }
+    // decoded from the FIFO DMA buffer straight into the pool buffer, the queue only carries the pointer
+    LoRa_Packet* packet_received = packet_pool_alloc(0);
+    if (packet_received == NULL) {
+        ESP_LOGE(TAG, "No free packet buffer, frame dropped");
+        return;
+    }
+    // the replay window only follows frames addressed to this device
+    if (lora_codec_decode(packet_received, data, data_length) != 0 ||
+        packet_received->header.dest_device_addr != LORA_BASE_STATION_ADDR ||
+        !lora_accept_sequence(packet_received, 0)) {
+        packet_pool_free(packet_received);
+        return;
+    }
+    lora_link_record(packet_received, rssi, snr);
+    if (packet_received->header.message_type == LORA_MESSAGE_LINK) {
+        lora_receive_link(packet_received);
+        packet_pool_free(packet_received);
+        return;
+    }
+    if (packet_received->header.message_type == LORA_MESSAGE_BATCH) {
+        lora_demux_batch(packet_received);
+        return;
+    }
+    // the freshest frames matter most to the reassembly and the selective repeat state
+    lora_rx_enqueue(packet_received, LORA_OVERFLOW_DROP_OLDEST);
+}
+
+static void lora_record_wait(LoRa_Traffic_Class traffic_class, int64_t queued_at) {
+    int64_t wait = esp_timer_get_time() - queued_at;
+    taskENTER_CRITICAL(&lora_stats_lock);
+    lora_class_stats[traffic_class].sent++;
+    lora_class_stats[traffic_class].wait_total_us += wait;
+    if (wait > lora_class_stats[traffic_class].wait_max_us) {
+        lora_class_stats[traffic_class].wait_max_us = wait;
+    }
+    taskEXIT_CRITICAL(&lora_stats_lock);
+}
+
+static uint8_t lora_frame_expired(const LoRa_Packet* packet) {
+    return packet->expires_at != 0 && esp_timer_get_time() >= packet->expires_at;
+}
+
+// Releases a frame that expired before the sender got to it
+static void lora_drop_expired(LoRa_Traffic_Class traffic_class, LoRa_Packet* packet) {
+    taskENTER_CRITICAL(&lora_stats_lock);
+    lora_class_stats[traffic_class].expired++;
+    taskEXIT_CRITICAL(&lora_stats_lock);
+    ESP_LOGD(TAG, "Expired frame of type %d to %#X dropped", packet->header.message_type,
+             packet->header.dest_device_addr);
+    packet_pool_free(packet);
+}
+
+static void lora_record_overflow(LoRa_Traffic_Class traffic_class, uint8_t received) {
+    taskENTER_CRITICAL(&lora_stats_lock);
+    if (received) {
+        lora_class_stats[traffic_class].rx_overflow++;
+    } else {
+        lora_class_stats[traffic_class].overflow++;
+    }
+    taskEXIT_CRITICAL(&lora_stats_lock);
+}
+
+// Puts a frame the sender took back to the front of its queue. A producer may have filled the slot meanwhile,
+// then the frame is lost like the oldest frame of a full queue
+static void lora_tx_requeue(QueueHandle_t queue, LoRa_Traffic_Class traffic_class, LoRa_TX_Entry* entry) {
+    if (xQueueSendToFront(queue, entry, 0) != pdPASS) {
+        lora_record_overflow(traffic_class, 0);
+        packet_pool_free(entry->packet);
+    }
+}
+
+static void lora_wait_until(int64_t time) {
+    int64_t wait = time - esp_timer_get_time();
+    if (wait <= 0) {
+        return;
+    }
+    ESP_ERROR_CHECK(esp_timer_start_once(lora_slot_timer, wait));
+    xSemaphoreTake(lora_slot_semaphore, portMAX_DELAY);
+}
+
+static void lora_listen() {
+    for (int attempt = 1;; attempt++) {
+        int code = sx127x_async_set_implicit_header(NULL, lora_async, NULL, NULL);
+        if (code == SX127X_OK) {
+            code = sx127x_async_set_opmod(SX127x_MODE_RX_CONT, lora_async, lora_async_callback, NULL);
+        }
+        if (code == SX127X_OK) {
+            return;
+        }
+        ESP_LOGE(TAG, "can't queue return to rx %d", code);
+        if (attempt == LORA_ASYNC_RETRIES) {
+            return;
+        }
+        lora_wait_until(esp_timer_get_time() + LORA_ASYNC_RETRY_MS * 1000);
+    }
+}
+
+// Runs one CAD, the radio is in standby afterwards. A CAD that can't be started or never completes counts as clear
+static uint8_t lora_cad() {
+    xSemaphoreTake(lora_cad_semaphore, 0);
+    int code = sx127x_async_set_opmod(SX127x_MODE_STANDBY, lora_async, NULL, NULL);
+    if (code == SX127X_OK) {
+        code = sx127x_async_set_opmod(SX127x_MODE_CAD, lora_async, lora_async_callback, NULL);
+    }
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't queue CAD %d", code);
+        return 0;
+    }
+    if (xSemaphoreTake(lora_cad_semaphore, pdMS_TO_TICKS(LORA_TX_DONE_MARGIN_MS)) != pdTRUE) {
+        ESP_LOGW(TAG, "No CAD_DONE");
+        return 0;
+    }
+    return lora_cad_detected;
+}
+
+// Listen before talk, see LORA_LBT_CAD_SYMBOLS. Every busy CAD doubles the range of the random backoff, the sender
+// holds the radio meanwhile. The caller owns xLoraMutex.
+// \return 1 if the channel was clear by latest_start, 0 if it stayed busy
+static uint8_t lora_channel_clear(LoRa_Traffic_Class traffic_class, int64_t latest_start) {
+    for (uint8_t attempt = 1; ; attempt++) {
+        uint8_t busy = 0;
+        for (int i = 0; i < LORA_LBT_CAD_SYMBOLS && !busy; i++) {
+            busy = lora_cad();
+        }
+        if (!busy) {
+            return 1;
+        }
+        uint8_t exponent = attempt < LORA_LBT_BACKOFF_MAX_EXP ? attempt : LORA_LBT_BACKOFF_MAX_EXP;
+        int64_t resume = esp_timer_get_time() + (1 + esp_random() % (1u << exponent)) * LORA_LBT_BACKOFF_UNIT_US;
+        taskENTER_CRITICAL(&lora_stats_lock);
+        lora_class_stats[traffic_class].busy++;
+        if (resume > latest_start) {
+            lora_class_stats[traffic_class].busy_skipped++;
+        }
+        taskEXIT_CRITICAL(&lora_stats_lock);
+        if (resume > latest_start) {
+            return 0;
+        }
+        lora_wait_until(resume);
+    }
+}
 
-    ESP_LOGI(TAG, "received: %d %s rssi: %d snr: %f freq_error: %ld", data_length, payload, rssi, snr, frequency_error);
+// Moves the radio to a profile of the adaptive data rate ladder and waits until the worker derived its timing.
+// The caller owns xLoraMutex
+static void lora_switch_profile(uint8_t profile) {
+    lora_load_profile(profile);
+    xSemaphoreTake(lora_profile_semaphore, 0);
+    int code = sx127x_async_set_opmod(SX127x_MODE_STANDBY, lora_async, NULL, NULL);
+    if (code == SX127X_OK) {
+        code = sx127x_async_apply_profile(&lora_modem_profile, lora_async, lora_profile_applied, NULL);
+    }
+    if (code != SX127X_OK) {
+        // the next beacon announces the switch again
+        ESP_LOGE(TAG, "can't queue modem profile %d", code);
+        lora_load_profile(lora_link_profile);
+        return;
+    }
+    xSemaphoreTake(lora_profile_semaphore, portMAX_DELAY);
+    if (lora_profile_result == SX127X_OK) {
+        return;
+    }
+    // the switch stays pending, the next beacon announces it again and the sender retries at the end of that
+    // superframe. The aircraft that already switched keep the profile meanwhile, they only scan once the link is lost.
+    // Until then the radio goes back to the profile the slots are timed for, the worker runs it before the next request
+    lora_load_profile(lora_link_profile);
+    code = sx127x_async_apply_profile(&lora_modem_profile, lora_async, lora_async_callback, NULL);
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't queue modem profile %d", code);
+    }
+}
+
+void lora_slot_timer_expired(void* arg) {
+    xSemaphoreGive(lora_slot_semaphore);
 }
 
 void lora_packet_sender_task(void* pvParameters) {
     sx127x* lora_dev = (sx127x*) pvParameters;
-    LoRa_Packet packet_to_send;
-    // Optimization: if there are messages which has packet left to send
-    // the program does not set the LoRa mode back to receiving until every message has been sent
-    // which is indicated by the 0 value
-    uint8_t messages_unfinished = 0;
-    uint8_t mode = SX127x_MODE_RX_CONT;
-    uint8_t lora_mutex_is_held_by_task = 0;
+    Tdma_Superframe superframe;
+    LoRa_Packet* control[TDMA_MAX_CONTROL_SLOTS];
+    int64_t next_superframe = esp_timer_get_time();
+    // Superframes run back to back, see tdma.h. Every slot starts at its offset from the end of the beacon,
+    // whether the previous one was used or not. The radio listens during the reply slots and between two
+    // superframes, downlink frames queued meanwhile wait for the next superframe. A superframe lasts at least
+    // LORA_SUPERFRAME_MIN_MS. With listen before talk the CADs of a slot run in the guard time before it, a frame
+    // that finds no clear channel while it would still end in its slot is left out. A modem profile switch every
+    // aircraft acknowledged is announced by the beacon of a superframe and applied by both ends once it ended
     while (1) {
-        if( xQueueReceive(lora_tx_queue, &packet_to_send, portMAX_DELAY) == pdPASS )
-        {
-            if ( lora_mutex_is_held_by_task || xSemaphoreTake(xLoraMutex, portMAX_DELAY) == pdTRUE) {
-                lora_mutex_is_held_by_task = 1;
-                // ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_RX_CONT, lora_dev));
-
-                ESP_ERROR_CHECK(lora_send_packet(lora_dev, &packet_to_send));
-                // Indicating the last packet of the message
-                if (packet_to_send.header.packet_num == packet_to_send.header.num_of_packets - 1 &&
-                    packet_to_send.header.num_of_packets != 1) {
-                    messages_unfinished--;
-                }
-
-                // Indicating start of the message
-                if (packet_to_send.header.packet_num == 0 && packet_to_send.header.num_of_packets != 1) {
-                    messages_unfinished++;
-                }
-
-//                // Indicating all messages has been sent
-//                if (messages_unfinished == 0) {
-//                    ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_RX_CONT, lora_dev));
-//                    mode = SX127x_MODE_RX_CONT;
-//                    xSemaphoreGive(xLoraMutex);
-//                    lora_mutex_is_held_by_task = 0;
-//                }
-
-                //lora_display_packet(&packet_to_send);
-
-                xSemaphoreGive(xLoraMutex);
-                lora_mutex_is_held_by_task = 0;
+        lora_wait_until(next_superframe);
+        int64_t superframe_start = esp_timer_get_time();
+        memset(&superframe, 0, sizeof(superframe));
+        memset(control, 0, sizeof(control));
+        superframe.downlink_slots = lora_tx_backlog() < TDMA_MAX_DOWNLINK_SLOTS ? lora_tx_backlog() : TDMA_MAX_DOWNLINK_SLOTS;
+        if (lora_superframe_planner != NULL) {
+            lora_superframe_planner(&superframe, control);
+        }
+        next_superframe = superframe_start + LORA_SUPERFRAME_MIN_MS * 1000;
+        uint8_t profile = lora_link_switch != ADR_UNKNOWN ? lora_link_switch : lora_link_profile;
+        // setpoints need no sync, a superframe without reply and downlink slots goes without beacon
+        LoRa_Packet* beacon = NULL;
+        if (tdma_reply_slots(&superframe) != 0 || superframe.downlink_slots != 0 || profile != lora_link_profile) {
+            beacon = packet_pool_alloc(0);
+            if (beacon == NULL) {
+                ESP_LOGW(TAG, "No free packet buffer, superframe without beacon");
+                memset(superframe.reply_owner, TDMA_NO_OWNER, sizeof(superframe.reply_owner));
+                superframe.downlink_slots = 0;
+                profile = lora_link_profile;
+            }
+        }
 
+        xSemaphoreTake(xLoraMutex, portMAX_DELAY);
+        // a frame of another network ends within the longest airtime. The beacon goes out after that regardless,
+        // the aircraft need it for their reply slots
+        int64_t latest_start = superframe_start + lora_max_frame_airtime_us;
+        if (beacon != NULL) {
+            lora_codec_encode_beacon(&superframe, profile, LORA_BASE_STATION_ADDR, beacon);
+            lora_channel_clear(lora_traffic_class(beacon), latest_start);
+            lora_transmit_and_wait(lora_dev, beacon, &lora_control_header);
+        }
+        int64_t beacon_end = esp_timer_get_time();
+        if (beacon != NULL) {
+            // the last setpoint still ends a guard time before the reply slots
+            latest_start = beacon_end + tdma_control_slot_start_us(&lora_tdma_timing, superframe.control_slots) -
+                           lora_tdma_timing.control_slot_us;
+        }
+        for (uint8_t i = 0; i < superframe.control_slots; i++) {
+            if (control[i] == NULL) {
+                continue;
+            }
+            int64_t slot_start = beacon_end + tdma_control_slot_start_us(&lora_tdma_timing, i);
+            lora_wait_until(slot_start - lora_lbt_us);
+            if (lora_frame_expired(control[i])) {
+                lora_drop_expired(LORA_CLASS_CONTROL, control[i]);
+                continue;
+            }
+            if (!lora_channel_clear(LORA_CLASS_CONTROL, latest_start)) {
+                packet_pool_free(control[i]);
+                continue;
+            }
+            lora_wait_until(slot_start);
+            // control latency, from the time the planner sampled the sticks
+            lora_record_wait(LORA_CLASS_CONTROL, control[i]->sampled_at);
+            lora_transmit_and_wait(lora_dev, control[i], &lora_control_header);
+        }
+        if (tdma_reply_slots(&superframe) != 0) {
+            lora_listen();
+            xSemaphoreGive(xLoraMutex);
+            lora_wait_until(beacon_end + tdma_downlink_slot_start_us(&lora_tdma_timing, &superframe, 0));
+            xSemaphoreTake(xLoraMutex, portMAX_DELAY);
+        }
+        for (uint8_t i = 0; i < superframe.downlink_slots; i++) {
+            int64_t slot_start = beacon_end + tdma_downlink_slot_start_us(&lora_tdma_timing, &superframe, i);
+            lora_wait_until(slot_start - lora_lbt_us);
+            LoRa_Packet* packet = lora_tx_dequeue();
+            if (packet == NULL) {
+                break;
+            }
+            packet = lora_coalesce(packet);
+            uint8_t dest_addr = packet->header.dest_device_addr;
+            uint8_t announce = slot_start >= lora_peers[dest_addr].explicit_until;
+            uint32_t time_on_air;
+            ESP_ERROR_CHECK(sx127x_get_time_on_air(lora_dev, lora_codec_frame_length(packet), &time_on_air));
+            // the frame and its announce still end a guard time before the next slot
+            latest_start = slot_start + lora_tdma_timing.downlink_slot_us - TDMA_GUARD_US - time_on_air -
+                           (announce ? lora_control_airtime_us : 0);
+            LoRa_Traffic_Class traffic_class = lora_traffic_class(packet);
+            if (!lora_channel_clear(traffic_class, latest_start)) {
+                LoRa_TX_Entry entry = {.packet = packet, .queued_at = esp_timer_get_time()};
+                lora_tx_requeue(traffic_class == LORA_CLASS_LINK ? lora_tx_link_queue : lora_tx_queue, traffic_class, &entry);
+                break;
             }
-        } else { // if packet are not received for a long period of time, reset state
-            if (mode != SX127x_MODE_RX_CONT) {
-                ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_RX_CONT, lora_dev));
-                ESP_LOGI("LoRa", "LoRa set back to rx");
-                mode = SX127x_MODE_RX_CONT;
+            lora_wait_until(slot_start);
+            if (announce) {
+                lora_announce_explicit_header(lora_dev, dest_addr);
             }
+            lora_transmit_and_wait(lora_dev, packet, NULL);
+            // the aircraft falls back to implicit header at the end of the superframe
+            lora_peers[dest_addr].explicit_until = beacon_end + tdma_superframe_end_us(&lora_tdma_timing, &superframe);
+        }
+        int64_t superframe_end = beacon_end + tdma_superframe_end_us(&lora_tdma_timing, &superframe);
+        if (profile != lora_link_profile) {
+            // the aircraft switch at the end of the superframe, the next beacon leaves them a guard time for it
+            lora_wait_until(superframe_end);
+            lora_switch_profile(profile);
+            superframe_end += TDMA_GUARD_US;
+        }
+        lora_listen();
+        xSemaphoreGive(xLoraMutex);
+        if (superframe_end > next_superframe) {
+            next_superframe = superframe_end;
+        }
+    }
+}
+
+
+
+
+void lora_transmit_and_wait(sx127x* lora_dev, LoRa_Packet* packet, sx127x_implicit_header_t* header) {
+    uint32_t time_on_air;
+    // calculated with the header mode of the previous frame, an explicit header costs at most 5 more symbols
+    // which the margin covers
+    ESP_ERROR_CHECK(sx127x_get_time_on_air(lora_dev, lora_codec_frame_length(packet), &time_on_air));
+
+    // drop a TX_DONE that arrived after its wait timed out
+    xSemaphoreTake(lora_tx_done_semaphore, 0);
+    // chained with the FIFO load, a failed switch is reported by lora_tx_loaded_callback. A frame received before
+    // the switch is still read with the header mode of its reception
+    int code = sx127x_async_set_implicit_header(header, lora_async, NULL, NULL);
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't queue header mode %d", code);
+    }
+    // the buffer belongs to the tx path from here
+    if (lora_send_packet(lora_dev, packet) == 0 &&
+        xSemaphoreTake(lora_tx_done_semaphore, pdMS_TO_TICKS(time_on_air / 1000 + LORA_TX_DONE_MARGIN_MS)) != pdTRUE) {
+        ESP_LOGW(TAG, "No TX_DONE within %lu us", time_on_air);
+    }
+}
+
+void lora_announce_explicit_header(sx127x* lora_dev, uint8_t dest_addr) {
+    LoRa_Packet* announce = packet_pool_alloc(0);
+    if (announce == NULL) {
+        ESP_LOGW(TAG, "No free packet buffer, header mode frame skipped");
+        return;
+    }
+    lora_codec_encode_header_mode(LORA_BASE_STATION_ADDR, dest_addr, announce);
+    // still sent like a control frame, the aircraft is listening with implicit header
+    lora_transmit_and_wait(lora_dev, announce, &lora_control_header);
+}
+
+uint8_t lora_accept_sequence(const LoRa_Packet* packet, uint8_t in_order) {
+    Replay_Status status = replay_check(&lora_peers[packet->header.src_device_addr].rx_window,
+                                        packet->header.sequence);
+    if (status == REPLAY_FRESH || (status == REPLAY_REORDERED && !in_order)) {
+        return 1;
+    }
+    taskENTER_CRITICAL(&lora_stats_lock);
+    lora_class_stats[lora_traffic_class(packet)].rx_rejected++;
+    taskEXIT_CRITICAL(&lora_stats_lock);
+    ESP_LOGD(TAG, "Frame %u from %#X rejected (%d)", packet->header.sequence, packet->header.src_device_addr, status);
+    return 0;
+}
+
+LoRa_Traffic_Class lora_traffic_class(const LoRa_Packet* packet) {
+    switch (packet->header.message_type) {
+        case LORA_MESSAGE_CONTROL:
+            return LORA_CLASS_CONTROL;
+        case LORA_MESSAGE_NACK:
+        case LORA_MESSAGE_HEADER_MODE:
+        case LORA_MESSAGE_LINK:
+            return LORA_CLASS_LINK;
+        default:
+            return LORA_CLASS_BULK;
+    }
+}
+
+uint8_t lora_tx_enqueue(LoRa_Packet* packet, LoRa_Overflow_Policy policy) {
+    LoRa_Traffic_Class traffic_class = lora_traffic_class(packet);
+    LoRa_TX_Entry entry = {
+            .packet = packet,
+            .queued_at = esp_timer_get_time(),
+    };
+    LoRa_TX_Entry oldest;
+    QueueHandle_t queue = traffic_class == LORA_CLASS_LINK ? lora_tx_link_queue : lora_tx_queue;
+    if (xQueueSend(queue, &entry, 0) != pdPASS) {
+        lora_record_overflow(traffic_class, 0);
+        if (policy == LORA_OVERFLOW_REJECT) {
+            return 1;
+        }
+        if (policy == LORA_OVERFLOW_DROP_OLDEST && xQueueReceive(queue, &oldest, 0) == pdPASS) {
+            packet_pool_free(oldest.packet);
+        }
+        // another producer may take the freed slot first
+        if (policy == LORA_OVERFLOW_DROP_NEWEST || xQueueSend(queue, &entry, 0) != pdPASS) {
+            packet_pool_free(packet);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint8_t lora_rx_enqueue(LoRa_Packet* packet, LoRa_Overflow_Policy policy) {
+    LoRa_Packet* oldest;
+    if (xQueueSend(packet_rx_queue, &packet, 0) == pdPASS) {
+        return 0;
+    }
+    lora_record_overflow(lora_traffic_class(packet), 1);
+    if (policy == LORA_OVERFLOW_REJECT) {
+        return 1;
+    }
+    if (policy == LORA_OVERFLOW_DROP_OLDEST && xQueueReceive(packet_rx_queue, &oldest, 0) == pdPASS) {
+        packet_pool_free(oldest);
+    }
+    if (policy == LORA_OVERFLOW_DROP_NEWEST || xQueueSend(packet_rx_queue, &packet, 0) != pdPASS) {
+        packet_pool_free(packet);
+        return 1;
+    }
+    return 0;
+}
+
+uint8_t lora_tx_congested() {
+    return uxQueueMessagesWaiting(lora_tx_link_queue) + uxQueueMessagesWaiting(lora_tx_queue) >= LORA_TX_HIGH_WATER;
+}
+
+LoRa_Packet* lora_tx_dequeue() {
+    LoRa_TX_Entry entry;
+    while (xQueueReceive(lora_tx_link_queue, &entry, 0) == pdPASS) {
+        if (!lora_frame_expired(entry.packet)) {
+            lora_record_wait(LORA_CLASS_LINK, entry.queued_at);
+            return entry.packet;
+        }
+        lora_drop_expired(LORA_CLASS_LINK, entry.packet);
+    }
+    while (xQueueReceive(lora_tx_queue, &entry, 0) == pdPASS) {
+        if (!lora_frame_expired(entry.packet)) {
+            lora_record_wait(LORA_CLASS_BULK, entry.queued_at);
+            return entry.packet;
+        }
+        lora_drop_expired(LORA_CLASS_BULK, entry.packet);
+    }
+    return NULL;
+}
+
+uint8_t lora_tx_pending() {
+    return uxQueueMessagesWaiting(lora_tx_link_queue) != 0 || uxQueueMessagesWaiting(lora_tx_queue) != 0;
+}
+
+uint8_t lora_tx_backlog() {
+    return uxQueueMessagesWaiting(lora_tx_link_queue) + uxQueueMessagesWaiting(lora_tx_queue);
+}
+
+void lora_set_superframe_planner(LoRa_Superframe_Planner planner) {
+    lora_superframe_planner = planner;
+}
+
+uint32_t lora_tx_time_us(uint8_t frames) {
+    // one superframe more for the reply slot
+    return ((frames + TDMA_MAX_DOWNLINK_SLOTS - 1) / TDMA_MAX_DOWNLINK_SLOTS + 1) * lora_superframe_max_us;
+}
+
+void lora_get_class_stats(LoRa_Class_Stats* stats) {
+    taskENTER_CRITICAL(&lora_stats_lock);
+    memcpy(stats, lora_class_stats, sizeof(lora_class_stats));
+    taskEXIT_CRITICAL(&lora_stats_lock);
+}
 
-            if (lora_mutex_is_held_by_task == 1) {
-                xSemaphoreGive(xLoraMutex);
-                lora_mutex_is_held_by_task = 0;
+LoRa_Packet* lora_coalesce(LoRa_Packet* packet) {
+    if (!lora_codec_can_batch(packet)) {
+        return packet;
+    }
+    LoRa_Traffic_Class traffic_class = lora_traffic_class(packet);
+    QueueHandle_t queue = traffic_class == LORA_CLASS_LINK ? lora_tx_link_queue : lora_tx_queue;
+    LoRa_Packet* batch = NULL;
+    LoRa_TX_Entry next;
+    while (1) {
+        // a higher class is never held back by a longer frame
+        if (traffic_class == LORA_CLASS_BULK && uxQueueMessagesWaiting(lora_tx_link_queue) != 0) {
+            break;
+        }
+        // taken rather than peeked, a producer dropping the oldest frame may consume the queue too
+        if (xQueueReceive(queue, &next, 0) != pdPASS) {
+            break;
+        }
+        if (lora_frame_expired(next.packet)) {
+            lora_drop_expired(traffic_class, next.packet);
+            continue;
+        }
+        if (next.packet->header.dest_device_addr != packet->header.dest_device_addr ||
+            !lora_codec_can_batch(next.packet)) {
+            lora_tx_requeue(queue, traffic_class, &next);
+            break;
+        }
+        if (batch == NULL) {
+            batch = packet_pool_alloc(0);
+            if (batch == NULL) {
+                lora_tx_requeue(queue, traffic_class, &next);
+                break;
             }
+            lora_codec_batch_init(packet->header.src_device_addr, packet->header.dest_device_addr, batch);
+            lora_codec_batch_append(batch, packet);
+        }
+        if (lora_codec_batch_append(batch, next.packet) != 0) {
+            lora_tx_requeue(queue, traffic_class, &next);
+            break;
         }
+        lora_record_wait(traffic_class, next.queued_at);
+        packet_pool_free(next.packet);
     }
+    if (batch == NULL) {
+        return packet;
+    }
+    packet_pool_free(packet);
+    return batch;
 }
 
+void lora_demux_batch(LoRa_Packet* batch) {
+    uint8_t offset = 0;
+    LoRa_Packet* packet = packet_pool_alloc(0);
+    while (packet != NULL && lora_codec_batch_next(batch, &offset, packet) == 0) {
+        if (lora_rx_enqueue(packet, LORA_OVERFLOW_REJECT) != 0) {
+            break;
+        }
+        packet = packet_pool_alloc(0);
+    }
+    if (offset < batch->header.payload_size) {
+        ESP_LOGW(TAG, "Batch frame cut short at %d of %d bytes", offset, batch->header.payload_size);
+    }
+    // spare buffer, or the record that didn't fit the queue
+    packet_pool_free(packet);
+    packet_pool_free(batch);
+}
 
+void lora_async_callback(sx127x *device, int code, void *arg) {
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "async request failed %d", code);
+    }
+}
 
+void lora_tx_loaded_callback(sx127x *device, int code, void *arg) {
+    LoRa_TX_Frame* frame = (LoRa_TX_Frame*) arg;
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't load frame %d", code);
+    } else {
+        ESP_LOGD(TAG, "Frame loaded in %lld us", esp_timer_get_time() - frame->load_start);
+    }
+    packet_pool_free(frame->packet);
+    frame->packet = NULL;
+    xSemaphoreGive(lora_tx_frame_semaphore);
+}
 
-// Calculates CRC and sends packet
+// Sends packet. Takes ownership of the pool buffer, it is released once the frame is in the FIFO
+// Returns 0 if the frame was queued for transmission, 1 if it was dropped
+// The frame is encoded while the previous one is still being loaded, the FIFO load and the switch to tx are
+// queued on the async worker as one request
 uint8_t lora_send_packet(sx127x *lora_dev, LoRa_Packet* packet){
-    uint8_t data[255];
-    memset(&data[0], packet->header.src_device_addr, sizeof(uint8_t));
-    memset(&data[1], packet->header.dest_device_addr, sizeof(uint8_t));
-    memset(&data[2], packet->header.num_of_packets, sizeof(uint8_t));
-    memset(&data[3], packet->header.packet_num, sizeof(uint8_t));
-    memset(&data[4], packet->header.payload_size, sizeof(uint8_t));
-    memset(&data[5], packet->header.header_crc >> 8, sizeof(uint8_t));
-    memset(&data[6], packet->header.header_crc & 0xFF, sizeof(uint8_t));
-    memset(&data[7], packet->payload.payload_crc >> 8, sizeof(uint8_t));
-    memset(&data[8], packet->payload.payload_crc & 0xFF, sizeof(uint8_t));
-    memcpy(&data[9], packet->payload.payload, packet->header.payload_size);
-    spi_device_acquire_bus(lora_spi_device, portMAX_DELAY);
-    ESP_ERROR_CHECK(sx127x_set_for_transmission(data, packet->header.payload_size + sizeof(LoRa_Packet_Header) - 1 + sizeof(uint16_t), lora_dev));
-    ESP_ERROR_CHECK(sx127x_set_opmod(SX127x_MODE_TX, lora_dev));
-    spi_device_release_bus(lora_spi_device);
-
+    xSemaphoreTake(lora_tx_frame_semaphore, portMAX_DELAY);
+    LoRa_TX_Frame* frame = &lora_tx_frames[lora_tx_frame_index];
+    lora_tx_frame_index = (lora_tx_frame_index + 1) % LORA_TX_FRAME_BUFFERS;
+    // every frame on air gets the next number, a resent fragment is a new frame
+    packet->header.sequence = lora_peers[packet->header.dest_device_addr].tx_sequence++;
+    // only the header is serialized, header and payload go out in the same FIFO burst
+    lora_codec_encode_segments(packet, frame->header, frame->segments);
+    frame->packet = packet;
+    frame->load_start = esp_timer_get_time();
+    int code = sx127x_async_transmit_segments(frame->segments, LORA_PACKET_WIRE_SEGMENTS, lora_async, lora_tx_loaded_callback, frame);
+    if (code != SX127X_OK) {
+        ESP_LOGE(TAG, "can't queue frame %d, dropped", code);
+        packet_pool_free(packet);
+        frame->packet = NULL;
+        xSemaphoreGive(lora_tx_frame_semaphore);
+        return 1;
+    }
     return 0;
 }
 
 uint8_t lora_send_message(uint8_t src_addr, uint8_t dest_addr, uint8_t* message, uint8_t message_len) {
-    LoRa_Packet* lora_packets_buff;
-
     uint8_t num_of_full_packets = message_len / LORA_PAYLOAD_MAX_SIZE;
     uint8_t remaining_packet_size = message_len % LORA_PAYLOAD_MAX_SIZE;
 
@@ -247,38 +1016,41 @@ uint8_t lora_send_message(uint8_t src_addr, uint8_t dest_addr, uint8_t* message,
         num_of_packets++;
     }
 
-    lora_packets_buff = (LoRa_Packet*) malloc(sizeof(LoRa_Packet) * num_of_packets);
-    if (lora_packets_buff == NULL) {
-        ESP_LOGE(TAG, "Unable to allocate memory for packets.");
-        return MESSAGE_NOT_ENOUGH_MEMORY;
-    }
-
     for (uint8_t i = 0; i < num_of_packets; i++){
-        LoRa_Packet packet;
+        // packets are built in place in the pool, the sender task gets the pointer
+        LoRa_Packet* packet = packet_pool_alloc(0);
+        if (packet == NULL) {
+            ESP_LOGE(TAG, "Unable to allocate memory for packets.");
+            // fragments already queued carry this id
+            lora_tx_message_id++;
+            return MESSAGE_NOT_ENOUGH_MEMORY;
+        }
         if (message_len / LORA_PAYLOAD_MAX_SIZE == 0) {
-            memcpy(packet.payload.payload, &(message[i * LORA_PAYLOAD_MAX_SIZE]), remaining_packet_size);
-            packet.header.payload_size = remaining_packet_size;
+            memcpy(packet->payload.payload, &(message[i * LORA_PAYLOAD_MAX_SIZE]), remaining_packet_size);
+            packet->header.payload_size = remaining_packet_size;
         } else {
-            memcpy(packet.payload.payload, &(message[i * LORA_PAYLOAD_MAX_SIZE]), LORA_PAYLOAD_MAX_SIZE);
-            packet.header.payload_size = LORA_PAYLOAD_MAX_SIZE;
+            memcpy(packet->payload.payload, &(message[i * LORA_PAYLOAD_MAX_SIZE]), LORA_PAYLOAD_MAX_SIZE);
+            packet->header.payload_size = LORA_PAYLOAD_MAX_SIZE;
         }
 
-        packet.header.src_device_addr = src_addr;
-        packet.header.dest_device_addr = dest_addr;
-        packet.header.num_of_packets = num_of_packets;
-        packet.header.packet_num = i;
-        lora_calc_packet_crc(&(packet.payload), packet.header.payload_size);
-        lora_calc_header_crc(&(packet.header));
+        packet->header.message_type = LORA_MESSAGE_DATA;
+        packet->header.src_device_addr = src_addr;
+        packet->header.dest_device_addr = dest_addr;
+        packet->header.num_of_packets = num_of_packets;
+        packet->header.packet_num = i;
+        packet->header.message_id = lora_tx_message_id;
+        packet->header.poll = 0;
+        packet->payload.payload_crc = lora_calc_packet_crc(&(packet->payload), packet->header.payload_size);
+        packet->header.header_crc = lora_calc_header_crc(&(packet->header));
         message_len -= LORA_PAYLOAD_MAX_SIZE;
 
-        // Do not send immediately, needed to cache the whole message for the networking
-        // and error correcting part
-        lora_packets_buff[i] = packet;
-
-        xQueueSend(lora_tx_queue, (void*) &packet, portMAX_DELAY);
-
+        if (lora_tx_enqueue(packet, LORA_OVERFLOW_DROP_NEWEST) != 0) {
+            ESP_LOGW(TAG, "TX queue full, message cut short");
+            lora_tx_message_id++;
+            return MESSAGE_QUEUE_FULL;
+        }
     }
-    free(lora_packets_buff);
+    lora_tx_message_id++;
 
     return MESSAGE_OK;
 }
@@ -2,6 +2,8 @@
 // Created by molnar on 2023.02.14..
 //
 #include "network.h"
+#include "packet_pool.h"
+#include "lora_codec.h"
 
 Network_Device_Container device_container;
 
@@ -9,37 +11,167 @@ TaskHandle_t network_rx_packet_handler;
 QueueHandle_t packet_rx_queue;
 TaskHandle_t network_device_processor_handler;
 QueueHandle_t network_device_processor_queue;
+// fragments of every device, only touched by network_packet_rx_handler_task
+Reassembly_Context network_reassembly;
+// selective repeat state is updated by the rx handler and by set_packets_for_tx
+portMUX_TYPE network_arq_lock = portMUX_INITIALIZER_UNLOCKED;
+// taken while a device is published to the table, lookups read the slots without it
+portMUX_TYPE network_device_lock = portMUX_INITIALIZER_UNLOCKED;
+// picks the destination of every setpoint, only touched by network_plan_superframe
+Control_Sched network_control_sched;
+// superframes planned since boot and the device that got the last reply slot in turn
+uint32_t network_superframe_count = 0;
+uint16_t network_reply_turn = 0;
+// setpoints go out in every network_control_stride-th superframe, see NETWORK_CONTROL_PERIOD_MAX_MS
+uint32_t network_control_stride = 1;
+uint32_t network_control_skipped = 0;
+// Aircraft known at boot, they are ONLINE without key exchange. The others join through the rx handler
+static const uint8_t network_provisioned_devices[] = {0x01};
 
 extern SemaphoreHandle_t xLoraTXQueueMutex;
 extern SemaphoreHandle_t joystick_semaphore_handle;
 
-extern QueueHandle_t lora_tx_queue;
 extern SemaphoreHandle_t lcd_mutex;
 extern SemaphoreHandle_t lg_state_mutex;
 
 extern sx127x *lora_device;
+extern Tdma_Timing lora_tdma_timing;
+extern uint32_t lora_superframe_max_us;
 extern LandingGearState lg_state;
 
 
-static bool network_is_device_in_arp(Network_Device_Container* dev_container, uint8_t dev_addr) {
-    for (uint8_t i = 0; i < dev_container->num_of_devices; i++) {
-        if (dev_container->device_contexts[i].address == dev_addr) {
-            return true;
+static Network_Device_Context* get_device_from_arp(Network_Device_Container* dev_container, uint8_t dev_addr) {
+    return dev_container->device_contexts[dev_addr];
+}
+
+// Queues the fragments of the next selective repeat round, the last one polls the device for a NACK.
+// A fragment that can't be queued is left out, the missing report or the next NACK brings it back
+static void network_send_round(Network_Device_Context* device_ctx) {
+    taskENTER_CRITICAL(&network_arq_lock);
+    uint64_t previously_sent = device_ctx->arq.sent;
+    // the report is due once the whole window is on air and the device got its reply slot
+    uint64_t round = arq_next_round(&device_ctx->arq, esp_timer_get_time() +
+                                    lora_tx_time_us(ARQ_WINDOW + device_ctx->packet_tx_num_of_parity) +
+                                    ARQ_REPORT_TIMEOUT_MS * 1000);
+    uint8_t num_of_packets = device_ctx->arq.num_of_packets;
+    taskEXIT_CRITICAL(&network_arq_lock);
+    if (round == 0) {
+        return;
+    }
+    // parity follows the first transmission of the last data fragment, resends are plain data fragments
+    uint64_t last_fragment = (uint64_t) 1 << (num_of_packets - 1);
+    uint8_t num_of_parity = (round & last_fragment) && !(previously_sent & last_fragment) ?
+                            device_ctx->packet_tx_num_of_parity : 0;
+
+    uint64_t resent = round & previously_sent;
+    device_ctx->num_of_faulty_packets = 0;
+    if (resent != 0 && device_ctx->packet_num_of_faulty_packets == NULL) {
+        device_ctx->packet_num_of_faulty_packets = (uint8_t*) malloc(ARQ_WINDOW);
+    }
+    device_ctx->connection_status = resent != 0 ? WAITING_FOR_PACKET_CORRECTION : MESSAGE_SENT;
+
+    uint8_t last = 63 - __builtin_clzll(round);
+    for (uint8_t i = 0; i <= last; i++) {
+        if (!((round >> i) & 1)) {
+            continue;
+        }
+        if (((resent >> i) & 1) && device_ctx->packet_num_of_faulty_packets != NULL) {
+            device_ctx->packet_num_of_faulty_packets[device_ctx->num_of_faulty_packets++] = i;
+        }
+        LoRa_Packet* packet = packet_pool_alloc(0);
+        if (packet == NULL) {
+            ESP_LOGW("Network", "No free packet buffer, round cut short");
+            return;
+        }
+        packet_pool_copy(packet, &device_ctx->packet_tx_buff[i]);
+        packet->header.poll = i == last && num_of_parity == 0;
+        if (lora_tx_enqueue(packet, LORA_OVERFLOW_REJECT) != 0) {
+            ESP_LOGW("Network", "TX queue full, round cut short");
+            packet_pool_free(packet);
+            return;
+        }
+    }
+    for (uint8_t i = 0; i < num_of_parity; i++) {
+        LoRa_Packet* packet = packet_pool_alloc(0);
+        if (packet == NULL) {
+            ESP_LOGW("Network", "No free packet buffer, parity cut short");
+            return;
+        }
+        packet_pool_copy(packet, &device_ctx->packet_tx_buff[num_of_packets + i]);
+        packet->header.poll = i == num_of_parity - 1;
+        if (lora_tx_enqueue(packet, LORA_OVERFLOW_REJECT) != 0) {
+            ESP_LOGW("Network", "TX queue full, parity cut short");
+            packet_pool_free(packet);
+            return;
         }
     }
+}
 
-    return false;
+static void network_handle_arq_status(Network_Device_Context* device_ctx, Arq_Status status) {
+    switch (status) {
+        case ARQ_SEND:
+            network_send_round(device_ctx);
+            break;
+        case ARQ_DONE:
+            ESP_LOGD("Network", "Message %d delivered to %#X", device_ctx->arq.message_id, device_ctx->address);
+            device_ctx->connection_status = CONNECTION_ESTABLISHED;
+            break;
+        case ARQ_FAILED:
+            ESP_LOGE("Network", "Message %d to %#X given up after %d rounds without progress", device_ctx->arq.message_id,
+                     device_ctx->address, ARQ_MAX_RETRIES);
+            device_ctx->connection_status = CONNECTION_ESTABLISHED;
+            break;
+        default:
+            break;
+    }
 }
 
-static Network_Device_Context* get_device_from_arp(Network_Device_Container* dev_container, uint8_t dev_addr) {
-    for (uint8_t i = 0; i < dev_container->num_of_devices; i++) {
-        if (dev_container->device_contexts[i].address == dev_addr) {
-            ESP_LOGI("Network", "device found in arp");
-            return &dev_container->device_contexts[i];
-        }
+// Answers a polling fragment with the fragments still missing from its message
+static void network_send_nack(uint8_t dest_addr, uint8_t message_id, uint64_t missing) {
+    LoRa_Packet* packet = packet_pool_alloc(0);
+    if (packet == NULL) {
+        ESP_LOGW("Network", "No free packet buffer, NACK dropped");
+        return;
     }
+    lora_codec_encode_nack(LORA_BASE_STATION_ADDR, dest_addr, message_id, missing, packet);
+    // the ARQ timeout of the sender covers a lost NACK
+    lora_tx_enqueue(packet, LORA_OVERFLOW_DROP_NEWEST);
+}
 
-    return NULL;
+// Appends device_ctx->tx_parity erasure code fragments to the data fragments in packet_tx_buff. Without memory
+// the message goes out unprotected, selective repeat still delivers it
+static void network_append_parity(Network_Device_Context* device_ctx) {
+    uint8_t num_of_packets = device_ctx->packet_tx_buff[0].header.num_of_packets;
+    uint8_t num_of_parity = device_ctx->tx_parity > FEC_MAX_PARITY ? FEC_MAX_PARITY : device_ctx->tx_parity;
+    device_ctx->packet_tx_num_of_parity = 0;
+    // a single fragment is cheaper to resend than to protect
+    if (num_of_parity == 0 || num_of_packets < 2) {
+        return;
+    }
+    LoRa_Packet* packets = (LoRa_Packet*) realloc(device_ctx->packet_tx_buff,
+                                                  (num_of_packets + num_of_parity) * sizeof(LoRa_Packet));
+    if (packets == NULL) {
+        ESP_LOGW("Network", "No memory for parity fragments, message sent without");
+        return;
+    }
+    device_ctx->packet_tx_buff = packets;
+
+    LoRa_Packet* last = &packets[num_of_packets - 1];
+    // the code covers the zero padded last fragment
+    memset(&last->payload.payload[last->header.payload_size], 0, LORA_PAYLOAD_MAX_SIZE - last->header.payload_size);
+    for (uint8_t i = 0; i < num_of_parity; i++) {
+        LoRa_Packet* parity = &packets[num_of_packets + i];
+        parity->header = packets[0].header;
+        parity->header.message_type = LORA_MESSAGE_PARITY;
+        parity->header.packet_num = i;
+        parity->header.last_payload_size = last->header.payload_size;
+        parity->header.payload_size = LORA_PAYLOAD_MAX_SIZE;
+        fec_encode(packets[0].payload.payload, sizeof(LoRa_Packet), num_of_packets, LORA_PAYLOAD_MAX_SIZE, i,
+                   parity->payload.payload);
+        parity->header.header_crc = lora_calc_header_crc(&parity->header);
+        parity->payload.payload_crc = lora_calc_packet_crc(&parity->payload, LORA_PAYLOAD_MAX_SIZE);
+    }
+    device_ctx->packet_tx_num_of_parity = num_of_parity;
 }
 
 static void display_packet(LoRa_Packet* packet_to_display){
@@ -62,54 +194,145 @@ static void display_packet(LoRa_Packet* packet_to_display){
 }
 
 
-void network_uav_temporary_controller_task(void* pvParameters) {
-    Network_Device_Context* device_to_send = get_device_from_arp(&device_container, 0x01);
-    if (device_to_send == NULL) {
-        ESP_LOGI("network", "Device not in arp.");
-    } else {
-        ESP_LOGI("network", "Device in arp.");
+// Schedules every ONLINE device with its weight and drops the others.
+// \return 1 if the schedule changed.
+static uint8_t network_sync_control_sched(Network_Device_Container* dev_ctnr) {
+    uint8_t changed = 0;
+    for (uint16_t addr = network_next_device(dev_ctnr, 0); addr < NETWORK_DEVICE_TABLE_SIZE;
+         addr = network_next_device(dev_ctnr, addr + 1)) {
+        Network_Device_Context* device_ctx = get_device_from_arp(dev_ctnr, addr);
+        uint8_t weight = device_ctx->status == ONLINE ? device_ctx->control_weight : 0;
+        if (network_control_sched.weight[addr] != weight) {
+            control_sched_set_weight(&network_control_sched, addr, weight);
+            changed = 1;
+        }
     }
+    return changed;
+}
 
-    device_to_send->tx_secret_message = (uint8_t*) malloc(4 * sizeof(uint8_t));
-    if (device_to_send->tx_secret_message == NULL) {
-        ESP_LOGI("network", "Out of memory temp.");
+// Logs the setpoint period of every scheduled device, without and with the reply and downlink slots.
+static void network_log_control_periods(Network_Device_Container* dev_ctnr, uint8_t control_slots) {
+    // setpoints only, the superframe goes without beacon
+    uint32_t shortest_us = control_slots * lora_tdma_timing.control_slot_us;
+    shortest_us = shortest_us < LORA_SUPERFRAME_MIN_MS * 1000 ? LORA_SUPERFRAME_MIN_MS * 1000 : shortest_us;
+    ESP_LOGI("Network", "%d devices scheduled in %d control slots, superframe %lu - %lu us",
+             network_control_sched.num_of_devices, control_slots, shortest_us, lora_superframe_max_us);
+    if (control_slots == 0) {
+        return;
     }
-
-    device_to_send->tx_secret_message_size = 5 * sizeof(uint8_t);
-    uint16_t thr_raw_val;
-    int8_t joystick_x_percentage;
-    int8_t joystick_y_percentage;
-    int8_t joystick_z_percentage;
-
-    while (1) {
-        vTaskDelay(20 / portTICK_PERIOD_MS);
-        if (xSemaphoreTake(joystick_semaphore_handle, portMAX_DELAY) == pdTRUE) {
-            joystick_x_percentage = joystick_convert_current_joystick_x_direction_to_percentage();
-            joystick_y_percentage = joystick_convert_current_joystick_y_direction_to_percentage();
-            joystick_z_percentage = joystick_convert_current_joystick_rudder_direction_to_percentage();
-            memset(&device_to_send->tx_secret_message[0], joystick_x_percentage, sizeof(int8_t));
-            memset(&device_to_send->tx_secret_message[1], joystick_y_percentage, sizeof(int8_t));
-            memset(&device_to_send->tx_secret_message[2], joystick_z_percentage, sizeof(int8_t));
-            xSemaphoreGive(joystick_semaphore_handle);
+    for (uint16_t addr = network_next_device(dev_ctnr, 0); addr < NETWORK_DEVICE_TABLE_SIZE;
+         addr = network_next_device(dev_ctnr, addr + 1)) {
+        uint32_t period_us = control_sched_device_period_us(&network_control_sched, addr, shortest_us / control_slots);
+        if (period_us != 0) {
+            ESP_LOGI("Network", "Device %#X: setpoint every %lu us, %lu.%02lu Hz, at worst every %lu us", addr,
+                     period_us, 1000000 / period_us, 100000000 / period_us % 100,
+                     control_sched_device_period_us(&network_control_sched, addr, lora_superframe_max_us / control_slots));
         }
+    }
+}
 
-        memset(&device_to_send->tx_secret_message[3], throttle_convert_to_percentage(throttle_get_thr_raw()), sizeof(uint8_t));
-        if (xSemaphoreTake(lg_state_mutex, portMAX_DELAY) == pdPASS){
-            memset(&device_to_send->tx_secret_message[4], lg_state, sizeof(uint8_t));
-            xSemaphoreGive(lg_state_mutex);
+// Grants the reply slots, first to the devices that owe the report of a selective repeat round or sent a frame in
+// one of the last two superframes, they likely have more fragments to send. Every NETWORK_REPLY_EVERY superframes
+// the next device in turn gets a slot, so the aircraft can start messages of their own.
+static void network_grant_reply_slots(Network_Device_Container* dev_ctnr, Tdma_Superframe* superframe) {
+    uint8_t granted = 0;
+    network_superframe_count++;
+    for (uint16_t addr = network_next_device(dev_ctnr, 0); addr < NETWORK_DEVICE_TABLE_SIZE && granted < TDMA_MAX_REPLY_SLOTS;
+         addr = network_next_device(dev_ctnr, addr + 1)) {
+        Network_Device_Context* device_ctx = get_device_from_arp(dev_ctnr, addr);
+        taskENTER_CRITICAL(&network_arq_lock);
+        Arq_Status status = device_ctx->arq.status;
+        taskEXIT_CRITICAL(&network_arq_lock);
+        // the frame of the last reply slot may still be on its way to the rx handler. A modem profile switch waits
+        // for the acknowledgement of the device
+        if (status == ARQ_WAITING || lora_link_reply_due(addr) ||
+            (device_ctx->reply_superframe != 0 && network_superframe_count - device_ctx->reply_superframe <= 2)) {
+            superframe->reply_owner[granted++] = addr;
+        }
+    }
+    if (network_superframe_count % NETWORK_REPLY_EVERY != 0 || granted == TDMA_MAX_REPLY_SLOTS) {
+        return;
+    }
+    uint16_t addr = network_next_device(dev_ctnr, network_reply_turn + 1);
+    if (addr == NETWORK_DEVICE_TABLE_SIZE) {
+        addr = network_next_device(dev_ctnr, 0);
+    }
+    if (addr != NETWORK_DEVICE_TABLE_SIZE) {
+        network_reply_turn = addr;
+        if (tdma_reply_slot(superframe, addr) == TDMA_NO_SLOT) {
+            superframe->reply_owner[granted] = addr;
         }
-        printf("\n\nalerion percentage: %u\nelevator precentage: %u\nrudder percentage: %u\nmotor percentage: %u\nRTLG staus: %u\n\n",
-               device_to_send->tx_secret_message[0],
-               device_to_send->tx_secret_message[1],
-               device_to_send->tx_secret_message[2],
-               device_to_send->tx_secret_message[3],
-               device_to_send->tx_secret_message[4]
-        );
+    }
+}
 
+// Stretches the setpoint stride while the transmit queues are congested and shrinks it back one step at a time.
+// \return 1 if this superframe goes without setpoints.
+static uint8_t network_skip_setpoints(uint8_t control_slots) {
+    if (lora_tx_congested()) {
+        // a device of weight 1 gets a setpoint every total_weight / control_slots superframes
+        uint32_t max_stride = (uint32_t) ((uint64_t) NETWORK_CONTROL_PERIOD_MAX_MS * 1000 * control_slots /
+                                          ((uint64_t) lora_superframe_max_us * network_control_sched.total_weight));
+        max_stride = max_stride == 0 ? 1 : max_stride;
+        network_control_stride = network_control_stride * 2 > max_stride ? max_stride : network_control_stride * 2;
+    } else if (network_control_stride > 1) {
+        network_control_stride--;
+    }
+    if (++network_control_skipped < network_control_stride) {
+        return 1;
+    }
+    network_control_skipped = 0;
+    return 0;
+}
+
+void network_plan_superframe(Tdma_Superframe* superframe, LoRa_Packet* control[TDMA_MAX_CONTROL_SLOTS]) {
+    // setpoints skip message fragmentation, each one is encoded straight into a pool buffer
+    LoRa_Control_Frame setpoint;
+    uint8_t changed = network_sync_control_sched(&device_container);
+    // a small fleet gets its whole scheduler cycle in every superframe
+    superframe->control_slots = network_control_sched.total_weight < TDMA_MAX_CONTROL_SLOTS ?
+                                network_control_sched.total_weight : TDMA_MAX_CONTROL_SLOTS;
+    if (changed) {
+        network_log_control_periods(&device_container, superframe->control_slots);
+    }
+    network_grant_reply_slots(&device_container, superframe);
+    if (superframe->control_slots == 0) {
+        return;
+    }
+    if (network_skip_setpoints(superframe->control_slots)) {
+        superframe->control_slots = 0;
+        return;
+    }
+
+    // the setpoints expire, and their control latency is counted, from here
+    int64_t sampled_at = esp_timer_get_time();
+    if (xSemaphoreTake(joystick_semaphore_handle, portMAX_DELAY) == pdTRUE) {
+        setpoint.aileron = joystick_convert_current_joystick_x_direction_to_percentage();
+        setpoint.elevator = joystick_convert_current_joystick_y_direction_to_percentage();
+        setpoint.rudder = joystick_convert_current_joystick_rudder_direction_to_percentage();
+        xSemaphoreGive(joystick_semaphore_handle);
+    }
 
-        deconstruct_message_into_packets(device_to_send);
+    setpoint.throttle = throttle_convert_to_percentage(throttle_get_thr_raw());
+    if (xSemaphoreTake(lg_state_mutex, portMAX_DELAY) == pdPASS){
+        setpoint.landing_gear = lg_state;
+        xSemaphoreGive(lg_state_mutex);
+    }
+    // runs right before the beacon, a console write would delay the whole superframe
+    ESP_LOGD("Network", "Setpoint aileron %d elevator %d rudder %d throttle %u landing gear %u", setpoint.aileron,
+             setpoint.elevator, setpoint.rudder, setpoint.throttle, setpoint.landing_gear);
 
-        set_packets_for_tx(device_to_send, &lora_tx_queue);
+    // every device gets the same stick input
+    for (uint8_t i = 0; i < superframe->control_slots; i++) {
+        control[i] = packet_pool_alloc(0);
+        if (control[i] == NULL) {
+            ESP_LOGW("network", "No free packet buffer, setpoint skipped");
+            break;
+        }
+        lora_codec_encode_control(&setpoint, LORA_BASE_STATION_ADDR, control_sched_next(&network_control_sched), control[i]);
+        control[i]->sampled_at = sampled_at;
+        // slot i comes up a beacon and i slots after the sample, only a delay on top of that counts
+        control[i]->expires_at = sampled_at + tdma_control_slot_due_us(&lora_tdma_timing, i) +
+                                 LORA_CONTROL_EXPIRY_MS * 1000;
     }
 }
 
@@ -121,98 +344,152 @@ void network_device_processor_task(void* pvParameters){
     uint8_t dev_addr;
     Network_Device_Context* device_ctx;
     while (1) {
-        if( xQueueReceive(packet_rx_queue, &dev_addr, portMAX_DELAY) == pdPASS ) {
+        if( xQueueReceive(network_device_processor_queue, &dev_addr, portMAX_DELAY) == pdPASS ) {
             device_ctx = get_device_from_arp(dev_ctnr, dev_addr);
             if (device_ctx == NULL) {
                 continue;
             }
 
-            if (device_ctx->packet_rx_buff == NULL) {
-                continue;
-            }
-
-            construct_message_from_packets(device_ctx);
-
-
+            ESP_LOGD("Network", "Message of %d bytes received from %#X", device_ctx->status == ONLINE ?
+                     device_ctx->rx_secret_message_size : device_ctx->rx_message_size, dev_addr);
         }
     }
 }
 
 void network_packet_rx_handler_task(void* pvParameters){
     Network_Device_Container* dev_cntr = (Network_Device_Container*) pvParameters;
-    LoRa_Packet received_packet;
+    LoRa_Packet* received_packet;
     Network_Device_Context* packet_device_ctx;
+    Reassembly_Message* message;
 
     while (1) {
-        if( xQueueReceive(packet_rx_queue, &received_packet, portMAX_DELAY) == pdPASS ) {
-            // check if the packet was addressed to this device
-            if (received_packet.header.dest_device_addr != LORA_BASE_STATION_ADDR) {
-                continue;
+        // woken at least every ARQ_REPORT_TIMEOUT_MS, lost reports and unfinished messages time out without traffic
+        if( xQueueReceive(packet_rx_queue, &received_packet, pdMS_TO_TICKS(ARQ_REPORT_TIMEOUT_MS)) != pdPASS ) {
+            if (reassembly_expire(&network_reassembly, esp_timer_get_time()) > 0) {
+                ESP_LOGW("Network", "Incomplete message dropped");
             }
+            network_check_arq_timeouts(dev_cntr);
+            continue;
+        }
+        // check if the packet was addressed to this device
+        if (received_packet->header.dest_device_addr != LORA_BASE_STATION_ADDR) {
+            packet_pool_free(received_packet);
+            continue;
+        }
 
-            // check if device is in ARP, if not add a new device with status OFFLINE, start copy packet to its rx buff
-            // only if this is the first packet of the device, else throw out packet
-            if (!network_is_device_in_arp(dev_cntr, received_packet.header.src_device_addr) &&
-                received_packet.header.packet_num == 0)
-            {
-                network_add_device(dev_cntr, received_packet.header.src_device_addr);
-            } else if (!network_is_device_in_arp(dev_cntr, received_packet.header.src_device_addr) &&
-                       received_packet.header.packet_num != 0)
-            {
-                continue;
-                // TODO: send back some type of error message
-            }
-
-            packet_device_ctx = get_device_from_arp(dev_cntr, received_packet.header.src_device_addr);
-
-            // checking the packet indexing
-            if (received_packet.header.packet_num > received_packet.header.num_of_packets - 1) {
+        // fragments may arrive in any order, an unknown device is added with its first valid fragment
+        packet_device_ctx = get_device_from_arp(dev_cntr, received_packet->header.src_device_addr);
+        if (packet_device_ctx == NULL) {
+            if (network_add_device(dev_cntr, received_packet->header.src_device_addr) != NETWORK_OK) {
+                packet_pool_free(received_packet);
                 continue;
-                // TODO: send back error
             }
+            packet_device_ctx = get_device_from_arp(dev_cntr, received_packet->header.src_device_addr);
+        }
+        packet_device_ctx->reply_superframe = network_superframe_count;
+        if (received_packet->header.message_type == LORA_MESSAGE_NACK) {
+            network_receive_nack(packet_device_ctx, received_packet);
+            packet_pool_free(received_packet);
+            continue;
+        }
 
-            // the procedure is different when the station is waiting for corrected devices
-            if (packet_device_ctx->connection_status == WAITING_FOR_PACKET_CORRECTION) {
-                packet_device_ctx->packet_rx_buff[received_packet.header.packet_num] = received_packet;
-
-                // last corrected packet
-                if (received_packet.header.packet_num == packet_device_ctx->packet_num_of_faulty_packets[packet_device_ctx->num_of_faulty_packets - 1]) {
-                    // TODO: pass device to the device processor
-                }
-            } else {
-                if (received_packet.header.packet_num == 0) {
-                    network_free_device_network_rx_buff(packet_device_ctx);
-                    packet_device_ctx->packet_rx_buff = (LoRa_Packet*) malloc(received_packet.header.num_of_packets * sizeof(LoRa_Packet));
-                }
+        Reassembly_Status status;
+        if (received_packet->header.message_type == LORA_MESSAGE_PARITY) {
+            status = reassembly_add_parity(&network_reassembly, received_packet->header.src_device_addr,
+                                           received_packet->header.message_id, received_packet->header.num_of_packets,
+                                           received_packet->header.packet_num, received_packet->header.last_payload_size,
+                                           received_packet->payload.payload, received_packet->header.payload_size,
+                                           esp_timer_get_time(), &message);
+        } else {
+            status = reassembly_add(&network_reassembly, received_packet->header.src_device_addr,
+                                    received_packet->header.message_id, received_packet->header.num_of_packets,
+                                    received_packet->header.packet_num, received_packet->payload.payload,
+                                    received_packet->header.payload_size, esp_timer_get_time(), &message);
+        }
+        switch (status) {
+            case REASSEMBLY_COMPLETE:
+                network_deliver_message(packet_device_ctx, message);
+                break;
+            case REASSEMBLY_STORED:
+            case REASSEMBLY_DUPLICATE:
+                break;
+            default:
+                // no reply, the sender's round times out after ARQ_REPORT_TIMEOUT_MS and is sent again. A slot is free
+                // again once another message completes or times out, otherwise the sender gives up after
+                // ARQ_MAX_RETRIES rounds without progress
+                ESP_LOGW("Network", "Fragment %d/%d of message %d from %#X dropped (%d)", received_packet->header.packet_num,
+                         received_packet->header.num_of_packets, received_packet->header.message_id,
+                         received_packet->header.src_device_addr, status);
+                break;
+        }
+        if (received_packet->header.poll && (status == REASSEMBLY_COMPLETE || status == REASSEMBLY_STORED ||
+                                             status == REASSEMBLY_DUPLICATE)) {
+            // an empty bitmap acknowledges a delivered message, late polls included
+            network_send_nack(received_packet->header.src_device_addr, received_packet->header.message_id,
+                              reassembly_missing(message));
+        }
+        packet_pool_free(received_packet);
+        network_check_arq_timeouts(dev_cntr);
+    }
+}
 
-                packet_device_ctx->packet_rx_buff[received_packet.header.packet_num] = received_packet;
+void network_receive_nack(Network_Device_Context* device_ctx, LoRa_Packet* packet) {
+    uint8_t message_id;
+    uint64_t missing;
+    if (lora_codec_decode_nack(packet, &message_id, &missing) != 0) {
+        return;
+    }
+    taskENTER_CRITICAL(&network_arq_lock);
+    Arq_Status status = arq_report(&device_ctx->arq, message_id, missing);
+    taskEXIT_CRITICAL(&network_arq_lock);
+    network_handle_arq_status(device_ctx, status);
+}
 
-                if (received_packet.header.packet_num == received_packet.header.num_of_packets - 1){
-                    // TODO: pass device to device processor
-                }
-            }
+void network_check_arq_timeouts(Network_Device_Container* dev_ctnr) {
+    int64_t now = esp_timer_get_time();
+    for (uint16_t addr = network_next_device(dev_ctnr, 0); addr < NETWORK_DEVICE_TABLE_SIZE;
+         addr = network_next_device(dev_ctnr, addr + 1)) {
+        Network_Device_Context* device_ctx = dev_ctnr->device_contexts[addr];
+        taskENTER_CRITICAL(&network_arq_lock);
+        uint8_t waiting = device_ctx->arq.status == ARQ_WAITING;
+        Arq_Status status = arq_check_timeout(&device_ctx->arq, now);
+        taskEXIT_CRITICAL(&network_arq_lock);
+        if (waiting && status != ARQ_WAITING) {
+            network_handle_arq_status(device_ctx, status);
         }
     }
 }
 
+void network_deliver_message(Network_Device_Context* device_ctx, Reassembly_Message* message) {
+    // if device is online decryption is needed so message goes into the rx_secret_message buffer
+    if (device_ctx->status == ONLINE) {
+        network_free_device_rx_secret_message(device_ctx);
+        device_ctx->rx_secret_message = reassembly_take(message, &device_ctx->rx_secret_message_size);
+    } else {
+        network_free_device_rx_message(device_ctx);
+        device_ctx->rx_message = reassembly_take(message, &device_ctx->rx_message_size);
+    }
+    if (xQueueSend(network_device_processor_queue, &device_ctx->address, 0) != pdPASS) {
+        ESP_LOGW("Network", "Device processor busy, message from %#X not processed", device_ctx->address);
+    }
+}
+
 
 void network_init(Network_Device_Container* device_cont)
 {
-    device_cont->device_contexts = NULL;
-    device_cont->num_of_devices = 0;
-    network_add_device(device_cont, 0x01);
-
-    device_cont->device_contexts[0].status = ONLINE;
-    packet_rx_queue = xQueueCreate(15, sizeof(LoRa_Packet*));
-    xTaskCreate(network_packet_rx_handler_task, "PacketReceiveTask", 4096, &device_container, 1, &network_rx_packet_handler);
-    network_device_processor_queue = xQueueCreate(20, sizeof(uint8_t));
-    xTaskCreate(network_packet_rx_handler_task, "DeviceProcessorTask", 4096, &device_container, 1, &network_device_processor_handler);
-    BaseType_t uav_control_task_code = xTaskCreatePinnedToCore(network_uav_temporary_controller_task, "UAVControllerTask", 4096, NULL, 1, NULL, 0);
-    if (uav_control_task_code != pdPASS)
-    {
-        ESP_LOGE("network init", "can't create uav control task %d", uav_control_task_code);
-        return;
+    memset(device_cont, 0, sizeof(Network_Device_Container));
+    for (uint8_t i = 0; i < sizeof(network_provisioned_devices); i++) {
+        if (network_add_device(device_cont, network_provisioned_devices[i]) == NETWORK_OK) {
+            get_device_from_arp(device_cont, network_provisioned_devices[i])->status = ONLINE;
+        }
     }
+    reassembly_init(&network_reassembly, LORA_PAYLOAD_MAX_SIZE);
+    network_device_processor_queue = xQueueCreate(20, sizeof(uint8_t));
+    packet_rx_queue = xQueueCreate(PACKET_POOL_SIZE, sizeof(LoRa_Packet*));
+    xTaskCreate(network_packet_rx_handler_task, "PacketReceiveTask", 4096, &device_container, 1, &network_rx_packet_handler);
+    xTaskCreate(network_device_processor_task, "DeviceProcessorTask", 4096, &device_container, 1, &network_device_processor_handler);
+    control_sched_init(&network_control_sched);
+    lora_set_superframe_planner(network_plan_superframe);
     ESP_LOGI("Network", "Network init finished.");
 
 }
@@ -232,25 +509,31 @@ network_operation_t network_add_device(Network_Device_Container* device_cont, ui
     new_device.tx_message_size = 0;
     new_device.rx_message = NULL;
     new_device.rx_message_size = 0;
-    new_device.packet_rx_buff = NULL;
     new_device.packet_tx_buff = NULL;
+    new_device.tx_message_id = 0;
+    new_device.arq.status = ARQ_IDLE;
+    new_device.tx_parity = NETWORK_FEC_PARITY;
+    new_device.packet_tx_num_of_parity = 0;
     new_device.packet_num_of_faulty_packets = NULL;
     new_device.num_of_faulty_packets = 0;
+    new_device.control_weight = NETWORK_CONTROL_DEFAULT_WEIGHT;
+    new_device.reply_superframe = 0;
 
-    if (device_cont->num_of_devices == 0) {
-        device_cont->num_of_devices++;
-        device_cont->device_contexts = (Network_Device_Context*) malloc(sizeof(Network_Device_Context));
-
-    } else {
-        device_cont->num_of_devices++;
-        device_cont->device_contexts = (Network_Device_Context*) realloc(device_cont->device_contexts, device_cont->num_of_devices * sizeof(Network_Device_Context));
+    if (device_cont->device_contexts[dev_addr] != NULL) {
+        return NETWORK_OK;
     }
-
-    if (device_cont->device_contexts == NULL) {
+    Network_Device_Context* device_ctx = (Network_Device_Context*) malloc(sizeof(Network_Device_Context));
+    if (device_ctx == NULL) {
         return NETWORK_OUT_OF_MEMORY;
     }
+    *device_ctx = new_device;
 
-    device_cont->device_contexts[device_cont->num_of_devices - 1] = new_device;
+    // the context is complete before its slot is visible
+    taskENTER_CRITICAL(&network_device_lock);
+    device_cont->device_contexts[dev_addr] = device_ctx;
+    device_cont->occupied[dev_addr / 32] |= (uint32_t) 1 << (dev_addr % 32);
+    device_cont->num_of_devices++;
+    taskEXIT_CRITICAL(&network_device_lock);
 
     // refresh device number on lcd
     if (xSemaphoreTake(lcd_mutex, portMAX_DELAY) == pdPASS) {
@@ -261,6 +544,18 @@ network_operation_t network_add_device(Network_Device_Container* device_cont, ui
     return NETWORK_OK;
 }
 
+uint16_t network_next_device(const Network_Device_Container* device_cont, uint16_t from) {
+    while (from < NETWORK_DEVICE_TABLE_SIZE) {
+        // registered addresses from from on in its word
+        uint32_t word = device_cont->occupied[from / 32] & (UINT32_MAX << (from % 32));
+        if (word != 0) {
+            return (from & ~31) + __builtin_ctz(word);
+        }
+        from = (from & ~31) + 32;
+    }
+    return NETWORK_DEVICE_TABLE_SIZE;
+}
+
 uint8_t check_packet_crc(LoRa_Packet* packet){
     uint16_t header_crc;
     uint16_t payload_crc;
@@ -276,70 +571,6 @@ uint8_t check_packet_crc(LoRa_Packet* packet){
 }
 
 
-uint8_t construct_message_from_packets(Network_Device_Context* device_ctx){
-    // TODO: construct package only into rx_message, same when deconstructing
-    if (device_ctx->packet_rx_buff == NULL) {
-        return NETWORK_BUFFER_EMPTY_ERROR;
-    }
-
-    // free both message rx buffers
-    if (device_ctx->rx_secret_message != NULL) {
-        free(device_ctx->rx_secret_message);
-        device_ctx->rx_secret_message = NULL; // for safety
-        device_ctx->rx_secret_message_size = 0;
-    }
-
-    if (device_ctx->rx_message != NULL) {
-        free(device_ctx->rx_message);
-        device_ctx->rx_message = NULL; // for safety
-        device_ctx->rx_message_size = 0;
-    }
-
-    // if device is online decryption is needed so message gets copied into
-    // the rx_secret_message buffer
-    if (device_ctx->status == ONLINE){
-        // calculate message length
-        for (uint8_t i = 0; i < device_ctx->packet_rx_buff[0].header.num_of_packets; i++) {
-            device_ctx->rx_secret_message_size += device_ctx->packet_rx_buff->header.payload_size;
-        }
-
-        device_ctx->rx_secret_message = (uint8_t*) malloc(device_ctx->rx_secret_message_size * sizeof(uint8_t));
-
-        // test it thoroughly!
-        uint8_t rx_secret_message_buff_index = 0;
-        for (uint8_t i = 0; i < device_ctx->packet_rx_buff[0].header.num_of_packets; i++) {
-            memcpy(&device_ctx->rx_secret_message[rx_secret_message_buff_index],
-                   device_ctx->packet_rx_buff[i].payload.payload,
-                   device_ctx->packet_rx_buff[i].header.payload_size);
-
-            rx_secret_message_buff_index += (LORA_PAYLOAD_MAX_SIZE + 1);
-        }
-
-    } else { // message gets copied into rx_message buffer
-        for (uint8_t i = 0; i < device_ctx->packet_rx_buff[0].header.num_of_packets; i++) {
-            device_ctx->rx_message_size += device_ctx->packet_rx_buff->header.payload_size;
-        }
-
-        device_ctx->rx_message = (uint8_t*) malloc(device_ctx->rx_message_size * sizeof(uint8_t));
-
-        // test it thoroughly!
-        uint8_t rx_secret_message_buff_index = 0;
-        for (uint8_t i = 0; i < device_ctx->packet_rx_buff[0].header.num_of_packets; i++) {
-            memcpy(&device_ctx->rx_message[rx_secret_message_buff_index],
-                   device_ctx->packet_rx_buff[i].payload.payload,
-                   device_ctx->packet_rx_buff[i].header.payload_size);
-
-            rx_secret_message_buff_index += (LORA_PAYLOAD_MAX_SIZE);
-        }
-    }
-
-    free(device_ctx->packet_rx_buff);
-    device_ctx->packet_rx_buff = NULL;
-
-    return NETWORK_OK;
-}
-
-
 uint8_t deconstruct_message_into_packets(Network_Device_Context *device_ctx) {
     if (device_ctx->packet_tx_buff != NULL) {
         free(device_ctx->packet_tx_buff);
@@ -359,11 +590,14 @@ uint8_t deconstruct_message_into_packets(Network_Device_Context *device_ctx) {
 
         // test thoroughly!!
         for (uint8_t i = 0; i < num_of_packets; i++) {
+            device_ctx->packet_tx_buff[i].header.message_type = LORA_MESSAGE_DATA;
             device_ctx->packet_tx_buff[i].header.num_of_packets = num_of_packets;
             device_ctx->packet_tx_buff[i].header.payload_size = (i == (num_of_packets - 1)) ? last_packet_payload_size : LORA_PAYLOAD_MAX_SIZE;
             device_ctx->packet_tx_buff[i].header.dest_device_addr = device_ctx->address;
             device_ctx->packet_tx_buff[i].header.src_device_addr = LORA_BASE_STATION_ADDR;
             device_ctx->packet_tx_buff[i].header.packet_num = i;
+            device_ctx->packet_tx_buff[i].header.message_id = device_ctx->tx_message_id;
+            device_ctx->packet_tx_buff[i].header.poll = 0;
             if (i == num_of_packets - 1) { // last packet
                 memcpy(device_ctx->packet_tx_buff[i].payload.payload, &device_ctx->tx_secret_message[i * LORA_PAYLOAD_MAX_SIZE], last_packet_payload_size);
             } else {
@@ -385,11 +619,14 @@ uint8_t deconstruct_message_into_packets(Network_Device_Context *device_ctx) {
         }
 
         for (uint8_t i = 0; i < num_of_packets; i++) {
+            device_ctx->packet_tx_buff[i].header.message_type = LORA_MESSAGE_DATA;
             device_ctx->packet_tx_buff[i].header.num_of_packets = num_of_packets;
             device_ctx->packet_tx_buff[i].header.payload_size = i == num_of_packets - 1 ? last_packet_payload_size : LORA_PAYLOAD_MAX_SIZE;
             device_ctx->packet_tx_buff[i].header.dest_device_addr = device_ctx->address;
             device_ctx->packet_tx_buff[i].header.src_device_addr = LORA_BASE_STATION_ADDR;
             device_ctx->packet_tx_buff[i].header.packet_num = i;
+            device_ctx->packet_tx_buff[i].header.message_id = device_ctx->tx_message_id;
+            device_ctx->packet_tx_buff[i].header.poll = 0;
             if (i == num_of_packets - 1) {
                 memcpy(device_ctx->packet_tx_buff[i].payload.payload, &device_ctx->tx_message[i * LORA_PAYLOAD_MAX_SIZE], last_packet_payload_size);
             } else {
@@ -400,20 +637,22 @@ uint8_t deconstruct_message_into_packets(Network_Device_Context *device_ctx) {
             device_ctx->packet_tx_buff[i].payload.payload_crc = lora_calc_packet_crc(&device_ctx->packet_tx_buff[i].payload, device_ctx->packet_tx_buff[i].header.payload_size);
         }
     }
+    network_append_parity(device_ctx);
+    // packets resent from packet_tx_buff keep this id, the receiver only stores the fragments it is missing
+    device_ctx->tx_message_id++;
     return NETWORK_OK;
 }
 
-void set_packets_for_tx(Network_Device_Context* device_ctx, QueueHandle_t* lora_tx_queue_ptr) {
+void set_packets_for_tx(Network_Device_Context* device_ctx) {
     if (device_ctx->packet_tx_buff == NULL) {
         return;
     }
 
-    for (uint8_t i = 0; i < device_ctx->packet_tx_buff->header.num_of_packets; i++) {
-        //display_packet(&device_ctx->packet_tx_buff[i]);
-        if (xQueueSend(*lora_tx_queue_ptr, &device_ctx->packet_tx_buff[i], portMAX_DELAY) != pdPASS) {
-            ESP_LOGE("packet setup", "Could not send packet to queue");
-        }
-    }
+    // rounds are copied out of packet_tx_buff into pool buffers, it stays cached for the resends
+    taskENTER_CRITICAL(&network_arq_lock);
+    arq_start(&device_ctx->arq, device_ctx->packet_tx_buff->header.message_id, device_ctx->packet_tx_buff->header.num_of_packets);
+    taskEXIT_CRITICAL(&network_arq_lock);
+    network_send_round(device_ctx);
 }
 
 void network_encrypt_device_message(Network_Device_Context* device_ctx){
@@ -470,29 +709,15 @@ network_operation_t network_decrypt_device_message(Network_Device_Context* devic
 
 
 uint8_t network_parse_byte_array_into_packet(LoRa_Packet* packet, uint8_t* byte_arr, uint16_t arr_size){
-    // size needs to be at least 9 bytes (header + payload crc)
-    if (arr_size < sizeof(LoRa_Packet_Header) + 2) {
+    // a LoRa frame is at most 255 bytes, anything longer is not a frame
+    if (arr_size > UINT8_MAX) {
         return 1;
     }
-
-    // copy header
-    memcpy(&packet->header, byte_arr, sizeof(LoRa_Packet_Header));
-
-    //copy payload
-    memcpy(&packet->payload.payload, &byte_arr[sizeof(LoRa_Packet_Header)], packet->header.payload_size);
-    // copy payload crc
-    memcpy(&packet->payload.payload_crc, &byte_arr[arr_size - 2], sizeof(uint16_t));
-
-    return 0;
+    return lora_codec_decode(packet, byte_arr, arr_size);
 }
 
-void network_parse_packet_into_byte_array(LoRa_Packet* packet, uint8_t* byte_arr){
-    // copy header
-    memcpy(byte_arr, &packet->header, sizeof(LoRa_Packet_Header));
-    // copy payload
-    memcpy(&byte_arr[sizeof(LoRa_Packet_Header)], &packet->payload.payload, packet->header.payload_size);
-    // copy payload crc
-    memcpy(&byte_arr[sizeof(LoRa_Packet_Header) + packet->header.payload_size], &packet->payload.payload_crc, sizeof(uint16_t));
+uint8_t network_parse_packet_into_byte_array(LoRa_Packet* packet, uint8_t* byte_arr){
+    return lora_codec_encode(packet, byte_arr);
 }
 
 
@@ -531,9 +756,10 @@ void network_free_device_ctx(Network_Device_Context* device_ctx) {
         device_ctx->packet_tx_buff = NULL;
     }
 
-    if (device_ctx->packet_rx_buff != NULL) {
-        free(device_ctx->packet_rx_buff);
-        device_ctx->packet_rx_buff = NULL;
+    if (device_ctx->packet_num_of_faulty_packets != NULL) {
+        free(device_ctx->packet_num_of_faulty_packets);
+        device_ctx->packet_num_of_faulty_packets = NULL;
+        device_ctx->num_of_faulty_packets = 0;
     }
 }
 
@@ -583,13 +809,6 @@ void network_free_device_rx_message(Network_Device_Context* device_ctx) {
 }
 
 
-void network_free_device_network_rx_buff(Network_Device_Context* device_ctx) {
-    if (device_ctx->packet_rx_buff != NULL) {
-        free(device_ctx->packet_rx_buff);
-        device_ctx->packet_rx_buff = NULL;
-    }
-}
-
 void network_free_device_network_tx_buff(Network_Device_Context* device_ctx) {
     if (device_ctx->packet_tx_buff != NULL) {
         free(device_ctx->packet_tx_buff);
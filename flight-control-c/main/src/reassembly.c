@@ -0,0 +1,199 @@
+#include "reassembly.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t reassembly_complete_mask(uint8_t num_of_packets) {
+    return num_of_packets == REASSEMBLY_MAX_FRAGMENTS ? UINT64_MAX : (((uint64_t) 1 << num_of_packets) - 1);
+}
+
+static Reassembly_Message* reassembly_find(Reassembly_Context* ctx, uint8_t src_device_addr, uint8_t message_id) {
+    for (uint8_t i = 0; i < REASSEMBLY_SLOTS; i++) {
+        Reassembly_Message* message = &ctx->slots[i];
+        if (message->in_use && message->src_device_addr == src_device_addr && message->message_id == message_id) {
+            return message;
+        }
+    }
+    return NULL;
+}
+
+static Reassembly_Status reassembly_open(Reassembly_Context* ctx, uint8_t src_device_addr, uint8_t message_id,
+                                         uint8_t num_of_packets, Reassembly_Message** result) {
+    // a free slot, or else the delivered message closest to its deadline
+    Reassembly_Message* message = NULL;
+    for (uint8_t i = 0; i < REASSEMBLY_SLOTS; i++) {
+        Reassembly_Message* slot = &ctx->slots[i];
+        if (!slot->in_use) {
+            message = slot;
+            break;
+        }
+        if (slot->taken && (message == NULL || slot->deadline < message->deadline)) {
+            message = slot;
+        }
+    }
+    if (message == NULL) {
+        return REASSEMBLY_NO_SLOT;
+    }
+    message->data = (uint8_t*) malloc((size_t) num_of_packets * ctx->fragment_size);
+    if (message->data == NULL) {
+        message->in_use = 0;
+        return REASSEMBLY_OUT_OF_MEMORY;
+    }
+    message->parity = NULL;
+    message->in_use = 1;
+    message->taken = 0;
+    message->src_device_addr = src_device_addr;
+    message->message_id = message_id;
+    message->num_of_packets = num_of_packets;
+    message->received = 0;
+    message->parity_received = 0;
+    message->message_size = 0;
+    *result = message;
+    return REASSEMBLY_STORED;
+}
+
+// slot of the message the fragment belongs to, a new one for the first fragment
+static Reassembly_Status reassembly_lookup(Reassembly_Context* ctx, uint8_t src_device_addr, uint8_t message_id,
+                                           uint8_t num_of_packets, int64_t now, Reassembly_Message** message) {
+    reassembly_expire(ctx, now);
+    Reassembly_Message* slot = reassembly_find(ctx, src_device_addr, message_id);
+    if (slot == NULL) {
+        Reassembly_Status status = reassembly_open(ctx, src_device_addr, message_id, num_of_packets, &slot);
+        if (status != REASSEMBLY_STORED) {
+            return status;
+        }
+    } else if (slot->num_of_packets != num_of_packets) {
+        return REASSEMBLY_INVALID;
+    }
+    *message = slot;
+    // the sender is still retrying, a delivered message must not time out and be received again
+    slot->deadline = now + (int64_t) REASSEMBLY_TIMEOUT_MS * 1000;
+    return REASSEMBLY_STORED;
+}
+
+static Reassembly_Status reassembly_complete(Reassembly_Context* ctx, Reassembly_Message* message) {
+    uint64_t complete = reassembly_complete_mask(message->num_of_packets);
+    if (message->received == complete) {
+        return REASSEMBLY_COMPLETE;
+    }
+    if (message->parity_received == 0 || message->message_size == 0 ||
+        __builtin_popcountll(message->received) + __builtin_popcount(message->parity_received) < message->num_of_packets) {
+        return REASSEMBLY_STORED;
+    }
+    // the code covers the zero padded last fragment
+    size_t last_offset = (size_t) (message->num_of_packets - 1) * ctx->fragment_size;
+    if (message->received & ((uint64_t) 1 << (message->num_of_packets - 1))) {
+        memset(&message->data[message->message_size], 0, last_offset + ctx->fragment_size - message->message_size);
+    }
+    if (fec_decode(message->data, ctx->fragment_size, message->num_of_packets, message->received,
+                   message->parity, message->parity_received, ctx->fragment_size)) {
+        return REASSEMBLY_STORED;
+    }
+    message->received = complete;
+    return REASSEMBLY_COMPLETE;
+}
+
+void reassembly_init(Reassembly_Context* ctx, uint8_t fragment_size) {
+    memset(ctx, 0, sizeof(Reassembly_Context));
+    ctx->fragment_size = fragment_size;
+}
+
+Reassembly_Status reassembly_add(Reassembly_Context* ctx, uint8_t src_device_addr, uint8_t message_id,
+                                 uint8_t num_of_packets, uint8_t packet_num,
+                                 const uint8_t* payload, uint8_t payload_size,
+                                 int64_t now, Reassembly_Message** message) {
+    if (num_of_packets == 0 || num_of_packets > REASSEMBLY_MAX_FRAGMENTS || packet_num >= num_of_packets ||
+        payload_size > ctx->fragment_size) {
+        return REASSEMBLY_INVALID;
+    }
+    // every fragment but the last is full, so fragments can be stored at fixed offsets
+    uint8_t last = packet_num == num_of_packets - 1;
+    if (!last && payload_size != ctx->fragment_size) {
+        return REASSEMBLY_INVALID;
+    }
+    Reassembly_Message* slot;
+    Reassembly_Status status = reassembly_lookup(ctx, src_device_addr, message_id, num_of_packets, now, &slot);
+    if (status != REASSEMBLY_STORED) {
+        return status;
+    }
+    *message = slot;
+
+    uint64_t bit = (uint64_t) 1 << packet_num;
+    if (slot->taken || (slot->received & bit)) {
+        return REASSEMBLY_DUPLICATE;
+    }
+    memcpy(&slot->data[(size_t) packet_num * ctx->fragment_size], payload, payload_size);
+    slot->received |= bit;
+    if (last) {
+        slot->message_size = (uint16_t) packet_num * ctx->fragment_size + payload_size;
+    }
+
+    return reassembly_complete(ctx, slot);
+}
+
+Reassembly_Status reassembly_add_parity(Reassembly_Context* ctx, uint8_t src_device_addr, uint8_t message_id,
+                                        uint8_t num_of_packets, uint8_t parity_index, uint8_t last_payload_size,
+                                        const uint8_t* payload, uint8_t payload_size,
+                                        int64_t now, Reassembly_Message** message) {
+    if (num_of_packets == 0 || num_of_packets > REASSEMBLY_MAX_FRAGMENTS || parity_index >= FEC_MAX_PARITY ||
+        payload_size != ctx->fragment_size || last_payload_size > ctx->fragment_size) {
+        return REASSEMBLY_INVALID;
+    }
+    Reassembly_Message* slot;
+    Reassembly_Status status = reassembly_lookup(ctx, src_device_addr, message_id, num_of_packets, now, &slot);
+    if (status != REASSEMBLY_STORED) {
+        return status;
+    }
+    *message = slot;
+
+    uint8_t bit = 1 << parity_index;
+    if (slot->taken || (slot->parity_received & bit)) {
+        return REASSEMBLY_DUPLICATE;
+    }
+    if (slot->parity == NULL) {
+        slot->parity = (uint8_t*) malloc((size_t) FEC_MAX_PARITY * ctx->fragment_size);
+        if (slot->parity == NULL) {
+            return REASSEMBLY_OUT_OF_MEMORY;
+        }
+    }
+    memcpy(&slot->parity[(size_t) parity_index * ctx->fragment_size], payload, payload_size);
+    slot->parity_received |= bit;
+    slot->message_size = (uint16_t) (num_of_packets - 1) * ctx->fragment_size + last_payload_size;
+
+    return reassembly_complete(ctx, slot);
+}
+
+uint8_t* reassembly_take(Reassembly_Message* message, uint16_t* message_size) {
+    uint8_t* data = message->data;
+    *message_size = message->message_size;
+    message->data = NULL;
+    free(message->parity);
+    message->parity = NULL;
+    message->taken = 1;
+    return data;
+}
+
+uint64_t reassembly_missing(const Reassembly_Message* message) {
+    if (message->taken) {
+        return 0;
+    }
+    return reassembly_complete_mask(message->num_of_packets) & ~message->received;
+}
+
+void reassembly_release(Reassembly_Message* message) {
+    free(message->data);
+    message->data = NULL;
+    free(message->parity);
+    message->parity = NULL;
+    message->in_use = 0;
+}
+
+uint8_t reassembly_expire(Reassembly_Context* ctx, int64_t now) {
+    uint8_t expired = 0;
+    for (uint8_t i = 0; i < REASSEMBLY_SLOTS; i++) {
+        if (ctx->slots[i].in_use && now >= ctx->slots[i].deadline) {
+            reassembly_release(&ctx->slots[i]);
+            expired++;
+        }
+    }
+    return expired;
+}
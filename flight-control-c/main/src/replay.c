@@ -0,0 +1,42 @@
+#include "replay.h"
+
+static Replay_Status replay_restart(Replay_Window* window, uint16_t sequence) {
+    window->seen = 1;
+    window->highest = sequence;
+    window->started = 1;
+    window->too_old_run = 0;
+    return REPLAY_FRESH;
+}
+
+void replay_init(Replay_Window* window) {
+    window->seen = 0;
+    window->highest = 0;
+    window->started = 0;
+    window->too_old_run = 0;
+}
+
+Replay_Status replay_check(Replay_Window* window, uint16_t sequence) {
+    if (!window->started) {
+        return replay_restart(window, sequence);
+    }
+    int32_t ahead = (int16_t) (uint16_t) (sequence - window->highest);
+    if (ahead > 0) {
+        window->seen = ahead >= REPLAY_WINDOW ? 1 : (window->seen << ahead) | 1;
+        window->highest = sequence;
+        window->too_old_run = 0;
+        return REPLAY_FRESH;
+    }
+    if (-ahead >= REPLAY_WINDOW) {
+        if (++window->too_old_run >= REPLAY_RESYNC_AFTER) {
+            return replay_restart(window, sequence);
+        }
+        return REPLAY_TOO_OLD;
+    }
+    uint64_t bit = (uint64_t) 1 << -ahead;
+    if (window->seen & bit) {
+        return REPLAY_DUPLICATE;
+    }
+    window->seen |= bit;
+    window->too_old_run = 0;
+    return REPLAY_REORDERED;
+}
@@ -0,0 +1,50 @@
+#include "tdma.h"
+
+void tdma_timing_init(Tdma_Timing* timing, uint32_t control_airtime_us, uint32_t max_frame_airtime_us) {
+    timing->beacon_slot_us = control_airtime_us;
+    timing->control_slot_us = control_airtime_us + TDMA_GUARD_US;
+    timing->reply_slot_us = max_frame_airtime_us + TDMA_GUARD_US;
+    timing->downlink_slot_us = control_airtime_us + max_frame_airtime_us + TDMA_GUARD_US;
+}
+
+uint8_t tdma_reply_slots(const Tdma_Superframe* superframe) {
+    uint8_t slots = 0;
+    for (uint8_t i = 0; i < TDMA_MAX_REPLY_SLOTS; i++) {
+        if (superframe->reply_owner[i] != TDMA_NO_OWNER) {
+            slots = i + 1;
+        }
+    }
+    return slots;
+}
+
+uint8_t tdma_reply_slot(const Tdma_Superframe* superframe, uint8_t dev_addr) {
+    if (dev_addr == TDMA_NO_OWNER) {
+        return TDMA_NO_SLOT;
+    }
+    for (uint8_t i = 0; i < TDMA_MAX_REPLY_SLOTS; i++) {
+        if (superframe->reply_owner[i] == dev_addr) {
+            return i;
+        }
+    }
+    return TDMA_NO_SLOT;
+}
+
+uint32_t tdma_control_slot_start_us(const Tdma_Timing* timing, uint8_t slot) {
+    return slot * timing->control_slot_us;
+}
+
+uint32_t tdma_control_slot_due_us(const Tdma_Timing* timing, uint8_t slot) {
+    return timing->beacon_slot_us + tdma_control_slot_start_us(timing, slot);
+}
+
+uint32_t tdma_reply_slot_start_us(const Tdma_Timing* timing, const Tdma_Superframe* superframe, uint8_t slot) {
+    return tdma_control_slot_start_us(timing, superframe->control_slots) + slot * timing->reply_slot_us;
+}
+
+uint32_t tdma_downlink_slot_start_us(const Tdma_Timing* timing, const Tdma_Superframe* superframe, uint8_t slot) {
+    return tdma_reply_slot_start_us(timing, superframe, tdma_reply_slots(superframe)) + slot * timing->downlink_slot_us;
+}
+
+uint32_t tdma_superframe_end_us(const Tdma_Timing* timing, const Tdma_Superframe* superframe) {
+    return tdma_downlink_slot_start_us(timing, superframe, superframe->downlink_slots);
+}
@@ -0,0 +1,169 @@
+#include "adr.h"
+#include "test.h"
+
+#include <math.h>
+#include <string.h>
+
+// Trace replay of the adaptive data rate controller. A trace is the mean SNR of every frame slot, in dB as measured
+// in 500 kHz. Each frame gets Rayleigh fading on top, and it is lost depending on its margin to the floor of the
+// profile the link runs at that moment. The built-in trace flies out to range, holds and comes back. A recorded
+// trace can be replayed instead: ./adr_test trace.csv, one SNR in dB per line
+#define MAX_FRAMES 400000
+#define BUILTIN_FRAMES 200000
+// the aircraft reports its window every this many frames, the ground station decides on each report
+#define REPORT_EVERY 50
+// frames lost in a row before the link is taken as lost and falls back, stands in for the aircraft's link loss scan
+#define LINK_LOST_FRAMES 200
+// the modem's SNR reading saturates around here, the RSSI takes over above
+#define SNR_SATURATION_DB 10.0
+
+static double trace[MAX_FRAMES];
+static double fading[MAX_FRAMES];
+static uint32_t seed = 25;
+
+static double uniform(void) {
+    return (test_random(&seed) + 1.0) / 4294967297.0;
+}
+
+// frame success probability against the margin in dB, a waterfall about 2 dB wide
+static double success_probability(double margin_db) {
+    return 1.0 / (1.0 + exp(-(margin_db + 1.0) * 2.0));
+}
+
+// relative bit rate of a profile
+static double bit_rate(uint8_t profile) {
+    const Adr_Profile* p = &adr_profiles[profile];
+    return p->spreading_factor * (double)p->bandwidth_hz / (1 << p->spreading_factor) * 4.0 / p->coding_rate;
+}
+
+static int builtin_trace(void) {
+    for (int t = 0; t < BUILTIN_FRAMES; t++) {
+        double x = (double)t / BUILTIN_FRAMES;
+        double distance = x < 0.4 ? x / 0.4 : x < 0.6 ? 1.0 : (1 - x) / 0.4;
+        // +8 dB close in, -12 dB at range
+        trace[t] = 8.0 - 20.0 * distance;
+    }
+    return BUILTIN_FRAMES;
+}
+
+static int load_trace(const char* path) {
+    FILE* file = fopen(path, "r");
+    CHECK(file != NULL);
+    int frames = 0;
+    while (frames < MAX_FRAMES && fscanf(file, "%lf", &trace[frames]) == 1) {
+        frames++;
+    }
+    fclose(file);
+    CHECK(frames >= ADR_MIN_FRAMES);
+    return frames;
+}
+
+typedef struct {
+    long received;
+    long lost;
+    double goodput; // bit rate of the profile summed over the received frames, per frame slot
+    int switches;
+} Replay_Result;
+
+// fixed_profile ADR_UNKNOWN runs the controller from the fastest profile
+static Replay_Result replay(int frames, uint8_t fixed_profile) {
+    Adr_Link link;
+    adr_link_init(&link);
+    uint8_t profile = fixed_profile == ADR_UNKNOWN ? 0 : fixed_profile;
+    Replay_Result result = {0};
+    int lost_run = 0;
+    for (int t = 0; t < frames; t++) {
+        double snr_db = trace[t] + fading[t];
+        const Adr_Profile* p = &adr_profiles[profile];
+        double margin_db = snr_db + p->bandwidth_gain_qdb / 4.0 - p->required_snr_qdb / 4.0;
+        if (uniform() < success_probability(margin_db)) {
+            result.received++;
+            result.goodput += bit_rate(profile);
+            lost_run = 0;
+            double measured_db = snr_db + p->bandwidth_gain_qdb / 4.0;
+            measured_db = measured_db > SNR_SATURATION_DB ? SNR_SATURATION_DB : measured_db;
+            adr_record(&link, (uint16_t)(t + 1), (int16_t)floor(snr_db + ADR_NOISE_FLOOR_DBM), (int16_t)(measured_db * 4), profile);
+        } else {
+            result.lost++;
+            lost_run++;
+        }
+        if (fixed_profile != ADR_UNKNOWN) {
+            continue;
+        }
+        if (lost_run > LINK_LOST_FRAMES && profile + 1 < ADR_PROFILE_COUNT) {
+            profile++;
+            result.switches++;
+            adr_link_init(&link);
+            lost_run = 0;
+            continue;
+        }
+        if (t % REPORT_EVERY == 0) {
+            uint8_t decided = adr_decide(&link, profile);
+            if (decided != ADR_UNKNOWN) {
+                adr_restart_window(&link);
+                result.switches += decided != profile;
+                profile = decided;
+            }
+        }
+    }
+    result.goodput /= frames;
+    return result;
+}
+
+static double per_percent(const Replay_Result* result) {
+    return 100.0 * result->lost / (result->received + result->lost);
+}
+
+static void test_window(void) {
+    Adr_Link link;
+    adr_link_init(&link);
+    CHECK_EQ(INT16_MIN, adr_snr_qdb(&link));
+    CHECK_EQ(ADR_UNKNOWN, adr_decide(&link, 0));
+    // the first frame only syncs, gaps count as lost, a huge gap is a restart
+    adr_record(&link, 100, -80, 20, 0);
+    adr_record(&link, 103, -80, 40, 0);
+    CHECK_EQ(2, link.received);
+    CHECK_EQ(2, link.lost);
+    CHECK_EQ(30, adr_snr_qdb(&link));
+    CHECK_EQ(500, adr_per_permille(&link));
+    adr_record(&link, 103 + ADR_MAX_GAP + 10, -80, 40, 0);
+    CHECK_EQ(2, link.lost);
+    // the SNR reading is capped by the RSSI above the noise floor
+    adr_restart_window(&link);
+    adr_record(&link, 104 + ADR_MAX_GAP + 10, ADR_NOISE_FLOOR_DBM + 2, 40, 0);
+    CHECK_EQ(8, adr_snr_qdb(&link));
+    // a clean window with room to spare steps faster, a lossy one more robust
+    adr_restart_window(&link);
+    adr_merge(&link, 40, ADR_MIN_FRAMES, 0);
+    CHECK_EQ(1, adr_decide(&link, 2));
+    CHECK_EQ(0, adr_decide(&link, 0));
+    adr_merge(&link, 40, 0, ADR_MIN_FRAMES);
+    CHECK_EQ(3, adr_decide(&link, 2));
+    CHECK_EQ(ADR_PROFILE_COUNT - 1, adr_decide(&link, ADR_PROFILE_COUNT - 1));
+}
+
+int main(int argc, char** argv) {
+    test_window();
+    int frames = argc > 1 ? load_trace(argv[1]) : builtin_trace();
+    for (int t = 0; t < frames; t++) {
+        // Rayleigh power in dB, halved for moderate fading
+        fading[t] = 0.5 * 10 * log10(-log(uniform()));
+    }
+
+    Replay_Result adaptive = replay(frames, ADR_UNKNOWN);
+    printf("ADR:       PER %5.2f%%, goodput %6.0f, %d switches\n", per_percent(&adaptive), adaptive.goodput, adaptive.switches);
+    double best_goodput = 0;
+    for (uint8_t profile = 0; profile < ADR_PROFILE_COUNT; profile++) {
+        Replay_Result fixed = replay(frames, profile);
+        printf("profile %u: PER %5.2f%%, goodput %6.0f\n", profile, per_percent(&fixed), fixed.goodput);
+        // a fixed profile that holds the PER target over the whole flight is the one ADR has to beat
+        if (per_percent(&fixed) * 10 <= 2 * ADR_PER_TARGET_PERMILLE && fixed.goodput > best_goodput) {
+            best_goodput = fixed.goodput;
+        }
+    }
+    if (argc == 1) {
+        CHECK(per_percent(&adaptive) * 10 <= 2 * ADR_PER_TARGET_PERMILLE);
+        CHECK(adaptive.goodput > best_goodput);
+    }
+    return 0;
+}
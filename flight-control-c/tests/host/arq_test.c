@@ -0,0 +1,146 @@
+#include "arq.h"
+#include "reassembly.h"
+#include "test.h"
+
+#define FRAGMENT_SIZE 246
+#define LAST_FRAGMENT_SIZE 100
+#define MESSAGE_ID 7
+// airtime at SF7 / 500 kHz of a full fragment and of a NACK report
+#define DATA_US 98600LL
+#define NACK_US 11584LL
+#define TRIALS 500
+
+static uint32_t seed = 42;
+
+// Old behaviour: every fragment again until one attempt gets through, with free feedback
+static int64_t full_resend_us(int num_of_packets, uint32_t loss) {
+    int64_t airtime = 0;
+    for (;;) {
+        int ok = 1;
+        for (int k = 0; k < num_of_packets; k++) {
+            airtime += DATA_US;
+            if (test_chance(&seed, loss)) {
+                ok = 0;
+            }
+        }
+        if (ok) {
+            return airtime;
+        }
+    }
+}
+
+// Selective repeat against the reassembly engine, with data and reports lost at the same rate
+static int64_t selective_us(int num_of_packets, uint32_t loss, int* rounds) {
+    static uint8_t message[ARQ_MAX_FRAGMENTS * FRAGMENT_SIZE];
+    Reassembly_Context rx;
+    reassembly_init(&rx, FRAGMENT_SIZE);
+    Arq_Sender tx;
+    arq_start(&tx, MESSAGE_ID, num_of_packets);
+    int64_t now = 0;
+    *rounds = 0;
+    for (;;) {
+        CHECK_EQ(ARQ_SEND, tx.status);
+        uint64_t round = arq_next_round(&tx, INT64_MAX);
+        CHECK(round != 0);
+        (*rounds)++;
+        int poll = 63 - __builtin_clzll(round);
+        uint64_t missing = 0;
+        int reported = 0;
+        for (int k = 0; k < num_of_packets; k++) {
+            if (!(round >> k & 1)) {
+                continue;
+            }
+            now += DATA_US;
+            if (test_chance(&seed, loss)) {
+                continue;
+            }
+            Reassembly_Message* slot;
+            uint8_t payload_size = k == num_of_packets - 1 ? LAST_FRAGMENT_SIZE : FRAGMENT_SIZE;
+            Reassembly_Status status = reassembly_add(&rx, 1, MESSAGE_ID, num_of_packets, k,
+                                                      &message[k * FRAGMENT_SIZE], payload_size, now, &slot);
+            CHECK(status == REASSEMBLY_STORED || status == REASSEMBLY_COMPLETE || status == REASSEMBLY_DUPLICATE);
+            if (status == REASSEMBLY_COMPLETE) {
+                uint16_t size;
+                free(reassembly_take(slot, &size));
+                CHECK_EQ((num_of_packets - 1) * FRAGMENT_SIZE + LAST_FRAGMENT_SIZE, size);
+            }
+            if (k == poll) {
+                missing = reassembly_missing(slot);
+                reported = 1;
+            }
+        }
+        if (reported) {
+            now += NACK_US;
+            reported = !test_chance(&seed, loss);
+        }
+        Arq_Status status;
+        if (reported) {
+            status = arq_report(&tx, MESSAGE_ID, missing);
+        } else {
+            now += ARQ_REPORT_TIMEOUT_MS * 1000LL;
+            tx.deadline = now;
+            status = arq_check_timeout(&tx, now);
+        }
+        if (status == ARQ_DONE) {
+            reassembly_expire(&rx, INT64_MAX);
+            return now;
+        }
+        if (status == ARQ_FAILED) {
+            // the sender gives up and starts over, the receiver keeps its fragments
+            arq_start(&tx, MESSAGE_ID, num_of_packets);
+        }
+    }
+}
+
+static void test_simulated_loss(void) {
+    const int fragments[] = {4, 16, 32};
+    const uint32_t losses[] = {0, 5, 10, 20};
+    printf("fragments loss%%  full resend ms  selective ms  rounds  speedup\n");
+    for (size_t a = 0; a < sizeof(fragments) / sizeof(fragments[0]); a++) {
+        for (size_t b = 0; b < sizeof(losses) / sizeof(losses[0]); b++) {
+            int64_t full = 0;
+            int64_t selective = 0;
+            long rounds = 0;
+            for (int i = 0; i < TRIALS; i++) {
+                int trial_rounds;
+                full += full_resend_us(fragments[a], losses[b]);
+                selective += selective_us(fragments[a], losses[b], &trial_rounds);
+                rounds += trial_rounds;
+            }
+            printf("%9d %5u %14.0f %13.0f %7.2f %7.2fx\n", fragments[a], losses[b],
+                   full / 1000.0 / TRIALS, selective / 1000.0 / TRIALS, (double)rounds / TRIALS, (double)full / selective);
+            if (losses[b] == 0) {
+                // the polling reports are the only overhead on a clean link
+                CHECK(selective <= full + (int64_t)TRIALS * ((fragments[a] + ARQ_WINDOW - 1) / ARQ_WINDOW) * NACK_US);
+            } else if (fragments[a] >= 16) {
+                CHECK(selective < full);
+            }
+        }
+    }
+}
+
+static void test_rounds(void) {
+    Arq_Sender arq;
+    arq_start(&arq, 1, 20);
+    CHECK_EQ(0xFF, arq_next_round(&arq, 100));
+    // reports of other messages are ignored
+    CHECK_EQ(ARQ_WAITING, arq_report(&arq, 2, 0));
+    // fragment 2 is missing, the window slides to 2..9
+    CHECK_EQ(ARQ_SEND, arq_report(&arq, 1, ~0ULL & ~(uint64_t)0xFB));
+    CHECK_EQ((1ULL << 2) | (1ULL << 8) | (1ULL << 9), arq_next_round(&arq, 200));
+    CHECK_EQ(ARQ_WAITING, arq_check_timeout(&arq, 199));
+    CHECK_EQ(ARQ_SEND, arq_check_timeout(&arq, 200));
+    for (int i = 1; i < ARQ_MAX_RETRIES; i++) {
+        arq_next_round(&arq, 0);
+        CHECK_EQ(i + 1 < ARQ_MAX_RETRIES ? ARQ_SEND : ARQ_FAILED, arq_check_timeout(&arq, 0));
+    }
+    arq_start(&arq, 3, ARQ_MAX_FRAGMENTS);
+    CHECK(arq_next_round(&arq, 0) != 0);
+    CHECK_EQ(ARQ_DONE, arq_report(&arq, 3, 0));
+}
+
+int main(void) {
+    test_rounds();
+    test_simulated_loss();
+    return 0;
+}
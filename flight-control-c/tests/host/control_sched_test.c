@@ -0,0 +1,188 @@
+#include "control_sched.h"
+#include "tdma.h"
+#include "test.h"
+
+#include <math.h>
+#include <string.h>
+
+// airtime at SF7 / 500 kHz of a control frame with implicit header and of the longest frame
+#define CONTROL_AIRTIME_US 9024
+#define MAX_FRAME_AIRTIME_US 98624
+// like LORA_SUPERFRAME_MIN_MS, a superframe of setpoints only still takes this long
+#define SUPERFRAME_MIN_US 20000
+#define JOIN_EVERY_US 2000000LL
+#define FLEET 16
+
+// Picks total_weight * cycles ticks, checks each device got exactly weight picks per cycle and returns the longest
+// gap between two picks of each device in ticks
+static void run_cycles(Control_Sched* sched, int cycles, int32_t max_gap[CONTROL_SCHED_TABLE_SIZE]) {
+    int64_t last[CONTROL_SCHED_TABLE_SIZE];
+    uint16_t picks[CONTROL_SCHED_TABLE_SIZE];
+    memset(max_gap, 0, sizeof(int32_t) * CONTROL_SCHED_TABLE_SIZE);
+    for (int i = 0; i < CONTROL_SCHED_TABLE_SIZE; i++) {
+        last[i] = -1;
+    }
+    int64_t tick = 0;
+    for (int cycle = 0; cycle < cycles; cycle++) {
+        memset(picks, 0, sizeof(picks));
+        for (int i = 0; i < sched->total_weight; i++, tick++) {
+            uint16_t addr = control_sched_next(sched);
+            CHECK(addr < CONTROL_SCHED_TABLE_SIZE);
+            CHECK(sched->weight[addr] != 0);
+            picks[addr]++;
+            if (last[addr] >= 0 && tick - last[addr] > max_gap[addr]) {
+                max_gap[addr] = (int32_t)(tick - last[addr]);
+            }
+            last[addr] = tick;
+        }
+        for (int addr = 0; addr < CONTROL_SCHED_TABLE_SIZE; addr++) {
+            CHECK_EQ(sched->weight[addr], picks[addr]);
+        }
+    }
+}
+
+static void test_empty(void) {
+    Control_Sched sched;
+    control_sched_init(&sched);
+    CHECK_EQ(CONTROL_SCHED_NONE, control_sched_next(&sched));
+    CHECK_EQ(0, control_sched_device_period_us(&sched, 1, 20000));
+    control_sched_set_weight(&sched, 1, 1);
+    control_sched_set_weight(&sched, 1, 0);
+    CHECK_EQ(0, sched.num_of_devices);
+    CHECK_EQ(0, sched.total_weight);
+    CHECK_EQ(CONTROL_SCHED_NONE, control_sched_next(&sched));
+}
+
+// Equal weights are plain round robin in address order, every device waits exactly N ticks
+static void test_round_robin(void) {
+    const int fleets[] = {1, 2, 3, 8, 16, 254};
+    int32_t max_gap[CONTROL_SCHED_TABLE_SIZE];
+    for (size_t f = 0; f < sizeof(fleets) / sizeof(fleets[0]); f++) {
+        Control_Sched sched;
+        control_sched_init(&sched);
+        for (int addr = 1; addr <= fleets[f]; addr++) {
+            control_sched_set_weight(&sched, addr, 1);
+        }
+        CHECK_EQ(fleets[f], sched.num_of_devices);
+        for (int addr = 1; addr <= fleets[f]; addr++) {
+            CHECK_EQ(addr, control_sched_next(&sched));
+        }
+        run_cycles(&sched, 3, max_gap);
+        for (int addr = 1; addr <= fleets[f] && fleets[f] > 1; addr++) {
+            CHECK_EQ(fleets[f], max_gap[addr]);
+        }
+    }
+}
+
+// Random fleets with weights 1 to 8: exact shares per cycle, weight 1 devices wait exactly one cycle and no device
+// waits twice its average period
+static void test_weighted(void) {
+    uint32_t seed = 22;
+    int32_t max_gap[CONTROL_SCHED_TABLE_SIZE];
+    for (int trial = 0; trial < 2000; trial++) {
+        Control_Sched sched;
+        control_sched_init(&sched);
+        int devices = 1 + test_random(&seed) % 32;
+        for (int i = 0; i < devices; i++) {
+            control_sched_set_weight(&sched, 1 + test_random(&seed) % 254, 1 + test_random(&seed) % 8);
+        }
+        run_cycles(&sched, 4, max_gap);
+        for (int addr = 0; addr < CONTROL_SCHED_TABLE_SIZE; addr++) {
+            uint8_t weight = sched.weight[addr];
+            if (weight == 0 || weight == sched.total_weight) {
+                continue;
+            }
+            int32_t average = (sched.total_weight + weight - 1) / weight;
+            CHECK(max_gap[addr] < 2 * average);
+            if (weight == 1) {
+                CHECK_EQ(sched.total_weight, max_gap[addr]);
+            }
+        }
+    }
+}
+
+// Devices join, change weight and leave, every change starts a cycle with exact shares again
+static void test_changes(void) {
+    Control_Sched sched;
+    control_sched_init(&sched);
+    int32_t max_gap[CONTROL_SCHED_TABLE_SIZE];
+    uint32_t seed = 7;
+    for (int step = 0; step < 500; step++) {
+        uint8_t addr = 1 + test_random(&seed) % 40;
+        uint8_t weight = test_random(&seed) % 3 == 0 ? 0 : 1 + test_random(&seed) % 4;
+        // a few picks mid cycle, the change resets the credits
+        for (int i = 0; i < step % 5 && sched.num_of_devices != 0; i++) {
+            control_sched_next(&sched);
+        }
+        control_sched_set_weight(&sched, addr, weight);
+        uint16_t devices = 0;
+        uint16_t total = 0;
+        for (int a = 0; a < CONTROL_SCHED_TABLE_SIZE; a++) {
+            devices += sched.weight[a] != 0;
+            total += sched.weight[a];
+            CHECK_EQ(sched.weight[a] != 0, (sched.members[a / 32] >> (a % 32)) & 1);
+        }
+        CHECK_EQ(devices, sched.num_of_devices);
+        CHECK_EQ(total, sched.total_weight);
+        if (sched.num_of_devices != 0) {
+            run_cycles(&sched, 2, max_gap);
+        }
+    }
+}
+
+// N aircraft join one every two seconds on a link of setpoint-only superframes planned like network_plan_superframe.
+// The measured update rate of every device must match control_sched_device_period_us
+static void test_fleet_simulation(void) {
+    Tdma_Timing timing;
+    tdma_timing_init(&timing, CONTROL_AIRTIME_US, MAX_FRAME_AIRTIME_US);
+    Control_Sched sched;
+    control_sched_init(&sched);
+    int64_t now = 0;
+    printf("devices  slots  superframe us  weight 1 Hz  weight 3 Hz  min Hz measured  max Hz measured\n");
+    for (int devices = 1; devices <= FLEET; devices++) {
+        // device 1 flies with weight 3, the others with 1
+        control_sched_set_weight(&sched, devices, devices == 1 ? 3 : 1);
+        uint8_t control_slots = sched.total_weight < TDMA_MAX_CONTROL_SLOTS ? sched.total_weight : TDMA_MAX_CONTROL_SLOTS;
+        uint32_t superframe_us = control_slots * timing.control_slot_us;
+        superframe_us = superframe_us < SUPERFRAME_MIN_US ? SUPERFRAME_MIN_US : superframe_us;
+        uint32_t tick_us = superframe_us / control_slots;
+
+        long updates[FLEET + 1] = {0};
+        int64_t phase_end = now + JOIN_EVERY_US;
+        int64_t phase_start = now;
+        int superframes = 0;
+        for (; now + superframe_us <= phase_end; now += superframe_us) {
+            for (int i = 0; i < control_slots; i++) {
+                updates[control_sched_next(&sched)]++;
+            }
+            superframes++;
+        }
+        double seconds = (double)superframes * superframe_us / 1e6;
+        double min_hz = 1e9;
+        double max_hz = 0;
+        for (int addr = 1; addr <= devices; addr++) {
+            double expected = 1e6 / control_sched_device_period_us(&sched, addr, tick_us);
+            double measured = updates[addr] / seconds;
+            // the phase ends within a scheduler cycle, a device may be up to its weight off its share
+            CHECK(fabs(updates[addr] - expected * seconds) <= sched.weight[addr]);
+            if (addr != 1) {
+                min_hz = measured < min_hz ? measured : min_hz;
+                max_hz = measured > max_hz ? measured : max_hz;
+            }
+        }
+        printf("%7d  %5u  %13u  %11.2f  %11.2f  %15.2f  %15.2f\n", devices, control_slots, superframe_us,
+               devices > 1 ? 1e6 / control_sched_device_period_us(&sched, 2, tick_us) : 0.0,
+               1e6 / control_sched_device_period_us(&sched, 1, tick_us),
+               devices > 1 ? min_hz : 0.0, devices > 1 ? max_hz : 0.0);
+        now = phase_start + JOIN_EVERY_US;
+    }
+}
+
+int main(void) {
+    test_empty();
+    test_round_robin();
+    test_weighted();
+    test_changes();
+    test_fleet_simulation();
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include "crc16.h"
+#include "test.h"
+
+#include <string.h>
+
+// Bitwise reference with the same parameters as the ESP ROM crc16_be: poly 0x1021, MSB first,
+// register and result inverted (CRC-16/GENIBUS).
+static uint16_t crc16_bitwise(uint16_t crc, const uint8_t* data, size_t length) {
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return ~crc;
+}
+
+static void test_check_value(void) {
+    const uint8_t check[] = "123456789";
+    CHECK_EQ(0xD64E, crc16(0, check, 9));
+    CHECK_EQ(0x0000, crc16(0, check, 0));
+}
+
+// Every length and start offset, so the slicing-by-4 loop is entered at every alignment and left with every tail
+static void test_matches_bitwise(void) {
+    uint8_t data[300];
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)test_random(&seed);
+    }
+    for (size_t offset = 0; offset < 4; offset++) {
+        for (size_t length = 0; length <= 256; length++) {
+            CHECK_EQ(crc16_bitwise(0, data + offset, length), crc16(0, data + offset, length));
+        }
+    }
+}
+
+static void test_chained(void) {
+    uint8_t data[256];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7 + 3);
+    }
+    for (size_t length = 0; length <= sizeof(data); length += 5) {
+        uint16_t whole = crc16(0, data, length);
+        for (size_t split = 0; split <= length; split++) {
+            CHECK_EQ(whole, crc16(crc16(0, data, split), data + split, length - split));
+        }
+    }
+}
+
+static void benchmark(void) {
+    uint8_t data[256];
+    memset(data, 0xA5, sizeof(data));
+    const size_t lengths[] = {9, 64, 253};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        size_t length = lengths[i];
+        long iterations = 4000000 / (long)length;
+        volatile uint16_t sink = 0;
+        double start = test_now_s();
+        for (long n = 0; n < iterations; n++) {
+            sink ^= crc16_bitwise(0, data, length);
+        }
+        double bitwise = test_now_s() - start;
+        start = test_now_s();
+        for (long n = 0; n < iterations; n++) {
+            sink ^= crc16(0, data, length);
+        }
+        double sliced = test_now_s() - start;
+        printf("%3zu B: bitwise %.1f MB/s, slicing-by-4 %.1f MB/s\n", length,
+               (double)(iterations * (long)length) / bitwise / 1e6, (double)(iterations * (long)length) / sliced / 1e6);
+    }
+}
+
+int main(void) {
+    test_check_value();
+    test_matches_bitwise();
+    test_chained();
+    benchmark();
+    return 0;
+}
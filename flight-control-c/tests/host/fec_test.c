@@ -0,0 +1,211 @@
+#include "fec.h"
+#include "reassembly.h"
+#include "test.h"
+
+#include <string.h>
+
+#define FRAGMENT_SIZE 246
+#define TRIALS 4000
+// airtime at SF7 / 500 kHz of a full fragment, and of a NACK report with the RX/TX turnaround of a round
+#define DATA_MS 98.6
+#define ROUND_MS (11.6 + 150.0)
+
+static uint8_t original[FEC_MAX_DATA_FRAGMENTS * FRAGMENT_SIZE];
+static uint8_t data[FEC_MAX_DATA_FRAGMENTS * FRAGMENT_SIZE];
+static uint8_t parity[FEC_MAX_PARITY * FRAGMENT_SIZE];
+static uint32_t seed = 88172645;
+
+static uint64_t full_mask(uint8_t num_of_data) {
+    return num_of_data == 64 ? ~0ULL : (1ULL << num_of_data) - 1;
+}
+
+// Random message of num_of_data fragments with a zero padded short last fragment, returns its size
+static uint16_t make_message(uint8_t num_of_data, uint8_t num_of_parity) {
+    for (int i = 0; i < num_of_data * FRAGMENT_SIZE; i++) {
+        original[i] = (uint8_t)test_random(&seed);
+    }
+    int last = 1 + test_random(&seed) % FRAGMENT_SIZE;
+    memset(&original[(num_of_data - 1) * FRAGMENT_SIZE + last], 0, FRAGMENT_SIZE - last);
+    for (int j = 0; j < num_of_parity; j++) {
+        fec_encode(original, FRAGMENT_SIZE, num_of_data, FRAGMENT_SIZE, j, &parity[j * FRAGMENT_SIZE]);
+    }
+    return (num_of_data - 1) * FRAGMENT_SIZE + last;
+}
+
+// Any erasure of up to K of the N + K fragments is rebuilt, one more is refused
+static void test_random_erasures(void) {
+    for (int trial = 0; trial < TRIALS; trial++) {
+        uint8_t num_of_data = 1 + test_random(&seed) % FEC_MAX_DATA_FRAGMENTS;
+        uint8_t num_of_parity = 1 + test_random(&seed) % FEC_MAX_PARITY;
+        make_message(num_of_data, num_of_parity);
+        memcpy(data, original, num_of_data * FRAGMENT_SIZE);
+        uint64_t received = full_mask(num_of_data);
+        uint8_t parity_received = (uint8_t)((1u << num_of_parity) - 1);
+        int lose = test_random(&seed) % (num_of_parity + 2);
+        if (lose > num_of_data + num_of_parity) {
+            lose = num_of_data + num_of_parity;
+        }
+        for (int lost = 0; lost < lose;) {
+            int which = test_random(&seed) % (num_of_data + num_of_parity);
+            if (which < num_of_data && (received >> which & 1)) {
+                received &= ~(1ULL << which);
+                memset(&data[which * FRAGMENT_SIZE], 0xA5, FRAGMENT_SIZE);
+                lost++;
+            } else if (which >= num_of_data && (parity_received >> (which - num_of_data) & 1)) {
+                parity_received &= ~(1u << (which - num_of_data));
+                lost++;
+            }
+        }
+        uint8_t result = fec_decode(data, FRAGMENT_SIZE, num_of_data, received, parity, parity_received, FRAGMENT_SIZE);
+        if (lose <= num_of_parity) {
+            CHECK_EQ(0, result);
+            CHECK(memcmp(data, original, num_of_data * FRAGMENT_SIZE) == 0);
+        } else {
+            CHECK_EQ(1, result);
+        }
+    }
+}
+
+// Data and parity fragments through the reassembly engine in shuffled order with up to K of them lost
+static void test_reassembly_with_parity(void) {
+    Reassembly_Context ctx;
+    reassembly_init(&ctx, FRAGMENT_SIZE);
+    int64_t now = 0;
+    for (int trial = 0; trial < TRIALS / 4; trial++) {
+        uint8_t num_of_data = 1 + test_random(&seed) % FEC_MAX_DATA_FRAGMENTS;
+        uint8_t num_of_parity = 1 + test_random(&seed) % FEC_MAX_PARITY;
+        uint16_t size = make_message(num_of_data, num_of_parity);
+        uint8_t last_size = size - (num_of_data - 1) * FRAGMENT_SIZE;
+        int total = num_of_data + num_of_parity;
+        int order[FEC_MAX_DATA_FRAGMENTS + FEC_MAX_PARITY];
+        for (int i = 0; i < total; i++) {
+            order[i] = i;
+        }
+        for (int i = total - 1; i > 0; i--) {
+            int j = test_random(&seed) % (i + 1);
+            int swap = order[i];
+            order[i] = order[j];
+            order[j] = swap;
+        }
+        int lose = test_random(&seed) % (num_of_parity + 1);
+        int done = 0;
+        for (int i = lose; i < total; i++) {
+            Reassembly_Message* slot;
+            Reassembly_Status status;
+            now += 1000;
+            if (order[i] < num_of_data) {
+                int k = order[i];
+                status = reassembly_add(&ctx, 1, (uint8_t)trial, num_of_data, k, &original[k * FRAGMENT_SIZE],
+                                        k == num_of_data - 1 ? last_size : FRAGMENT_SIZE, now, &slot);
+            } else {
+                int j = order[i] - num_of_data;
+                status = reassembly_add_parity(&ctx, 1, (uint8_t)trial, num_of_data, j, last_size,
+                                               &parity[j * FRAGMENT_SIZE], FRAGMENT_SIZE, now, &slot);
+            }
+            if (done) {
+                CHECK_EQ(REASSEMBLY_DUPLICATE, status);
+            } else if (status == REASSEMBLY_COMPLETE) {
+                uint16_t taken_size;
+                uint8_t* taken = reassembly_take(slot, &taken_size);
+                CHECK_EQ(size, taken_size);
+                CHECK(memcmp(taken, original, size) == 0);
+                free(taken);
+                done = 1;
+            } else {
+                CHECK_EQ(REASSEMBLY_STORED, status);
+            }
+        }
+        CHECK(done);
+        now += REASSEMBLY_TIMEOUT_MS * 1000LL;
+        reassembly_expire(&ctx, now);
+    }
+}
+
+static void benchmark(void) {
+    const uint8_t num_of_data = 16;
+    const int iterations = 20000;
+    make_message(num_of_data, FEC_MAX_PARITY);
+    for (uint8_t num_of_parity = 1; num_of_parity <= 4; num_of_parity *= 2) {
+        double start = test_now_s();
+        for (int r = 0; r < iterations; r++) {
+            for (int j = 0; j < num_of_parity; j++) {
+                fec_encode(original, FRAGMENT_SIZE, num_of_data, FRAGMENT_SIZE, j, &parity[j * FRAGMENT_SIZE]);
+            }
+        }
+        double encode = test_now_s() - start;
+        uint64_t received = full_mask(num_of_data) & ~((1ULL << num_of_parity) - 1);
+        uint8_t parity_received = (uint8_t)((1u << num_of_parity) - 1);
+        memcpy(data, original, num_of_data * FRAGMENT_SIZE);
+        start = test_now_s();
+        for (int r = 0; r < iterations; r++) {
+            CHECK_EQ(0, fec_decode(data, FRAGMENT_SIZE, num_of_data, received, parity, parity_received, FRAGMENT_SIZE));
+        }
+        double decode = test_now_s() - start;
+        printf("N=16 K=%u: encode %.1f us/message (%.0f MB/s), decode of %u lost %.1f us/message\n", num_of_parity,
+               encode / iterations * 1e6, num_of_data * FRAGMENT_SIZE * (double)iterations / encode / 1e6,
+               num_of_parity, decode / iterations * 1e6);
+    }
+}
+
+// Airtime to deliver a 16 fragment message: parity once after the data, selective repeat for the rest
+static void goodput(void) {
+    const int num_of_data = 16;
+    const int parities[] = {0, 2, 4};
+    const int runs = 5000;
+    printf("loss%%  airtime ms K=0/2/4   first round %% K=0/2/4   goodput B/s K=0/2/4\n");
+    for (uint32_t loss = 0; loss <= 20; loss += 5) {
+        double airtime[3] = {0};
+        int first_round[3] = {0};
+        for (int p = 0; p < 3; p++) {
+            for (int r = 0; r < runs; r++) {
+                int have[FEC_MAX_DATA_FRAGMENTS] = {0};
+                int got = 0;
+                int rounds = 0;
+                for (int i = 0; i < num_of_data + parities[p]; i++) {
+                    airtime[p] += DATA_MS;
+                    if (!test_chance(&seed, loss)) {
+                        if (i < num_of_data) {
+                            have[i] = 1;
+                        }
+                        got++;
+                    }
+                }
+                for (;;) {
+                    airtime[p] += ROUND_MS;
+                    if (got >= num_of_data) {
+                        break;
+                    }
+                    rounds++;
+                    for (int i = 0; i < num_of_data; i++) {
+                        if (!have[i]) {
+                            airtime[p] += DATA_MS;
+                            if (!test_chance(&seed, loss)) {
+                                have[i] = 1;
+                                got++;
+                            }
+                        }
+                    }
+                }
+                first_round[p] += rounds == 0;
+            }
+            airtime[p] /= runs;
+        }
+        printf("%5u %7.0f %6.0f %6.0f   %5.1f %5.1f %5.1f   %5.0f %5.0f %5.0f\n", loss,
+               airtime[0], airtime[1], airtime[2],
+               first_round[0] * 100.0 / runs, first_round[1] * 100.0 / runs, first_round[2] * 100.0 / runs,
+               num_of_data * FRAGMENT_SIZE / (airtime[0] / 1e3), num_of_data * FRAGMENT_SIZE / (airtime[1] / 1e3),
+               num_of_data * FRAGMENT_SIZE / (airtime[2] / 1e3));
+        if (loss > 0) {
+            // parity saves the retransmission round for most messages
+            CHECK(first_round[1] > first_round[0] && first_round[2] > first_round[1]);
+        }
+    }
+}
+
+int main(void) {
+    test_random_erasures();
+    test_reassembly_with_parity();
+    benchmark();
+    goodput();
+    return 0;
+}
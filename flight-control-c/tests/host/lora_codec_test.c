@@ -0,0 +1,317 @@
+#include "lora_codec.h"
+#include "test.h"
+
+#include <string.h>
+
+// The firmware defines these in lora.c, which needs the radio and doesn't build on the host
+uint16_t lora_calc_header_crc(LoRa_Packet_Header* header) {
+    uint8_t header_arr[7] = {header->message_type, header->src_device_addr, header->dest_device_addr,
+                             header->num_of_packets, header->packet_num, header->message_id,
+                             header->payload_size};
+    return crc16(0, header_arr, 7);
+}
+
+uint16_t lora_calc_packet_crc(LoRa_Packet_Payload* payload, uint8_t payload_length) {
+    return crc16(0, payload->payload, payload_length);
+}
+
+static uint32_t seed = 0xC0DEC;
+
+// Serializes through the segments, the path the sender task uses, and checks it against the contiguous encoder
+static uint8_t encode(LoRa_Packet* packet, uint8_t* frame) {
+    uint8_t wire_header[LORA_PACKET_WIRE_MAX_HEADER_SIZE];
+    sx127x_segment_t segments[LORA_PACKET_WIRE_SEGMENTS];
+    uint8_t length = lora_codec_encode_segments(packet, wire_header, segments);
+    CHECK_EQ(length, segments[0].buffer_length + segments[1].buffer_length);
+    CHECK(segments[1].buffer == packet->payload.payload);
+    memcpy(frame, segments[0].buffer, segments[0].buffer_length);
+    memcpy(&frame[segments[0].buffer_length], segments[1].buffer, segments[1].buffer_length);
+
+    uint8_t contiguous[LORA_PACKET_WIRE_MAX_SIZE];
+    CHECK_EQ(length, lora_codec_encode(packet, contiguous));
+    CHECK(memcmp(frame, contiguous, length) == 0);
+    CHECK_EQ(length, lora_codec_frame_length(packet));
+    return length;
+}
+
+static void check_same_packet(const LoRa_Packet* expected, const LoRa_Packet* actual) {
+    CHECK_EQ(expected->header.message_type, actual->header.message_type);
+    CHECK_EQ(expected->header.src_device_addr, actual->header.src_device_addr);
+    CHECK_EQ(expected->header.dest_device_addr, actual->header.dest_device_addr);
+    CHECK_EQ(expected->header.sequence, actual->header.sequence);
+    CHECK_EQ(expected->header.num_of_packets, actual->header.num_of_packets);
+    CHECK_EQ(expected->header.packet_num, actual->header.packet_num);
+    CHECK_EQ(expected->header.message_id, actual->header.message_id);
+    CHECK_EQ(expected->header.poll, actual->header.poll);
+    CHECK_EQ(expected->header.payload_size, actual->header.payload_size);
+    CHECK(memcmp(expected->payload.payload, actual->payload.payload, expected->header.payload_size) == 0);
+    CHECK_EQ(lora_calc_header_crc((LoRa_Packet_Header*)&actual->header), actual->header.header_crc);
+    CHECK_EQ(lora_calc_packet_crc((LoRa_Packet_Payload*)&actual->payload, actual->header.payload_size),
+             actual->payload.payload_crc);
+}
+
+static void test_control(void) {
+    LoRa_Control_Frame control = {.aileron = -50, .elevator = 20, .rudder = -100, .throttle = 75, .landing_gear = 1};
+    LoRa_Control_Frame decoded;
+    LoRa_Packet packet;
+    LoRa_Packet received;
+    uint8_t frame[LORA_PACKET_WIRE_MAX_SIZE];
+    lora_codec_encode_control(&control, LORA_BASE_STATION_ADDR, 1, &packet);
+    packet.header.sequence = 0xBEEF;
+    uint8_t length = encode(&packet, frame);
+    CHECK_EQ(LORA_CONTROL_WIRE_SIZE, length);
+    CHECK_EQ((LORA_WIRE_VERSION << LORA_WIRE_VERSION_SHIFT) | LORA_WIRE_FLAG_SINGLE | LORA_MESSAGE_CONTROL, frame[0]);
+    CHECK_EQ(0, lora_codec_decode(&received, frame, length));
+    check_same_packet(&packet, &received);
+    CHECK_EQ(0, lora_codec_decode_control(&received, &decoded));
+    CHECK_EQ(control.aileron, decoded.aileron);
+    CHECK_EQ(control.elevator, decoded.elevator);
+    CHECK_EQ(control.rudder, decoded.rudder);
+    CHECK_EQ(control.throttle, decoded.throttle);
+    CHECK_EQ(control.landing_gear, decoded.landing_gear);
+
+    control.landing_gear = 0;
+    control.throttle = 100;
+    lora_codec_encode_control(&control, LORA_BASE_STATION_ADDR, 1, &packet);
+    CHECK_EQ(0, lora_codec_decode_control(&packet, &decoded));
+    CHECK_EQ(100, decoded.throttle);
+    CHECK_EQ(0, decoded.landing_gear);
+
+    lora_codec_encode_header_mode(LORA_BASE_STATION_ADDR, 1, &packet);
+    CHECK_EQ(LORA_CONTROL_WIRE_SIZE, encode(&packet, frame));
+    CHECK_EQ(1, lora_codec_decode_control(&packet, &decoded));
+}
+
+// Any flipped bit, a truncated frame or another wire version must be refused
+static void test_corrupted_frames(void) {
+    LoRa_Packet packet;
+    LoRa_Packet received;
+    uint8_t frame[LORA_PACKET_WIRE_MAX_SIZE];
+    memset(&packet, 0, sizeof(packet));
+    packet.header.message_type = LORA_MESSAGE_DATA;
+    packet.header.src_device_addr = 1;
+    packet.header.num_of_packets = 3;
+    packet.header.packet_num = 2;
+    packet.header.message_id = 77;
+    packet.header.payload_size = 200;
+    for (int i = 0; i < 200; i++) {
+        packet.payload.payload[i] = (uint8_t)i;
+    }
+    uint8_t length = encode(&packet, frame);
+    CHECK_EQ(LORA_PACKET_WIRE_HEADER_SIZE + 200, length);
+    CHECK_EQ(0, frame[0] & LORA_WIRE_FLAG_SINGLE);
+    for (int bit = 0; bit < length * 8; bit++) {
+        frame[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+        CHECK_EQ(1, lora_codec_decode(&received, frame, length));
+        frame[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+    }
+    for (uint8_t shorter = 0; shorter < length; shorter++) {
+        CHECK_EQ(1, lora_codec_decode(&received, frame, shorter));
+    }
+    CHECK_EQ(0, lora_codec_decode(&received, frame, length));
+    check_same_packet(&packet, &received);
+}
+
+static void test_data_and_parity(void) {
+    LoRa_Packet packet;
+    LoRa_Packet received;
+    uint8_t frame[LORA_PACKET_WIRE_MAX_SIZE];
+    memset(&packet, 0, sizeof(packet));
+    // a single fragment data message keeps the full header, the receiver needs its message id
+    packet.header.message_type = LORA_MESSAGE_DATA;
+    packet.header.num_of_packets = 1;
+    packet.header.message_id = 77;
+    packet.header.payload_size = 10;
+    uint8_t length = encode(&packet, frame);
+    CHECK_EQ(LORA_PACKET_WIRE_HEADER_SIZE + 10, length);
+    CHECK_EQ(0, lora_codec_decode(&received, frame, length));
+    check_same_packet(&packet, &received);
+
+    // parity carries the size of the last data fragment
+    packet.header.message_type = LORA_MESSAGE_PARITY;
+    packet.header.last_payload_size = 17;
+    packet.header.payload_size = LORA_PAYLOAD_MAX_SIZE;
+    length = encode(&packet, frame);
+    CHECK_EQ(LORA_PACKET_WIRE_MAX_SIZE, length);
+    CHECK_EQ(0, lora_codec_decode(&received, frame, length));
+    check_same_packet(&packet, &received);
+    CHECK_EQ(17, received.header.last_payload_size);
+}
+
+static void test_beacon_link_nack(void) {
+    LoRa_Packet packet;
+    LoRa_Packet received;
+    uint8_t frame[LORA_PACKET_WIRE_MAX_SIZE];
+
+    Tdma_Superframe superframe = {.control_slots = 3, .downlink_slots = 2, .reply_owner = {0x01, 0x07}};
+    Tdma_Superframe decoded_superframe;
+    uint8_t profile;
+    lora_codec_encode_beacon(&superframe, 4, LORA_BASE_STATION_ADDR, &packet);
+    CHECK_EQ(LORA_CONTROL_WIRE_SIZE, encode(&packet, frame));
+    CHECK_EQ(0, lora_codec_decode(&received, frame, LORA_CONTROL_WIRE_SIZE));
+    CHECK_EQ(LORA_NETWORK_BROADCAST_ADDR, received.header.dest_device_addr);
+    CHECK_EQ(0, lora_codec_decode_beacon(&received, &decoded_superframe, &profile));
+    CHECK_EQ(3, decoded_superframe.control_slots);
+    CHECK_EQ(2, decoded_superframe.downlink_slots);
+    CHECK_EQ(0x01, decoded_superframe.reply_owner[0]);
+    CHECK_EQ(0x07, decoded_superframe.reply_owner[1]);
+    CHECK_EQ(4, profile);
+    received.payload.payload[0] = TDMA_MAX_CONTROL_SLOTS + 1;
+    CHECK_EQ(1, lora_codec_decode_beacon(&received, &decoded_superframe, &profile));
+
+    LoRa_Link_Frame link = {.op = LORA_LINK_REPORT, .profile = 2, .snr_qdb = -37, .received = 60000, .lost = 513};
+    LoRa_Link_Frame decoded_link;
+    lora_codec_encode_link(&link, 1, LORA_BASE_STATION_ADDR, &packet);
+    uint8_t length = encode(&packet, frame);
+    CHECK_EQ(0, lora_codec_decode(&received, frame, length));
+    CHECK_EQ(0, lora_codec_decode_link(&received, &decoded_link));
+    CHECK_EQ(link.op, decoded_link.op);
+    CHECK_EQ(link.profile, decoded_link.profile);
+    CHECK_EQ(link.snr_qdb, decoded_link.snr_qdb);
+    CHECK_EQ(link.received, decoded_link.received);
+    CHECK_EQ(link.lost, decoded_link.lost);
+    CHECK_EQ(1, lora_codec_decode_nack(&received, &profile, &(uint64_t){0}));
+
+    uint8_t message_id;
+    uint64_t missing;
+    lora_codec_encode_nack(1, LORA_BASE_STATION_ADDR, 5, 0x8000000000000001ULL, &packet);
+    length = encode(&packet, frame);
+    CHECK_EQ(0, lora_codec_decode(&received, frame, length));
+    CHECK_EQ(0, lora_codec_decode_nack(&received, &message_id, &missing));
+    CHECK_EQ(5, message_id);
+    CHECK(missing == 0x8000000000000001ULL);
+}
+
+// The sequence number is big endian on air and survives the wrap, batch records inherit it from their frame
+static void test_sequence(void) {
+    LoRa_Control_Frame control = {0};
+    LoRa_Packet packet;
+    LoRa_Packet received;
+    LoRa_Packet record;
+    uint8_t frame[LORA_PACKET_WIRE_MAX_SIZE];
+    const uint16_t sequences[] = {0xFFFE, 0xFFFF, 0x0000, 0x0001, 0x00FF, 0x0100, 0x7FFF, 0x8000};
+    for (size_t i = 0; i < sizeof(sequences) / sizeof(sequences[0]); i++) {
+        lora_codec_encode_control(&control, LORA_BASE_STATION_ADDR, 1, &packet);
+        packet.header.sequence = sequences[i];
+        uint8_t length = encode(&packet, frame);
+        CHECK_EQ(sequences[i] >> 8, frame[3]);
+        CHECK_EQ(sequences[i] & 0xFF, frame[4]);
+        CHECK_EQ(0, lora_codec_decode(&received, frame, length));
+        CHECK_EQ(sequences[i], received.header.sequence);
+
+        lora_codec_batch_init(1, LORA_BASE_STATION_ADDR, &packet);
+        packet.header.sequence = sequences[i];
+        lora_codec_encode_nack(1, LORA_BASE_STATION_ADDR, 5, 1, &record);
+        CHECK_EQ(0, lora_codec_batch_append(&packet, &record));
+        length = encode(&packet, frame);
+        CHECK_EQ(0, lora_codec_decode(&received, frame, length));
+        uint8_t offset = 0;
+        CHECK_EQ(0, lora_codec_batch_next(&received, &offset, &record));
+        CHECK_EQ(sequences[i], record.header.sequence);
+    }
+}
+
+static void make_data(LoRa_Packet* packet, uint8_t message_id, uint8_t payload_size) {
+    memset(packet, 0, sizeof(*packet));
+    packet->header.message_type = LORA_MESSAGE_DATA;
+    packet->header.src_device_addr = 1;
+    packet->header.dest_device_addr = LORA_BASE_STATION_ADDR;
+    packet->header.num_of_packets = 1;
+    packet->header.message_id = message_id;
+    packet->header.poll = 1;
+    packet->header.payload_size = payload_size;
+    for (int i = 0; i < payload_size; i++) {
+        packet->payload.payload[i] = (uint8_t)(i * 3);
+    }
+}
+
+// Two NACKs and a small data message share one frame and are split again on receive
+static void test_batch(void) {
+    LoRa_Packet batch;
+    LoRa_Packet received;
+    LoRa_Packet record;
+    LoRa_Packet packets[3];
+    uint8_t frame[LORA_PACKET_WIRE_MAX_SIZE];
+    lora_codec_batch_init(1, LORA_BASE_STATION_ADDR, &batch);
+    batch.header.sequence = 4242;
+    lora_codec_encode_nack(1, LORA_BASE_STATION_ADDR, 5, 0x8000000000000001ULL, &packets[0]);
+    lora_codec_encode_nack(1, LORA_BASE_STATION_ADDR, 6, 0, &packets[1]);
+    make_data(&packets[2], 9, 32);
+    for (int i = 0; i < 3; i++) {
+        packets[i].header.sequence = batch.header.sequence;
+        CHECK(lora_codec_can_batch(&packets[i]));
+        CHECK_EQ(0, lora_codec_batch_append(&batch, &packets[i]));
+    }
+    CHECK_EQ(2 * (2 + LORA_NACK_FRAME_SIZE) + 5 + 32, batch.header.payload_size);
+    uint8_t length = encode(&batch, frame);
+    CHECK_EQ(LORA_PACKET_WIRE_SINGLE_HEADER_SIZE + batch.header.payload_size, length);
+    CHECK_EQ(0, lora_codec_decode(&received, frame, length));
+    CHECK_EQ(LORA_MESSAGE_BATCH, received.header.message_type);
+    uint8_t offset = 0;
+    for (int i = 0; i < 3; i++) {
+        CHECK_EQ(0, lora_codec_batch_next(&received, &offset, &record));
+        check_same_packet(&packets[i], &record);
+    }
+    CHECK_EQ(1, lora_codec_batch_next(&received, &offset, &record));
+
+    // the frame refuses records once it is full, large or fragmented packets are not batched
+    make_data(&packets[2], 9, 100);
+    int appended = 0;
+    lora_codec_batch_init(1, LORA_BASE_STATION_ADDR, &batch);
+    while (lora_codec_batch_append(&batch, &packets[2]) == 0) {
+        appended++;
+    }
+    CHECK_EQ(2, appended);
+    packets[2].header.payload_size = LORA_BATCH_MAX_RECORD_SIZE;
+    CHECK(!lora_codec_can_batch(&packets[2]));
+    packets[2].header.payload_size = 10;
+    packets[2].header.num_of_packets = 2;
+    CHECK(!lora_codec_can_batch(&packets[2]));
+
+    // a truncated record is rejected
+    lora_codec_batch_init(1, LORA_BASE_STATION_ADDR, &batch);
+    lora_codec_batch_append(&batch, &packets[0]);
+    batch.header.payload_size--;
+    offset = 0;
+    CHECK_EQ(1, lora_codec_batch_next(&batch, &offset, &record));
+}
+
+// Random fragments and reports of every size round trip unchanged
+static void test_random_round_trip(void) {
+    LoRa_Packet packet;
+    LoRa_Packet received;
+    uint8_t frame[LORA_PACKET_WIRE_MAX_SIZE];
+    for (int trial = 0; trial < 20000; trial++) {
+        memset(&packet, 0, sizeof(packet));
+        packet.header.message_type = test_random(&seed) % 2 ? LORA_MESSAGE_DATA : LORA_MESSAGE_PARITY;
+        packet.header.src_device_addr = (uint8_t)test_random(&seed);
+        packet.header.dest_device_addr = (uint8_t)test_random(&seed);
+        packet.header.sequence = (uint16_t)test_random(&seed);
+        packet.header.num_of_packets = 1 + test_random(&seed) % 64;
+        packet.header.packet_num = test_random(&seed) % packet.header.num_of_packets;
+        packet.header.message_id = (uint8_t)test_random(&seed);
+        packet.header.poll = test_random(&seed) % 2;
+        packet.header.payload_size = 1 + test_random(&seed) % LORA_PAYLOAD_MAX_SIZE;
+        if (packet.header.message_type == LORA_MESSAGE_PARITY) {
+            packet.header.last_payload_size = 1 + test_random(&seed) % LORA_PAYLOAD_MAX_SIZE;
+        }
+        for (int i = 0; i < packet.header.payload_size; i++) {
+            packet.payload.payload[i] = (uint8_t)test_random(&seed);
+        }
+        uint8_t length = encode(&packet, frame);
+        CHECK_EQ(0, lora_codec_decode(&received, frame, length));
+        check_same_packet(&packet, &received);
+        CHECK_EQ(packet.header.last_payload_size, received.header.last_payload_size);
+    }
+}
+
+int main(void) {
+    test_control();
+    test_corrupted_frames();
+    test_data_and_parity();
+    test_beacon_link_nack();
+    test_batch();
+    test_sequence();
+    test_random_round_trip();
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include "packet_pool.h"
+#include "test.h"
+
+#include <string.h>
+
+#define BENCHMARK_PACKETS 2000000
+// rx_callback -> packet_rx_queue -> network task -> lora_tx_queue -> sender task
+#define PIPELINE_HOPS 2
+// the depth the queues had when they carried packets by value
+#define QUEUE_DEPTH 50
+
+static void test_alloc_free(void) {
+    packet_pool_init();
+    CHECK_EQ(PACKET_POOL_SIZE, packet_pool_available());
+
+    LoRa_Packet* packets[PACKET_POOL_SIZE];
+    for (int i = 0; i < PACKET_POOL_SIZE; i++) {
+        packets[i] = packet_pool_alloc(0);
+        CHECK(packets[i] != NULL);
+        CHECK_EQ(0, packets[i]->expires_at);
+        // DMA reads and writes the payload in place
+        CHECK_EQ(0, (uintptr_t)packets[i]->payload.payload % 4);
+        for (int j = 0; j < i; j++) {
+            CHECK(packets[i] != packets[j]);
+        }
+        packets[i]->expires_at = 1000 + i;
+    }
+    CHECK_EQ(0, packet_pool_available());
+    CHECK(packet_pool_alloc(0) == NULL);
+
+    // NULL and buffers from outside the slab don't end up on the free list
+    LoRa_Packet foreign;
+    packet_pool_free(NULL);
+    packet_pool_free(&foreign);
+    packet_pool_free(packets[0] + PACKET_POOL_SIZE);
+    CHECK_EQ(0, packet_pool_available());
+
+    for (int i = 0; i < PACKET_POOL_SIZE; i++) {
+        packet_pool_free(packets[i]);
+    }
+    CHECK_EQ(PACKET_POOL_SIZE, packet_pool_available());
+    // a reused buffer doesn't keep the expiry of its previous frame
+    for (int i = 0; i < PACKET_POOL_SIZE; i++) {
+        packets[i] = packet_pool_alloc(0);
+        CHECK_EQ(0, packets[i]->expires_at);
+    }
+    for (int i = 0; i < PACKET_POOL_SIZE; i++) {
+        packet_pool_free(packets[i]);
+    }
+}
+
+static void test_copy(void) {
+    LoRa_Packet* src = packet_pool_alloc(0);
+    LoRa_Packet* dst = packet_pool_alloc(0);
+    memset(dst->payload.payload, 0xAA, sizeof(dst->payload.payload));
+    dst->expires_at = 77;
+    src->header = (LoRa_Packet_Header){.message_type = LORA_MESSAGE_DATA, .src_device_addr = 1,
+            .dest_device_addr = 2, .sequence = 0x1234, .num_of_packets = 3, .packet_num = 1, .message_id = 9,
+            .payload_size = 10};
+    for (uint8_t i = 0; i < sizeof(src->payload.payload); i++) {
+        src->payload.payload[i] = i;
+    }
+    src->payload.payload_crc = 0xBEEF;
+    src->expires_at = 5;
+
+    packet_pool_copy(dst, src);
+    CHECK(memcmp(&dst->header, &src->header, sizeof(dst->header)) == 0);
+    CHECK(memcmp(dst->payload.payload, src->payload.payload, 10) == 0);
+    CHECK_EQ(0xBEEF, dst->payload.payload_crc);
+    CHECK_EQ(77, dst->expires_at);
+    // the unused rest of the payload isn't touched
+    for (size_t i = 10; i < sizeof(dst->payload.payload); i++) {
+        CHECK_EQ(0xAA, dst->payload.payload[i]);
+    }
+    packet_pool_free(src);
+    packet_pool_free(dst);
+    CHECK_EQ(PACKET_POOL_SIZE, packet_pool_available());
+}
+
+// Both ways a received frame takes through the tasks: queues of LoRa_Packet, and pointers into the pool. The frame
+// itself is written once either way, by the FIFO reader
+static void test_benchmark(void) {
+    uint8_t frame[LORA_PAYLOAD_MAX_SIZE];
+    for (size_t i = 0; i < sizeof(frame); i++) {
+        frame[i] = (uint8_t)(i * 7);
+    }
+    uint32_t checksum = 0;
+
+    QueueHandle_t by_value[PIPELINE_HOPS];
+    for (int hop = 0; hop < PIPELINE_HOPS; hop++) {
+        by_value[hop] = xQueueCreate(QUEUE_DEPTH, sizeof(LoRa_Packet));
+    }
+    double start = test_now_s();
+    for (uint32_t i = 0; i < BENCHMARK_PACKETS; i++) {
+        LoRa_Packet packet;
+        packet.header.payload_size = sizeof(frame);
+        memcpy(packet.payload.payload, frame, sizeof(frame));
+        packet.payload.payload[0] = (uint8_t)i;
+        for (int hop = 0; hop < PIPELINE_HOPS; hop++) {
+            CHECK(xQueueSend(by_value[hop], &packet, 0) == pdPASS);
+            CHECK(xQueueReceive(by_value[hop], &packet, 0) == pdPASS);
+        }
+        checksum += packet.payload.payload[0];
+    }
+    double value_s = test_now_s() - start;
+
+    QueueHandle_t by_pointer[PIPELINE_HOPS];
+    for (int hop = 0; hop < PIPELINE_HOPS; hop++) {
+        by_pointer[hop] = xQueueCreate(QUEUE_DEPTH, sizeof(LoRa_Packet*));
+    }
+    start = test_now_s();
+    for (uint32_t i = 0; i < BENCHMARK_PACKETS; i++) {
+        LoRa_Packet* packet = packet_pool_alloc(0);
+        packet->header.payload_size = sizeof(frame);
+        memcpy(packet->payload.payload, frame, sizeof(frame));
+        packet->payload.payload[0] = (uint8_t)i;
+        for (int hop = 0; hop < PIPELINE_HOPS; hop++) {
+            CHECK(xQueueSend(by_pointer[hop], &packet, 0) == pdPASS);
+            CHECK(xQueueReceive(by_pointer[hop], &packet, 0) == pdPASS);
+        }
+        checksum -= packet->payload.payload[0];
+        packet_pool_free(packet);
+    }
+    double pointer_s = test_now_s() - start;
+    CHECK_EQ(0, checksum);
+    CHECK_EQ(PACKET_POOL_SIZE, packet_pool_available());
+
+    // every hop copies the item into the queue and out again
+    size_t value_bytes = 2 * PIPELINE_HOPS * sizeof(LoRa_Packet);
+    size_t pointer_bytes = 2 * PIPELINE_HOPS * sizeof(LoRa_Packet*);
+    printf("by value: %.0f packets/s, %zu bytes copied by the queues per packet, %zu bytes of queue storage\n",
+           BENCHMARK_PACKETS / value_s, value_bytes, PIPELINE_HOPS * QUEUE_DEPTH * sizeof(LoRa_Packet));
+    printf("by pointer: %.0f packets/s, %zu bytes copied by the queues per packet, %zu bytes of queue storage\n",
+           BENCHMARK_PACKETS / pointer_s, pointer_bytes, PIPELINE_HOPS * QUEUE_DEPTH * sizeof(LoRa_Packet*));
+    CHECK(pointer_bytes * 20 < value_bytes);
+}
+
+int main(void) {
+    test_alloc_free();
+    test_copy();
+    test_benchmark();
+    return 0;
+}
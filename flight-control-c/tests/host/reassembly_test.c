@@ -0,0 +1,135 @@
+#include "reassembly.h"
+#include "test.h"
+
+#include <string.h>
+
+#define FRAGMENT_SIZE 246
+#define TRIALS 20000
+
+static uint8_t message[REASSEMBLY_MAX_FRAGMENTS * FRAGMENT_SIZE];
+
+static uint64_t full_mask(uint8_t num_of_packets) {
+    return num_of_packets == 64 ? ~0ULL : (1ULL << num_of_packets) - 1;
+}
+
+// Every fragment is sent one to three times and the trace is shuffled. One message in ten loses every copy of
+// fragment 0 and has to time out. A complete message must come out exactly once and byte for byte.
+static void test_random_loss_and_reorder(void) {
+    Reassembly_Context ctx;
+    reassembly_init(&ctx, FRAGMENT_SIZE);
+    uint32_t seed = 1234;
+    for (size_t i = 0; i < sizeof(message); i++) {
+        message[i] = (uint8_t)test_random(&seed);
+    }
+    int64_t now = 0;
+    int completed = 0;
+    int expired = 0;
+    for (int trial = 0; trial < TRIALS; trial++) {
+        uint8_t num_of_packets = 1 + test_random(&seed) % REASSEMBLY_MAX_FRAGMENTS;
+        uint16_t size = (num_of_packets - 1) * FRAGMENT_SIZE + 1 + test_random(&seed) % FRAGMENT_SIZE;
+        uint8_t message_id = (uint8_t)trial;
+        uint8_t src = test_random(&seed) % 3;
+        int lose_first = test_chance(&seed, 10);
+
+        uint8_t trace[3 * REASSEMBLY_MAX_FRAGMENTS];
+        int length = 0;
+        for (int k = 0; k < num_of_packets; k++) {
+            int copies = 1 + test_random(&seed) % 3;
+            for (int c = 0; c < copies; c++) {
+                trace[length++] = k;
+            }
+        }
+        for (int i = length - 1; i > 0; i--) {
+            int j = test_random(&seed) % (i + 1);
+            uint8_t swap = trace[i];
+            trace[i] = trace[j];
+            trace[j] = swap;
+        }
+
+        uint64_t received = 0;
+        int done = 0;
+        for (int i = 0; i < length; i++) {
+            uint8_t k = trace[i];
+            if (lose_first && k == 0) {
+                continue;
+            }
+            uint8_t payload_size = k == num_of_packets - 1 ? size - (num_of_packets - 1) * FRAGMENT_SIZE : FRAGMENT_SIZE;
+            Reassembly_Message* slot = NULL;
+            now += 1000;
+            Reassembly_Status status = reassembly_add(&ctx, src, message_id, num_of_packets, k,
+                                                      &message[k * FRAGMENT_SIZE], payload_size, now, &slot);
+            if (done || (received & (1ULL << k))) {
+                CHECK_EQ(REASSEMBLY_DUPLICATE, status);
+                continue;
+            }
+            received |= 1ULL << k;
+            if (received == full_mask(num_of_packets)) {
+                CHECK_EQ(REASSEMBLY_COMPLETE, status);
+                CHECK_EQ(0, reassembly_missing(slot));
+                uint16_t taken_size;
+                uint8_t* taken = reassembly_take(slot, &taken_size);
+                CHECK_EQ(size, taken_size);
+                CHECK(memcmp(taken, message, size) == 0);
+                free(taken);
+                done = 1;
+                completed++;
+            } else {
+                CHECK_EQ(REASSEMBLY_STORED, status);
+                CHECK_EQ(full_mask(num_of_packets) & ~received, reassembly_missing(slot));
+            }
+        }
+        CHECK_EQ(!done, lose_first);
+        now += REASSEMBLY_TIMEOUT_MS * 1000LL;
+        CHECK_EQ(received ? 1 : 0, reassembly_expire(&ctx, now));
+        expired += !done;
+        for (int s = 0; s < REASSEMBLY_SLOTS; s++) {
+            CHECK(!ctx.slots[s].in_use);
+        }
+    }
+    printf("%d messages completed, %d timed out\n", completed, expired);
+}
+
+static void test_invalid_fragments(void) {
+    Reassembly_Context ctx;
+    reassembly_init(&ctx, FRAGMENT_SIZE);
+    Reassembly_Message* slot;
+    uint8_t payload[FRAGMENT_SIZE] = {0};
+    int64_t now = 1000;
+    CHECK_EQ(REASSEMBLY_INVALID, reassembly_add(&ctx, 1, 1, 3, 3, payload, FRAGMENT_SIZE, now, &slot));
+    CHECK_EQ(REASSEMBLY_INVALID, reassembly_add(&ctx, 1, 1, 3, 0, payload, 10, now, &slot));
+    CHECK_EQ(REASSEMBLY_INVALID, reassembly_add(&ctx, 1, 1, REASSEMBLY_MAX_FRAGMENTS + 1, 0, payload, FRAGMENT_SIZE, now, &slot));
+    for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+        CHECK_EQ(REASSEMBLY_STORED, reassembly_add(&ctx, 1, i, 3, 0, payload, FRAGMENT_SIZE, now, &slot));
+    }
+    CHECK_EQ(REASSEMBLY_NO_SLOT, reassembly_add(&ctx, 1, 99, 3, 0, payload, FRAGMENT_SIZE, now, &slot));
+    // same key, different fragment count
+    CHECK_EQ(REASSEMBLY_INVALID, reassembly_add(&ctx, 1, 0, 4, 1, payload, FRAGMENT_SIZE, now, &slot));
+    CHECK_EQ(REASSEMBLY_SLOTS, reassembly_expire(&ctx, now + REASSEMBLY_TIMEOUT_MS * 1000LL));
+}
+
+// Delivered messages keep rejecting late duplicates, but give their slot up to a new message, oldest first
+static void test_delivered_slots_are_reclaimed(void) {
+    Reassembly_Context ctx;
+    reassembly_init(&ctx, FRAGMENT_SIZE);
+    Reassembly_Message* slot;
+    uint8_t payload[FRAGMENT_SIZE] = {0};
+    uint16_t size;
+    int64_t now = 1000;
+    for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+        CHECK_EQ(REASSEMBLY_COMPLETE, reassembly_add(&ctx, 2, i, 1, 0, payload, 5, now + i, &slot));
+        free(reassembly_take(slot, &size));
+    }
+    CHECK_EQ(REASSEMBLY_DUPLICATE, reassembly_add(&ctx, 2, 0, 1, 0, payload, 5, now + 9, &slot));
+    CHECK_EQ(REASSEMBLY_STORED, reassembly_add(&ctx, 2, 50, 2, 0, payload, FRAGMENT_SIZE, now + 10, &slot));
+    CHECK(slot == &ctx.slots[1]);
+    CHECK_EQ(REASSEMBLY_COMPLETE, reassembly_add(&ctx, 2, 1, 1, 0, payload, 5, now + 11, &slot));
+    free(reassembly_take(slot, &size));
+    reassembly_expire(&ctx, now + 10 * REASSEMBLY_TIMEOUT_MS * 1000LL);
+}
+
+int main(void) {
+    test_random_loss_and_reorder();
+    test_invalid_fragments();
+    test_delivered_slots_are_reclaimed();
+    return 0;
+}
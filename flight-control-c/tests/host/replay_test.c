@@ -0,0 +1,134 @@
+#include "replay.h"
+#include "test.h"
+
+#define STEPS 300000
+// unwrapped sequence numbers of the random stream are stored at their value plus this offset
+#define REFERENCE_OFFSET (1 << 18)
+#define REFERENCE_SIZE (1 << 20)
+
+static void test_wrap(void) {
+    Replay_Window window;
+    replay_init(&window);
+    CHECK_EQ(REPLAY_FRESH, replay_check(&window, 65530));
+    CHECK_EQ(REPLAY_DUPLICATE, replay_check(&window, 65530));
+    CHECK_EQ(REPLAY_FRESH, replay_check(&window, 0xFFFF));
+    CHECK_EQ(REPLAY_FRESH, replay_check(&window, 0));
+    CHECK_EQ(REPLAY_DUPLICATE, replay_check(&window, 0xFFFF));
+    CHECK_EQ(REPLAY_FRESH, replay_check(&window, 3));
+    CHECK_EQ(REPLAY_REORDERED, replay_check(&window, 65533));
+    CHECK_EQ(REPLAY_DUPLICATE, replay_check(&window, 65533));
+    CHECK_EQ(REPLAY_REORDERED, replay_check(&window, 1));
+    // window edges across the wrap: highest - 63 is still inside, highest - 64 is behind
+    CHECK_EQ(REPLAY_REORDERED, replay_check(&window, (uint16_t)(3 - 63)));
+    CHECK_EQ(REPLAY_TOO_OLD, replay_check(&window, (uint16_t)(3 - 64)));
+    // a jump of a whole window clears the bitmap
+    CHECK_EQ(REPLAY_FRESH, replay_check(&window, 3 + REPLAY_WINDOW));
+    CHECK_EQ(REPLAY_TOO_OLD, replay_check(&window, 3));
+    CHECK_EQ(REPLAY_REORDERED, replay_check(&window, 4));
+}
+
+static void test_half_range(void) {
+    Replay_Window window;
+    replay_init(&window);
+    CHECK_EQ(REPLAY_FRESH, replay_check(&window, 0xFFFF));
+    // 0x8000 ahead is read as behind, 0x7FFF ahead as newer
+    CHECK_EQ(REPLAY_TOO_OLD, replay_check(&window, 0x7FFF));
+    CHECK_EQ(REPLAY_FRESH, replay_check(&window, 0x7FFE));
+}
+
+// The sender rebooted and restarted its counter far behind the window
+static void test_resync(void) {
+    Replay_Window window;
+    replay_init(&window);
+    for (uint16_t sequence = 0xFFC0; sequence != 0x0040; sequence++) {
+        CHECK_EQ(REPLAY_FRESH, replay_check(&window, sequence));
+    }
+    uint16_t sequence = 0x8100;
+    for (int i = 0; i < REPLAY_RESYNC_AFTER - 1; i++) {
+        CHECK_EQ(REPLAY_TOO_OLD, replay_check(&window, sequence++));
+    }
+    CHECK_EQ(REPLAY_FRESH, replay_check(&window, sequence));
+    CHECK_EQ(REPLAY_FRESH, replay_check(&window, sequence + 1));
+    CHECK_EQ(REPLAY_REORDERED, replay_check(&window, 0x8100));
+    // a replayed frame behind the window now and then doesn't resync, frames inside it restart the count
+    for (int i = 0; i < REPLAY_RESYNC_AFTER - 1; i++) {
+        CHECK_EQ(REPLAY_TOO_OLD, replay_check(&window, 0x7100));
+        CHECK_EQ(REPLAY_REORDERED, replay_check(&window, sequence - 8 - i));
+    }
+    CHECK_EQ(REPLAY_TOO_OLD, replay_check(&window, 0x7100));
+}
+
+// epoch of the resync in which the unwrapped sequence number was seen
+static uint16_t reference_seen[REFERENCE_SIZE];
+
+// Random stream through several wraps: mostly new frames, frames reordered within the window, duplicates,
+// frames behind the window and the odd sender restart, against a model on unwrapped sequence numbers
+static void test_random_stream(void) {
+    Replay_Window window;
+    replay_init(&window);
+    uint32_t seed = 20;
+    int64_t highest = 0xFF00;
+    uint16_t epoch = 1;
+    int too_old_run = 0;
+    long counts[4] = {0};
+    CHECK_EQ(REPLAY_FRESH, replay_check(&window, (uint16_t)highest));
+    reference_seen[highest + REFERENCE_OFFSET] = epoch;
+    int64_t restart_next = 0;
+    int restart_left = 0;
+    for (int step = 0; step < STEPS; step++) {
+        uint32_t kind = test_random(&seed) % 10000;
+        int64_t next;
+        if (restart_left > 0) {
+            // the sender restarted its counter, it keeps counting from there
+            next = restart_next++;
+            restart_left--;
+        } else if (kind < 7000) {
+            next = highest + 1 + test_random(&seed) % 3;
+        } else if (kind < 9600) {
+            next = highest - test_random(&seed) % REPLAY_WINDOW;
+        } else if (kind < 9998) {
+            next = highest - REPLAY_WINDOW - test_random(&seed) % 2000;
+        } else {
+            next = highest - 2000;
+            restart_next = next + 1;
+            restart_left = REPLAY_RESYNC_AFTER + 2;
+        }
+        CHECK(next + REFERENCE_OFFSET >= 0 && next + REFERENCE_OFFSET < REFERENCE_SIZE);
+
+        Replay_Status expected;
+        if (next > highest) {
+            expected = REPLAY_FRESH;
+        } else if (highest - next >= REPLAY_WINDOW) {
+            expected = ++too_old_run >= REPLAY_RESYNC_AFTER ? REPLAY_FRESH : REPLAY_TOO_OLD;
+        } else if (reference_seen[next + REFERENCE_OFFSET] == epoch) {
+            expected = REPLAY_DUPLICATE;
+        } else {
+            expected = REPLAY_REORDERED;
+        }
+        if (expected == REPLAY_FRESH && next <= highest) {
+            epoch++;
+        }
+        CHECK_EQ(expected, replay_check(&window, (uint16_t)next));
+        counts[expected]++;
+        if (expected == REPLAY_FRESH) {
+            highest = next;
+        }
+        if (expected == REPLAY_FRESH || expected == REPLAY_REORDERED) {
+            reference_seen[next + REFERENCE_OFFSET] = epoch;
+            too_old_run = 0;
+        }
+    }
+    CHECK(highest - 0xFF00 > 3 * 0x10000);
+    CHECK(epoch > 10);
+    printf("fresh %ld, reordered %ld, duplicate %ld, too old %ld, %u resyncs over %lld wraps\n",
+           counts[REPLAY_FRESH], counts[REPLAY_REORDERED], counts[REPLAY_DUPLICATE], counts[REPLAY_TOO_OLD],
+           epoch - 1, (long long)(highest / 0x10000));
+}
+
+int main(void) {
+    test_wrap();
+    test_half_range();
+    test_resync();
+    test_random_stream();
+    return 0;
+}
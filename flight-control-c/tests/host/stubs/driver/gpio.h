@@ -0,0 +1,4 @@
+#ifndef HOST_STUB_GPIO_H
+#define HOST_STUB_GPIO_H
+
+#endif //HOST_STUB_GPIO_H
@@ -0,0 +1,4 @@
+#ifndef HOST_STUB_SPI_COMMON_H
+#define HOST_STUB_SPI_COMMON_H
+
+#endif //HOST_STUB_SPI_COMMON_H
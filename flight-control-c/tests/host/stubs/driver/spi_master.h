@@ -0,0 +1,6 @@
+#ifndef HOST_STUB_SPI_MASTER_H
+#define HOST_STUB_SPI_MASTER_H
+
+typedef struct spi_device_t* spi_device_handle_t;
+
+#endif //HOST_STUB_SPI_MASTER_H
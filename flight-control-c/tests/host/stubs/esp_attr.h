@@ -0,0 +1,8 @@
+#ifndef HOST_STUB_ESP_ATTR_H
+#define HOST_STUB_ESP_ATTR_H
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define WORD_ALIGNED_ATTR __attribute__((aligned(4)))
+
+#endif //HOST_STUB_ESP_ATTR_H
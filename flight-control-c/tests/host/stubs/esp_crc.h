@@ -0,0 +1,4 @@
+#ifndef HOST_STUB_ESP_CRC_H
+#define HOST_STUB_ESP_CRC_H
+
+#endif //HOST_STUB_ESP_CRC_H
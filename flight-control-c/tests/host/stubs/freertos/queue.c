@@ -0,0 +1,52 @@
+#include "freertos/queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Ring buffer copying items in and out like the FreeRTOS queue. The host tests are single threaded, nothing can
+// make room or send while a call waits, so ticks_to_wait is ignored and a full or empty queue fails at once.
+struct QueueDefinition {
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t items[];
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    QueueHandle_t queue = malloc(sizeof(struct QueueDefinition) + (size_t)length * item_size);
+    if (queue == NULL) {
+        return NULL;
+    }
+    queue->length = length;
+    queue->item_size = item_size;
+    queue->head = 0;
+    queue->count = 0;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks_to_wait) {
+    (void)ticks_to_wait;
+    if (queue->count == queue->length) {
+        return pdFAIL;
+    }
+    UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(&queue->items[(size_t)tail * queue->item_size], item, queue->item_size);
+    queue->count++;
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks_to_wait) {
+    (void)ticks_to_wait;
+    if (queue->count == 0) {
+        return pdFAIL;
+    }
+    memcpy(item, &queue->items[(size_t)queue->head * queue->item_size], queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    return queue->count;
+}
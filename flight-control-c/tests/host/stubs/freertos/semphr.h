@@ -0,0 +1,6 @@
+#ifndef HOST_STUB_SEMPHR_H
+#define HOST_STUB_SEMPHR_H
+
+#include "freertos/queue.h"
+
+#endif //HOST_STUB_SEMPHR_H
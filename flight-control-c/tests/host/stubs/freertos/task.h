@@ -0,0 +1,6 @@
+#ifndef HOST_STUB_TASK_H
+#define HOST_STUB_TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+#endif //HOST_STUB_TASK_H
@@ -0,0 +1,192 @@
+#include "sx127x_spi_mock.h"
+
+#include <string.h>
+#include <sx127x_spi.h>
+
+#define MOCK_REG_FIFO 0x00
+#define MOCK_REG_OP_MODE 0x01
+#define MOCK_REG_FIFO_ADDR_PTR 0x0d
+#define MOCK_BANK_FIRST 0x0d
+#define MOCK_BANK_LAST 0x3f
+#define MOCK_LONG_RANGE_MODE 0x80
+#define MOCK_MODE_MASK 0x07
+// the FSK registers only have to differ from the LoRa ones, a shadow loaded from the wrong bank then shows up
+#define MOCK_FSK_MARKER 0xee
+
+Sx127x_Spi_Mock sx127x_spi_mock;
+
+void sx127x_spi_mock_reset(void) {
+    memset(&sx127x_spi_mock, 0, sizeof(sx127x_spi_mock));
+    memset(sx127x_spi_mock.fsk + MOCK_BANK_FIRST, MOCK_FSK_MARKER, MOCK_BANK_LAST - MOCK_BANK_FIRST + 1);
+    uint8_t* common = sx127x_spi_mock.common;
+    // LowFrequencyModeOn, FSK standby
+    common[MOCK_REG_OP_MODE] = 0x09;
+    common[0x06] = 0x6c;
+    common[0x07] = 0x80;
+    common[0x09] = 0x4f;
+    common[0x0a] = 0x09;
+    common[0x0b] = 0x2b;
+    common[0x0c] = 0x20;
+    common[0x42] = 0x12;
+    common[0x4d] = 0x84;
+    uint8_t* lora = sx127x_spi_mock.lora;
+    lora[0x0e] = 0x80;
+    lora[0x1d] = 0x72;
+    lora[0x1e] = 0x70;
+    lora[0x1f] = 0x64;
+    lora[0x21] = 0x08;
+    lora[0x22] = 0x01;
+    lora[0x23] = 0xff;
+    lora[0x26] = 0x04;
+    lora[0x31] = 0xc3;
+    lora[0x33] = 0x27;
+    lora[0x37] = 0x0a;
+    lora[0x39] = 0x12;
+    lora[0x3b] = 0x1d;
+}
+
+void sx127x_spi_mock_clear_counters(void) {
+    sx127x_spi_mock.transactions = 0;
+    sx127x_spi_mock.reads = 0;
+    sx127x_spi_mock.writes = 0;
+    sx127x_spi_mock.bytes = 0;
+}
+
+static uint8_t* mock_location(int reg) {
+    if (reg >= MOCK_BANK_FIRST && reg <= MOCK_BANK_LAST) {
+        if (sx127x_spi_mock.common[MOCK_REG_OP_MODE] & MOCK_LONG_RANGE_MODE) {
+            return &sx127x_spi_mock.lora[reg];
+        }
+        return &sx127x_spi_mock.fsk[reg];
+    }
+    return &sx127x_spi_mock.common[reg];
+}
+
+uint8_t sx127x_spi_mock_register(int reg) {
+    return *mock_location(reg);
+}
+
+// FIFO accesses go through RegFifoAddrPtr, which advances with every byte
+static uint8_t mock_read(int reg) {
+    if (reg == MOCK_REG_FIFO) {
+        return sx127x_spi_mock.fifo[sx127x_spi_mock.lora[MOCK_REG_FIFO_ADDR_PTR]++];
+    }
+    return *mock_location(reg);
+}
+
+static void mock_write(int reg, uint8_t value) {
+    if (reg == MOCK_REG_FIFO) {
+        sx127x_spi_mock.fifo[sx127x_spi_mock.lora[MOCK_REG_FIFO_ADDR_PTR]++] = value;
+        return;
+    }
+    if (reg == MOCK_REG_OP_MODE) {
+        uint8_t current = sx127x_spi_mock.common[MOCK_REG_OP_MODE];
+        if ((current & MOCK_MODE_MASK) != 0) {
+            value = (value & ~MOCK_LONG_RANGE_MODE) | (current & MOCK_LONG_RANGE_MODE);
+        }
+    }
+    *mock_location(reg) = value;
+}
+
+// A burst starting at the FIFO stays on the FIFO, otherwise the address increments
+static int mock_begin(int reg, size_t length, int write) {
+    if (reg < 0 || (size_t)reg + (reg == MOCK_REG_FIFO ? 1 : length) > SX127X_MOCK_REGISTERS) {
+        return SX127X_ERR_INVALID_ARG;
+    }
+    sx127x_spi_mock.transactions++;
+    if (write) {
+        sx127x_spi_mock.writes++;
+    } else {
+        sx127x_spi_mock.reads++;
+    }
+    sx127x_spi_mock.bytes += 1 + length;
+    return SX127X_OK;
+}
+
+static int mock_next(int reg, size_t i) {
+    return reg == MOCK_REG_FIFO ? reg : reg + (int)i;
+}
+
+int sx127x_spi_read_registers(int reg, void *spi_device, size_t data_length, uint32_t *result) {
+    (void)spi_device;
+    if (data_length == 0 || data_length > 4) {
+        return SX127X_ERR_INVALID_ARG;
+    }
+    int code = mock_begin(reg, data_length, 0);
+    if (code != SX127X_OK) {
+        return code;
+    }
+    *result = 0;
+    for (size_t i = 0; i < data_length; i++) {
+        *result = (*result << 8) | mock_read(mock_next(reg, i));
+    }
+    return SX127X_OK;
+}
+
+int sx127x_spi_read_buffer(int reg, uint8_t *buffer, size_t buffer_length, void *spi_device) {
+    (void)spi_device;
+    if (buffer_length > SX127X_MOCK_FIFO_SIZE) {
+        return SX127X_ERR_INVALID_ARG;
+    }
+    int code = mock_begin(reg, buffer_length, 0);
+    if (code != SX127X_OK) {
+        return code;
+    }
+    for (size_t i = 0; i < buffer_length; i++) {
+        buffer[i] = mock_read(mock_next(reg, i));
+    }
+    return SX127X_OK;
+}
+
+int sx127x_spi_write_register(int reg, uint8_t *data, size_t data_length, void *spi_device) {
+    (void)spi_device;
+    if (data_length == 0 || data_length > 4) {
+        return SX127X_ERR_INVALID_ARG;
+    }
+    int code = mock_begin(reg, data_length, 1);
+    if (code != SX127X_OK) {
+        return code;
+    }
+    for (size_t i = 0; i < data_length; i++) {
+        mock_write(mock_next(reg, i), data[i]);
+    }
+    return SX127X_OK;
+}
+
+int sx127x_spi_write_buffer(int reg, uint8_t *buffer, size_t buffer_length, void *spi_device) {
+    (void)spi_device;
+    if (buffer_length > SX127X_MOCK_FIFO_SIZE) {
+        return SX127X_ERR_INVALID_ARG;
+    }
+    int code = mock_begin(reg, buffer_length, 1);
+    if (code != SX127X_OK) {
+        return code;
+    }
+    for (size_t i = 0; i < buffer_length; i++) {
+        mock_write(mock_next(reg, i), buffer[i]);
+    }
+    return SX127X_OK;
+}
+
+// one burst with chip select held, counted as a single transaction like the chip sees it
+int sx127x_spi_write_segments(int reg, const sx127x_segment_t *segments, size_t segments_count, void *spi_device) {
+    (void)spi_device;
+    size_t total_length = 0;
+    for (size_t i = 0; i < segments_count; i++) {
+        total_length += segments[i].buffer_length;
+    }
+    if (total_length > SX127X_MOCK_FIFO_SIZE) {
+        return SX127X_ERR_INVALID_ARG;
+    }
+    int code = mock_begin(reg, total_length, 1);
+    if (code != SX127X_OK) {
+        return code;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < segments_count; i++) {
+        for (size_t j = 0; j < segments[i].buffer_length; j++) {
+            mock_write(mock_next(reg, offset++), segments[i].buffer[j]);
+        }
+    }
+    return SX127X_OK;
+}
@@ -0,0 +1,36 @@
+#ifndef SX127X_SPI_MOCK_H
+#define SX127X_SPI_MOCK_H
+
+#include <stdint.h>
+
+// Register level model of the sx127x behind the sx127x_spi.h backend, counting every SPI transaction.
+// 0x0d..0x3f are two register banks, LoRa and FSK, selected by LongRangeMode in RegOpMode. Like the chip, that bit
+// only changes while the chip is in sleep mode, and the chip comes out of reset in FSK standby.
+
+#define SX127X_MOCK_REGISTERS 0x80
+#define SX127X_MOCK_FIFO_SIZE 256
+
+typedef struct {
+    uint8_t common[SX127X_MOCK_REGISTERS];
+    uint8_t fsk[SX127X_MOCK_REGISTERS];
+    uint8_t lora[SX127X_MOCK_REGISTERS];
+    uint8_t fifo[SX127X_MOCK_FIFO_SIZE];
+    uint32_t transactions;
+    uint32_t reads;
+    uint32_t writes;
+    // bytes clocked over the bus, the address byte of each transaction included
+    uint32_t bytes;
+} Sx127x_Spi_Mock;
+
+extern Sx127x_Spi_Mock sx127x_spi_mock;
+
+/// Power-on reset: reset values in both banks, FSK standby, counters cleared.
+void sx127x_spi_mock_reset(void);
+
+/// Clears the transaction counters, the registers are kept.
+void sx127x_spi_mock_clear_counters(void);
+
+/// Reads a register of the active bank like the chip would, without counting a transaction.
+uint8_t sx127x_spi_mock_register(int reg);
+
+#endif //SX127X_SPI_MOCK_H
@@ -0,0 +1,453 @@
+#include <sx127x.h>
+#include "sx127x_spi_mock.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// sx127x_create reads the version, switches to LoRa, loads the shadow in one burst and reads RegPaDac
+#define CREATE_TRANSACTIONS 6
+#define RELOAD_LORA_TRANSACTIONS 3
+// one burst for each contiguous range sx127x_apply_profile writes
+#define APPLY_PROFILE_MAX_TRANSACTIONS 8
+// the clock the radio used to run at and LORA_SPI_CLOCK_SPEED_HZ
+#define SPI_CLOCK_BEFORE_HZ 100000
+#define SPI_CLOCK_AFTER_HZ 10000000
+// CPU side cost of one transaction on top of the bits on the bus: driver call, chip select, DMA or polling setup.
+// An estimate, the benchmark is about the bus time, which the clock dominates
+#define SPI_TRANSACTION_OVERHEAD_US 15
+// the control period of the stick stream
+#define CONTROL_PERIOD_US 20000
+// LORA_CONTROL_WIRE_SIZE, the stick message with its wire header and CRC
+#define CONTROL_WIRE_SIZE 11
+
+// the link profile of lora.c
+static const sx127x_modem_profile_t link_profile = {
+        .frequency = 437200012,
+        .bandwidth = SX127x_BW_500000,
+        .spreading_factor = SX127x_SF_7,
+        .coding_rate = SX127x_CR_4_5,
+        .crc = SX127x_RX_PAYLOAD_CRC_OFF,
+        .implicit_header = NULL,
+        .syncword = 18,
+        .preamble_length = 8,
+        .pa_pin = SX127x_PA_PIN_BOOST,
+        .power = 4,
+        .dio_mapping1 = SX127x_DIO0_RX_DONE,
+        .dio_mapping2 = SX127x_DIO4_CAD_DETECTED,
+};
+
+static sx127x* create_device(void) {
+    sx127x_spi_mock_reset();
+    sx127x* device = NULL;
+    CHECK_EQ(SX127X_OK, sx127x_create(&sx127x_spi_mock, &device));
+    CHECK(device != NULL);
+    return device;
+}
+
+// The chip comes out of reset in FSK mode, where 0x0d..0x3f are different registers. The shadow has to be loaded
+// after the switch to LoRa, otherwise every shadowed read returns an FSK register
+static void test_create_loads_lora_shadow(void) {
+    sx127x* device = create_device();
+    CHECK_EQ(CREATE_TRANSACTIONS, sx127x_spi_mock.transactions);
+    CHECK(sx127x_spi_mock.common[0x01] & 0x80);
+
+    sx127x_spi_mock_clear_counters();
+    uint32_t bandwidth = 0;
+    CHECK_EQ(SX127X_OK, sx127x_get_bandwidth(device, &bandwidth));
+    CHECK_EQ(125000, bandwidth);
+    // SF7, 125 kHz, CR 4/5, explicit header, no CRC, 8 symbols preamble: 8 + 3 * 5 payload symbols for 10 bytes
+    uint32_t time_on_air = 0;
+    CHECK_EQ(SX127X_OK, sx127x_get_time_on_air(device, 10, &time_on_air));
+    CHECK_EQ((4 * (8 + 8 + 3 * 5) + 17) * 128 * 1000000LL / (4 * 125000), time_on_air);
+    CHECK_EQ(0, sx127x_spi_mock.transactions);
+
+    // already in LoRa mode, nothing to switch
+    CHECK_EQ(SX127X_OK, sx127x_reload_registers(device));
+    CHECK_EQ(RELOAD_LORA_TRANSACTIONS, sx127x_spi_mock.transactions);
+    CHECK_EQ(0, sx127x_spi_mock.writes);
+    sx127x_destroy(device);
+
+    sx127x_spi_mock_reset();
+    sx127x_spi_mock.common[0x42] = 0x22;
+    device = NULL;
+    CHECK_EQ(SX127X_ERR_INVALID_VERSION, sx127x_create(&sx127x_spi_mock, &device));
+    CHECK(device == NULL);
+}
+
+// Configuration reads come from the shadow, field updates are a single write and an unchanged field none at all
+static void test_shadowed_access(void) {
+    sx127x* device = create_device();
+    sx127x_spi_mock_clear_counters();
+
+    uint32_t bandwidth;
+    for (int i = 0; i < 100; i++) {
+        CHECK_EQ(SX127X_OK, sx127x_get_bandwidth(device, &bandwidth));
+    }
+    CHECK_EQ(0, sx127x_spi_mock.transactions);
+
+    // SF7 at 500 kHz doesn't need the low data rate optimization, so only RegModemConfig1 is written
+    CHECK_EQ(SX127X_OK, sx127x_set_bandwidth(SX127x_BW_500000, device));
+    CHECK_EQ(1, sx127x_spi_mock.transactions);
+    CHECK_EQ(0x92, sx127x_spi_mock_register(0x1d));
+    CHECK_EQ(SX127X_OK, sx127x_set_bandwidth(SX127x_BW_500000, device));
+    CHECK_EQ(1, sx127x_spi_mock.transactions);
+
+    // the two detection registers and RegModemConfig2. SF12 on 500 kHz is 8 ms per symbol, RegModemConfig3 stays
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_set_modem_config_2(SX127x_SF_12, device));
+    CHECK_EQ(3, sx127x_spi_mock.transactions);
+    CHECK_EQ(0xc0, sx127x_spi_mock_register(0x1e));
+    CHECK_EQ(0x04, sx127x_spi_mock_register(0x26));
+    // 4096 chips at 125 kHz are 32 ms per symbol, the optimization gets switched on with one more write
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_set_bandwidth(SX127x_BW_125000, device));
+    CHECK_EQ(2, sx127x_spi_mock.transactions);
+    CHECK_EQ(0x0c, sx127x_spi_mock_register(0x26));
+
+    // the first TX sets the DIO0 mapping, after that a mode switch is one write
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_set_opmod(SX127x_MODE_TX, device));
+    CHECK_EQ(2, sx127x_spi_mock.transactions);
+    for (int i = 0; i < 10; i++) {
+        CHECK_EQ(SX127X_OK, sx127x_set_opmod(SX127x_MODE_STANDBY, device));
+        CHECK_EQ(SX127X_OK, sx127x_set_opmod(SX127x_MODE_TX, device));
+    }
+    CHECK_EQ(2 + 20, sx127x_spi_mock.transactions);
+    CHECK_EQ(0x83, sx127x_spi_mock.common[0x01]);
+    CHECK_EQ(0x40, sx127x_spi_mock.common[0x40]);
+
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_set_lna_gain(SX127x_LNA_GAIN_G2, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_lna_boost_hf(SX127x_LNA_BOOST_HF_ON, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_syncword(0x34, device));
+    // AGC off, gain and boost into RegLna one after the other, then the sync word
+    CHECK_EQ(4, sx127x_spi_mock.transactions);
+    CHECK_EQ(0x43, sx127x_spi_mock.common[0x0c]);
+    CHECK_EQ(0x08, sx127x_spi_mock_register(0x26));
+    CHECK_EQ(0x34, sx127x_spi_mock_register(0x39));
+
+    // status registers change on their own, they always go to the chip
+    sx127x_spi_mock_clear_counters();
+    sx127x_spi_mock.lora[0x19] = (uint8_t)-8;
+    float snr = 0;
+    CHECK_EQ(SX127X_OK, sx127x_get_packet_snr(device, &snr));
+    CHECK(snr == -2.0f);
+    CHECK_EQ(1, sx127x_spi_mock.transactions);
+    sx127x_destroy(device);
+}
+
+// After a chip reset the shadow is stale until sx127x_reload_registers, which has to go through LoRa again
+static void test_resync_after_reset(void) {
+    sx127x* device = create_device();
+    CHECK_EQ(SX127X_OK, sx127x_set_bandwidth(SX127x_BW_500000, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_syncword(0x34, device));
+
+    sx127x_spi_mock_reset();
+    CHECK_EQ(SX127X_OK, sx127x_reload_registers(device));
+    CHECK_EQ(CREATE_TRANSACTIONS - 1, sx127x_spi_mock.transactions);
+    CHECK(sx127x_spi_mock.common[0x01] & 0x80);
+    uint32_t bandwidth = 0;
+    CHECK_EQ(SX127X_OK, sx127x_get_bandwidth(device, &bandwidth));
+    CHECK_EQ(125000, bandwidth);
+
+    // a write of the old value isn't skipped, the shadow knows the chip lost it
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_set_bandwidth(SX127x_BW_500000, device));
+    CHECK_EQ(1, sx127x_spi_mock.transactions);
+    CHECK_EQ(0x92, sx127x_spi_mock_register(0x1d));
+    sx127x_destroy(device);
+}
+
+// Time the bus is busy for the transactions counted since the last clear, at the given SPI clock
+static uint32_t bus_time_us(uint32_t clock_hz) {
+    return (uint32_t)((uint64_t)sx127x_spi_mock.bytes * 8 * 1000000 / clock_hz) +
+           sx127x_spi_mock.transactions * SPI_TRANSACTION_OVERHEAD_US;
+}
+
+static void report_bus_time(const char* name, uint32_t* after_us) {
+    uint32_t before_us = bus_time_us(SPI_CLOCK_BEFORE_HZ);
+    *after_us = bus_time_us(SPI_CLOCK_AFTER_HZ);
+    printf("%s: %u transactions, %u bytes, %u us at %d kHz, %u us at %d kHz\n", name, sx127x_spi_mock.transactions,
+           sx127x_spi_mock.bytes, before_us, SPI_CLOCK_BEFORE_HZ / 1000, *after_us, SPI_CLOCK_AFTER_HZ / 1000);
+}
+
+// SPI time of one full frame through the driver, loading it for TX and reading it back on RX
+static void test_spi_time(void) {
+    sx127x* device = create_device();
+    CHECK_EQ(SX127X_OK, sx127x_apply_profile(&link_profile, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_opmod(SX127x_MODE_TX, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_opmod(SX127x_MODE_STANDBY, device));
+    uint32_t seed = 0x5B1;
+    uint8_t frame[255];
+    for (size_t i = 0; i < sizeof(frame); i++) {
+        frame[i] = (uint8_t)test_random(&seed);
+    }
+
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_set_for_transmission(frame, sizeof(frame), device));
+    CHECK_EQ(SX127X_OK, sx127x_set_opmod(SX127x_MODE_TX, device));
+    CHECK_EQ(3 + 1, sx127x_spi_mock.transactions);
+    CHECK(memcmp(sx127x_spi_mock.fifo, frame, sizeof(frame)) == 0);
+    CHECK_EQ(sizeof(frame), sx127x_spi_mock_register(0x22));
+    uint32_t tx_us;
+    report_bus_time("TX 255 bytes", &tx_us);
+    // at 100 kHz loading the frame alone took longer than a control period
+    CHECK(bus_time_us(SPI_CLOCK_BEFORE_HZ) > CONTROL_PERIOD_US);
+    CHECK(tx_us < CONTROL_PERIOD_US / 20);
+
+    // header and payload from separate buffers are still one burst
+    uint8_t header[9];
+    memcpy(header, frame, sizeof(header));
+    sx127x_segment_t segments[] = {{header, sizeof(header)}, {frame + sizeof(header), sizeof(frame) - sizeof(header)}};
+    memset(sx127x_spi_mock.fifo, 0, sizeof(sx127x_spi_mock.fifo));
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_set_for_transmission_segments(segments, 2, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_opmod(SX127x_MODE_TX, device));
+    CHECK_EQ(3 + 1, sx127x_spi_mock.transactions);
+    CHECK(memcmp(sx127x_spi_mock.fifo, frame, sizeof(frame)) == 0);
+    uint32_t segments_us;
+    report_bus_time("TX 255 bytes in segments", &segments_us);
+    CHECK_EQ(tx_us, segments_us);
+
+    // the chip received the frame at RegFifoRxCurrentAddr
+    sx127x_spi_mock.lora[0x10] = 0;
+    sx127x_spi_mock.lora[0x13] = sizeof(frame);
+    sx127x_spi_mock_clear_counters();
+    uint8_t* received = NULL;
+    uint8_t received_length = 0;
+    CHECK_EQ(SX127X_OK, sx127x_read_payload(device, &received, &received_length));
+    CHECK_EQ(sizeof(frame), received_length);
+    CHECK(memcmp(received, frame, sizeof(frame)) == 0);
+    CHECK_EQ(4, sx127x_spi_mock.transactions);
+    uint32_t rx_us;
+    report_bus_time("RX 255 bytes", &rx_us);
+    CHECK(rx_us < CONTROL_PERIOD_US / 20);
+
+    // switching the link profile at runtime
+    sx127x_modem_profile_t robust = link_profile;
+    robust.bandwidth = SX127x_BW_250000;
+    robust.spreading_factor = SX127x_SF_10;
+    robust.coding_rate = SX127x_CR_4_8;
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_apply_profile(&robust, device));
+    uint32_t switch_us;
+    report_bus_time("profile switch", &switch_us);
+    CHECK(switch_us < 100);
+    sx127x_destroy(device);
+}
+
+// LoRa time on air from the SX1276 datasheet, section 4.1.1.7, without the low data rate optimization
+static uint32_t reference_airtime_us(int sf, int bandwidth_hz, int cr_denominator, int implicit_header, int crc,
+                                     int preamble, int length) {
+    int payload_bits = 8 * length - 4 * sf + 28 + 16 * crc - 20 * implicit_header;
+    int symbols = 8;
+    if (payload_bits > 0) {
+        symbols += (payload_bits + 4 * sf - 1) / (4 * sf) * cr_denominator;
+    }
+    return (uint32_t)((4ULL * (preamble + symbols) + 17) * (1000000ULL << sf) / (4ULL * bandwidth_hz));
+}
+
+// Control frames go out with an implicit header, bulk with explicit. lora_load_timing switches between the two the
+// same way to derive the slot lengths
+static void test_implicit_header_airtime(void) {
+    sx127x* device = create_device();
+    sx127x_implicit_header_t control_header = {
+            .length = CONTROL_WIRE_SIZE,
+            .crc = SX127x_RX_PAYLOAD_CRC_OFF,
+            .coding_rate = SX127x_CR_4_5,
+    };
+    sx127x_modem_profile_t robust = link_profile;
+    robust.bandwidth = SX127x_BW_250000;
+    robust.spreading_factor = SX127x_SF_10;
+    robust.coding_rate = SX127x_CR_4_8;
+    const struct {
+        const sx127x_modem_profile_t* profile;
+        int sf;
+        int bandwidth_hz;
+        int cr_denominator;
+        // the 20 header bits only save symbols when they cross a block of 4 * SF bits
+        int saves;
+    } cases[] = {{&link_profile, 7, 500000, 5, 1}, {&robust, 10, 250000, 8, 0}};
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        CHECK_EQ(SX127X_OK, sx127x_apply_profile(cases[i].profile, device));
+        control_header.coding_rate = cases[i].profile->coding_rate;
+        uint32_t explicit_us;
+        CHECK_EQ(SX127X_OK, sx127x_get_time_on_air(device, CONTROL_WIRE_SIZE, &explicit_us));
+        CHECK_EQ(reference_airtime_us(cases[i].sf, cases[i].bandwidth_hz, cases[i].cr_denominator, 0, 0, 8,
+                                      CONTROL_WIRE_SIZE), explicit_us);
+
+        // header mode, and the payload length until the chip has it. The CRC setting stays
+        sx127x_spi_mock_clear_counters();
+        CHECK_EQ(SX127X_OK, sx127x_set_implicit_header(&control_header, device));
+        uint32_t to_implicit = i == 0 ? 2 : 1;
+        CHECK_EQ(to_implicit, sx127x_spi_mock.transactions);
+        CHECK_EQ(CONTROL_WIRE_SIZE, sx127x_spi_mock_register(0x22));
+        uint32_t implicit_us;
+        CHECK_EQ(SX127X_OK, sx127x_get_time_on_air(device, CONTROL_WIRE_SIZE, &implicit_us));
+        CHECK_EQ(reference_airtime_us(cases[i].sf, cases[i].bandwidth_hz, cases[i].cr_denominator, 1, 0, 8,
+                                      CONTROL_WIRE_SIZE), implicit_us);
+        CHECK_EQ(cases[i].saves, implicit_us < explicit_us);
+        CHECK(implicit_us <= explicit_us);
+        // the next control frame keeps the header, switching back for bulk is a single write
+        CHECK_EQ(SX127X_OK, sx127x_set_implicit_header(&control_header, device));
+        CHECK_EQ(to_implicit, sx127x_spi_mock.transactions);
+        CHECK_EQ(SX127X_OK, sx127x_set_implicit_header(NULL, device));
+        CHECK_EQ(to_implicit + 1, sx127x_spi_mock.transactions);
+        CHECK_EQ(0, sx127x_spi_mock_register(0x1d) & 0x01);
+        printf("control frame SF%d %d kHz: %u us with explicit, %u us with implicit header (%.1f%% less)\n",
+               cases[i].sf, cases[i].bandwidth_hz / 1000, explicit_us, implicit_us,
+               100.0 * (explicit_us - implicit_us) / explicit_us);
+    }
+    sx127x_destroy(device);
+}
+
+// The link profile against the same configuration through the single field setters
+static void test_apply_profile(void) {
+    sx127x* device = create_device();
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_apply_profile(&link_profile, device));
+    uint32_t applied = sx127x_spi_mock.transactions;
+    CHECK(applied <= APPLY_PROFILE_MAX_TRANSACTIONS);
+    uint8_t registers[SX127X_MOCK_REGISTERS];
+    for (int reg = 0; reg < SX127X_MOCK_REGISTERS; reg++) {
+        registers[reg] = sx127x_spi_mock_register(reg);
+    }
+    uint32_t frf = (uint32_t)registers[0x06] << 16 | (uint32_t)registers[0x07] << 8 | registers[0x08];
+    CHECK(llabs((long long)(((uint64_t)frf * 32000000) >> 19) - (long long)link_profile.frequency) < 128);
+    CHECK_EQ(0x82, registers[0x09]);
+    CHECK_EQ(0x18, registers[0x0b]);
+    CHECK_EQ(0x92, registers[0x1d]);
+    CHECK_EQ(0x70, registers[0x1e]);
+    CHECK_EQ(0x64, registers[0x1f]);
+    CHECK_EQ(8, registers[0x21]);
+    CHECK_EQ(0x04, registers[0x26]);
+    CHECK_EQ(18, registers[0x39]);
+    sx127x_destroy(device);
+
+    device = create_device();
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_set_frequency(link_profile.frequency, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_bandwidth(link_profile.bandwidth, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_modem_config_2(link_profile.spreading_factor, device));
+    sx127x_tx_header_t header = {.crc = link_profile.crc, .coding_rate = link_profile.coding_rate};
+    CHECK_EQ(SX127X_OK, sx127x_set_tx_explicit_header(&header, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_syncword(link_profile.syncword, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_preamble_length(link_profile.preamble_length, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_pa_config(link_profile.pa_pin, link_profile.power, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_lna_gain(SX127x_LNA_GAIN_AUTO, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_dio_mapping1(link_profile.dio_mapping1, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_dio_mapping2(link_profile.dio_mapping2, device));
+    for (int reg = 0x01; reg < SX127X_MOCK_REGISTERS; reg++) {
+        CHECK_EQ(registers[reg], sx127x_spi_mock_register(reg));
+    }
+    printf("link profile: %u transactions with sx127x_apply_profile, %u with the setters\n", applied,
+           sx127x_spi_mock.transactions);
+    CHECK(applied < sx127x_spi_mock.transactions);
+
+    // the profile is written over whatever the setters left behind, a second time costs nothing
+    CHECK_EQ(SX127X_OK, sx127x_set_lna_gain(SX127x_LNA_GAIN_G2, device));
+    CHECK_EQ(SX127X_OK, sx127x_apply_profile(&link_profile, device));
+    CHECK_EQ(0x04, sx127x_spi_mock_register(0x26));
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_apply_profile(&link_profile, device));
+    CHECK_EQ(0, sx127x_spi_mock.transactions);
+    sx127x_destroy(device);
+}
+
+// ADR switches between profiles at runtime. Every range changes at most once per switch
+static void test_profile_switch(void) {
+    sx127x* device = create_device();
+    CHECK_EQ(SX127X_OK, sx127x_apply_profile(&link_profile, device));
+
+    sx127x_implicit_header_t header = {.length = 11, .crc = SX127x_RX_PAYLOAD_CRC_ON, .coding_rate = SX127x_CR_4_8};
+    sx127x_modem_profile_t robust = link_profile;
+    robust.bandwidth = SX127x_BW_250000;
+    robust.spreading_factor = SX127x_SF_10;
+    robust.implicit_header = &header;
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_OK, sx127x_apply_profile(&robust, device));
+    CHECK(sx127x_spi_mock.transactions <= APPLY_PROFILE_MAX_TRANSACTIONS);
+    CHECK_EQ(0x89, sx127x_spi_mock_register(0x1d));
+    CHECK_EQ(0xa4, sx127x_spi_mock_register(0x1e));
+    CHECK_EQ(11, sx127x_spi_mock_register(0x22));
+    CHECK_EQ(0x04, sx127x_spi_mock_register(0x26));
+
+    // 32 ms symbols need the low data rate optimization
+    sx127x_modem_profile_t slowest = link_profile;
+    slowest.bandwidth = SX127x_BW_125000;
+    slowest.spreading_factor = SX127x_SF_12;
+    CHECK_EQ(SX127X_OK, sx127x_apply_profile(&slowest, device));
+    CHECK_EQ(0x0c, sx127x_spi_mock_register(0x26));
+    CHECK_EQ(0x72, sx127x_spi_mock_register(0x1d));
+
+    // SF6 can't be received with an explicit header, refused before anything is written
+    sx127x_modem_profile_t sf6 = link_profile;
+    sf6.spreading_factor = SX127x_SF_6;
+    sx127x_spi_mock_clear_counters();
+    CHECK_EQ(SX127X_ERR_INVALID_ARG, sx127x_apply_profile(&sf6, device));
+    CHECK_EQ(SX127X_ERR_INVALID_ARG, sx127x_apply_profile(NULL, device));
+    CHECK_EQ(0, sx127x_spi_mock.transactions);
+
+    // every range changes: one burst each and no more
+    sf6.implicit_header = &header;
+    sf6.syncword = 0x34;
+    sf6.power = 20;
+    sf6.dio_mapping1 = SX127x_DIO0_TX_DONE;
+    CHECK_EQ(SX127X_OK, sx127x_apply_profile(&sf6, device));
+    CHECK_EQ(APPLY_PROFILE_MAX_TRANSACTIONS, sx127x_spi_mock.transactions);
+    CHECK_EQ(0xc5, sx127x_spi_mock_register(0x31));
+    CHECK_EQ(0x0c, sx127x_spi_mock_register(0x37));
+    CHECK_EQ(0x87, sx127x_spi_mock_register(0x4d));
+    sx127x_destroy(device);
+}
+
+// The receiver listens with the control header while a transmit switches to explicit header, the RX_DONE interrupt
+// can queue the payload read right after that switch. The frame still has the length of the control header
+static void test_read_payload_header_of_reception(void) {
+    sx127x* device = create_device();
+    CHECK_EQ(SX127X_OK, sx127x_apply_profile(&link_profile, device));
+    sx127x_implicit_header_t control_header = {
+            .length = CONTROL_WIRE_SIZE,
+            .crc = SX127x_RX_PAYLOAD_CRC_OFF,
+            .coding_rate = SX127x_CR_4_5,
+    };
+    CHECK_EQ(SX127X_OK, sx127x_set_implicit_header(&control_header, device));
+    CHECK_EQ(SX127X_OK, sx127x_set_opmod(SX127x_MODE_RX_CONT, device));
+    for (int i = 0; i < CONTROL_WIRE_SIZE; i++) {
+        sx127x_spi_mock.fifo[0x40 + i] = (uint8_t)(0xA0 + i);
+    }
+    sx127x_spi_mock.lora[0x10] = 0x40;
+    // garbage in explicit header mode, an implicit header frame doesn't set it
+    sx127x_spi_mock.lora[0x13] = 0xff;
+
+    CHECK_EQ(SX127X_OK, sx127x_set_implicit_header(NULL, device));
+    uint8_t* received = NULL;
+    uint8_t received_length = 0;
+    CHECK_EQ(SX127X_OK, sx127x_read_payload(device, &received, &received_length));
+    CHECK_EQ(CONTROL_WIRE_SIZE, received_length);
+    for (int i = 0; i < CONTROL_WIRE_SIZE; i++) {
+        CHECK_EQ(0xA0 + i, received[i]);
+    }
+
+    // the next reception listens with explicit header and takes the length from RegRxNbBytes
+    CHECK_EQ(SX127X_OK, sx127x_set_opmod(SX127x_MODE_RX_CONT, device));
+    sx127x_spi_mock.lora[0x13] = 5;
+    CHECK_EQ(SX127X_OK, sx127x_set_implicit_header(&control_header, device));
+    CHECK_EQ(SX127X_OK, sx127x_read_payload(device, &received, &received_length));
+    CHECK_EQ(5, received_length);
+    sx127x_destroy(device);
+}
+
+int main(void) {
+    test_create_loads_lora_shadow();
+    test_shadowed_access();
+    test_resync_after_reset();
+    test_apply_profile();
+    test_profile_switch();
+    test_spi_time();
+    test_implicit_header_airtime();
+    test_read_payload_header_of_reception();
+    return 0;
+}
@@ -0,0 +1,280 @@
+#include "tdma.h"
+#include "adr.h"
+#include "test.h"
+
+#include <string.h>
+
+// on-air lengths, LORA_CONTROL_WIRE_SIZE with implicit header and LORA_PACKET_WIRE_MAX_SIZE with explicit header
+#define CONTROL_FRAME_LENGTH 11
+#define MAX_FRAME_LENGTH 255
+#define PREAMBLE_SYMBOLS 8
+// like LORA_SUPERFRAME_MIN_MS
+#define SUPERFRAME_MIN_US 20000
+#define SIMULATED_US (60LL * 1000000)
+#define MAX_TRANSMISSIONS 200000
+// every this many superframes the next aircraft in turn gets a reply slot, like NETWORK_REPLY_EVERY
+#define REPLY_EVERY 16
+// like LORA_CONTROL_EXPIRY_MS
+#define CONTROL_EXPIRY_US 100000
+
+// LoRa time on air from the SX1276 datasheet, CRC on, no low data rate optimization
+static uint32_t airtime_us(const Adr_Profile* profile, int length, int implicit_header) {
+    int sf = profile->spreading_factor;
+    int payload_bits = 8 * length - 4 * sf + 28 + 16 - 20 * implicit_header;
+    int symbols = 8;
+    if (payload_bits > 0) {
+        symbols += (payload_bits + 4 * sf - 1) / (4 * sf) * profile->coding_rate;
+    }
+    // preamble symbols plus 4.25, in quarter symbols
+    uint64_t quarter_symbols = 4 * (PREAMBLE_SYMBOLS + symbols) + 17;
+    return (uint32_t)(quarter_symbols * (1000000ULL << sf) / (4ULL * profile->bandwidth_hz));
+}
+
+static void timing_for(uint8_t profile, Tdma_Timing* timing, uint32_t* control_us, uint32_t* max_us) {
+    *control_us = airtime_us(&adr_profiles[profile], CONTROL_FRAME_LENGTH, 1);
+    *max_us = airtime_us(&adr_profiles[profile], MAX_FRAME_LENGTH, 0);
+    tdma_timing_init(timing, *control_us, *max_us);
+}
+
+// Every layout: slots follow each other without gaps or overlaps, in the documented order, and each slot fits the
+// frames it carries with the guard to spare
+static void test_layouts(void) {
+    for (uint8_t profile = 0; profile < ADR_PROFILE_COUNT; profile++) {
+        Tdma_Timing timing;
+        uint32_t control_us;
+        uint32_t max_us;
+        timing_for(profile, &timing, &control_us, &max_us);
+        CHECK(timing.control_slot_us >= control_us + TDMA_GUARD_US);
+        CHECK(timing.reply_slot_us >= max_us + TDMA_GUARD_US);
+        CHECK(timing.downlink_slot_us >= control_us + max_us + TDMA_GUARD_US);
+        CHECK_EQ(control_us, timing.beacon_slot_us);
+        for (uint8_t control = 0; control <= TDMA_MAX_CONTROL_SLOTS; control++) {
+            for (uint8_t downlink = 0; downlink <= TDMA_MAX_DOWNLINK_SLOTS; downlink++) {
+                for (uint8_t owners = 0; owners < 1 << TDMA_MAX_REPLY_SLOTS; owners++) {
+                    Tdma_Superframe superframe = {.control_slots = control, .downlink_slots = downlink};
+                    uint8_t expected_replies = 0;
+                    for (uint8_t i = 0; i < TDMA_MAX_REPLY_SLOTS; i++) {
+                        superframe.reply_owner[i] = owners >> i & 1 ? 0x10 + i : TDMA_NO_OWNER;
+                        expected_replies = owners >> i & 1 ? i + 1 : expected_replies;
+                    }
+                    // an unused slot before a granted one stays on air
+                    CHECK_EQ(expected_replies, tdma_reply_slots(&superframe));
+                    uint32_t end = 0;
+                    for (uint8_t i = 0; i < control; i++) {
+                        CHECK_EQ(end, tdma_control_slot_start_us(&timing, i));
+                        end += timing.control_slot_us;
+                    }
+                    for (uint8_t i = 0; i < expected_replies; i++) {
+                        CHECK_EQ(end, tdma_reply_slot_start_us(&timing, &superframe, i));
+                        CHECK_EQ(owners >> i & 1 ? i : TDMA_NO_SLOT, tdma_reply_slot(&superframe, 0x10 + i));
+                        end += timing.reply_slot_us;
+                    }
+                    for (uint8_t i = 0; i < downlink; i++) {
+                        CHECK_EQ(end, tdma_downlink_slot_start_us(&timing, &superframe, i));
+                        end += timing.downlink_slot_us;
+                    }
+                    CHECK_EQ(end, tdma_superframe_end_us(&timing, &superframe));
+                    CHECK_EQ(TDMA_NO_SLOT, tdma_reply_slot(&superframe, TDMA_NO_OWNER));
+                    CHECK_EQ(TDMA_NO_SLOT, tdma_reply_slot(&superframe, 0x42));
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    int64_t start;
+    int64_t end;
+} Transmission;
+
+static Transmission transmissions[MAX_TRANSMISSIONS];
+static int num_of_transmissions;
+
+static void on_air(int64_t start, uint32_t length) {
+    CHECK(num_of_transmissions < MAX_TRANSMISSIONS);
+    transmissions[num_of_transmissions].start = start;
+    transmissions[num_of_transmissions].end = start + length;
+    num_of_transmissions++;
+}
+
+static int by_start(const void* a, const void* b) {
+    int64_t difference = ((const Transmission*)a)->start - ((const Transmission*)b)->start;
+    return difference < 0 ? -1 : difference > 0;
+}
+
+static uint32_t jitter(uint32_t* seed, uint32_t max_us) {
+    return max_us ? test_random(seed) % (max_us + 1) : 0;
+}
+
+// One minute of superframes planned like network_plan_superframe for a fleet: control slots for every aircraft up to
+// the limit, reply slots for busy aircraft and one in turn, downlink slots for the queued bulk frames. The ground
+// station wakes up to wakeup_us late for each of its slots. The aircraft see the beacon RX_DONE up to rx_us late,
+// then wake up to wakeup_us late for their reply slot. Returns the number of frames that overlapped on air
+static int simulate(uint8_t profile, int aircraft, uint32_t wakeup_us, uint32_t rx_us, int64_t* busy_us) {
+    Tdma_Timing timing;
+    uint32_t control_us;
+    uint32_t max_us;
+    timing_for(profile, &timing, &control_us, &max_us);
+    uint32_t seed = 23 + profile * 1000 + aircraft;
+    num_of_transmissions = 0;
+    int64_t now = 0;
+    uint32_t count = 0;
+    int turn = 0;
+    int downlink_queue = 0;
+    int busy[TDMA_MAX_REPLY_SLOTS + 16] = {0};
+    while (now < SIMULATED_US) {
+        int64_t start = now + jitter(&seed, wakeup_us);
+        Tdma_Superframe superframe = {0};
+        superframe.control_slots = aircraft < TDMA_MAX_CONTROL_SLOTS ? aircraft : TDMA_MAX_CONTROL_SLOTS;
+        superframe.downlink_slots = downlink_queue < TDMA_MAX_DOWNLINK_SLOTS ? downlink_queue : TDMA_MAX_DOWNLINK_SLOTS;
+        uint8_t granted = 0;
+        for (int addr = 1; addr <= aircraft && granted < TDMA_MAX_REPLY_SLOTS; addr++) {
+            if (busy[addr]) {
+                superframe.reply_owner[granted++] = addr;
+            }
+        }
+        if (++count % REPLY_EVERY == 0 && granted < TDMA_MAX_REPLY_SLOTS) {
+            turn = turn % aircraft + 1;
+            if (tdma_reply_slot(&superframe, turn) == TDMA_NO_SLOT) {
+                superframe.reply_owner[granted] = turn;
+            }
+        }
+        // setpoints only go without beacon
+        int64_t beacon_end = start;
+        if (tdma_reply_slots(&superframe) != 0 || superframe.downlink_slots != 0) {
+            on_air(start, timing.beacon_slot_us);
+            beacon_end = start + timing.beacon_slot_us;
+        }
+        for (uint8_t i = 0; i < superframe.control_slots; i++) {
+            on_air(beacon_end + tdma_control_slot_start_us(&timing, i) + jitter(&seed, wakeup_us), control_us);
+        }
+        for (uint8_t i = 0; i < tdma_reply_slots(&superframe); i++) {
+            int addr = superframe.reply_owner[i];
+            if (addr == TDMA_NO_OWNER) {
+                continue;
+            }
+            int64_t rx_done = beacon_end + jitter(&seed, rx_us);
+            // a busy aircraft sends a full fragment, the others a short report
+            on_air(rx_done + tdma_reply_slot_start_us(&timing, &superframe, i) + jitter(&seed, wakeup_us),
+                   busy[addr] ? max_us : control_us);
+            busy[addr] = test_chance(&seed, 50);
+        }
+        for (uint8_t i = 0; i < superframe.downlink_slots; i++) {
+            int64_t slot_start = beacon_end + tdma_downlink_slot_start_us(&timing, &superframe, i) + jitter(&seed, wakeup_us);
+            // header mode announce, then the frame
+            on_air(slot_start, control_us);
+            on_air(slot_start + control_us, max_us);
+            downlink_queue--;
+            if (test_chance(&seed, 25)) {
+                busy[1 + test_random(&seed) % aircraft] = 1;
+            }
+        }
+        int64_t superframe_end = beacon_end + tdma_superframe_end_us(&timing, &superframe);
+        now = start + SUPERFRAME_MIN_US > superframe_end ? start + SUPERFRAME_MIN_US : superframe_end;
+        if (test_chance(&seed, 10)) {
+            downlink_queue++;
+        }
+    }
+    qsort(transmissions, num_of_transmissions, sizeof(Transmission), by_start);
+    int overlaps = 0;
+    int64_t reach = 0;
+    *busy_us = 0;
+    for (int i = 0; i < num_of_transmissions; i++) {
+        overlaps += transmissions[i].start < reach;
+        reach = transmissions[i].end > reach ? transmissions[i].end : reach;
+        *busy_us += transmissions[i].end - transmissions[i].start;
+    }
+    return overlaps;
+}
+
+static void test_no_overlap_within_guard(void) {
+    const int fleets[] = {1, 4, 8, 16};
+    printf("profile  aircraft  frames  airtime %%  overlaps\n");
+    for (uint8_t profile = 0; profile < ADR_PROFILE_COUNT; profile++) {
+        for (size_t f = 0; f < sizeof(fleets) / sizeof(fleets[0]); f++) {
+            int64_t busy_us;
+            // both latencies together stay below the guard
+            int overlaps = simulate(profile, fleets[f], TDMA_GUARD_US * 2 / 5, TDMA_GUARD_US * 2 / 5, &busy_us);
+            printf("%7u  %8d  %6d  %9.1f  %8d\n", profile, fleets[f], num_of_transmissions,
+                   100.0 * busy_us / SIMULATED_US, overlaps);
+            CHECK_EQ(0, overlaps);
+        }
+    }
+}
+
+// The same traffic with latencies beyond the guard collides, so the simulation does see overlaps
+static void test_overlap_beyond_guard(void) {
+    int64_t busy_us;
+    CHECK(simulate(0, 8, TDMA_GUARD_US * 2, TDMA_GUARD_US * 2, &busy_us) > 0);
+}
+
+// Setpoints under a bulk backlog that never drains: every superframe has its beacon, both reply slots and both
+// downlink slots, the longest layout there is. A setpoint is sampled right before the beacon and sent in its own
+// control slot, so no queue stands between the sticks and the aircraft. Its age on arrival is bounded by the slot
+// offset and the staleness at the aircraft, the age of the newest setpoint it holds, by one superframe on top
+static void test_setpoint_staleness(void) {
+    const int aircraft = TDMA_MAX_CONTROL_SLOTS;
+    const uint32_t wakeup_us = TDMA_GUARD_US * 2 / 5;
+    printf("profile  age max us  staleness max us  bound us  expired  expired if counted from the sample\n");
+    for (uint8_t profile = 0; profile < ADR_PROFILE_COUNT; profile++) {
+        Tdma_Timing timing;
+        uint32_t control_us;
+        uint32_t max_us;
+        timing_for(profile, &timing, &control_us, &max_us);
+        uint32_t seed = 8 + profile;
+        Tdma_Superframe superframe = {.control_slots = aircraft, .downlink_slots = TDMA_MAX_DOWNLINK_SLOTS};
+        for (uint8_t i = 0; i < TDMA_MAX_REPLY_SLOTS; i++) {
+            superframe.reply_owner[i] = 1 + i;
+        }
+        int64_t superframe_us = timing.beacon_slot_us + tdma_superframe_end_us(&timing, &superframe);
+        int64_t last_sample[TDMA_MAX_CONTROL_SLOTS];
+        for (int i = 0; i < aircraft; i++) {
+            last_sample[i] = -1;
+        }
+        int64_t age_max = 0;
+        int64_t staleness_max = 0;
+        int expired = 0;
+        int expired_from_sample = 0;
+        int sent = 0;
+        int64_t now = 0;
+        while (now < SIMULATED_US) {
+            int64_t start = now + jitter(&seed, wakeup_us);
+            int64_t sampled_at = start;
+            int64_t beacon_end = start + timing.beacon_slot_us;
+            for (uint8_t i = 0; i < superframe.control_slots; i++) {
+                int64_t slot_start = beacon_end + tdma_control_slot_start_us(&timing, i) + jitter(&seed, wakeup_us);
+                // the expiry of network_plan_superframe, and the one it had before the slot offset was counted
+                expired_from_sample += slot_start >= sampled_at + CONTROL_EXPIRY_US;
+                if (slot_start >= sampled_at + tdma_control_slot_due_us(&timing, i) + CONTROL_EXPIRY_US) {
+                    expired++;
+                    continue;
+                }
+                int64_t arrival = slot_start + control_us;
+                age_max = arrival - sampled_at > age_max ? arrival - sampled_at : age_max;
+                if (last_sample[i] >= 0 && arrival - last_sample[i] > staleness_max) {
+                    staleness_max = arrival - last_sample[i];
+                }
+                last_sample[i] = sampled_at;
+                sent++;
+            }
+            int64_t superframe_end = beacon_end + tdma_superframe_end_us(&timing, &superframe);
+            now = start + SUPERFRAME_MIN_US > superframe_end ? start + SUPERFRAME_MIN_US : superframe_end;
+        }
+        int64_t age_bound = tdma_control_slot_due_us(&timing, aircraft - 1) + wakeup_us + control_us;
+        int64_t staleness_bound = superframe_us + wakeup_us + age_bound;
+        printf("%7u  %10lld  %16lld  %8lld  %7d  %33.1f%%\n", profile, (long long)age_max, (long long)staleness_max,
+               (long long)staleness_bound, expired, 100.0 * expired_from_sample / (sent + expired));
+        CHECK(sent > 0);
+        CHECK_EQ(0, expired);
+        CHECK(age_max <= age_bound);
+        CHECK(staleness_max <= staleness_bound);
+    }
+}
+
+int main(void) {
+    test_layouts();
+    test_no_overlap_within_guard();
+    test_overlap_beyond_guard();
+    test_setpoint_staleness();
+    return 0;
+}
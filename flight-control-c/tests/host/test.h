@@ -0,0 +1,52 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Minimal assertions for the host tests. A failed CHECK prints the location and exits with 1, which CTest reports.
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define CHECK_EQ(expected, actual) \
+    do { \
+        long long check_expected = (long long)(expected); \
+        long long check_actual = (long long)(actual); \
+        if (check_expected != check_actual) { \
+            fprintf(stderr, "%s:%d: CHECK_EQ failed: %s == %s (%lld != %lld)\n", \
+                    __FILE__, __LINE__, #expected, #actual, check_expected, check_actual); \
+            exit(1); \
+        } \
+    } while (0)
+
+/// Deterministic xorshift32 generator, so a failing randomized run can be reproduced from its seed.
+static inline uint32_t test_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/// Returns 1 with the given probability in percent.
+static inline int test_chance(uint32_t* state, uint32_t percent) {
+    return test_random(state) % 100 < percent;
+}
+
+/// Monotonic time in seconds, for the benchmarks.
+static inline double test_now_s(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+#endif //HOST_TEST_H